@@ -0,0 +1,730 @@
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zmq.h>
+#include <zmq_utils.h>
+
+#include <freeabode/eventtime.h>
+#include <freeabode/fabdcfg.h>
+#include <freeabode/freeabode.pb-c.h>
+#include <freeabode/pbarena.h>
+#include <freeabode/security.h>
+#include <freeabode/util.h>
+
+// Everything runs in this process, over real ipc/tcp endpoints on localhost, unless -t points the requests elsewhere
+
+// Time allowed for stragglers after publishers stop
+static const unsigned long events_grace_ms = 500;
+// How long a publisher waits for the subscriber to show up
+static const int subscribe_timeout_ms = 5000;
+static const int int_zero = 0;
+
+enum bench_profile {
+	BP_NBP,
+	BP_HTU21D,
+	BP_GPIO_HVAC,
+	BP__COUNT,
+};
+
+static const char * const bench_profile_names[BP__COUNT] = {
+	[BP_NBP] = "nbp",
+	[BP_HTU21D] = "htu21d",
+	[BP_GPIO_HVAC] = "gpio_hvac",
+};
+
+// Which daemon's requests to mimic
+enum bench_target {
+	BT_TSTAT,
+	BT_GPIO_HVAC,
+	// gpio_hvac, with random changes to random wires, several per request
+	BT_GPIO_FUZZ,
+};
+
+struct bench_opts {
+	unsigned long duration_ms;
+	double rate;
+	unsigned publishers;
+	unsigned clients;
+	unsigned window;
+	bool run_events;
+	bool run_requests;
+	const char *target_uri;
+	enum bench_target target;
+};
+
+struct bench_ctx {
+	const struct bench_opts *opts;
+	void *zmq_ctx;
+	bool curve;
+	const char *transport;
+	unsigned n_endpoints;
+	// Mock servers only exit once the context is terminated
+	void *mock_threads[2];
+	unsigned n_mock_threads;
+	char server_public[41], server_secret[41];
+	char client_public[41], client_secret[41];
+};
+
+struct bench_samples {
+	uint32_t *us;
+	size_t n;
+	size_t sz;
+};
+
+static
+void bench_samples_add(struct bench_samples * const s, const uint64_t us)
+{
+	if (s->n == s->sz)
+	{
+		s->sz = s->sz ? (s->sz * 2) : 0x1000;
+		s->us = realloc(s->us, sizeof(*s->us) * s->sz);
+		assert(s->us);
+	}
+	s->us[s->n++] = (us > UINT32_MAX) ? UINT32_MAX : us;
+}
+
+static
+void bench_samples_merge(struct bench_samples * const dst, const struct bench_samples * const src)
+{
+	for (size_t i = 0; i < src->n; ++i)
+		bench_samples_add(dst, src->us[i]);
+}
+
+static
+int bench_u32_cmp(const void * const a, const void * const b)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static
+uint32_t bench_percentile(const struct bench_samples * const s, const double q)
+{
+	if (!s->n)
+		return 0;
+	size_t i = s->n * q;
+	if (i >= s->n)
+		i = s->n - 1;
+	return s->us[i];
+}
+
+static
+void bench_report(const char * const what, const struct bench_ctx * const b, const char * const mode, const uint64_t count, const double secs, struct bench_samples * const s, const char * const extra)
+{
+	qsort(s->us, s->n, sizeof(*s->us), bench_u32_cmp);
+	printf("%-8s %-5s %-3s %-7s %10.1f/s  p50 %7luus  p99 %7luus  p999 %7luus  max %7luus%s\n",
+	       what, b->opts->target_uri ? "-" : (b->curve ? "curve" : "plain"), b->transport, mode, count / secs,
+	       (unsigned long)bench_percentile(s, 0.5), (unsigned long)bench_percentile(s, 0.99), (unsigned long)bench_percentile(s, 0.999), (unsigned long)(s->n ? s->us[s->n - 1] : 0),
+	       extra);
+	fflush(stdout);
+}
+
+static
+uint64_t bench_elapsed_us(const struct timespec * const start, const struct timespec * const end)
+{
+	return ((int64_t)(end->tv_sec - start->tv_sec) * 1000000) + ((end->tv_nsec - start->tv_nsec) / 1000);
+}
+
+static
+void *bench_socket(const struct bench_ctx * const b, const int type)
+{
+	void * const s = zmq_socket(b->zmq_ctx, type);
+	assert(s);
+	zmq_setsockopt(s, ZMQ_LINGER, &int_zero, sizeof(int_zero));
+	return s;
+}
+
+// Binds to a fresh endpoint, and writes it to endpoint for connecting
+static
+void bench_bind(struct bench_ctx * const b, void * const s, char * const endpoint, const size_t endpointsz)
+{
+	if (b->curve)
+	{
+		zmq_setsockopt(s, ZMQ_CURVE_SERVER, &int_one, sizeof(int_one));
+		zmq_setsockopt(s, ZMQ_CURVE_SECRETKEY, b->server_secret, 40);
+	}
+	if (!strcmp(b->transport, "ipc"))
+		snprintf(endpoint, endpointsz, "ipc:///tmp/fabd-bench-%ld-%u", (long)getpid(), b->n_endpoints++);
+	else
+		snprintf(endpoint, endpointsz, "tcp://127.0.0.1:*");
+	assert(!zmq_bind(s, endpoint));
+	size_t sz = endpointsz;
+	assert(!zmq_getsockopt(s, ZMQ_LAST_ENDPOINT, endpoint, &sz));
+}
+
+static
+void bench_unbind(const char * const endpoint)
+{
+	if (!strncmp(endpoint, "ipc://", 6))
+		unlink(&endpoint[6]);
+}
+
+static
+void bench_connect(const struct bench_ctx * const b, void * const s, const char * const endpoint)
+{
+	if (b->opts->target_uri)
+	{
+		freeabode_zmq_security(s, false);
+		assert(fabdcfg_zmq_connect_uri(NULL, endpoint, s));
+		return;
+	}
+	if (b->curve)
+	{
+		zmq_setsockopt(s, ZMQ_CURVE_SERVERKEY, b->server_public, 40);
+		zmq_setsockopt(s, ZMQ_CURVE_PUBLICKEY, b->client_public, 40);
+		zmq_setsockopt(s, ZMQ_CURVE_SECRETKEY, b->client_secret, 40);
+	}
+	assert(!zmq_connect(s, endpoint));
+}
+
+// Publishers
+
+struct bench_event_scratch {
+	PbWeather weather;
+	PbBattery battery;
+	PbWireStats wire_stats, *wire_statsp;
+	uint32_t hist_bounds[5], on_hist[6], off_hist[6];
+	PbSetHVACWireRequest wire_change[2], *wire_changep[2];
+};
+
+// Roughly what each daemon publishes
+static
+void bench_make_event(const enum bench_profile profile, const unsigned seq, PbEvent * const pbevent, struct bench_event_scratch * const sc)
+{
+	pb_event__init(pbevent);
+	switch (profile)
+	{
+		case BP_NBP:
+			pb_weather__init(&sc->weather);
+			sc->weather.has_temperature = sc->weather.has_humidity = true;
+			sc->weather.temperature = 2150 + (seq % 50);
+			sc->weather.humidity = 450 + (seq % 20);
+			pbevent->weather = &sc->weather;
+			pb_battery__init(&sc->battery);
+			sc->battery.has_charging = sc->battery.has_voltage = true;
+			sc->battery.charging = seq & 1;
+			sc->battery.voltage = 3900 + (seq % 100);
+			pbevent->battery = &sc->battery;
+			if (seq % 4)
+				break;
+			pb_wire_stats__init(&sc->wire_stats);
+			sc->wire_stats.wire = PB_HVACWIRES__G;
+			sc->wire_stats.has_runtime_ms = sc->wire_stats.has_offtime_ms = sc->wire_stats.has_cycles = true;
+			sc->wire_stats.runtime_ms = seq * 1000ULL;
+			sc->wire_stats.offtime_ms = seq * 3000ULL;
+			sc->wire_stats.cycles = seq / 4;
+			for (int i = 0; i < 5; ++i)
+				sc->hist_bounds[i] = 60000 << (i * 2);
+			for (int i = 0; i < 6; ++i)
+			{
+				sc->on_hist[i] = seq >> i;
+				sc->off_hist[i] = seq >> (5 - i);
+			}
+			sc->wire_stats.n_histogram_bounds_ms = 5;
+			sc->wire_stats.histogram_bounds_ms = sc->hist_bounds;
+			sc->wire_stats.n_on_histogram = sc->wire_stats.n_off_histogram = 6;
+			sc->wire_stats.on_histogram = sc->on_hist;
+			sc->wire_stats.off_histogram = sc->off_hist;
+			sc->wire_statsp = &sc->wire_stats;
+			pbevent->n_wire_stats = 1;
+			pbevent->wire_stats = &sc->wire_statsp;
+			break;
+		case BP_HTU21D:
+			// Temperature and humidity are read, and published, separately
+			pb_weather__init(&sc->weather);
+			if (seq & 1)
+			{
+				sc->weather.has_humidity = true;
+				sc->weather.humidity = 450 + (seq % 20);
+			}
+			else
+			{
+				sc->weather.has_temperature = true;
+				sc->weather.temperature = 2150 + (seq % 50);
+			}
+			pbevent->weather = &sc->weather;
+			break;
+		case BP_GPIO_HVAC:
+			// Fan with compressor, on and off
+			for (int i = 0; i < 2; ++i)
+			{
+				pb_set_hvacwire_request__init(&sc->wire_change[i]);
+				sc->wire_change[i].connect = !(seq & 1);
+				sc->wire_changep[i] = &sc->wire_change[i];
+			}
+			sc->wire_change[0].wire = (seq & 1) ? PB_HVACWIRES__Y1 : PB_HVACWIRES__G;
+			sc->wire_change[1].wire = (seq & 1) ? PB_HVACWIRES__G : PB_HVACWIRES__Y1;
+			pbevent->n_wire_change = 2;
+			pbevent->wire_change = sc->wire_changep;
+			break;
+		case BP__COUNT:
+			break;
+	}
+}
+
+struct bench_publisher {
+	const struct bench_ctx *b;
+	enum bench_profile profile;
+	void *socket;
+	char endpoint[0x100];
+	uint64_t sent;
+	void *thread;
+};
+
+static
+void bench_publisher_thread(void * const userp)
+{
+	struct bench_publisher * const pub = userp;
+	const struct bench_opts * const opts = pub->b->opts;
+	
+	// Like the real daemons, wait to hear of a subscriber
+	zmq_setsockopt(pub->socket, ZMQ_RCVTIMEO, &subscribe_timeout_ms, sizeof(subscribe_timeout_ms));
+	zmq_msg_t msg;
+	assert(!zmq_msg_init(&msg));
+	const bool subscribed = (zmq_msg_recv(&msg, pub->socket, 0) >= 0);
+	zmq_msg_close(&msg);
+	if (!subscribed)
+	{
+		fprintf(stderr, "%s publisher: no subscriber\n", bench_profile_names[pub->profile]);
+		zmq_close(pub->socket);
+		return;
+	}
+	
+	const uint64_t interval_ns = (opts->rate > 0) ? (1e9 / opts->rate) : 0;
+	struct timespec ts_now, ts_next, ts_end;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	ts_next = ts_now;
+	timespec_add_ms(&ts_now, opts->duration_ms, &ts_end);
+	PbEvent pbevent;
+	struct bench_event_scratch scratch;
+	while (!timespec_passed(&ts_end, &ts_now, NULL))
+	{
+		bench_make_event(pub->profile, pub->sent, &pbevent, &scratch);
+		fabd_pbevent_send(pub->socket, &pbevent, &ts_now);
+		++pub->sent;
+		if (interval_ns)
+		{
+			ts_next.tv_nsec += interval_ns;
+			ts_next.tv_sec += ts_next.tv_nsec / 1000000000;
+			ts_next.tv_nsec %= 1000000000;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts_next, NULL) == EINTR)
+			{}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	}
+	zmq_close(pub->socket);
+}
+
+static
+void bench_events(struct bench_ctx * const b)
+{
+	const struct bench_opts * const opts = b->opts;
+	const unsigned n_pubs = opts->publishers * BP__COUNT;
+	struct bench_publisher pubs[n_pubs];
+	void * const sub = bench_socket(b, ZMQ_SUB);
+	for (unsigned i = 0; i < n_pubs; ++i)
+	{
+		struct bench_publisher * const pub = &pubs[i];
+		*pub = (struct bench_publisher){
+			.b = b,
+			.profile = i % BP__COUNT,
+			.socket = bench_socket(b, ZMQ_XPUB),
+		};
+		bench_bind(b, pub->socket, pub->endpoint, sizeof(pub->endpoint));
+		bench_connect(b, sub, pub->endpoint);
+	}
+	assert(!zmq_setsockopt(sub, ZMQ_SUBSCRIBE, NULL, 0));
+	for (unsigned i = 0; i < n_pubs; ++i)
+	{
+		pubs[i].thread = zmq_threadstart(bench_publisher_thread, &pubs[i]);
+		assert(pubs[i].thread);
+	}
+	
+	struct bench_samples samples = { .n = 0, };
+	struct fabd_pbarena arena;
+	fabd_pbarena_init(&arena, 0x400);
+	zmq_msg_t msg;
+	assert(!zmq_msg_init(&msg));
+	uint64_t received = 0, undecodable = 0;
+	struct timespec ts_start, ts_now, ts_end;
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	timespec_add_ms(&ts_start, opts->duration_ms + events_grace_ms, &ts_end);
+	ts_now = ts_start;
+	zmq_pollitem_t pollitem = { .socket = sub, .events = ZMQ_POLLIN };
+	while (!timespec_passed(&ts_end, &ts_now, NULL))
+	{
+		if (zmq_poll(&pollitem, 1, timespec_to_timeout_ms(&ts_now, &ts_end)) > 0)
+		{
+			while (zmq_msg_recv(&msg, sub, ZMQ_DONTWAIT) >= 0)
+			{
+				const uint64_t now_us = fabd_realtime_us();
+				PbEvent * const pbevent = pb_event__unpack(&arena.allocator, zmq_msg_size(&msg), zmq_msg_data(&msg));
+				if (pbevent && pbevent->has_published_us)
+				{
+					++received;
+					bench_samples_add(&samples, (now_us > pbevent->published_us) ? (now_us - pbevent->published_us) : 0);
+				}
+				else
+					++undecodable;
+				fabd_pbarena_reset(&arena);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	}
+	zmq_msg_close(&msg);
+	
+	uint64_t sent = 0;
+	for (unsigned i = 0; i < n_pubs; ++i)
+	{
+		zmq_threadclose(pubs[i].thread);
+		sent += pubs[i].sent;
+		bench_unbind(pubs[i].endpoint);
+	}
+	zmq_close(sub);
+	
+	char extra[0x80];
+	snprintf(extra, sizeof(extra), "  (%llu sent, %llu lost, %llu bad)", (unsigned long long)sent, (unsigned long long)((sent > received) ? (sent - received) : 0), (unsigned long long)undecodable);
+	bench_report("events", b, "", received, opts->duration_ms / 1000., &samples, extra);
+	free(samples.us);
+	fabd_pbarena_free(&arena);
+}
+
+// Requests
+
+// Answers like tstat (HVACGoals) and gpio_hvac (SetHVACWire), without doing anything
+static
+void bench_mock_server_thread(void * const s)
+{
+	struct fabd_pbarena arena;
+	fabd_pbarena_init(&arena, 0x400);
+	zmq_msg_t msg;
+	assert(!zmq_msg_init(&msg));
+	while (true)
+	{
+		if (zmq_msg_recv(&msg, s, 0) < 0)
+		{
+			if (errno == ETERM)
+				break;
+			continue;
+		}
+		PbRequest * const req = pb_request__unpack(&arena.allocator, zmq_msg_size(&msg), zmq_msg_data(&msg));
+		PbRequestReply reply = PB_REQUEST_REPLY__INIT;
+		PbHVACGoals goals = PB_HVACGOALS__INIT;
+		protobuf_c_boolean successes[req ? (req->n_sethvacwire ?: 1) : 1];
+		if (req)
+		{
+			reply.n_sethvacwiresuccess = req->n_sethvacwire;
+			reply.sethvacwiresuccess = successes;
+			for (size_t i = 0; i < req->n_sethvacwire; ++i)
+				successes[i] = true;
+			if (req->hvacgoals)
+			{
+				goals.has_temp_low = goals.has_temp_high = goals.has_temp_hysteresis = goals.has_fan_mode = true;
+				goals.temp_low = 2400;
+				goals.temp_high = 3020;
+				goals.temp_hysteresis = 50;
+				goals.fan_mode = PB_FAN_MODE__Auto;
+				reply.hvacgoals = &goals;
+			}
+		}
+		zmq_send_protobuf(s, pb_request_reply, &reply, 0);
+		fabd_pbarena_reset(&arena);
+	}
+	zmq_msg_close(&msg);
+	zmq_close(s);
+	fabd_pbarena_free(&arena);
+}
+
+struct bench_client {
+	const struct bench_ctx *b;
+	const char *endpoint;
+	enum bench_target target;
+	bool batched;
+	struct bench_samples samples;
+	uint64_t failures;
+	void *thread;
+};
+
+static
+void bench_send_request(void * const s, const enum bench_target target, const unsigned seq, unsigned * const seedp, const bool envelope)
+{
+	static const PbHVACWires fuzz_wires[] = { PB_HVACWIRES__Y1, PB_HVACWIRES__OB, PB_HVACWIRES__G, PB_HVACWIRES__W2, };
+	PbRequest req = PB_REQUEST__INIT;
+	PbHVACGoals goals = PB_HVACGOALS__INIT;
+	PbSetHVACWireRequest wirereq = PB_SET_HVACWIRE_REQUEST__INIT, *wirereqp = &wirereq;
+	PbSetHVACWireRequest fuzzreq[4], *fuzzreqp[4];
+	if (target == BT_TSTAT)
+		// Empty goals just asks for the current ones
+		req.hvacgoals = &goals;
+	else
+	if (target == BT_GPIO_FUZZ)
+	{
+		req.n_sethvacwire = 1 + (rand_r(seedp) % 4);
+		for (size_t i = 0; i < req.n_sethvacwire; ++i)
+		{
+			pb_set_hvacwire_request__init(&fuzzreq[i]);
+			fuzzreq[i].wire = fuzz_wires[rand_r(seedp) % (sizeof(fuzz_wires) / sizeof(*fuzz_wires))];
+			fuzzreq[i].connect = rand_r(seedp) & 1;
+			fuzzreqp[i] = &fuzzreq[i];
+		}
+		req.sethvacwire = fuzzreqp;
+	}
+	else
+	{
+		wirereq.wire = PB_HVACWIRES__G;
+		wirereq.connect = !(seq & 1);
+		req.n_sethvacwire = 1;
+		req.sethvacwire = &wirereqp;
+	}
+	if (envelope)
+		zmq_send(s, NULL, 0, ZMQ_SNDMORE);
+	zmq_send_protobuf(s, pb_request, &req, 0);
+}
+
+// Returns false if the reply is missing or bad, or (if require_success) refuses anything
+static
+bool bench_recv_reply(void * const s, struct fabd_pbarena * const arena, const bool require_success)
+{
+	zmq_msg_t msg;
+	assert(!zmq_msg_init(&msg));
+	do {
+		if (zmq_msg_recv(&msg, s, 0) < 0)
+		{
+			zmq_msg_close(&msg);
+			return false;
+		}
+	} while (zmq_msg_more(&msg));
+	PbRequestReply * const reply = pb_request_reply__unpack(&arena->allocator, zmq_msg_size(&msg), zmq_msg_data(&msg));
+	zmq_msg_close(&msg);
+	bool ok = (reply != NULL);
+	for (size_t i = 0; ok && require_success && i < reply->n_sethvacwiresuccess; ++i)
+		ok = reply->sethvacwiresuccess[i];
+	fabd_pbarena_reset(arena);
+	return ok;
+}
+
+static
+void bench_client_thread(void * const userp)
+{
+	struct bench_client * const c = userp;
+	const struct bench_opts * const opts = c->b->opts;
+	const unsigned window = c->batched ? opts->window : 1;
+	void * const s = bench_socket(c->b, c->batched ? ZMQ_DEALER : ZMQ_REQ);
+	// A stuck server shouldn't hang the whole run
+	const int timeout_ms = 5000;
+	zmq_setsockopt(s, ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
+	bench_connect(c->b, s, c->endpoint);
+	
+	struct fabd_pbarena arena;
+	fabd_pbarena_init(&arena, 0x400);
+	// Send times of requests in flight, oldest first (replies come back in order)
+	struct timespec ts_sent[window];
+	unsigned head = 0, inflight = 0, seq = 0;
+	unsigned seed = (uintptr_t)c;
+	struct timespec ts_now, ts_end;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	timespec_add_ms(&ts_now, opts->duration_ms, &ts_end);
+	while (true)
+	{
+		const bool sending = !timespec_passed(&ts_end, &ts_now, NULL);
+		if (sending && inflight < window)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &ts_sent[(head + inflight) % window]);
+			bench_send_request(s, c->target, seq++, &seed, c->batched);
+			++inflight;
+			continue;
+		}
+		if (!inflight)
+			break;
+		// Fuzzed changes are expected to be refused by interlocks often
+		const bool ok = bench_recv_reply(s, &arena, c->target != BT_GPIO_FUZZ);
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+		if (!ok)
+		{
+			++c->failures;
+			// Lost track of what's in flight
+			break;
+		}
+		bench_samples_add(&c->samples, bench_elapsed_us(&ts_sent[head], &ts_now));
+		head = (head + 1) % window;
+		--inflight;
+	}
+	fabd_pbarena_free(&arena);
+	zmq_close(s);
+}
+
+static
+void bench_requests(struct bench_ctx * const b, const bool batched)
+{
+	const struct bench_opts * const opts = b->opts;
+	char endpoint[0x100];
+	if (opts->target_uri)
+		snprintf(endpoint, sizeof(endpoint), "%s", opts->target_uri);
+	else
+	{
+		void * const server = bench_socket(b, ZMQ_REP);
+		bench_bind(b, server, endpoint, sizeof(endpoint));
+		void * const thread = zmq_threadstart(bench_mock_server_thread, server);
+		assert(thread);
+		b->mock_threads[b->n_mock_threads++] = thread;
+	}
+	
+	struct bench_client clients[opts->clients];
+	for (unsigned i = 0; i < opts->clients; ++i)
+	{
+		clients[i] = (struct bench_client){
+			.b = b,
+			.endpoint = endpoint,
+			// The mock answers for both, so split the swarm between them
+			.target = opts->target_uri ? opts->target : ((i & 1) ? BT_GPIO_HVAC : BT_TSTAT),
+			.batched = batched,
+		};
+		clients[i].thread = zmq_threadstart(bench_client_thread, &clients[i]);
+		assert(clients[i].thread);
+	}
+	
+	struct bench_samples samples = { .n = 0, };
+	uint64_t failures = 0;
+	for (unsigned i = 0; i < opts->clients; ++i)
+	{
+		zmq_threadclose(clients[i].thread);
+		bench_samples_merge(&samples, &clients[i].samples);
+		free(clients[i].samples.us);
+		failures += clients[i].failures;
+	}
+	
+	char extra[0x80] = "";
+	if (failures)
+		snprintf(extra, sizeof(extra), "  (%llu failed)", (unsigned long long)failures);
+	bench_report("requests", b, batched ? "batched" : "single", samples.n, opts->duration_ms / 1000., &samples, extra);
+	free(samples.us);
+	if (!opts->target_uri)
+		bench_unbind(endpoint);
+}
+
+static
+void bench_run(const struct bench_opts * const opts, const bool curve, const char * const transport)
+{
+	struct bench_ctx b = {
+		.opts = opts,
+		.zmq_ctx = zmq_ctx_new(),
+		.curve = curve,
+		.transport = transport,
+	};
+	if (curve)
+	{
+		// Fresh keys each run; no secretkey file needed
+		assert(!zmq_curve_keypair(b.server_public, b.server_secret));
+		assert(!zmq_curve_keypair(b.client_public, b.client_secret));
+	}
+	if (opts->run_events && !opts->target_uri)
+		bench_events(&b);
+	if (opts->run_requests)
+	{
+		bench_requests(&b, false);
+		bench_requests(&b, true);
+	}
+	zmq_ctx_term(b.zmq_ctx);
+	for (unsigned i = 0; i < b.n_mock_threads; ++i)
+		zmq_threadclose(b.mock_threads[i]);
+}
+
+static
+void bench_usage(const char * const argv0)
+{
+	fprintf(stderr, "Usage: %s [-d <seconds>] [-r <rate>] [-p <n>] [-c <n>] [-w <n>] [-s events|requests] [-t <uri> [-k tstat|gpio_hvac|fuzz]]\n", argv0);
+	fprintf(stderr, "  -d  Duration of each run (default 2)\n");
+	fprintf(stderr, "  -r  Events per second from each publisher (default 1000; 0 for as fast as possible)\n");
+	fprintf(stderr, "  -p  Publishers per profile (nbp, htu21d, gpio_hvac; default 1)\n");
+	fprintf(stderr, "  -c  Concurrent request clients (default 4)\n");
+	fprintf(stderr, "  -w  Requests in flight per client when batched (default 16)\n");
+	fprintf(stderr, "  -s  Only run this suite\n");
+	fprintf(stderr, "  -t  Send requests to this server (eg, fabd:my_tstat/control) instead of an in-process mock\n");
+	fprintf(stderr, "  -k  Kind of requests to send with -t (default tstat; fuzz is random gpio_hvac wire changes)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts opts = {
+		.duration_ms = 2000,
+		.rate = 1000,
+		.publishers = 1,
+		.clients = 4,
+		.window = 16,
+		.run_events = true,
+		.run_requests = true,
+		.target = BT_TSTAT,
+	};
+	int opt;
+	while ((opt = getopt(argc, argv, "c:d:k:p:r:s:t:w:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c':
+				opts.clients = strtoul(optarg, NULL, 0);
+				break;
+			case 'd':
+				opts.duration_ms = strtod(optarg, NULL) * 1000;
+				break;
+			case 'k':
+				if (!strcmp(optarg, "tstat"))
+					opts.target = BT_TSTAT;
+				else
+				if (!strcmp(optarg, "gpio_hvac"))
+					opts.target = BT_GPIO_HVAC;
+				else
+				if (!strcmp(optarg, "fuzz"))
+					opts.target = BT_GPIO_FUZZ;
+				else
+					bench_usage(argv[0]);
+				break;
+			case 'p':
+				opts.publishers = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				opts.rate = strtod(optarg, NULL);
+				break;
+			case 's':
+				opts.run_events = !strcmp(optarg, "events");
+				opts.run_requests = !strcmp(optarg, "requests");
+				if (!(opts.run_events || opts.run_requests))
+					bench_usage(argv[0]);
+				break;
+			case 't':
+				opts.target_uri = optarg;
+				break;
+			case 'w':
+				opts.window = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				bench_usage(argv[0]);
+		}
+	}
+	if (optind < argc || !opts.duration_ms || !opts.publishers || !opts.clients || !opts.window)
+		bench_usage(argv[0]);
+	
+	if (opts.target_uri)
+	{
+		// The server's own configuration decides transport and security
+		fabdcfg_load_directory();
+		load_freeabode_key();
+		bench_run(&opts, false, "cfg");
+		return 0;
+	}
+	
+	static const char * const transports[] = { "ipc", "tcp", };
+	for (int curve = 0; curve < 2; ++curve)
+		for (size_t i = 0; i < sizeof(transports) / sizeof(*transports); ++i)
+			bench_run(&opts, curve, transports[i]);
+	return 0;
+}
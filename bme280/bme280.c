@@ -2,6 +2,8 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,14 +13,18 @@
 
 #include <zmq.h>
 
+#include <freeabode/eventtime.h>
 #include <freeabode/fabdcfg.h>
 #include <freeabode/freeabode.pb-c.h>
 #include <freeabode/logging.h>
+#include <freeabode/metrics.h>
 #include <freeabode/security.h>
 #include <freeabode/util.h>
 #include "driver/bme280.h"
 
-static unsigned poll_interval_ms = 21094;
+static const unsigned default_poll_interval_ms = 21094;
+static unsigned poll_interval_ms;
+static int cfg_reload_fd;
 
 static void *zmq_pub;
 static PbEvent current_pbe = PB_EVENT__INIT;
@@ -29,6 +35,8 @@ static int bme280_i2c_fd;
 static
 void handle_readings(const struct bme280_data * const data)
 {
+	struct timespec ts_captured;
+	clock_gettime(CLOCK_MONOTONIC, &ts_captured);
 	const long temperature = data->temperature;
 	const long humidity = (long)data->humidity * 10 / 1024;
 	
@@ -39,7 +47,13 @@ void handle_readings(const struct bme280_data * const data)
 	current_pbw.temperature = temperature;
 	current_pbw.has_humidity = true;
 	current_pbw.humidity = humidity;
-	zmq_send_protobuf(zmq_pub, pb_event, &current_pbe, 0);
+	fabd_pbevent_send(zmq_pub, &current_pbe, &ts_captured);
+}
+
+static
+void poll_interval_changed(const char * const devid, const char * const key, const struct fabdcfg_value * const newvalue, void * const userp)
+{
+	poll_interval_ms = (newvalue && newvalue->has_int && newvalue->intval > 0) ? newvalue->intval : default_poll_interval_ms;
 }
 
 void got_new_subscriber(void * const s)
@@ -54,7 +68,7 @@ void got_new_subscriber(void * const s)
 	if (!data[0])
 		goto out;
 	
-	zmq_send_protobuf(zmq_pub, pb_event, &current_pbe, 0);
+	fabd_pbevent_send(zmq_pub, &current_pbe, NULL);
 	
 out:
 	zmq_msg_close(&msg);
@@ -66,21 +80,24 @@ void my_loop(const struct timespec * const ts_req_timeout, const int fd, const s
 	struct timespec ts_now, ts_timeout;
 	zmq_pollitem_t pollitems[] = {
 		{ .socket = zmq_pub, .events = ZMQ_POLLIN },
+		{ .fd = cfg_reload_fd, .events = ZMQ_POLLIN },
 		{ .fd = fd, .events = fd_events },
 	};
-	int n_pollitems = (fd == -1) ? 1 : 2;
+	int n_pollitems = (fd == -1) ? 2 : 3;
 	while (true)
 	{
 		timespec_clear(&ts_timeout);
 		clock_gettime(CLOCK_MONOTONIC, &ts_now);
 		if (ts_req_timeout && timespec_passed(ts_req_timeout, &ts_now, &ts_timeout))
 			return;
-		if (pollitems[1].revents)
+		if (pollitems[2].revents)
 			return;
 		if (zmq_poll(pollitems, n_pollitems, timespec_to_timeout_ms(&ts_now, &ts_timeout)) <= 0)
 			continue;
 		if (pollitems[0].revents & ZMQ_POLLIN)
 			got_new_subscriber(zmq_pub);
+		if (pollitems[1].revents & ZMQ_POLLIN)
+			fabdcfg_dispatch_changes();
 	}
 }
 
@@ -164,11 +181,15 @@ int main(int argc, char **argv)
 	}
 	assert(!ioctl(fd, I2C_SLAVE, addr));
 	bme280_i2c_fd = fd;
+	poll_interval_changed(devid, "poll_interval_ms", fabdcfg_lookup(fabdcfg_current(), devid, "poll_interval_ms"), NULL);
+	fabdcfg_on_change(devid, "poll_interval_ms", poll_interval_changed, NULL);
+	cfg_reload_fd = fabdcfg_watch_start();
 	
 	current_pbe.weather = &current_pbw;
 	
 	void * const zmq_ctx = zmq_ctx_new();
 	start_zap_handler(zmq_ctx);
+	fabd_metrics_serve(zmq_ctx, devid);
 	
 	zmq_pub = zmq_socket(zmq_ctx, ZMQ_XPUB);
 	zmq_setsockopt(zmq_pub, ZMQ_XPUB_VERBOSE, &int_one, sizeof(int_one));
@@ -183,6 +204,10 @@ int main(int argc, char **argv)
 	struct timespec ts_next_req;
 	clock_gettime(CLOCK_MONOTONIC, &ts_next_req);
 	
+	char labels[strlen(devid) + 0x10];
+	snprintf(labels, sizeof(labels), "devid=\"%s\"", devid);
+	struct fabd_metric * const read_errors = fabd_metric_counter("fabd_sensor_read_errors_total", labels, "Sensor requests or readings that failed");
+	
 	struct bme280_data data;
 	while (true)
 	{
@@ -190,11 +215,13 @@ int main(int argc, char **argv)
 		
 		if (BME280_OK != bme280_set_sensor_mode(BME280_FORCED_MODE, bme280)) {
 			applog(LOG_ERR, "bme280_set_sensor_mode failed");
+			fabd_metric_inc(read_errors);
 			goto schedule_next_poll;
 		}
 		my_delay_us(req_delay * 1000, bme280->intf_ptr);
 		if (BME280_OK != bme280_get_sensor_data(BME280_TEMP | BME280_HUM, &data, bme280)) {
 			applog(LOG_ERR, "bme280_get_sensor_data failed");
+			fabd_metric_inc(read_errors);
 			goto schedule_next_poll;
 		}
 		
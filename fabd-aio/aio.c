@@ -0,0 +1,112 @@
+#include "config.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zmq.h>
+
+#include <freeabode/component.h>
+#include <freeabode/fabdcfg.h>
+#include <freeabode/logging.h>
+#include <freeabode/metrics.h>
+#include <freeabode/security.h>
+
+#include "nbp/nbp.h"
+#include "tstat/tstat.h"
+#ifdef HAVE_WALLKNOB
+#include "wallknob/wallknob.h"
+#endif
+
+static const struct fabd_component_type * const my_component_types[] = {
+	&nbp_component,
+	&tstat_component,
+#ifdef HAVE_WALLKNOB
+	&wallknob_component,
+#endif
+};
+
+static
+const struct fabd_component_type *aio_find_type(const char * const type)
+{
+	if (!type)
+		return NULL;
+	for (size_t i = 0; i < sizeof(my_component_types) / sizeof(*my_component_types); ++i)
+		if (!strcmp(my_component_types[i]->type, type))
+			return my_component_types[i];
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <device-id>...\n", argv[0]);
+		return 1;
+	}
+	const int n_components = argc - 1;
+	struct fabd_component components[n_components];
+	const struct fabd_component_type *types[n_components];
+	
+	fabdcfg_load_directory();
+	for (int i = 0; i < n_components; ++i)
+	{
+		const char * const devid = argv[i + 1];
+		fabdcfg_load_device(devid);
+		const char * const type = fabdcfg_device_getstr(devid, "type");
+		types[i] = aio_find_type(type);
+		if (!types[i])
+		{
+			fprintf(stderr, "%s: Unsupported type '%s'\n", devid, type ?: "");
+			return 1;
+		}
+		for (int j = 0; j < i; ++j)
+			if (types[j] == types[i])
+			{
+				// Components keep their state in globals
+				fprintf(stderr, "%s: Only one %s component per process\n", devid, type);
+				return 1;
+			}
+	}
+	// Logging is process-wide, so the first device's settings apply to every component
+	fabdcfg_log_config(argv[1]);
+	load_freeabode_key();
+	
+	// One context for everything, so components can talk over inproc without CURVE or I/O thread overhead
+	void * const ctx = zmq_ctx_new();
+	start_zap_handler(ctx);
+	for (int i = 0; i < n_components; ++i)
+		fabdcfg_inproc_host(argv[i + 1]);
+	
+	// Only this thread handles termination signals; new threads inherit the mask
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	assert(!pthread_sigmask(SIG_BLOCK, &sigs, NULL));
+	
+	for (int i = 0; i < n_components; ++i)
+	{
+		// Every "metrics" server gives the whole process's metrics
+		fabd_metrics_serve(ctx, argv[i + 1]);
+		fabd_component_init(&components[i], types[i], argv[i + 1], ctx);
+		fabd_component_start_thread(&components[i]);
+	}
+	
+	int sig;
+	sigwait(&sigs, &sig);
+	applog(LOG_INFO, "Got signal %d, stopping", sig);
+	
+	for (int i = n_components; i-- > 0; )
+		fabd_component_request_stop(&components[i]);
+	for (int i = n_components; i-- > 0; )
+		fabd_component_join(&components[i]);
+	
+	// The ZAP handler and metrics threads exit once the context is terminated
+	zmq_ctx_term(ctx);
+	return 0;
+}
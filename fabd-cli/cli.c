@@ -1,38 +1,65 @@
 #include "config.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <zmq.h>
 #include <jansson.h>
 
 #include <freeabode/freeabode.pb-c.h>
 #include <freeabode/json.h>
+#include <freeabode/pbarena.h>
 #include <freeabode/security.h>
 #include <freeabode/util.h>
 
-int main(int argc, char **argv)
+// Requests in flight at once in batch mode
+#define CLI_BATCH_WINDOW  0x40
+
+// Endpoints get the same default mechanism as servers bind them with (eg, peer credentials over ipc)
+static
+void cli_connect(void * const s, const char * const uri)
+{
+	freeabode_zmq_security_policy(s, false, fabd_security_policy_default(uri));
+	assert(!zmq_connect(s, uri));
+}
+
+static
+PbRequest *cli_parse_request(const char * const s, const char ** const errmsg)
 {
-	if (argc != 3)
+	json_error_t jserr;
+	json_t *json_req = json_loads(s, 0, &jserr);
+	if (!json_req)
 	{
-		printf("Usage: %s <uri> '<json>'\n", argv[0]);
-		exit(1);
+		*errmsg = "JSON parse error";
+		return NULL;
 	}
-	
-	load_freeabode_key();
-	
-	void *my_zmq_context, *ctl;
-	my_zmq_context = zmq_ctx_new();
-	ctl = zmq_socket(my_zmq_context, ZMQ_REQ);
-	
-	freeabode_zmq_security(ctl, false);
-	
-	assert(!zmq_connect(ctl, argv[1]));
+	int errcount = 0;
+	PbRequest *pb_req = json_to_protobuf(&pb_request__descriptor, json_req, &errcount);
+	json_decref(json_req);
+	if (errcount)
+	{
+		if (pb_req)
+			pb_request__free_unpacked(pb_req, NULL);
+		*errmsg = "Error converting JSON to PbRequest";
+		return NULL;
+	}
+	return pb_req;
+}
+
+static
+int cli_single(void * const ctx, const char * const uri, const char * const json)
+{
+	void * const ctl = zmq_socket(ctx, ZMQ_REQ);
+	cli_connect(ctl, uri);
 	
 	{
 		json_error_t jserr;
-		json_t *json_req = json_loads(argv[2], 0, &jserr);
+		json_t *json_req = json_loads(json, 0, &jserr);
 		if (!json_req)
 		{
 			printf("JSON parse error at %lu bytes: %s\n", (unsigned long)jserr.position, jserr.text);
@@ -54,17 +81,284 @@ int main(int argc, char **argv)
 		PbRequestReply *reply;
 		zmq_recv_protobuf(ctl, pb_request_reply, reply, NULL);
 		int errcount = 0;
-		json_t *json_reply = protobuf_to_json(reply, &errcount);
+		char * const json_reply = protobuf_to_json_str(reply, true, &errcount);
 		if (errcount)
 			printf("WARNING: %d errors converting PbRequestReply to JSON\n", errcount);
 		pb_request_reply__free_unpacked(reply, NULL);
-		json_dumpf(json_reply, stdout, JSON_INDENT(4) | JSON_ENSURE_ASCII | JSON_SORT_KEYS);
-		puts("");
-		json_decref(json_reply);
+		if (json_reply)
+			puts(json_reply);
+		free(json_reply);
 	}
 	
 	zmq_close(ctl);
-	zmq_ctx_destroy(my_zmq_context);
+	return 0;
+}
+
+static
+void cli_print_error(const char * const errmsg)
+{
+	json_t * const j = json_object();
+	json_object_set_new(j, "error", json_string(errmsg));
+	json_dumpf(j, stdout, JSON_COMPACT);
+	putchar('\n');
+	json_decref(j);
+}
+
+// One request per line in, one reply per line out, in the same order
+// Requests are pipelined over a single connection, so each pays for neither setup nor a round trip
+// Input is read only as it becomes available, and each reply printed as soon as it arrives, so this also works interactively
+struct cli_batch {
+	void *ctl;
+	// Lines that failed to parse still need their place in the output; NULL marks a request in flight
+	const char *queue[CLI_BATCH_WINDOW];
+	unsigned queue_head, queue_len, n_inflight;
+	int failures;
+	struct fabd_pbarena arena;
+	struct fabd_json_writer w;
+};
+
+static
+void cli_batch_flush_errors(struct cli_batch * const b)
+{
+	while (b->queue_len && b->queue[b->queue_head % CLI_BATCH_WINDOW])
+	{
+		cli_print_error(b->queue[b->queue_head % CLI_BATCH_WINDOW]);
+		++b->queue_head;
+		--b->queue_len;
+	}
+}
+
+static
+void cli_batch_request(struct cli_batch * const b, char * const line)
+{
+	if (!line[strspn(line, " \t\r\n")])
+		// Blank
+		return;
+	const char *errmsg = NULL;
+	PbRequest * const pb_req = cli_parse_request(line, &errmsg);
+	if (pb_req)
+	{
+		zmq_send(b->ctl, NULL, 0, ZMQ_SNDMORE);
+		zmq_send_protobuf(b->ctl, pb_request, pb_req, 0);
+		pb_request__free_unpacked(pb_req, NULL);
+		++b->n_inflight;
+	}
+	else
+		++b->failures;
+	b->queue[(b->queue_head + b->queue_len++) % CLI_BATCH_WINDOW] = errmsg;
+}
+
+// Prints any replies that have arrived; false once none are left
+static
+bool cli_batch_reply(struct cli_batch * const b)
+{
+	// Replies come back in order; skip the empty delimiter frame
+	zmq_msg_t msg;
+	assert(!zmq_msg_init(&msg));
+	do {
+		if (zmq_msg_recv(&msg, b->ctl, ZMQ_DONTWAIT) < 0)
+		{
+			assert(errno == EAGAIN);
+			zmq_msg_close(&msg);
+			return false;
+		}
+	} while (zmq_msg_more(&msg));
+	PbRequestReply * const reply = pb_request_reply__unpack(&b->arena.allocator, zmq_msg_size(&msg), zmq_msg_data(&msg));
+	zmq_msg_close(&msg);
+	--b->n_inflight;
+	++b->queue_head;
+	--b->queue_len;
+	
+	int errcount = 0;
+	b->w.len = 0;
+	if (reply && protobuf_to_json_write(&b->w, reply, &errcount))
+	{
+		fwrite(b->w.buf, b->w.len, 1, stdout);
+		putchar('\n');
+	}
+	else
+	{
+		cli_print_error("Error converting PbRequestReply to JSON");
+		++b->failures;
+	}
+	fabd_pbarena_reset(&b->arena);
+	cli_batch_flush_errors(b);
+	return true;
+}
+
+static
+int cli_batch(void * const ctx, const char * const uri, FILE * const in)
+{
+	struct cli_batch b = {
+		.ctl = zmq_socket(ctx, ZMQ_DEALER),
+	};
+	cli_connect(b.ctl, uri);
+	fabd_pbarena_init(&b.arena, 0x400);
+	fabd_json_writer_init(&b.w, false);
+	
+	// stdio would hide buffered lines from poll, so do our own line buffering
+	const int fd = fileno(in);
+	bool eof = false;
+	char *buf = NULL;
+	size_t buflen = 0, bufsz = 0;
 	
+	while (true)
+	{
+		cli_batch_flush_errors(&b);
+		
+		// Send whatever complete lines the window has room for
+		size_t bufpos = 0;
+		char *nl;
+		while (b.queue_len < CLI_BATCH_WINDOW && bufpos < buflen && (nl = memchr(&buf[bufpos], '\n', buflen - bufpos)))
+		{
+			*nl = '\0';
+			cli_batch_request(&b, &buf[bufpos]);
+			bufpos = nl + 1 - buf;
+		}
+		if (bufpos)
+		{
+			buflen -= bufpos;
+			memmove(buf, &buf[bufpos], buflen);
+		}
+		if (eof && buflen && b.queue_len < CLI_BATCH_WINDOW)
+		{
+			// Last line had no newline
+			buf[buflen] = '\0';
+			cli_batch_request(&b, buf);
+			buflen = 0;
+		}
+		cli_batch_flush_errors(&b);
+		fflush(stdout);
+		
+		if (eof && !b.queue_len)
+			break;
+		
+		zmq_pollitem_t pi[2];
+		int n_pi = 0;
+		if (b.n_inflight)
+			pi[n_pi++] = (zmq_pollitem_t){ .socket = b.ctl, .events = ZMQ_POLLIN, };
+		const bool want_input = !eof && b.queue_len < CLI_BATCH_WINDOW;
+		if (want_input)
+			pi[n_pi++] = (zmq_pollitem_t){ .fd = fd, .events = ZMQ_POLLIN, };
+		if (zmq_poll(pi, n_pi, -1) < 0)
+		{
+			assert(errno == EINTR);
+			continue;
+		}
+		
+		if (b.n_inflight && (pi[0].revents & ZMQ_POLLIN))
+			while (cli_batch_reply(&b))
+			{}
+		
+		if (want_input && (pi[n_pi - 1].revents & (ZMQ_POLLIN | ZMQ_POLLERR)))
+		{
+			// Room for a terminator too
+			if (bufsz - buflen < 0x1001)
+			{
+				bufsz = buflen + 0x1001;
+				buf = realloc(buf, bufsz);
+				assert(buf);
+			}
+			const ssize_t r = read(fd, &buf[buflen], bufsz - buflen - 1);
+			if (r > 0)
+				buflen += r;
+			else
+			if (r == 0 || errno != EINTR)
+				eof = true;
+		}
+	}
+	
+	free(buf);
+	fabd_json_writer_free(&b.w);
+	fabd_pbarena_free(&b.arena);
+	zmq_close(b.ctl);
+	return b.failures ? 1 : 0;
+}
+
+static
+int cli_watch(void * const ctx, const char * const uri)
+{
+	void * const sub = zmq_socket(ctx, ZMQ_SUB);
+	cli_connect(sub, uri);
+	assert(!zmq_setsockopt(sub, ZMQ_SUBSCRIBE, NULL, 0));
+	
+	struct fabd_pbarena arena;
+	fabd_pbarena_init(&arena, 0x400);
+	struct fabd_json_writer w;
+	fabd_json_writer_init(&w, false);
+	while (true)
+	{
+		PbEvent *pbevent;
+		zmq_recv_protobuf(sub, pb_event, pbevent, &arena.allocator);
+		int errcount = 0;
+		w.len = 0;
+		if (pbevent && protobuf_to_json_write(&w, pbevent, &errcount))
+		{
+			fwrite(w.buf, w.len, 1, stdout);
+			putchar('\n');
+			fflush(stdout);
+		}
+		else
+			cli_print_error("Error decoding PbEvent");
+		fabd_pbarena_reset(&arena);
+	}
+}
+
+static
+int cli_metrics(void * const ctx, const char * const uri)
+{
+	void * const s = zmq_socket(ctx, ZMQ_REQ);
+	cli_connect(s, uri);
+	zmq_send(s, "prometheus", 10, 0);
+	zmq_msg_t msg;
+	assert(!zmq_msg_init(&msg));
+	assert(zmq_msg_recv(&msg, s, 0) >= 0);
+	fwrite(zmq_msg_data(&msg), zmq_msg_size(&msg), 1, stdout);
+	zmq_msg_close(&msg);
+	zmq_close(s);
 	return 0;
 }
+
+int main(int argc, char **argv)
+{
+	const bool batch = (argc == 3 || argc == 4) && !strcmp(argv[2], "--batch");
+	const bool watch = (argc == 3) && !strcmp(argv[2], "--watch");
+	const bool metrics = (argc == 3) && !strcmp(argv[2], "--metrics");
+	if (!(batch || watch || metrics || (argc == 3 && strncmp(argv[2], "--", 2))))
+	{
+		printf("Usage: %s <uri> '<json>'\n", argv[0]);
+		printf("       %s <uri> --batch [<file>]  (one JSON request per line; '-' or none for stdin)\n", argv[0]);
+		printf("       %s <uri> --watch  (print events as JSON)\n", argv[0]);
+		printf("       %s <uri> --metrics  (print a metrics server's metrics as Prometheus text)\n", argv[0]);
+		exit(1);
+	}
+	
+	FILE *in = stdin;
+	if (batch && argc == 4 && strcmp(argv[3], "-"))
+	{
+		in = fopen(argv[3], "r");
+		if (!in)
+		{
+			perror(argv[3]);
+			exit(1);
+		}
+	}
+	
+	load_freeabode_key();
+	
+	void * const my_zmq_context = zmq_ctx_new();
+	int rv;
+	if (batch)
+		rv = cli_batch(my_zmq_context, argv[1], in);
+	else
+	if (watch)
+		rv = cli_watch(my_zmq_context, argv[1]);
+	else
+	if (metrics)
+		rv = cli_metrics(my_zmq_context, argv[1]);
+	else
+		rv = cli_single(my_zmq_context, argv[1], argv[2]);
+	zmq_ctx_destroy(my_zmq_context);
+	
+	return rv;
+}
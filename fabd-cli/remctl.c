@@ -36,9 +36,11 @@ int main(int argc, char **argv)
 	my_zmq_context = zmq_ctx_new();
 	ctl = zmq_socket(my_zmq_context, ZMQ_REQ);
 	
-	freeabode_zmq_security(ctl, false);
+	// Same default mechanism as the server binds with (eg, peer credentials over ipc)
+	const char * const uri = argv[3] ?: "ipc://nbp.ipc";
+	freeabode_zmq_security_policy(ctl, false, fabd_security_policy_default(uri));
 	
-	assert(!zmq_connect(ctl, argv[3] ?: "ipc://nbp.ipc"));
+	assert(!zmq_connect(ctl, uri));
 	
 	PbRequest req = PB_REQUEST__INIT;
 	req.n_sethvacwire = 1;
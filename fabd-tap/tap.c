@@ -0,0 +1,317 @@
+#include "config.h"
+
+#include <assert.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jansson.h>
+#include <zmq.h>
+
+#include <freeabode/eventtime.h>
+#include <freeabode/fabdcfg.h>
+#include <freeabode/freeabode.pb-c.h>
+#include <freeabode/json.h>
+#include <freeabode/pbarena.h>
+#include <freeabode/security.h>
+#include <freeabode/util.h>
+
+// Binary captures are "FABDTAP1", then for each event:
+//   u64le microseconds since the epoch, u16le source index (order given on the command line), u32le length, raw PbEvent
+static const char tap_capture_magic[8] = "FABDTAP1";
+
+// Power of two size buckets, starting at 16 bytes
+#define TAP_SIZE_BUCKETS  8
+
+enum tap_output {
+	TO_JSON,
+	TO_BINARY,
+	TO_NONE,
+};
+
+struct tap_source {
+	const char *uri;
+	// The URI as a JSON string, for wrapping events from multiple sources
+	char *juri;
+	void *socket;
+	
+	uint64_t msgs, bytes;
+	uint64_t interval_msgs, interval_bytes;
+	size_t min_sz, max_sz;
+	uint64_t size_hist[TAP_SIZE_BUCKETS];
+	struct fabd_event_latency latency;
+};
+
+static volatile sig_atomic_t tap_stop;
+
+static
+void tap_sighandler(const int sig)
+{
+	tap_stop = 1;
+}
+
+static
+bool tap_field_present(const ProtobufCMessage * const pb, const ProtobufCFieldDescriptor * const pbfield)
+{
+	const void * const addr = (const void *)pb + pbfield->offset;
+	if (pbfield->label == PROTOBUF_C_LABEL_REPEATED)
+		return *(const size_t *)((const void *)pb + pbfield->quantifier_offset);
+	if (pbfield->label == PROTOBUF_C_LABEL_REQUIRED)
+		return true;
+	if (pbfield->quantifier_offset)
+		return *(const protobuf_c_boolean *)((const void *)pb + pbfield->quantifier_offset);
+	return *(void * const *)addr;
+}
+
+static
+void tap_record_size(struct tap_source * const src, const size_t sz)
+{
+	++src->msgs;
+	++src->interval_msgs;
+	src->bytes += sz;
+	src->interval_bytes += sz;
+	if (sz < src->min_sz || src->msgs == 1)
+		src->min_sz = sz;
+	if (sz > src->max_sz)
+		src->max_sz = sz;
+	int bucket = 0;
+	while (bucket < TAP_SIZE_BUCKETS - 1 && sz >= (0x10 << bucket))
+		++bucket;
+	++src->size_hist[bucket];
+}
+
+static
+void tap_print_latency(const char * const what, const struct fabd_latency_hist * const hist)
+{
+	if (!hist->count)
+		return;
+	fprintf(stderr, "; %s mean %lluus p50<%luus p99<%luus max %lluus", what, (unsigned long long)(hist->sum_us / hist->count), (unsigned long)fabd_latency_hist_quantile_us(hist, 0.5), (unsigned long)fabd_latency_hist_quantile_us(hist, 0.99), (unsigned long long)hist->max_us);
+}
+
+static
+void tap_print_stats(struct tap_source * const sources, const size_t n_sources, const double interval_secs, const bool final)
+{
+	for (size_t i = 0; i < n_sources; ++i)
+	{
+		struct tap_source * const src = &sources[i];
+		if (final)
+			fprintf(stderr, "%s: %llu msgs, %llu bytes", src->uri, (unsigned long long)src->msgs, (unsigned long long)src->bytes);
+		else
+			fprintf(stderr, "%s: %.1f msg/s, %.1f B/s", src->uri, src->interval_msgs / interval_secs, src->interval_bytes / interval_secs);
+		if (src->msgs)
+		{
+			fprintf(stderr, "; size min/avg/max %lu/%lu/%lu; hist", (unsigned long)src->min_sz, (unsigned long)(src->bytes / src->msgs), (unsigned long)src->max_sz);
+			for (int j = 0; j < TAP_SIZE_BUCKETS; ++j)
+				fprintf(stderr, " %s%u:%llu", (j == TAP_SIZE_BUCKETS - 1) ? ">=" : "<", (j == TAP_SIZE_BUCKETS - 1) ? (0x10 << (j - 1)) : (0x10 << j), (unsigned long long)src->size_hist[j]);
+		}
+		tap_print_latency("publish latency", &src->latency.hop);
+		tap_print_latency("reading age", &src->latency.age);
+		fputc('\n', stderr);
+		src->interval_msgs = src->interval_bytes = 0;
+	}
+}
+
+static
+void tap_usage(const char * const argv0)
+{
+	fprintf(stderr, "Usage: %s [-d <device-id>] [-f <field>]... [-o json|binary|none] [-s <seconds>] <uri>...\n", argv0);
+	fprintf(stderr, "  -d  Resolve fabd: URIs as this device (defaults to directory.json only)\n");
+	fprintf(stderr, "  -f  Only show events with this field set (may be repeated)\n");
+	fprintf(stderr, "  -o  Output format for events on stdout (default json)\n");
+	fprintf(stderr, "  -s  Print per-source stats to stderr this often (default 10; 0 to disable)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *devid = NULL;
+	const char **filter_names = NULL;
+	size_t n_filters = 0;
+	enum tap_output output = TO_JSON;
+	unsigned long stats_interval_ms = 10000;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:f:o:s:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd':
+				devid = optarg;
+				break;
+			case 'f':
+				filter_names = realloc(filter_names, sizeof(*filter_names) * (n_filters + 1));
+				assert(filter_names);
+				filter_names[n_filters++] = optarg;
+				break;
+			case 'o':
+				if (!strcmp(optarg, "json"))
+					output = TO_JSON;
+				else
+				if (!strcmp(optarg, "binary"))
+					output = TO_BINARY;
+				else
+				if (!strcmp(optarg, "none"))
+					output = TO_NONE;
+				else
+					tap_usage(argv[0]);
+				break;
+			case 's':
+				stats_interval_ms = strtod(optarg, NULL) * 1000;
+				break;
+			default:
+				tap_usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		tap_usage(argv[0]);
+	
+	const ProtobufCFieldDescriptor *filters[n_filters ?: 1];
+	for (size_t i = 0; i < n_filters; ++i)
+	{
+		filters[i] = protobuf_c_message_descriptor_get_field_by_name(&pb_event__descriptor, filter_names[i]);
+		if (!filters[i])
+		{
+			fprintf(stderr, "PbEvent has no field '%s'\n", filter_names[i]);
+			exit(1);
+		}
+	}
+	
+	fabdcfg_load_directory();
+	if (devid)
+		fabdcfg_load_device(devid);
+	load_freeabode_key();
+	
+	void * const my_zmq_context = zmq_ctx_new();
+	const size_t n_sources = argc - optind;
+	struct tap_source sources[n_sources];
+	zmq_pollitem_t pollitems[n_sources];
+	for (size_t i = 0; i < n_sources; ++i)
+	{
+		sources[i] = (struct tap_source){
+			.uri = argv[optind + i],
+			.socket = zmq_socket(my_zmq_context, ZMQ_SUB),
+		};
+		freeabode_zmq_security(sources[i].socket, false);
+		if (!fabdcfg_zmq_connect_uri(devid, sources[i].uri, sources[i].socket))
+		{
+			fprintf(stderr, "Failed to connect to %s\n", sources[i].uri);
+			exit(1);
+		}
+		assert(!zmq_setsockopt(sources[i].socket, ZMQ_SUBSCRIBE, NULL, 0));
+		pollitems[i] = (zmq_pollitem_t){ .socket = sources[i].socket, .events = ZMQ_POLLIN };
+		fabd_event_latency_init(&sources[i].latency, NULL, sources[i].uri);
+		json_t * const juri = json_string(sources[i].uri);
+		sources[i].juri = json_dumps(juri, JSON_ENCODE_ANY);
+		json_decref(juri);
+	}
+	
+	signal(SIGINT, tap_sighandler);
+	signal(SIGTERM, tap_sighandler);
+	
+	if (output == TO_BINARY)
+		fwrite(tap_capture_magic, sizeof(tap_capture_magic), 1, stdout);
+	
+	struct fabd_pbarena arena;
+	fabd_pbarena_init(&arena, 0x400);
+	struct fabd_json_writer w;
+	fabd_json_writer_init(&w, false);
+	zmq_msg_t msg;
+	assert(!zmq_msg_init(&msg));
+	
+	struct timespec ts_now, ts_timeout, ts_next_stats = TIMESPEC_INIT_CLEAR;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	if (stats_interval_ms)
+		timespec_add_ms(&ts_now, stats_interval_ms, &ts_next_stats);
+	while (!tap_stop)
+	{
+		timespec_clear(&ts_timeout);
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+		if (stats_interval_ms && timespec_passed(&ts_next_stats, &ts_now, &ts_timeout))
+		{
+			tap_print_stats(sources, n_sources, stats_interval_ms / 1000., false);
+			timespec_add_ms(&ts_now, stats_interval_ms, &ts_next_stats);
+			timespec_min(&ts_timeout, &ts_next_stats, &ts_timeout);
+		}
+		if (zmq_poll(pollitems, n_sources, timespec_to_timeout_ms(&ts_now, &ts_timeout)) <= 0)
+			continue;
+		for (size_t i = 0; i < n_sources; ++i)
+		{
+			if (!(pollitems[i].revents & ZMQ_POLLIN))
+				continue;
+			struct tap_source * const src = &sources[i];
+			while (zmq_msg_recv(&msg, src->socket, ZMQ_DONTWAIT) >= 0)
+			{
+				const size_t sz = zmq_msg_size(&msg);
+				tap_record_size(src, sz);
+				
+				PbEvent *pbevent = NULL;
+				if (n_filters || output == TO_JSON || stats_interval_ms)
+				{
+					pbevent = pb_event__unpack(&arena.allocator, sz, zmq_msg_data(&msg));
+					if (!pbevent)
+					{
+						fprintf(stderr, "%s: failed to decode PbEvent\n", src->uri);
+						fabd_pbarena_reset(&arena);
+						continue;
+					}
+					fabd_event_latency_record(&src->latency, pbevent);
+					bool match = !n_filters;
+					for (size_t j = 0; j < n_filters && !match; ++j)
+						match = tap_field_present(&pbevent->base, filters[j]);
+					if (!match)
+					{
+						fabd_pbarena_reset(&arena);
+						continue;
+					}
+				}
+				
+				if (output == TO_NONE)
+				{}
+				else
+				if (output == TO_BINARY)
+				{
+					struct timespec ts;
+					clock_gettime(CLOCK_REALTIME, &ts);
+					uint8_t hdr[14];
+					pk_u64le(hdr, 0, ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+					pk_u16le(hdr, 8, i);
+					pk_u32le(hdr, 10, sz);
+					fwrite(hdr, sizeof(hdr), 1, stdout);
+					fwrite(zmq_msg_data(&msg), sz, 1, stdout);
+				}
+				else
+				{
+					int errcount = 0;
+					w.len = 0;
+					if (protobuf_to_json_write(&w, pbevent, &errcount))
+					{
+						// Still one JSON object per line
+						if (n_sources > 1)
+							printf("{\"source\":%s,\"event\":", src->juri);
+						fwrite(w.buf, w.len, 1, stdout);
+						if (n_sources > 1)
+							putchar('}');
+						putchar('\n');
+					}
+				}
+				fabd_pbarena_reset(&arena);
+			}
+			fflush(stdout);
+		}
+	}
+	
+	zmq_msg_close(&msg);
+	if (stats_interval_ms)
+		tap_print_stats(sources, n_sources, 0, true);
+	for (size_t i = 0; i < n_sources; ++i)
+	{
+		zmq_close(sources[i].socket);
+		free(sources[i].juri);
+	}
+	zmq_ctx_destroy(my_zmq_context);
+	return 0;
+}
@@ -0,0 +1,294 @@
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+#include <sodium/crypto_shorthash.h>
+#include <sodium/randombytes.h>
+#include <sodium/utils.h>
+
+#include "authz.h"
+#include "bytes.h"
+#include "fabdcfg.h"
+#include "logging.h"
+#include "security.h"
+#include "util.h"
+
+#define FABD_AUTHZ_KEYSZ  0x20
+
+struct fabd_authz_key {
+	uint64_t hash;
+	const char *domain;  // NULL for all servers
+	uint8_t pubkey[FABD_AUTHZ_KEYSZ];
+	unsigned roles;
+};
+
+struct fabd_authz_server {
+	uint64_t hash;
+	char *domain;
+	unsigned required;
+};
+
+struct fabd_authz {
+	// Client-chosen keys index the table, so use a keyed hash to keep probe chains short
+	uint8_t hashkey[crypto_shorthash_KEYBYTES];
+	struct fabd_authz_key *keys;
+	size_t keys_mask, n_keys;
+	struct fabd_authz_server *servers;
+	size_t servers_mask, n_servers;
+};
+
+static
+uint64_t fabd_authz_hash(const struct fabd_authz * const authz, const char * const domain, const uint8_t * const pubkey)
+{
+	const size_t domainlen = domain ? strlen(domain) : 0;
+	uint8_t buf[domainlen + 1 + (pubkey ? FABD_AUTHZ_KEYSZ : 0)];
+	memcpy(buf, domain ?: "", domainlen);
+	buf[domainlen] = '\0';
+	if (pubkey)
+		memcpy(&buf[domainlen + 1], pubkey, FABD_AUTHZ_KEYSZ);
+	uint8_t out[crypto_shorthash_BYTES];
+	crypto_shorthash(out, buf, sizeof(buf), authz->hashkey);
+	return upk_u64le(out, 0);
+}
+
+static
+bool fabd_authz_domain_eq(const char * const a, const char * const b)
+{
+	if (!(a && b))
+		return a == b;
+	return !strcmp(a, b);
+}
+
+static
+struct fabd_authz_key *fabd_authz_key_probe(struct fabd_authz_key * const keys, const size_t mask, const uint64_t hash, const char * const domain, const uint8_t * const pubkey)
+{
+	for (size_t i = hash & mask; ; i = (i + 1) & mask)
+	{
+		struct fabd_authz_key * const e = &keys[i];
+		if (!e->roles)
+			return e;
+		if (e->hash == hash && fabd_authz_domain_eq(e->domain, domain) && !sodium_memcmp(e->pubkey, pubkey, FABD_AUTHZ_KEYSZ))
+			return e;
+	}
+}
+
+static
+struct fabd_authz_server *fabd_authz_server_probe(struct fabd_authz_server * const servers, const size_t mask, const uint64_t hash, const char * const domain)
+{
+	for (size_t i = hash & mask; ; i = (i + 1) & mask)
+	{
+		struct fabd_authz_server * const e = &servers[i];
+		if (!e->domain)
+			return e;
+		if (e->hash == hash && !strcmp(e->domain, domain))
+			return e;
+	}
+}
+
+static
+void fabd_authz_grow_keys(struct fabd_authz * const authz)
+{
+	if ((authz->n_keys + 1) * 2 <= authz->keys_mask + 1)
+		return;
+	const size_t newsz = (authz->keys_mask + 1) * 2;
+	struct fabd_authz_key * const keys = calloc(newsz, sizeof(*keys));
+	assert(keys);
+	for (size_t i = 0; i <= authz->keys_mask; ++i)
+	{
+		const struct fabd_authz_key * const e = &authz->keys[i];
+		if (e->roles)
+			*fabd_authz_key_probe(keys, newsz - 1, e->hash, e->domain, e->pubkey) = *e;
+	}
+	free(authz->keys);
+	authz->keys = keys;
+	authz->keys_mask = newsz - 1;
+}
+
+static
+void fabd_authz_grow_servers(struct fabd_authz * const authz)
+{
+	if ((authz->n_servers + 1) * 2 <= authz->servers_mask + 1)
+		return;
+	const size_t newsz = (authz->servers_mask + 1) * 2;
+	struct fabd_authz_server * const servers = calloc(newsz, sizeof(*servers));
+	assert(servers);
+	for (size_t i = 0; i <= authz->servers_mask; ++i)
+	{
+		const struct fabd_authz_server * const e = &authz->servers[i];
+		if (e->domain)
+			*fabd_authz_server_probe(servers, newsz - 1, e->hash, e->domain) = *e;
+	}
+	free(authz->servers);
+	authz->servers = servers;
+	authz->servers_mask = newsz - 1;
+}
+
+static
+void fabd_authz_add_key(struct fabd_authz * const authz, const char * const domain, const uint8_t * const pubkey, const unsigned roles)
+{
+	if (!roles)
+		return;
+	fabd_authz_grow_keys(authz);
+	const uint64_t hash = fabd_authz_hash(authz, domain, pubkey);
+	struct fabd_authz_key * const e = fabd_authz_key_probe(authz->keys, authz->keys_mask, hash, domain, pubkey);
+	if (!e->roles)
+	{
+		e->hash = hash;
+		e->domain = domain;
+		memcpy(e->pubkey, pubkey, FABD_AUTHZ_KEYSZ);
+		++authz->n_keys;
+	}
+	e->roles |= roles;
+}
+
+unsigned fabd_authz_parse_roles(json_t * const j)
+{
+	if (json_is_array(j))
+	{
+		unsigned roles = 0;
+		json_t *jj;
+		size_t i;
+		json_array_foreach(j, i, jj)
+			roles |= fabd_authz_parse_roles(jj);
+		return roles;
+	}
+	const char * const s = json_string_value(j);
+	if (!s)
+		return 0;
+	if (!strcmp(s, "read"))
+		return FABD_ROLE_READ;
+	if (!strcmp(s, "control"))
+		return FABD_ROLE_CONTROL;
+	if (!strcmp(s, "all"))
+		return FABD_ROLE_ALL;
+	applog(LOG_WARNING, "Unknown role '%s'", s);
+	return 0;
+}
+
+// { "<public key>": <role or Array of roles>, ... }
+static
+void fabd_authz_add_keys(struct fabd_authz * const authz, const char * const domain, json_t * const jkeys)
+{
+	const char *s;
+	json_t *j;
+	uint8_t pubkey[FABD_AUTHZ_KEYSZ];
+	json_object_foreach(jkeys, s, j)
+	{
+		if (!freeabode_parse_pubkey(s, pubkey))
+		{
+			applog(LOG_WARNING, "Invalid public key '%s'", s);
+			continue;
+		}
+		fabd_authz_add_key(authz, domain, pubkey, fabd_authz_parse_roles(j));
+	}
+}
+
+static
+void fabd_authz_add_server(struct fabd_authz * const authz, const char * const devid, const char * const servername, json_t * const jserver)
+{
+	const size_t domainsz = strlen(devid) + 1 + strlen(servername) + 1;
+	char domainbuf[domainsz];
+	snprintf(domainbuf, domainsz, "%s/%s", devid, servername);
+	
+	// Unless specified, control servers need the control role, and anything else just read
+	json_t * const jrole = json_is_object(jserver) ? json_object_get(jserver, "role") : NULL;
+	unsigned required = jrole ? fabd_authz_parse_roles(jrole) : 0;
+	if (!required)
+		required = strcmp(servername, "control") ? FABD_ROLE_READ : FABD_ROLE_CONTROL;
+	
+	fabd_authz_grow_servers(authz);
+	const uint64_t hash = fabd_authz_hash(authz, domainbuf, NULL);
+	struct fabd_authz_server * const e = fabd_authz_server_probe(authz->servers, authz->servers_mask, hash, domainbuf);
+	if (!e->domain)
+	{
+		*e = (struct fabd_authz_server){
+			.hash = hash,
+			.domain = strdup(domainbuf),
+		};
+		++authz->n_servers;
+	}
+	e->required = required;
+	
+	// Key entries share the server's copy of the domain
+	if (json_is_object(jserver))
+		fabd_authz_add_keys(authz, e->domain, json_object_get(jserver, "keys"));
+}
+
+static
+void fabd_authz_add_device(struct fabd_authz * const authz, const struct fabdcfg_snapshot * const snap, const char * const devid)
+{
+	const struct fabdcfg_value * const v = fabdcfg_lookup(snap, devid, "servers");
+	if (!v)
+		return;
+	const char *servername;
+	json_t *j;
+	json_object_foreach(v->json, servername, j)
+		fabd_authz_add_server(authz, devid, servername, j);
+}
+
+struct fabd_authz *fabd_authz_build(const struct fabdcfg_snapshot * const snap)
+{
+	struct fabd_authz * const authz = malloc(sizeof(*authz));
+	assert(authz);
+	*authz = (struct fabd_authz){
+		.keys = calloc(0x10, sizeof(*authz->keys)),
+		.keys_mask = 0xf,
+		.servers = calloc(0x10, sizeof(*authz->servers)),
+		.servers_mask = 0xf,
+	};
+	assert(authz->keys && authz->servers);
+	randombytes_buf(authz->hashkey, sizeof(authz->hashkey));
+	
+	// Our own key can do anything, anywhere
+	if (bytes_len(freeabode_pubkey) == FABD_AUTHZ_KEYSZ)
+		fabd_authz_add_key(authz, NULL, bytes_buf(freeabode_pubkey), FABD_ROLE_ALL);
+	
+	fabd_authz_add_keys(authz, NULL, fabdcfg_directory_get(snap, "keys"));
+	
+	// Devices may also be known only from their own config file
+	json_t * const jdevices = fabdcfg_directory_get(snap, "devices");
+	const char *devid;
+	json_t *j;
+	json_object_foreach(jdevices, devid, j)
+		fabd_authz_add_device(authz, snap, devid);
+	json_object_foreach(fabdcfg_loaded_configs(snap), devid, j)
+		if (!json_object_get(jdevices, devid))
+			fabd_authz_add_device(authz, snap, devid);
+	
+	return authz;
+}
+
+void fabd_authz_free(struct fabd_authz * const authz)
+{
+	if (!authz)
+		return;
+	free(authz->keys);
+	for (size_t i = 0; i <= authz->servers_mask; ++i)
+		free(authz->servers[i].domain);
+	free(authz->servers);
+	free(authz);
+}
+
+bool fabd_authz_check(const struct fabd_authz * const authz, const char * const domain, const uint8_t * const pubkey)
+{
+	// Unknown servers (not bound via fabdcfg) get the strictest treatment
+	unsigned required = FABD_ROLE_ALL;
+	if (domain && domain[0])
+	{
+		const struct fabd_authz_server * const srv = fabd_authz_server_probe(authz->servers, authz->servers_mask, fabd_authz_hash(authz, domain, NULL), domain);
+		if (srv->domain)
+			required = srv->required;
+	}
+	
+	unsigned roles = fabd_authz_key_probe(authz->keys, authz->keys_mask, fabd_authz_hash(authz, NULL, pubkey), NULL, pubkey)->roles;
+	if (domain && domain[0])
+		roles |= fabd_authz_key_probe(authz->keys, authz->keys_mask, fabd_authz_hash(authz, domain, pubkey), domain, pubkey)->roles;
+	return (roles & required) == required;
+}
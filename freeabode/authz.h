@@ -0,0 +1,27 @@
+#ifndef FABD_AUTHZ_H
+#define FABD_AUTHZ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <freeabode/fabdcfg.h>
+
+// Which CURVE client keys may use which servers, built from a config snapshot.
+// Servers are identified by their ZAP domain, "<device-id>/<server>".
+
+enum fabd_role {
+	FABD_ROLE_READ    = 1 << 0,
+	FABD_ROLE_CONTROL = 1 << 1,
+	
+	FABD_ROLE_ALL = FABD_ROLE_READ | FABD_ROLE_CONTROL,
+};
+
+struct fabd_authz;
+
+extern struct fabd_authz *fabd_authz_build(const struct fabdcfg_snapshot *);
+extern void fabd_authz_free(struct fabd_authz *);
+extern bool fabd_authz_check(const struct fabd_authz *, const char *domain, const uint8_t *pubkey);
+// "read", "control", "all", or an Array of them; for others enforcing the same roles
+extern unsigned fabd_authz_parse_roles(json_t *);
+
+#endif
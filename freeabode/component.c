@@ -0,0 +1,82 @@
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <zmq.h>
+#include <zmq_utils.h>
+
+#include "component.h"
+#include "fabdcfg.h"
+#include "logging.h"
+#include "metrics.h"
+#include "security.h"
+
+void fabd_component_init(struct fabd_component * const comp, const struct fabd_component_type * const type, const char * const devid, void * const zmq_context)
+{
+	*comp = (struct fabd_component){
+		.type = type,
+		.devid = devid,
+		.zmq_context = zmq_context,
+		.stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK),
+	};
+	assert(comp->stop_fd >= 0);
+}
+
+bool fabd_component_stopping(const struct fabd_component * const comp)
+{
+	return __atomic_load_n(&comp->stopping, __ATOMIC_ACQUIRE);
+}
+
+void fabd_component_request_stop(struct fabd_component * const comp)
+{
+	if (__atomic_exchange_n(&comp->stopping, true, __ATOMIC_ACQ_REL))
+		return;
+	// Never read, so polls on it keep returning until the component is gone
+	const uint64_t one = 1;
+	if (write(comp->stop_fd, &one, sizeof(one)) != sizeof(one))
+		applog(LOG_WARNING, "%s: Failed to signal stop", comp->devid);
+	if (comp->type->stop)
+		comp->type->stop(comp);
+}
+
+static
+void fabd_component_thread(void * const userp)
+{
+	struct fabd_component * const comp = userp;
+	applog(LOG_INFO, "Starting %s component %s", comp->type->type, comp->devid);
+	comp->type->run(comp);
+	applog(LOG_INFO, "Stopped %s component %s", comp->type->type, comp->devid);
+}
+
+void fabd_component_start_thread(struct fabd_component * const comp)
+{
+	comp->thread = zmq_threadstart(fabd_component_thread, comp);
+	assert(comp->thread);
+}
+
+void fabd_component_join(struct fabd_component * const comp)
+{
+	zmq_threadclose(comp->thread);
+	comp->thread = NULL;
+	close(comp->stop_fd);
+	comp->stop_fd = -1;
+}
+
+int fabd_component_main(int argc, char **argv, const struct fabd_component_type * const type)
+{
+	const char * const devid = fabd_common_argv(argc, argv, type->type);
+	load_freeabode_key();
+	
+	void * const ctx = zmq_ctx_new();
+	start_zap_handler(ctx);
+	fabd_metrics_serve(ctx, devid);
+	
+	struct fabd_component comp;
+	fabd_component_init(&comp, type, devid, ctx);
+	type->run(&comp);
+	return 0;
+}
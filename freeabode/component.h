@@ -0,0 +1,39 @@
+#ifndef FABD_COMPONENT_H
+#define FABD_COMPONENT_H
+
+#include <stdbool.h>
+
+// A component is the body of a daemon, so it can run standalone or as one of several threads sharing a ZeroMQ context.
+// Each type may only run once per process, since components keep their state in globals.
+
+struct fabd_component;
+
+struct fabd_component_type {
+	const char *type;  // as in the "type" config key
+	// Runs until fabd_component_stopping is true
+	void (*run)(struct fabd_component *);
+	// Optional; called from another thread, to wake anything not polling stop_fd
+	void (*stop)(struct fabd_component *);
+};
+
+struct fabd_component {
+	const struct fabd_component_type *type;
+	const char *devid;
+	void *zmq_context;
+	// Becomes (and stays) readable once a stop is requested
+	int stop_fd;
+	bool stopping;
+	void *thread;
+};
+
+extern void fabd_component_init(struct fabd_component *, const struct fabd_component_type *, const char *devid, void *zmq_context);
+extern bool fabd_component_stopping(const struct fabd_component *);
+extern void fabd_component_request_stop(struct fabd_component *);
+
+extern void fabd_component_start_thread(struct fabd_component *);
+extern void fabd_component_join(struct fabd_component *);
+
+// Standalone main: one component with its own context
+extern int fabd_component_main(int argc, char **argv, const struct fabd_component_type *);
+
+#endif
@@ -0,0 +1,149 @@
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <zmq.h>
+
+#include <freeabode/freeabode.pb-c.h>
+#include <freeabode/logging.h>
+#include <freeabode/metrics.h>
+#include <freeabode/util.h>
+
+#include "eventtime.h"
+
+static const unsigned long latency_log_interval_ms = 300000;
+
+const uint32_t fabd_latency_bounds_us[FABD_LATENCY_BUCKETS - 1] = {
+	1000,
+	2000,
+	5000,
+	10000,
+	20000,
+	50000,
+	100000,
+	200000,
+	500000,
+	1000000,
+	2000000,
+	5000000,
+};
+
+uint64_t fabd_realtime_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+uint64_t fabd_monotonic_to_realtime_us(const struct timespec * const ts_mono)
+{
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	const int64_t ago_us = ((int64_t)(ts_now.tv_sec - ts_mono->tv_sec) * 1000000) + ((ts_now.tv_nsec - ts_mono->tv_nsec) / 1000);
+	return fabd_realtime_us() - ago_us;
+}
+
+void fabd_pbevent_send(void * const socket, PbEvent * const pbevent, const struct timespec * const captured)
+{
+	pbevent->has_captured_us = (captured != NULL);
+	if (captured)
+		pbevent->captured_us = fabd_monotonic_to_realtime_us(captured);
+	pbevent->has_published_us = true;
+	pbevent->published_us = fabd_realtime_us();
+	zmq_send_protobuf(socket, pb_event, pbevent, 0);
+	
+	static struct fabd_metric *published_metric;
+	struct fabd_metric *m = __atomic_load_n(&published_metric, __ATOMIC_RELAXED);
+	if (!m)
+	{
+		// Registering again just returns the same metric, so racing here is harmless
+		m = fabd_metric_counter("fabd_events_published_total", NULL, "Events published by this process");
+		__atomic_store_n(&published_metric, m, __ATOMIC_RELAXED);
+	}
+	fabd_metric_inc(m);
+}
+
+void fabd_latency_hist_add(struct fabd_latency_hist * const hist, const uint64_t latency_us)
+{
+	int i;
+	for (i = 0; i < FABD_LATENCY_BUCKETS - 1; ++i)
+		if (latency_us < fabd_latency_bounds_us[i])
+			break;
+	// Atomic, so other threads may read them
+	__atomic_add_fetch(&hist->buckets[i], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->sum_us, latency_us, __ATOMIC_RELAXED);
+	if (latency_us > __atomic_load_n(&hist->max_us, __ATOMIC_RELAXED))
+		__atomic_store_n(&hist->max_us, latency_us, __ATOMIC_RELAXED);
+}
+
+uint32_t fabd_latency_hist_quantile_us(const struct fabd_latency_hist * const hist, const double q)
+{
+	const uint64_t target = hist->count * q;
+	uint64_t seen = 0;
+	for (int i = 0; i < FABD_LATENCY_BUCKETS - 1; ++i)
+	{
+		seen += hist->buckets[i];
+		if (seen > target)
+			return fabd_latency_bounds_us[i];
+	}
+	return UINT32_MAX;
+}
+
+void fabd_event_latency_init(struct fabd_event_latency * const lat, const char * const devid, const char * const source)
+{
+	*lat = (struct fabd_event_latency){
+		.source = source,
+	};
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	timespec_add_ms(&ts_now, latency_log_interval_ms, &lat->ts_next_log);
+	
+	if (!devid)
+		return;
+	const size_t labelssz = strlen(devid) + strlen(source) + 0x20;
+	char labels[labelssz];
+	snprintf(labels, labelssz, "devid=\"%s\",source=\"%s\"", devid, source);
+	lat->hop_metric = fabd_metric_histogram_external("fabd_event_publish_latency_us", labels, "Time from publishing an event to receiving it", fabd_latency_bounds_us, FABD_LATENCY_BUCKETS - 1, lat->hop.buckets, &lat->hop.sum_us, &lat->hop.count);
+	lat->age_metric = fabd_metric_histogram_external("fabd_event_reading_age_us", labels, "Age of readings when their events are received", fabd_latency_bounds_us, FABD_LATENCY_BUCKETS - 1, lat->age.buckets, &lat->age.sum_us, &lat->age.count);
+}
+
+void fabd_event_latency_free(struct fabd_event_latency * const lat)
+{
+	fabd_metric_unregister(lat->hop_metric);
+	fabd_metric_unregister(lat->age_metric);
+	lat->hop_metric = lat->age_metric = NULL;
+}
+
+static
+void fabd_latency_hist_log(const char * const source, const char * const what, const struct fabd_latency_hist * const hist)
+{
+	if (!hist->count)
+		return;
+	applog(LOG_DEBUG, "%s %s: %llu events, mean %lluus, p50<%luus, p99<%luus, max %lluus", source, what, (unsigned long long)hist->count, (unsigned long long)(hist->sum_us / hist->count), (unsigned long)fabd_latency_hist_quantile_us(hist, 0.5), (unsigned long)fabd_latency_hist_quantile_us(hist, 0.99), (unsigned long long)hist->max_us);
+}
+
+void fabd_event_latency_record(struct fabd_event_latency * const lat, const PbEvent * const pbevent)
+{
+	const uint64_t now_us = fabd_realtime_us();
+	// Clocks on different nodes can disagree slightly; count that as no delay at all
+	if (pbevent->has_published_us)
+		fabd_latency_hist_add(&lat->hop, (now_us > pbevent->published_us) ? (now_us - pbevent->published_us) : 0);
+	if (pbevent->has_captured_us)
+		fabd_latency_hist_add(&lat->age, (now_us > pbevent->captured_us) ? (now_us - pbevent->captured_us) : 0);
+	
+	if (!applog_enabled(LOG_DEBUG))
+		return;
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	if (timespec_passed(&lat->ts_next_log, &ts_now, NULL))
+	{
+		fabd_latency_hist_log(lat->source, "publish latency", &lat->hop);
+		fabd_latency_hist_log(lat->source, "reading age", &lat->age);
+		timespec_add_ms(&ts_now, latency_log_interval_ms, &lat->ts_next_log);
+	}
+}
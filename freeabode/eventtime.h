@@ -0,0 +1,48 @@
+#ifndef FABD_EVENTTIME_H
+#define FABD_EVENTTIME_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <freeabode/freeabode.pb-c.h>
+#include <freeabode/metrics.h>
+
+// PbEvent timestamps are microseconds since the epoch (CLOCK_REALTIME), so they compare across nodes with synchronised clocks
+extern uint64_t fabd_realtime_us(void);
+extern uint64_t fabd_monotonic_to_realtime_us(const struct timespec *);
+
+// Stamps the publish time, and the capture time if known (CLOCK_MONOTONIC; NULL if not), then sends
+extern void fabd_pbevent_send(void *socket, PbEvent *, const struct timespec *captured);
+
+// Latencies below each bound go in that bucket; the last bucket has everything else
+#define FABD_LATENCY_BUCKETS  13
+extern const uint32_t fabd_latency_bounds_us[FABD_LATENCY_BUCKETS - 1];
+
+struct fabd_latency_hist {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t max_us;
+	uint64_t buckets[FABD_LATENCY_BUCKETS];
+};
+
+// Per subscribed source: how long events took from the publisher, and how old their readings were on arrival
+struct fabd_event_latency {
+	const char *source;
+	struct fabd_latency_hist hop;
+	struct fabd_latency_hist age;
+	struct timespec ts_next_log;
+	struct fabd_metric *hop_metric;
+	struct fabd_metric *age_metric;
+};
+
+extern void fabd_latency_hist_add(struct fabd_latency_hist *, uint64_t latency_us);
+// Returns the upper bound of the bucket containing the given fraction of samples, or UINT32_MAX if in the last bucket
+extern uint32_t fabd_latency_hist_quantile_us(const struct fabd_latency_hist *, double q);
+
+// If devid is given, the histograms are also registered as metrics (labelled with both), until fabd_event_latency_free
+extern void fabd_event_latency_init(struct fabd_event_latency *, const char *devid, const char *source);
+extern void fabd_event_latency_free(struct fabd_event_latency *);
+// Call as soon as an event is received
+extern void fabd_event_latency_record(struct fabd_event_latency *, const PbEvent *);
+
+#endif
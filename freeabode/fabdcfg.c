@@ -1,23 +1,78 @@
 #include "config.h"
 
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 #include <jansson.h>
 #include <zmq.h>
+#include <zmq_utils.h>
 
 #include "fabdcfg.h"
 #include "json.h"
+#include "logging.h"
+#include "security.h"
 #include "util.h"
 
 static const char * const fabd_cfg_dir = "fabd_cfg";
 static const char * const fabd_cfg_suffix = ".json";
+// Editors often write files in several steps, so wait for things to settle before reloading
+static const int fabdcfg_reload_settle_ms = 250;
 
-static json_t *my_directory, *my_configs;
+// The latest snapshot holds a reference of its own; my_snapshot_mutex only covers replacing it, and taking a reference to it
+static struct fabdcfg_snapshot *my_snapshot;
+static pthread_mutex_t my_snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Held while building a snapshot from the latest one, so concurrent loads don't lose each other's changes
+static pthread_mutex_t my_load_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Each thread keeps the snapshot it last saw (and a reference to it) until it loads, dispatches changes, or refreshes
+static pthread_once_t my_pin_once = PTHREAD_ONCE_INIT;
+static pthread_key_t my_pin_key;
+static __thread struct fabdcfg_snapshot *my_pin;
+
+struct fabdcfg_entry {
+	uint32_t hash;
+	// NULL devid holds the defaults, for devices not otherwise known
+	const char *devid;
+	const char *key;
+	struct fabdcfg_value value;
+};
+
+// Resolved fabd: client URIs
+struct fabdcfg_endpoint {
+	uint32_t hash;
+	const char *from_devid;
+	const char *uri;
+	char *dest_devid;
+	char *dest_servername;
+	char *resolved;  // NULL if unreachable
+	enum fabd_security_policy policy;
+	bool has_serverkey;
+	uint8_t serverkey[0x20];
+};
+
+struct fabdcfg_snapshot {
+	unsigned refs;
+	json_t *directory, *configs;
+	struct fabdcfg_entry *entries;
+	size_t entries_mask;
+	size_t n_entries;
+	struct fabdcfg_endpoint *endpoints;
+	size_t endpoints_mask;
+};
+
+static void fabdcfg_snapshot_resolve_endpoints(struct fabdcfg_snapshot *);
+static void fabdcfg_unwatch_thread(void);
+static void fabdcfg_inotify_start(void);
 
 static
 char *my_cfg_filepath(const char * const name)
@@ -33,27 +88,262 @@ char *my_cfg_filepath(const char * const name)
 }
 
 static
-json_t *fabdcfg_load_(const char * const name)
+json_t *fabdcfg_try_load_(const char * const name)
 {
 	char *path = my_cfg_filepath(name);
 	json_error_t je;
 	json_t * const rv = json_load_file(path, 0, &je);
+	if (!rv)
+		applog(LOG_ERR, "%s:%d: %s", path, je.line, je.text);
 	free(path);
+	return rv;
+}
+
+static
+json_t *fabdcfg_load_(const char * const name)
+{
+	json_t * const rv = fabdcfg_try_load_(name);
 	assert(rv);
 	return rv;
 }
 
+static
+uint32_t fabdcfg_hash(const char * const devid, const char * const key)
+{
+	// FNV-1a
+	uint32_t h = 0x811c9dc5;
+	if (devid)
+		for (const char *p = devid; p[0]; ++p)
+			h = (h ^ (uint8_t)p[0]) * 0x01000193;
+	h = (h ^ (devid ? 0xff : 0xfe)) * 0x01000193;
+	for (const char *p = key; p[0]; ++p)
+		h = (h ^ (uint8_t)p[0]) * 0x01000193;
+	return h;
+}
+
+static
+void fabdcfg_value_compile(struct fabdcfg_value * const v, json_t * const j)
+{
+	*v = (struct fabdcfg_value){
+		.json = j,
+		.str = json_string_value(j),
+		.truth = FTS_TRUE,
+	};
+	if (json_is_number(j))
+	{
+		v->has_int = true;
+		v->intval = json_number_value(j);
+	}
+	switch (json_typeof(j)) {
+		case JSON_ARRAY:
+			v->truth = (json_array_size(j) != 0);
+			break;
+		case JSON_STRING:
+			v->truth = (v->str[0] != '\0');
+			break;
+		case JSON_INTEGER:
+			v->truth = (json_integer_value(j) != 0);
+			break;
+		case JSON_REAL:
+			v->truth = (json_real_value(j) != 0);
+			break;
+		case JSON_FALSE:
+			v->truth = FTS_FALSE;
+			break;
+		case JSON_NULL:
+			v->truth = FTS_UNKNOWN;
+			break;
+		default:
+			break;
+	}
+}
+
+static
+struct fabdcfg_entry *fabdcfg_probe(const struct fabdcfg_snapshot * const snap, const uint32_t hash, const char * const devid, const char * const key)
+{
+	for (size_t i = hash & snap->entries_mask; ; i = (i + 1) & snap->entries_mask)
+	{
+		struct fabdcfg_entry * const e = &snap->entries[i];
+		if (!e->key)
+			return e;
+		if (e->hash == hash && !strcmp(e->key, key) && (devid ? (e->devid && !strcmp(e->devid, devid)) : !e->devid))
+			return e;
+	}
+}
+
+static
+void fabdcfg_snapshot_add_object(struct fabdcfg_snapshot * const snap, const char * const devid, json_t * const jobj)
+{
+	const char *key;
+	json_t *j;
+	json_object_foreach(jobj, key, j)
+	{
+		const uint32_t hash = fabdcfg_hash(devid, key);
+		struct fabdcfg_entry * const e = fabdcfg_probe(snap, hash, devid, key);
+		if (!e->key)
+			++snap->n_entries;
+		// Later sources override earlier ones
+		*e = (struct fabdcfg_entry){
+			.hash = hash,
+			.devid = devid,
+			.key = key,
+		};
+		fabdcfg_value_compile(&e->value, j);
+	}
+}
+
+static
+void fabdcfg_snapshot_add_device(struct fabdcfg_snapshot * const snap, const char * const devid)
+{
+	fabdcfg_snapshot_add_object(snap, devid, json_object_get(snap->directory, "defaults"));
+	fabdcfg_snapshot_add_object(snap, devid, json_object_get(json_object_get(snap->directory, "devices"), devid));
+	fabdcfg_snapshot_add_object(snap, devid, json_object_get(snap->configs, devid));
+}
+
+// Resolves defaults, directory entries and device configs into a single flat table
+// Takes over the caller's references to directory and configs, which must not be shared with any other snapshot
+static
+struct fabdcfg_snapshot *fabdcfg_compile(json_t * const directory, json_t * const configs)
+{
+	json_t * const jdefaults = json_object_get(directory, "defaults");
+	json_t * const jdevices = json_object_get(directory, "devices");
+	
+	// Upper bound on entries, so the table never needs to grow
+	size_t n_max = json_object_size(jdefaults);
+	const char *devid;
+	json_t *j;
+	json_object_foreach(jdevices, devid, j)
+		n_max += json_object_size(jdefaults) + json_object_size(j) + json_object_size(json_object_get(configs, devid));
+	json_object_foreach(configs, devid, j)
+		n_max += json_object_size(jdefaults) + json_object_size(j);
+	size_t allocsz = 0x10;
+	while (allocsz < n_max * 2)
+		allocsz *= 2;
+	
+	struct fabdcfg_snapshot * const snap = malloc(sizeof(*snap));
+	assert(snap);
+	*snap = (struct fabdcfg_snapshot){
+		.refs = 1,
+		.directory = directory,
+		.configs = configs,
+		.entries = calloc(allocsz, sizeof(*snap->entries)),
+		.entries_mask = allocsz - 1,
+	};
+	assert(snap->entries);
+	
+	// Key strings are borrowed, so they must come from the snapshot's own references
+	fabdcfg_snapshot_add_object(snap, NULL, jdefaults);
+	json_object_foreach(jdevices, devid, j)
+		fabdcfg_snapshot_add_device(snap, devid);
+	json_object_foreach(snap->configs, devid, j)
+		if (!json_object_get(jdevices, devid))
+			fabdcfg_snapshot_add_device(snap, devid);
+	fabdcfg_snapshot_resolve_endpoints(snap);
+	return snap;
+}
+
+static
+void fabdcfg_snapshot_free(struct fabdcfg_snapshot * const snap)
+{
+	for (size_t i = 0; i <= snap->endpoints_mask; ++i)
+	{
+		struct fabdcfg_endpoint * const e = &snap->endpoints[i];
+		if (!e->uri)
+			continue;
+		free(e->dest_devid);
+		free(e->dest_servername);
+		free(e->resolved);
+	}
+	free(snap->endpoints);
+	free(snap->entries);
+	json_decref(snap->configs);
+	json_decref(snap->directory);
+	free(snap);
+}
+
+static
+void fabdcfg_snapshot_release(struct fabdcfg_snapshot * const snap)
+{
+	if (snap && !__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL))
+		fabdcfg_snapshot_free(snap);
+}
+
+static
+struct fabdcfg_snapshot *fabdcfg_snapshot_acquire()
+{
+	pthread_mutex_lock(&my_snapshot_mutex);
+	struct fabdcfg_snapshot * const snap = my_snapshot;
+	if (snap)
+		__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&my_snapshot_mutex);
+	return snap;
+}
+
+// Caller must hold my_load_mutex
+static
+void fabdcfg_publish(struct fabdcfg_snapshot * const snap)
+{
+	pthread_mutex_lock(&my_snapshot_mutex);
+	struct fabdcfg_snapshot * const old = my_snapshot;
+	__atomic_store_n(&my_snapshot, snap, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&my_snapshot_mutex);
+	// Threads still using the old one have their own references
+	fabdcfg_snapshot_release(old);
+}
+
+static
+void fabdcfg_thread_exit(void * const p)
+{
+	fabdcfg_snapshot_release(p);
+	fabdcfg_unwatch_thread();
+}
+
+static
+void fabdcfg_pin_init()
+{
+	assert(!pthread_key_create(&my_pin_key, fabdcfg_thread_exit));
+}
+
+// Moves this thread to the latest snapshot; if it did, the caller must release the previous one
+static
+bool fabdcfg_repin()
+{
+	// The pinned snapshot can't be freed and reused, so the same address is the same snapshot
+	if (my_pin && my_pin == __atomic_load_n(&my_snapshot, __ATOMIC_ACQUIRE))
+		return false;
+	pthread_once(&my_pin_once, fabdcfg_pin_init);
+	my_pin = fabdcfg_snapshot_acquire();
+	pthread_setspecific(my_pin_key, my_pin);
+	return true;
+}
+
+void fabdcfg_refresh()
+{
+	struct fabdcfg_snapshot * const old = my_pin;
+	if (fabdcfg_repin())
+		fabdcfg_snapshot_release(old);
+}
+
 void fabdcfg_load_directory()
 {
-	my_directory = fabdcfg_load_("directory");
-	my_configs = json_object();
+	pthread_mutex_lock(&my_load_mutex);
+	fabdcfg_publish(fabdcfg_compile(fabdcfg_load_("directory"), json_object()));
+	pthread_mutex_unlock(&my_load_mutex);
+	fabdcfg_refresh();
 }
 
 void fabdcfg_load_device(const char * const devid)
 {
-	json_t *j = fabdcfg_load_(devid);
-	if (j)
-		json_object_set_new(my_configs, devid, j);
+	json_t * const j = fabdcfg_load_(devid);
+	pthread_mutex_lock(&my_load_mutex);
+	const struct fabdcfg_snapshot * const cur = my_snapshot;
+	assert(cur);
+	// Deep copies, since JSON reference counts can't be shared with snapshots being freed in other threads
+	json_t * const configs = json_deep_copy(cur->configs);
+	json_object_set_new(configs, devid, j);
+	fabdcfg_publish(fabdcfg_compile(json_deep_copy(cur->directory), configs));
+	pthread_mutex_unlock(&my_load_mutex);
+	fabdcfg_refresh();
 }
 
 const char *fabd_common_argv(int argc, char **argv, const char * const type)
@@ -66,83 +356,419 @@ const char *fabd_common_argv(int argc, char **argv, const char * const type)
 	const char * const my_devid = argv[1];
 	fabdcfg_load_directory();
 	fabdcfg_load_device(my_devid);
+	fabdcfg_log_config(my_devid);
 	return my_devid;
 }
 
+const struct fabdcfg_snapshot *fabdcfg_current()
+{
+	if (!my_pin)
+		fabdcfg_repin();
+	return my_pin;
+}
+
+const struct fabdcfg_value *fabdcfg_lookup(const struct fabdcfg_snapshot * const snap, const char * const devid, const char * const key)
+{
+	if (!snap)
+		return NULL;
+	const struct fabdcfg_entry *e = fabdcfg_probe(snap, fabdcfg_hash(devid, key), devid, key);
+	if (!e->key && devid)
+		e = fabdcfg_probe(snap, fabdcfg_hash(NULL, key), NULL, key);
+	return e->key ? &e->value : NULL;
+}
+
+json_t *fabdcfg_directory_get(const struct fabdcfg_snapshot * const snap, const char * const key)
+{
+	if (!snap)
+		return NULL;
+	return json_object_get(snap->directory, key);
+}
+
+json_t *fabdcfg_loaded_configs(const struct fabdcfg_snapshot * const snap)
+{
+	return snap ? snap->configs : NULL;
+}
+
 json_t *fabdcfg_device_get(const char * const devid, const char * const key)
 {
+	const struct fabdcfg_value * const v = fabdcfg_lookup(fabdcfg_current(), devid, key);
+	return v ? v->json : NULL;
+}
+
+bool fabdcfg_device_getbool(const char * const devid, const char * const key, const bool def)
+{
+	const struct fabdcfg_value * const v = fabdcfg_lookup(fabdcfg_current(), devid, key);
+	if (!(v && v->truth != FTS_UNKNOWN))
+		return def;
+	return v->truth;
+}
+
+const char *fabdcfg_device_getstr(const char * const devid, const char * const key)
+{
+	const struct fabdcfg_value * const v = fabdcfg_lookup(fabdcfg_current(), devid, key);
+	return v ? v->str : NULL;
+}
+
+int fabdcfg_device_getint(const char * const devid, const char * const key, const int def)
+{
+	const struct fabdcfg_value * const v = fabdcfg_lookup(fabdcfg_current(), devid, key);
+	return (v && v->has_int) ? v->intval : def;
+}
+
+bool fabdcfg_device_checktype(const char * const devid, const char * const type)
+{
+	const char * const atype = fabdcfg_device_getstr(devid, "type");
+	return atype && !strcmp(atype, type);
+}
+
+struct fabdcfg_watcher {
+	fabdcfg_change_cb cb;
+	void *userp;
+	char *devid;
+	char *key;
+};
+
+// Watchers belong to the thread that added them, since that is where they are dispatched
+static __thread struct fabdcfg_watcher *my_watchers;
+static __thread size_t n_watchers;
+
+// One eventfd per thread watching for changes, all signalled by the inotify thread
+static __thread int my_reload_eventfd = -1;
+static int *my_reload_eventfds;
+static size_t n_reload_eventfds;
+static pthread_mutex_t my_reload_eventfds_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool my_inotify_started;
+// Logging is process-wide, so only one device's settings apply
+static char *my_log_devid;
+
+void fabdcfg_on_change(const char * const devid, const char * const key, const fabdcfg_change_cb cb, void * const userp)
+{
+	my_watchers = realloc(my_watchers, sizeof(*my_watchers) * (n_watchers + 1));
+	assert(my_watchers);
+	my_watchers[n_watchers++] = (struct fabdcfg_watcher){
+		.cb = cb,
+		.userp = userp,
+		.devid = strdup(devid),
+		.key = strdup(key),
+	};
+}
+
+void fabdcfg_off_change(const char * const devid, const char * const key, const fabdcfg_change_cb cb, void * const userp)
+{
+	for (size_t i = 0; i < n_watchers; ++i)
+	{
+		struct fabdcfg_watcher * const w = &my_watchers[i];
+		if (w->cb != cb || w->userp != userp || strcmp(w->devid, devid) || strcmp(w->key, key))
+			continue;
+		free(w->devid);
+		free(w->key);
+		my_watchers[i--] = my_watchers[--n_watchers];
+	}
+}
+
+static
+bool fabdcfg_value_equal(const struct fabdcfg_value * const a, const struct fabdcfg_value * const b)
+{
+	if (!(a && b))
+		return a == b;
+	return json_equal(a->json, b->json);
+}
+
+void fabdcfg_dispatch_changes()
+{
+	uint64_t n;
+	if (my_reload_eventfd >= 0 && read(my_reload_eventfd, &n, sizeof(n)) != sizeof(n))
+		return;
+	
+	// Callbacks see the new snapshot from fabdcfg_current too; the old one is only released once they're done
+	struct fabdcfg_snapshot * const old = my_pin;
+	if (!fabdcfg_repin())
+		return;
+	const struct fabdcfg_snapshot * const cur = my_pin;
+	for (size_t i = 0; i < n_watchers; ++i)
+	{
+		const struct fabdcfg_watcher * const w = &my_watchers[i];
+		const struct fabdcfg_value * const newvalue = fabdcfg_lookup(cur, w->devid, w->key);
+		if (fabdcfg_value_equal(fabdcfg_lookup(old, w->devid, w->key), newvalue))
+			continue;
+		applog(LOG_INFO, "Config %s for %s changed", w->key, w->devid);
+		w->cb(w->devid, w->key, newvalue, w->userp);
+	}
+	fabdcfg_snapshot_release(old);
+}
+
+static
+bool fabdcfg_reload()
+{
+	json_t * const directory = fabdcfg_try_load_("directory");
+	if (!directory)
+		return false;
+	json_t * const configs = json_object();
+	pthread_mutex_lock(&my_load_mutex);
+	const char *devid;
 	json_t *j;
+	json_object_foreach(my_snapshot->configs, devid, j)
+	{
+		json_t * const jdev = fabdcfg_try_load_(devid);
+		if (!jdev)
+		{
+			pthread_mutex_unlock(&my_load_mutex);
+			json_decref(configs);
+			json_decref(directory);
+			return false;
+		}
+		json_object_set_new(configs, devid, jdev);
+	}
+	fabdcfg_publish(fabdcfg_compile(directory, configs));
+	pthread_mutex_unlock(&my_load_mutex);
+	return true;
+}
+
+static
+bool fabdcfg_inotify_relevant(int fd)
+{
+	const size_t suffixlen = strlen(fabd_cfg_suffix);
+	bool relevant = false;
+	char buf[0x1000] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t rsz;
+	while ((rsz = read(fd, buf, sizeof(buf))) > 0)
+		for (char *p = buf; p < &buf[rsz]; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+		{
+			const struct inotify_event * const ev = (void*)p;
+			if (!ev->len)
+				continue;
+			const size_t namelen = strlen(ev->name);
+			if (namelen > suffixlen && !strcmp(&ev->name[namelen - suffixlen], fabd_cfg_suffix))
+				relevant = true;
+		}
+	return relevant;
+}
+
+static
+void fabdcfg_log_level_changed(const char * const devid, const char * const key, const struct fabdcfg_value * const newvalue, void * const userp)
+{
+	if (!(newvalue && newvalue->str))
+	{
+		applog_set_level(LOG_DEBUG);
+		return;
+	}
+	const int loglevel = applog_level_from_str(newvalue->str);
+	if (loglevel < 0)
+		applog(LOG_WARNING, "Unknown log_level '%s'", newvalue->str);
+	else
+		applog_set_level(loglevel);
+}
+
+void fabdcfg_log_config(const char * const devid)
+{
+	fabdcfg_log_level_changed(devid, "log_level", fabdcfg_lookup(fabdcfg_current(), devid, "log_level"), NULL);
+	if (fabdcfg_device_getbool(devid, "log_syslog", false))
+		applog_use_syslog(devid);
 	
-	if ( (j = json_object_get(my_configs, devid)) )
-		if ( (j = json_object_get(j, key)) )
-			return j;
+	// Every process reloads config for this, even if nothing else watches for changes
+	pthread_mutex_lock(&my_reload_eventfds_mutex);
+	if (!my_log_devid)
+		my_log_devid = strdup(devid);
+	fabdcfg_inotify_start();
+	pthread_mutex_unlock(&my_reload_eventfds_mutex);
+}
+
+static
+void fabdcfg_watch_thread(void * const userp)
+{
+	const int fd = (intptr_t)userp;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN, };
 	
-	if ( (j = json_object_get(my_directory, "devices")) )
-		if ( (j = json_object_get(j, devid)) )
-			if ( (j = json_object_get(j, key)) )
-				return j;
+	// log_level is reapplied from this thread, since not every process has another that dispatches changes
+	pthread_mutex_lock(&my_reload_eventfds_mutex);
+	if (my_log_devid)
+		fabdcfg_on_change(my_log_devid, "log_level", fabdcfg_log_level_changed, NULL);
+	pthread_mutex_unlock(&my_reload_eventfds_mutex);
+	fabdcfg_current();
 	
-	if ( (j = json_object_get(my_directory, "defaults")) )
-		if ( (j = json_object_get(j, key)) )
-			return j;
+	while (true)
+	{
+		if (poll(&pfd, 1, -1) <= 0 || !fabdcfg_inotify_relevant(fd))
+			continue;
+		while (poll(&pfd, 1, fabdcfg_reload_settle_ms) > 0)
+			fabdcfg_inotify_relevant(fd);
+		
+		if (!fabdcfg_reload())
+		{
+			applog(LOG_WARNING, "Config reload failed; keeping previous config");
+			continue;
+		}
+		applog(LOG_INFO, "Config reloaded");
+		fabdcfg_dispatch_changes();
+		const uint64_t one = 1;
+		pthread_mutex_lock(&my_reload_eventfds_mutex);
+		for (size_t i = 0; i < n_reload_eventfds; ++i)
+			if (write(my_reload_eventfds[i], &one, sizeof(one)) != sizeof(one))
+				applog(LOG_WARNING, "Failed to signal config reload");
+		pthread_mutex_unlock(&my_reload_eventfds_mutex);
+	}
+}
+
+// Caller must hold my_reload_eventfds_mutex
+static
+void fabdcfg_inotify_start()
+{
+	if (my_inotify_started)
+		return;
+	my_inotify_started = true;
+	const int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (fd < 0 || inotify_add_watch(fd, fabd_cfg_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+	{
+		// Eventfds are still usable, they just never become readable
+		applog(LOG_WARNING, "Failed to watch %s for changes", fabd_cfg_dir);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	zmq_threadstart(fabdcfg_watch_thread, (void*)(intptr_t)fd);
+}
+
+int fabdcfg_watch_start()
+{
+	if (my_reload_eventfd >= 0)
+		return my_reload_eventfd;
+	// Changes are compared against what this thread has seen so far
+	fabdcfg_current();
+	my_reload_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	assert(my_reload_eventfd >= 0);
 	
-	return NULL;
+	pthread_mutex_lock(&my_reload_eventfds_mutex);
+	my_reload_eventfds = realloc(my_reload_eventfds, sizeof(*my_reload_eventfds) * (n_reload_eventfds + 1));
+	assert(my_reload_eventfds);
+	my_reload_eventfds[n_reload_eventfds++] = my_reload_eventfd;
+	fabdcfg_inotify_start();
+	pthread_mutex_unlock(&my_reload_eventfds_mutex);
+	return my_reload_eventfd;
 }
 
-bool fabdcfg_device_getbool(const char * const devid, const char * const key, const bool def)
+static
+void fabdcfg_unwatch_thread()
 {
-	json_t * const j = fabdcfg_device_get(devid, key);
-	if (!j) return def;
-	switch (json_typeof(j)) {
-		case JSON_ARRAY:
-			return json_array_size(j) != 0;
-		case JSON_STRING:
-			return json_string_value(j)[0] != '\0';
-		case JSON_INTEGER:
-			return json_integer_value(j) != 0;
-		case JSON_REAL:
-			return json_real_value(j) != 0;
-		case JSON_FALSE:
-			return false;
-		case JSON_NULL:
-			return def;
-		default:
-			return true;
+	for (size_t i = 0; i < n_watchers; ++i)
+	{
+		free(my_watchers[i].devid);
+		free(my_watchers[i].key);
 	}
+	free(my_watchers);
+	my_watchers = NULL;
+	n_watchers = 0;
+	if (my_reload_eventfd < 0)
+		return;
+	pthread_mutex_lock(&my_reload_eventfds_mutex);
+	for (size_t i = 0; i < n_reload_eventfds; ++i)
+		if (my_reload_eventfds[i] == my_reload_eventfd)
+			my_reload_eventfds[i--] = my_reload_eventfds[--n_reload_eventfds];
+	pthread_mutex_unlock(&my_reload_eventfds_mutex);
+	close(my_reload_eventfd);
+	my_reload_eventfd = -1;
 }
 
-const char *fabdcfg_device_getstr(const char * const devid, const char * const key)
+static
+json_t *fabdcfg_server_get(const struct fabdcfg_snapshot * const snap, const char * const devid, const char * const servername)
 {
-	json_t * const j = fabdcfg_device_get(devid, key);
-	if (!(j && json_is_string(j)))
+	const struct fabdcfg_value * const v = fabdcfg_lookup(snap, devid, "servers");
+	if (!v)
 		return NULL;
-	return json_string_value(j);
+	return json_object_get(v->json, servername);
 }
 
-int fabdcfg_device_getint(const char * const devid, const char * const key, const int def)
+// Devices served by this process, which can be reached over inproc (assuming a single ZeroMQ context per process)
+static char **my_inproc_devids;
+static size_t n_inproc_devids;
+static pthread_mutex_t my_inproc_devids_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static
+char *fabdcfg_inproc_uri(const char * const devid, const char * const servername)
 {
-	json_t * const j = fabdcfg_device_get(devid, key);
-	return fabd_json_as_int(j, def);
+	const size_t urisz = 14 + strlen(devid) + 1 + strlen(servername) + 1;
+	char * const uri = malloc(urisz);
+	assert(uri);
+	snprintf(uri, urisz, "inproc://fabd/%s/%s", devid, servername);
+	return uri;
 }
 
-bool fabdcfg_device_checktype(const char * const devid, const char * const type)
+static
+bool fabdcfg_inproc_hosted_(const char * const devid)
 {
-	const char * const atype = fabdcfg_device_getstr(devid, "type");
-	return atype && !strcmp(atype, type);
+	for (size_t i = 0; i < n_inproc_devids; ++i)
+		if (!strcmp(my_inproc_devids[i], devid))
+			return true;
+	return false;
 }
 
+void fabdcfg_inproc_host(const char * const devid)
+{
+	pthread_mutex_lock(&my_inproc_devids_mutex);
+	if (!fabdcfg_inproc_hosted_(devid))
+	{
+		my_inproc_devids = realloc(my_inproc_devids, sizeof(*my_inproc_devids) * (n_inproc_devids + 1));
+		assert(my_inproc_devids);
+		my_inproc_devids[n_inproc_devids++] = strdup(devid);
+	}
+	pthread_mutex_unlock(&my_inproc_devids_mutex);
+}
+
+static
+bool fabdcfg_inproc_hosted(const char * const devid)
+{
+	pthread_mutex_lock(&my_inproc_devids_mutex);
+	const bool rv = fabdcfg_inproc_hosted_(devid);
+	pthread_mutex_unlock(&my_inproc_devids_mutex);
+	return rv;
+}
+
+// The server's "security", else the device's (or default); either a String, or an Object keyed by transport ("*" for any other)
 static
-json_t *fabdcfg_server_get(const char * const devid, const char * const servername)
+enum fabd_security_policy fabdcfg_security_policy(const struct fabdcfg_snapshot * const snap, const char * const devid, json_t * const jserver, const char * const uri)
 {
-	json_t *j = fabdcfg_device_get(devid, "servers");
+	json_t *j = json_is_object(jserver) ? json_object_get(jserver, "security") : NULL;
 	if (!j)
-		return NULL;
-	return json_object_get(j, servername);
+	{
+		const struct fabdcfg_value * const v = fabdcfg_lookup(snap, devid, "security");
+		j = v ? v->json : NULL;
+	}
+	if (json_is_object(j))
+	{
+		char scheme[0x10];
+		const char * const colon = strchr(uri, ':');
+		const size_t schemelen = colon ? (colon - uri) : 0;
+		if (schemelen < sizeof(scheme))
+		{
+			memcpy(scheme, uri, schemelen);
+			scheme[schemelen] = '\0';
+			j = json_object_get(j, scheme) ?: json_object_get(j, "*");
+		}
+		else
+			j = json_object_get(j, "*");
+	}
+	enum fabd_security_policy policy;
+	if (j && fabd_security_policy_from_str(json_string_value(j), &policy))
+		return policy;
+	if (j)
+		applog(LOG_WARNING, "%s: Invalid security policy for %s", devid, uri);
+	return fabd_security_policy_default(uri);
+}
+
+// Sockets the caller didn't set up for CURVE are left alone
+static
+bool fabdcfg_zmq_secured(void * const socket)
+{
+	int mechanism = ZMQ_NULL;
+	size_t sz = sizeof(mechanism);
+	if (zmq_getsockopt(socket, ZMQ_MECHANISM, &mechanism, &sz))
+		return false;
+	return mechanism == ZMQ_CURVE;
 }
 
 bool fabdcfg_zmq_bind(const char * const devid, const char * const servername, void * const socket)
 {
-	json_t *j = fabdcfg_server_get(devid, servername);
+	const struct fabdcfg_snapshot * const snap = fabdcfg_current();
+	json_t * const jserver = fabdcfg_server_get(snap, devid, servername), *j = jserver;
 	if (!j)
 		return false;
 	if (json_is_object(j))
@@ -151,15 +777,36 @@ bool fabdcfg_zmq_bind(const char * const devid, const char * const servername, v
 		if (!j)
 			return false;
 	}
+	const bool secured = fabdcfg_zmq_secured(socket);
+	const size_t zap_domainsz = strlen(devid) + 1 + strlen(servername) + 1;
+	char zap_domain[zap_domainsz];
+	snprintf(zap_domain, zap_domainsz, "%s/%s", devid, servername);
 	j = fabd_json_array(j);
 	bool success = true;
 	for (size_t i = 0, il = json_array_size(j); i < il; ++i)
 	{
-		json_t * const jj = json_array_get(j, i);
-		if (zmq_bind(socket, json_string_value(jj)))
+		const char * const s = json_string_value(json_array_get(j, i));
+		if (s && secured)
+		{
+			const enum fabd_security_policy policy = fabdcfg_security_policy(snap, devid, jserver, s);
+			freeabode_zmq_security_policy(socket, true, policy);
+			if (policy == FSP_CURVE)
+				// Identifies the server to ZAP, for authorization
+				zmq_setsockopt(socket, ZMQ_ZAP_DOMAIN, zap_domain, strlen(zap_domain));
+		}
+		if (!s || zmq_bind(socket, s))
 			success = false;
 	}
 	json_decref(j);
+	
+	char * const uri = fabdcfg_inproc_uri(devid, servername);
+	if (secured)
+		freeabode_zmq_security_policy(socket, true, FSP_NULL);
+	if (!zmq_bind(socket, uri))
+		fabdcfg_inproc_host(devid);
+	free(uri);
+	if (secured)
+		freeabode_zmq_security_policy(socket, true, FSP_CURVE);
 	return success;
 }
 
@@ -183,48 +830,67 @@ bool fabd_parse_devuri(const char * const s, char ** const devid, char ** const
 }
 
 static
-char *fabdcfg_server_get_connect(const char * const devid, const char * const servername, const char * const from_devid)
+bool fabdcfg_node_is_self(const char * const node)
 {
-	bool is_local;
-	const char *node;
-	{
-		json_t * const jnode = fabdcfg_device_get(devid, "node");
-		if (json_is_string(jnode))
-		{
-			node = json_string_value(jnode);
-			json_t * const jfromnode = fabdcfg_device_get(from_devid, "node");
-			is_local = (json_is_string(jfromnode) && !strcmp(node, json_string_value(jfromnode)));
-		}
-		else
-		{
-			is_local = false;
-			node = NULL;
-		}
-	}
+	if (!node)
+		return false;
+	if (!(strcmp(node, "localhost") && strncmp(node, "127.", 4) && strcmp(node, "::1")))
+		return true;
+	char hostname[0x100];
+	if (gethostname(hostname, sizeof(hostname)))
+		return false;
+	hostname[sizeof(hostname) - 1] = '\0';
+	return !strcmp(node, hostname);
+}
+
+// Higher is faster; 0 is unusable
+static
+int fabdcfg_endpoint_rank(const char * const s, const bool is_local)
+{
+	if (!strncmp(s, "ipc:", 4))
+		return is_local ? 2 : 0;
+	if (!strncmp(s, "inproc:", 7))
+		// Only meaningful within a process, which is handled separately
+		return 0;
+	return 1;
+}
+
+static
+char *fabdcfg_server_get_connect(const struct fabdcfg_snapshot * const snap, const char * const devid, const char * const servername, const char * const from_devid)
+{
+	const struct fabdcfg_value * const vnode = fabdcfg_lookup(snap, devid, "node");
+	const struct fabdcfg_value * const vfromnode = fabdcfg_lookup(snap, from_devid, "node");
+	const char * const node = vnode ? vnode->str : NULL;
+	const char * const fromnode = vfromnode ? vfromnode->str : NULL;
+	const bool is_local = node && fromnode && (!strcmp(node, fromnode) || (fabdcfg_node_is_self(node) && fabdcfg_node_is_self(fromnode)));
 	
-	json_t *jserver = fabdcfg_server_get(devid, servername), *j;
+	json_t *jserver = fabdcfg_server_get(snap, devid, servername), *j;
 	if (!jserver)
 		return NULL;
+	const char *best = NULL;
+	int best_rank = 0;
 	if (json_is_object(jserver))
 	{
 		j = json_object_get(jserver, "connect");
 		if (j)
 		{
-			// Choose first applicable URI
+			// Choose the fastest applicable URI, or the first of equals
 			j = fabd_json_array(j);
 			for (size_t i = 0, il = json_array_size(j); i < il; ++i)
 			{
-				json_t * const ji = json_array_get(j, i);
-				const char * const s = json_string_value(ji);
-				
+				const char * const s = json_string_value(json_array_get(j, i));
 				if (!s)
 					continue;
-				if ((!strncmp(s, "ipc:", 4)) && !is_local)
-					continue;
-				
-				return strdup(s);
+				const int rank = fabdcfg_endpoint_rank(s, is_local);
+				if (rank > best_rank)
+				{
+					best = s;
+					best_rank = rank;
+				}
 			}
-			return NULL;
+			char * const rv = best ? strdup(best) : NULL;
+			json_decref(j);
+			return rv;
 		}
 		j = json_object_get(jserver, "bind");
 		if (!j)
@@ -235,33 +901,157 @@ char *fabdcfg_server_get_connect(const char * const devid, const char * const se
 	
 	// Construct connect from bind
 	j = fabd_json_array(j);
+	const char *best_star = NULL;
 	for (size_t i = 0, il = json_array_size(j); i < il; ++i)
 	{
-		json_t * const ji = json_array_get(j, i);
-		const char * const s = json_string_value(ji);
+		const char * const s = json_string_value(json_array_get(j, i));
 		if (!s)
 			continue;
-		const char *p = strchr(s, '*');
-		if (!p)
-		{
-			// No '*'; for now we assume that means it only works locally
-			if (is_local)
-				return strdup(s);
-		}
-		else
-		if (node)
+		const char * const p = strchr(s, '*');
+		// Without a '*', for now we assume it only works locally
+		if (!(p ? (node != NULL) : is_local))
+			continue;
+		const int rank = fabdcfg_endpoint_rank(s, is_local);
+		if (rank > best_rank)
 		{
-			// Replace '*' with node
-			const size_t nodelen = strlen(node), slen = strlen(s), ppos = p - s;
-			char * const rv = malloc(slen + nodelen);
-			memcpy(rv, s, ppos);
-			memcpy(&rv[ppos], node, nodelen);
-			memcpy(&rv[ppos+nodelen], &p[1], slen - (ppos + 1));
-			rv[nodelen + slen - 1] = '\0';
-			return rv;
+			best = s;
+			best_rank = rank;
+			best_star = p;
 		}
 	}
-	return NULL;
+	char *rv = NULL;
+	if (best_star)
+	{
+		// Replace '*' with node
+		const size_t nodelen = strlen(node), slen = strlen(best), ppos = best_star - best;
+		// slen - 1 (dropping the '*') + nodelen + 1 (null terminator)
+		rv = malloc(slen + nodelen);
+		assert(rv);
+		memcpy(rv, best, ppos);
+		memcpy(&rv[ppos], node, nodelen);
+		memcpy(&rv[ppos+nodelen], &best_star[1], slen - (ppos + 1));
+		rv[nodelen + slen - 1] = '\0';
+	}
+	else
+	if (best)
+		rv = strdup(best);
+	json_decref(j);
+	return rv;
+}
+
+static
+struct fabdcfg_endpoint *fabdcfg_endpoint_probe(const struct fabdcfg_snapshot * const snap, const uint32_t hash, const char * const from_devid, const char * const uri)
+{
+	for (size_t i = hash & snap->endpoints_mask; ; i = (i + 1) & snap->endpoints_mask)
+	{
+		struct fabdcfg_endpoint * const e = &snap->endpoints[i];
+		if (!e->uri)
+			return e;
+		if (e->hash == hash && !strcmp(e->uri, uri) && !strcmp(e->from_devid, from_devid))
+			return e;
+	}
+}
+
+// The destination's own CURVE public key, if it doesn't share ours
+static
+bool fabdcfg_server_key(const struct fabdcfg_snapshot * const snap, const char * const devid, uint8_t * const out)
+{
+	const struct fabdcfg_value * const v = fabdcfg_lookup(snap, devid, "public_key");
+	if (!(v && v->str))
+		return false;
+	if (!freeabode_parse_pubkey(v->str, out))
+	{
+		applog(LOG_WARNING, "Invalid public_key for %s", devid);
+		return false;
+	}
+	return true;
+}
+
+static
+void fabdcfg_snapshot_resolve_client(struct fabdcfg_snapshot * const snap, const char * const from_devid, json_t * const jclient)
+{
+	json_t *j;
+	size_t i;
+	json_array_foreach(jclient, i, j)
+		fabdcfg_snapshot_resolve_client(snap, from_devid, j);
+	const char * const uri = json_string_value(jclient);
+	char *dest_devid, *dest_servername;
+	if (!fabd_parse_devuri(uri, &dest_devid, &dest_servername))
+		return;
+	const uint32_t hash = fabdcfg_hash(from_devid, uri);
+	struct fabdcfg_endpoint * const e = fabdcfg_endpoint_probe(snap, hash, from_devid, uri);
+	if (!e->uri)
+	{
+		*e = (struct fabdcfg_endpoint){
+			.hash = hash,
+			.from_devid = from_devid,
+			.uri = uri,
+			.dest_devid = dest_devid,
+			.dest_servername = dest_servername,
+			.resolved = fabdcfg_server_get_connect(snap, dest_devid, dest_servername, from_devid),
+		};
+		e->policy = e->resolved ? fabdcfg_security_policy(snap, dest_devid, fabdcfg_server_get(snap, dest_devid, dest_servername), e->resolved) : FSP_CURVE;
+		e->has_serverkey = fabdcfg_server_key(snap, dest_devid, e->serverkey);
+	}
+	else
+	{
+		free(dest_devid);
+		free(dest_servername);
+	}
+}
+
+static
+void fabdcfg_snapshot_resolve_device(struct fabdcfg_snapshot * const snap, const char * const devid)
+{
+	const struct fabdcfg_value * const v = fabdcfg_lookup(snap, devid, "clients");
+	if (!v)
+		return;
+	const char *clientname;
+	json_t *j;
+	json_object_foreach(v->json, clientname, j)
+		fabdcfg_snapshot_resolve_client(snap, devid, j);
+}
+
+static
+size_t fabdcfg_count_clients(const struct fabdcfg_snapshot * const snap, const char * const devid)
+{
+	const struct fabdcfg_value * const v = fabdcfg_lookup(snap, devid, "clients");
+	if (!v)
+		return 0;
+	size_t count = 0;
+	const char *clientname;
+	json_t *j;
+	json_object_foreach(v->json, clientname, j)
+		count += json_is_array(j) ? json_array_size(j) : 1;
+	return count;
+}
+
+static
+void fabdcfg_snapshot_resolve_endpoints(struct fabdcfg_snapshot * const snap)
+{
+	json_t * const jdevices = json_object_get(snap->directory, "devices");
+	
+	// Upper bound, so the table never needs to grow
+	size_t n_max = 0;
+	const char *devid;
+	json_t *j;
+	json_object_foreach(jdevices, devid, j)
+		n_max += fabdcfg_count_clients(snap, devid);
+	json_object_foreach(snap->configs, devid, j)
+		if (!json_object_get(jdevices, devid))
+			n_max += fabdcfg_count_clients(snap, devid);
+	size_t allocsz = 0x10;
+	while (allocsz < n_max * 2)
+		allocsz *= 2;
+	snap->endpoints = calloc(allocsz, sizeof(*snap->endpoints));
+	assert(snap->endpoints);
+	snap->endpoints_mask = allocsz - 1;
+	
+	json_object_foreach(jdevices, devid, j)
+		fabdcfg_snapshot_resolve_device(snap, devid);
+	json_object_foreach(snap->configs, devid, j)
+		if (!json_object_get(jdevices, devid))
+			fabdcfg_snapshot_resolve_device(snap, devid);
 }
 
 static
@@ -287,38 +1077,100 @@ void fabdcfg_zmq_connect_init_heartbeat(void * const socket)
 	zmq_setsockopt(socket, ZMQ_HEARTBEAT_TIMEOUT, &option_value, sizeof(option_value));
 }
 
+static
+bool fabdcfg_zmq_connect_one(const struct fabdcfg_snapshot * const snap, const char * const devid, const char *s, void * const socket, const bool secured)
+{
+	char *inproc = NULL, *adhoc = NULL;
+	enum fabd_security_policy policy = s ? fabdcfg_security_policy(snap, devid, NULL, s) : FSP_CURVE;
+	const uint8_t *serverkey = NULL;
+	uint8_t adhoc_serverkey[0x20];
+	if (s && !strncmp(s, "fabd:", 5))
+	{
+		// Resolved once per config snapshot; but prefer a server in this very process
+		const struct fabdcfg_endpoint * const e = devid ? fabdcfg_endpoint_probe(snap, fabdcfg_hash(devid, s), devid, s) : NULL;
+		char *dest_devid = NULL, *dest_servername = NULL;
+		if (!(e && e->uri))
+		{
+			// Not from any configured client, so resolve it now
+			if (fabd_parse_devuri(s, &dest_devid, &dest_servername))
+			{
+				if (fabdcfg_inproc_hosted(dest_devid))
+				{
+					s = inproc = fabdcfg_inproc_uri(dest_devid, dest_servername);
+					policy = FSP_NULL;
+				}
+				else
+				{
+					s = adhoc = fabdcfg_server_get_connect(snap, dest_devid, dest_servername, devid);
+					if (s)
+					{
+						policy = fabdcfg_security_policy(snap, dest_devid, fabdcfg_server_get(snap, dest_devid, dest_servername), s);
+						if (fabdcfg_server_key(snap, dest_devid, adhoc_serverkey))
+							serverkey = adhoc_serverkey;
+					}
+				}
+			}
+			else
+				s = NULL;
+			free(dest_devid);
+			free(dest_servername);
+		}
+		else
+		if (fabdcfg_inproc_hosted(e->dest_devid))
+		{
+			// inproc may connect before the server binds
+			s = inproc = fabdcfg_inproc_uri(e->dest_devid, e->dest_servername);
+			policy = FSP_NULL;
+		}
+		else
+		{
+			s = e->resolved;
+			policy = e->policy;
+			if (e->has_serverkey)
+				serverkey = e->serverkey;
+		}
+	}
+	
+	fabdcfg_zmq_connect_init_heartbeat(socket);
+	if (s && secured)
+	{
+		freeabode_zmq_security_policy(socket, false, policy);
+		if (policy == FSP_CURVE && serverkey)
+			freeabode_zmq_security_serverkey(socket, serverkey);
+	}
+	
+	const bool success = s && !zmq_connect(socket, s);
+	free(inproc);
+	free(adhoc);
+	return success;
+}
+
 bool fabdcfg_zmq_connect(const char * const devid, const char * const clientname, void * const socket)
 {
-	json_t *j = fabdcfg_device_get(devid, "clients");
-	if (!j)
+	const struct fabdcfg_snapshot * const snap = fabdcfg_current();
+	const struct fabdcfg_value * const v = fabdcfg_lookup(snap, devid, "clients");
+	if (!v)
 		return false;
-	j = json_object_get(j, clientname);
+	json_t *j = json_object_get(v->json, clientname);
 	if (!j)
 		return false;
+	const bool secured = fabdcfg_zmq_secured(socket);
 	j = fabd_json_array(j);
 	bool success = true;
 	for (size_t i = 0, il = json_array_size(j); i < il; ++i)
-	{
-		json_t * const ji = json_array_get(j, i);
-		const char *s = json_string_value(ji);
-		char *sfree = NULL;
-		{
-			char *dest_devid, *dest_servername;
-			if (fabd_parse_devuri(s, &dest_devid, &dest_servername))
-			{
-				// Lookup server config and determine where to connect from that
-				s = sfree = fabdcfg_server_get_connect(dest_devid, dest_servername, devid);
-			}
-		}
-		
-		fabdcfg_zmq_connect_init_heartbeat(socket);
-		
-		if (zmq_connect(socket, s))
+		if (!fabdcfg_zmq_connect_one(snap, devid, json_string_value(json_array_get(j, i)), socket, secured))
 			success = false;
-		
-		free(sfree);
-	}
 	json_decref(j);
+	if (secured)
+		freeabode_zmq_security_policy(socket, false, FSP_CURVE);
 	return success;
 }
 
+bool fabdcfg_zmq_connect_uri(const char * const devid, const char * const uri, void * const socket)
+{
+	const bool secured = fabdcfg_zmq_secured(socket);
+	const bool success = fabdcfg_zmq_connect_one(fabdcfg_current(), devid, uri, socket, secured);
+	if (secured)
+		freeabode_zmq_security_policy(socket, false, FSP_CURVE);
+	return success;
+}
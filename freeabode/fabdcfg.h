@@ -5,9 +5,35 @@
 
 #include <jansson.h>
 
+#include <freeabode/util.h>
+
+// Config values are resolved (device config, then directory entry, then defaults) once at load time.
+// Snapshots are immutable; each thread keeps using the one it has until it loads, dispatches changes, or refreshes,
+// so pointers into it remain valid in that thread until then (longer-lived values must be copied).
+struct fabdcfg_snapshot;
+
+struct fabdcfg_value {
+	json_t *json;
+	const char *str;  // NULL unless a string
+	bool has_int;
+	int intval;
+	enum fabd_tristate truth;  // unknown for null
+};
+
 extern void fabdcfg_load_directory(void);
 extern void fabdcfg_load_device(const char *devid);
 extern const char *fabd_common_argv(int argc, char **argv, const char *type);
+// Applies devid's log_level and log_syslog, and reapplies log_level whenever config is reloaded; call before fabdcfg_watch_start
+// Logging is process-wide, so under fabd-aio these come from just one device
+extern void fabdcfg_log_config(const char *devid);
+
+extern const struct fabdcfg_snapshot *fabdcfg_current(void);
+// For threads that don't dispatch changes, to move on to the latest snapshot
+extern void fabdcfg_refresh(void);
+extern const struct fabdcfg_value *fabdcfg_lookup(const struct fabdcfg_snapshot *, const char *devid, const char *key);
+extern json_t *fabdcfg_directory_get(const struct fabdcfg_snapshot *, const char *key);
+// Device configs loaded (with fabdcfg_load_device) into the snapshot, keyed by device id
+extern json_t *fabdcfg_loaded_configs(const struct fabdcfg_snapshot *);
 
 extern json_t *fabdcfg_device_get(const char *devid, const char *key);
 extern bool fabdcfg_device_getbool(const char *devid, const char *key, bool def);
@@ -15,7 +41,20 @@ extern const char *fabdcfg_device_getstr(const char *devid, const char *key);
 extern int fabdcfg_device_getint(const char *devid, const char *key, int def);
 extern bool fabdcfg_device_checktype(const char *devid, const char *type);
 
+// Changes under fabd_cfg/ are reloaded in the background; poll the returned fd, and call fabdcfg_dispatch_changes when it's readable.
+// The fd, and callbacks, belong to the calling thread: they run from its fabdcfg_dispatch_changes only,
+// for keys whose value actually changed (newvalue is NULL if removed).
+typedef void (*fabdcfg_change_cb)(const char *devid, const char *key, const struct fabdcfg_value *newvalue, void *userp);
+extern int fabdcfg_watch_start(void);
+extern void fabdcfg_on_change(const char *devid, const char *key, fabdcfg_change_cb, void *userp);
+extern void fabdcfg_off_change(const char *devid, const char *key, fabdcfg_change_cb, void *userp);
+extern void fabdcfg_dispatch_changes(void);
+
+// Servers of hosted devices are reached over inproc, even before they bind; this requires sharing one ZeroMQ context
+extern void fabdcfg_inproc_host(const char *devid);
 extern bool fabdcfg_zmq_bind(const char *devid, const char *servername, void *socket);
 extern bool fabdcfg_zmq_connect(const char *devid, const char *clientname, void *socket);
+// Connects to a "fabd:<device-id>/<server>" URI (or a plain ZeroMQ endpoint) that isn't one of devid's clients; devid may be NULL
+extern bool fabdcfg_zmq_connect_uri(const char *devid, const char *uri, void *socket);
 
 #endif
@@ -0,0 +1,166 @@
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <freeabode/freeabode.pb-c.h>
+#include <freeabode/logging.h>
+#include <freeabode/util.h>
+#include <freeabode/util_hvac.h>
+
+#include "interlock.h"
+
+// Every check below walks only the set bits of a mask, so at most FABD_INTERLOCK_MAX_WIRES steps each
+#define first_wire(mask)  ((unsigned)__builtin_ctz(mask))
+
+static
+void interlock_max_delay(struct timespec * const cur, const struct timespec * const delay)
+{
+	if (timespec_cmp(delay, cur) > 0)
+		*cur = *delay;
+}
+
+void fabd_interlocks_init(struct fabd_interlocks * const il, const struct fabd_interlock_rule * const rules, const size_t n_rules, const uint32_t available, const struct timespec * const now)
+{
+	memset(il, 0, sizeof(*il));
+	il->available = available;
+	for (unsigned wire = 0; wire < FABD_INTERLOCK_MAX_WIRES; ++wire)
+		il->last_changed[wire] = *now;
+	
+	for (size_t i = 0; i < n_rules; ++i)
+	{
+		const struct fabd_interlock_rule * const rule = &rules[i];
+		for (uint32_t m = rule->wires; m; m &= m - 1)
+		{
+			const unsigned wire = first_wire(m);
+			switch (rule->type) {
+				case FIT_MIN_OFF:
+					il->min_off_mask |= FABD_WIRE(wire);
+					interlock_max_delay(&il->min_off[wire], &rule->delay);
+					break;
+				case FIT_STAGE_AFTER:
+					il->stage_mask |= FABD_WIRE(wire);
+					il->stage_after[wire] |= rule->others;
+					interlock_max_delay(&il->stage_delay[wire], &rule->delay);
+					break;
+				case FIT_HOLD_WHILE:
+					// With more than one rule, the shortest tolerance wins
+					if (!(il->hold_mask & FABD_WIRE(wire)) || timespec_cmp(&rule->delay, &il->hold_tolerance[wire]) < 0)
+						il->hold_tolerance[wire] = rule->delay;
+					il->hold_mask |= FABD_WIRE(wire);
+					il->hold_while[wire] |= rule->others;
+					break;
+				case FIT_EXCLUDES:
+					il->excludes_mask |= FABD_WIRE(wire);
+					il->excludes[wire] |= rule->others;
+					for (uint32_t m2 = rule->others; m2; m2 &= m2 - 1)
+					{
+						const unsigned other = first_wire(m2);
+						il->excludes_mask |= FABD_WIRE(other);
+						il->excludes[other] |= FABD_WIRE(wire);
+					}
+					break;
+				case FIT_REQUIRES:
+					if (rule->force)
+					{
+						if (!(rule->others & available))
+							break;
+						il->forces[wire] |= rule->others & available;
+					}
+					else
+						il->requires[wire] |= rule->others;
+					il->requires_mask |= FABD_WIRE(wire);
+					break;
+			}
+		}
+	}
+}
+
+static
+bool interlock_elapsed(const struct timespec * const since, const struct timespec * const delay, const struct timespec * const now)
+{
+	struct timespec ts_when;
+	timespec_add(since, delay, &ts_when);
+	return timespec_cmp(now, &ts_when) >= 0;
+}
+
+uint32_t fabd_interlocks_check(const struct fabd_interlocks * const il, uint32_t proposed, const struct timespec * const now)
+{
+	proposed = (proposed & il->available) | (il->on & ~il->available);
+	
+	// Wires that may not turn on just now, whether proposed or not (they may yet be forced)
+	uint32_t blocked = 0;
+	for (uint32_t m = il->min_off_mask & ~il->on; m; m &= m - 1)
+	{
+		const unsigned wire = first_wire(m);
+		if (!interlock_elapsed(&il->last_changed[wire], &il->min_off[wire], now))
+			blocked |= FABD_WIRE(wire);
+	}
+	for (uint32_t m = il->stage_mask & ~il->on & ~blocked; m; m &= m - 1)
+	{
+		const unsigned wire = first_wire(m);
+		if ((il->on & il->stage_after[wire]) != il->stage_after[wire])
+		{
+			blocked |= FABD_WIRE(wire);
+			continue;
+		}
+		for (uint32_t m2 = il->stage_after[wire]; m2; m2 &= m2 - 1)
+			if (!interlock_elapsed(&il->last_changed[first_wire(m2)], &il->stage_delay[wire], now))
+				blocked |= FABD_WIRE(wire);
+	}
+	for (uint32_t m = blocked & proposed; m; m &= m - 1)
+		applog(LOG_WARNING, "Prevented attempt to turn on %s during safety lockout", hvacwire_name(first_wire(m)));
+	proposed &= ~blocked;
+	
+	for (uint32_t m = (proposed ^ il->on) & il->hold_mask; m; m &= m - 1)
+	{
+		const unsigned wire = first_wire(m);
+		uint32_t running = 0;
+		for (uint32_t m2 = il->hold_while[wire] & il->on & proposed; m2; m2 &= m2 - 1)
+			if (interlock_elapsed(&il->last_changed[first_wire(m2)], &il->hold_tolerance[wire], now))
+				running |= FABD_WIRE(first_wire(m2));
+		if (!running)
+			continue;
+		applog(LOG_WARNING, "Prevented attempt to turn %s %s while %s running", (proposed & FABD_WIRE(wire)) ? "on" : "off", hvacwire_name(wire), hvacwire_name(first_wire(running)));
+		proposed ^= FABD_WIRE(wire);
+		proposed &= ~running;
+	}
+	
+	for (uint32_t m = proposed & ~il->on & il->excludes_mask; m; m &= m - 1)
+	{
+		const unsigned wire = first_wire(m);
+		const uint32_t conflict = proposed & il->excludes[wire];
+		if (!conflict)
+			continue;
+		applog(LOG_WARNING, "Prevented attempt to turn on %s while %s on", hvacwire_name(wire), hvacwire_name(first_wire(conflict)));
+		proposed &= ~FABD_WIRE(wire);
+	}
+	
+	for (uint32_t m = proposed & il->requires_mask; m; m &= m - 1)
+	{
+		const unsigned wire = first_wire(m);
+		const uint32_t missing = (il->requires[wire] | (il->forces[wire] & blocked)) & ~proposed;
+		if (missing)
+		{
+			applog(LOG_WARNING, "Prevented %s from running without %s", hvacwire_name(wire), hvacwire_name(first_wire(missing)));
+			proposed &= ~FABD_WIRE(wire);
+			continue;
+		}
+		const uint32_t forced = il->forces[wire] & ~proposed;
+		for (uint32_t m2 = forced & il->on; m2; m2 &= m2 - 1)
+			applog(LOG_WARNING, "Prevented attempt to turn off %s while %s running", hvacwire_name(first_wire(m2)), hvacwire_name(wire));
+		proposed |= forced;
+	}
+	
+	return proposed;
+}
+
+void fabd_interlocks_commit(struct fabd_interlocks * const il, const uint32_t state, const struct timespec * const now)
+{
+	for (uint32_t m = state ^ il->on; m; m &= m - 1)
+		il->last_changed[first_wire(m)] = *now;
+	il->on = state;
+}
@@ -0,0 +1,68 @@
+#ifndef FABD_INTERLOCK_H
+#define FABD_INTERLOCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Safety interlocks between HVAC wires (nbp FETs are numbered the same)
+// A state has one bit per wire, FABD_WIRE(wire) set if it is on
+
+#define FABD_INTERLOCK_MAX_WIRES  32
+#define FABD_WIRE(wire)  (UINT32_C(1) << (wire))
+
+// Applied in this order, each to the result of the ones before
+enum fabd_interlock_type {
+	// wires may not turn on until they have been off for delay
+	FIT_MIN_OFF,
+	// wires may not turn on until all of others have been on for delay
+	FIT_STAGE_AFTER,
+	// wires may not change while any of others (staying on) have been on for longer than delay
+	// since others are presumably working against what is desired, such an attempt shuts them off
+	FIT_HOLD_WHILE,
+	// neither wires nor others may turn on while the other is on
+	FIT_EXCLUDES,
+	// wires may only be on with all of others; if force, others are turned on to match
+	FIT_REQUIRES,
+};
+
+struct fabd_interlock_rule {
+	enum fabd_interlock_type type;
+	uint32_t wires;
+	uint32_t others;
+	struct timespec delay;
+	bool force;
+};
+
+struct fabd_interlocks {
+	uint32_t available;
+	
+	// Rules, compiled per wire
+	uint32_t min_off_mask;
+	struct timespec min_off[FABD_INTERLOCK_MAX_WIRES];
+	uint32_t stage_mask;
+	uint32_t stage_after[FABD_INTERLOCK_MAX_WIRES];
+	struct timespec stage_delay[FABD_INTERLOCK_MAX_WIRES];
+	uint32_t hold_mask;
+	uint32_t hold_while[FABD_INTERLOCK_MAX_WIRES];
+	struct timespec hold_tolerance[FABD_INTERLOCK_MAX_WIRES];
+	uint32_t excludes_mask;
+	uint32_t excludes[FABD_INTERLOCK_MAX_WIRES];
+	uint32_t requires_mask;
+	uint32_t requires[FABD_INTERLOCK_MAX_WIRES];
+	uint32_t forces[FABD_INTERLOCK_MAX_WIRES];
+	
+	uint32_t on;
+	struct timespec last_changed[FABD_INTERLOCK_MAX_WIRES];  // CLOCK_MONOTONIC
+};
+
+// Only wires in available can ever be changed; a forced requirement on any other is dropped, but a plain one can never be met
+// Every wire starts off, as if it had just been turned off
+extern void fabd_interlocks_init(struct fabd_interlocks *, const struct fabd_interlock_rule *rules, size_t n_rules, uint32_t available, const struct timespec *now);
+// Returns the closest state to proposed that is safe to put in place now, logging anything prevented
+extern uint32_t fabd_interlocks_check(const struct fabd_interlocks *, uint32_t proposed, const struct timespec *now);
+// Records the state actually put in place
+extern void fabd_interlocks_commit(struct fabd_interlocks *, uint32_t state, const struct timespec *now);
+
+#endif
@@ -2,10 +2,14 @@
 
 #include <errno.h>
 #include <float.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -57,9 +61,202 @@ bool pb_is_optional_and_missing(const ProtobufCFieldDescriptor * const pbfield,
 	}
 }
 
+// Field lookups, element sizes and submessage descriptors are compiled once per message type into a plan
+
+struct pbjson_field {
+	const ProtobufCFieldDescriptor *pbfield;
+	size_t namelen;
+	size_t elem_sz;
+	const struct pbjson_plan *subplan;  // resolved on first use, as messages may be recursive
+};
+
+struct pbjson_plan {
+	const ProtobufCMessageDescriptor *des;
+	struct pbjson_plan *next;
+	uint32_t seed, mask;
+	// Perfect hash of field names; unused slots are NULL
+	const struct pbjson_field **table;
+	struct pbjson_field fields[];
+};
+
+static pthread_mutex_t my_plans_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pbjson_plan *my_plans;
+
+static
+uint32_t pbjson_hash(const char * const s, const size_t len, const uint32_t seed)
+{
+	// FNV-1a, with a final mix so the low bits are usable directly
+	uint32_t h = 0x811c9dc5 ^ seed;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (uint8_t)s[i]) * 0x01000193;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	return h;
+}
+
+static
+size_t pbjson_elem_size(const ProtobufCType type)
+{
+	switch (type)
+	{
+		case PROTOBUF_C_TYPE_INT32:
+		case PROTOBUF_C_TYPE_SINT32:
+		case PROTOBUF_C_TYPE_SFIXED32:
+		case PROTOBUF_C_TYPE_UINT32:
+		case PROTOBUF_C_TYPE_FIXED32:
+			return 4;
+		case PROTOBUF_C_TYPE_INT64:
+		case PROTOBUF_C_TYPE_SINT64:
+		case PROTOBUF_C_TYPE_SFIXED64:
+		case PROTOBUF_C_TYPE_UINT64:
+		case PROTOBUF_C_TYPE_FIXED64:
+			return 8;
+		case PROTOBUF_C_TYPE_FLOAT:
+			return sizeof(float);
+		case PROTOBUF_C_TYPE_DOUBLE:
+			return sizeof(double);
+		case PROTOBUF_C_TYPE_BOOL:
+			return sizeof(protobuf_c_boolean);
+		case PROTOBUF_C_TYPE_ENUM:
+			return sizeof(int);
+		case PROTOBUF_C_TYPE_STRING:
+		case PROTOBUF_C_TYPE_MESSAGE:
+			return sizeof(void *);
+		case PROTOBUF_C_TYPE_BYTES:
+			return sizeof(ProtobufCBinaryData);
+	}
+	// No default case, so we get warnings during compile if a new case is added to the types :)
+	return 0;
+}
+
+static
+bool pbjson_plan_try_seed(struct pbjson_plan * const plan, const uint32_t seed, const uint32_t mask)
+{
+	memset(plan->table, 0, sizeof(*plan->table) * (mask + 1));
+	for (unsigned i = 0; i < plan->des->n_fields; ++i)
+	{
+		const struct pbjson_field * const f = &plan->fields[i];
+		const uint32_t slot = pbjson_hash(f->pbfield->name, f->namelen, seed) & mask;
+		if (plan->table[slot])
+			return false;
+		plan->table[slot] = f;
+	}
+	plan->seed = seed;
+	plan->mask = mask;
+	return true;
+}
+
+static
+struct pbjson_plan *pbjson_plan_compile(const ProtobufCMessageDescriptor * const des)
+{
+	struct pbjson_plan * const plan = malloc(sizeof(*plan) + (sizeof(*plan->fields) * des->n_fields));
+	if (!plan)
+		return NULL;
+	plan->des = des;
+	for (unsigned i = 0; i < des->n_fields; ++i)
+	{
+		const ProtobufCFieldDescriptor * const pbfield = &des->fields[i];
+		plan->fields[i] = (struct pbjson_field){
+			.pbfield = pbfield,
+			.namelen = strlen(pbfield->name),
+			.elem_sz = pbjson_elem_size(pbfield->type),
+		};
+	}
+	
+	// Start at twice the field count, and double the table whenever no seed in a while works
+	uint32_t mask = 1;
+	while (mask + 1 < des->n_fields * 2)
+		mask = (mask << 1) | 1;
+	plan->table = NULL;
+	while (true)
+	{
+		void * const p = realloc(plan->table, sizeof(*plan->table) * (mask + 1));
+		if (!p)
+		{
+			free(plan->table);
+			free(plan);
+			return NULL;
+		}
+		plan->table = p;
+		for (uint32_t seed = 0; seed < 0x100; ++seed)
+			if (pbjson_plan_try_seed(plan, seed, mask))
+				return plan;
+		mask = (mask << 1) | 1;
+	}
+}
+
+static
+const struct pbjson_plan *pbjson_plan_get(const ProtobufCMessageDescriptor * const des)
+{
+	for (const struct pbjson_plan *plan = __atomic_load_n(&my_plans, __ATOMIC_ACQUIRE); plan; plan = plan->next)
+		if (plan->des == des)
+			return plan;
+	
+	pthread_mutex_lock(&my_plans_mutex);
+	struct pbjson_plan *plan;
+	for (plan = my_plans; plan; plan = plan->next)
+		if (plan->des == des)
+			break;
+	if (!plan)
+	{
+		plan = pbjson_plan_compile(des);
+		if (plan)
+		{
+			plan->next = my_plans;
+			__atomic_store_n(&my_plans, plan, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&my_plans_mutex);
+	return plan;
+}
+
 static
-void j2p_assign_field(void * const out_pb, const ProtobufCFieldDescriptor * const pbfield, json_t * const jval, int * const errcount)
+const struct pbjson_plan *pbjson_field_subplan(const struct pbjson_field * const f)
 {
+	const struct pbjson_plan *subplan = __atomic_load_n(&f->subplan, __ATOMIC_ACQUIRE);
+	if (!subplan)
+	{
+		subplan = pbjson_plan_get(f->pbfield->descriptor);
+		// Plans are never freed, so it's harmless if another thread races us here
+		__atomic_store_n(&((struct pbjson_field *)f)->subplan, subplan, __ATOMIC_RELEASE);
+	}
+	return subplan;
+}
+
+static
+const struct pbjson_field *pbjson_plan_lookup(const struct pbjson_plan * const plan, const char * const name)
+{
+	const size_t namelen = strlen(name);
+	const struct pbjson_field * const f = plan->table[pbjson_hash(name, namelen, plan->seed) & plan->mask];
+	if (!(f && f->namelen == namelen && !memcmp(f->pbfield->name, name, namelen)))
+		return NULL;
+	return f;
+}
+
+// Appends an uninitialised element to a repeated field, returning its address
+static
+void *pbjson_repeated_append(void * const out_pb, const struct pbjson_field * const f)
+{
+	void ** const p = out_pb + f->pbfield->offset;
+	size_t * const np = out_pb + f->pbfield->quantifier_offset;
+	// Capacity is implicitly the next power of two, so only reallocate (doubling) when it's full
+	if (!(*np & (*np - 1)))
+	{
+		void * const q = realloc(*p, f->elem_sz * (*np ? (*np * 2) : 1));
+		if (!q)
+			return NULL;
+		*p = q;
+	}
+	return *p + (f->elem_sz * *np);
+}
+
+static void *pbjson_plan_decode(const struct pbjson_plan *, json_t *, int *errcount);
+
+static
+void j2p_assign_field(void * const out_pb, const struct pbjson_field * const f, json_t * const jval, int * const errcount)
+{
+	const ProtobufCFieldDescriptor * const pbfield = f->pbfield;
 	if (json_is_null(jval))
 		// Ignore null entirely
 		return;
@@ -84,64 +281,9 @@ void j2p_assign_field(void * const out_pb, const ProtobufCFieldDescriptor * cons
 	if (pbfield->label == PROTOBUF_C_LABEL_REPEATED)
 	{
 		// addr is actually an array of items
-		void ** const p = addr;
-		size_t *np = out_pb + pbfield->quantifier_offset;
-		size_t item_sz = 0;
-		switch (pbfield->type)
-		{
-			case PROTOBUF_C_TYPE_INT32:
-			case PROTOBUF_C_TYPE_SINT32:
-			case PROTOBUF_C_TYPE_SFIXED32:
-			case PROTOBUF_C_TYPE_UINT32:
-			case PROTOBUF_C_TYPE_FIXED32:
-				item_sz = 4;
-				break;
-			case PROTOBUF_C_TYPE_INT64:
-			case PROTOBUF_C_TYPE_SINT64:
-			case PROTOBUF_C_TYPE_SFIXED64:
-			case PROTOBUF_C_TYPE_UINT64:
-			case PROTOBUF_C_TYPE_FIXED64:
-				item_sz = 8;
-				break;
-			case PROTOBUF_C_TYPE_FLOAT:
-				item_sz = sizeof(float);
-				break;
-			case PROTOBUF_C_TYPE_DOUBLE:
-				item_sz = sizeof(double);
-				break;
-			case PROTOBUF_C_TYPE_BOOL:
-				item_sz = 1;
-				break;
-			case PROTOBUF_C_TYPE_ENUM:
-				item_sz = sizeof(int);
-				break;
-			case PROTOBUF_C_TYPE_STRING:
-			case PROTOBUF_C_TYPE_MESSAGE:
-				item_sz = sizeof(void *);
-				break;
-			case PROTOBUF_C_TYPE_BYTES:
-				item_sz = sizeof(ProtobufCBinaryData);
-				break;
-		}
-		if (!item_sz)
-			// In theory, we can handle this using a default case in the switch, but we want warnings during compile if a new case is added to the types :)
+		addr = pbjson_repeated_append(out_pb, f);
+		if (!addr)
 			goto err;
-		if (*p)
-		{
-			// already allocated
-			void *q = realloc(*p, item_sz * (*np + 1));
-			if (!q)
-				goto err;
-			*p = q;
-		}
-		else
-		{
-			// first item
-			*p = malloc(item_sz);
-			if (!*p)
-				goto err;
-		}
-		addr = *p + (item_sz * *np);
 	}
 	bool handled_type = false;
 	switch (pbfield->type)
@@ -281,7 +423,7 @@ void j2p_assign_field(void * const out_pb, const ProtobufCFieldDescriptor * cons
 			
 			if (pbfield->type == PROTOBUF_C_TYPE_FLOAT)
 			{
-				if (n > FLT_MAX || n < FLT_MIN)
+				if (n > FLT_MAX || n < -FLT_MAX)
 					goto err;
 				float *p = addr;
 				*p = n;
@@ -445,10 +587,12 @@ void j2p_assign_field(void * const out_pb, const ProtobufCFieldDescriptor * cons
 		{
 			handled_type = true;
 			void **p = addr, *msg;
-			const ProtobufCMessageDescriptor *des = pbfield->descriptor;
-			msg = json_to_protobuf(des, jval, errcount);
+			const struct pbjson_plan * const subplan = pbjson_field_subplan(f);
+			if (!subplan)
+				goto err;
+			msg = pbjson_plan_decode(subplan, jval, errcount);
 			if (!msg)
-				// errcount already incremented by json_to_protobuf
+				// errcount already incremented by pbjson_plan_decode
 				return;
 			*p = msg;
 			break;
@@ -474,8 +618,10 @@ err:
 	++*errcount;
 }
 
-void *json_to_protobuf(const ProtobufCMessageDescriptor * const des, json_t * const json, int * const errcount)
+static
+void *pbjson_plan_decode(const struct pbjson_plan * const plan, json_t * const json, int * const errcount)
 {
+	const ProtobufCMessageDescriptor * const des = plan->des;
 	ProtobufCMessage *pb = malloc(des->sizeof_message);
 	if (!pb)
 	{
@@ -486,8 +632,8 @@ void *json_to_protobuf(const ProtobufCMessageDescriptor * const des, json_t * co
 	
 	for (void *jiter = json_object_iter(json); jiter; jiter = json_object_iter_next(json, jiter))
 	{
-		const ProtobufCFieldDescriptor *pbfield = protobuf_c_message_descriptor_get_field_by_name(des, json_object_iter_key(jiter));
-		if (!pbfield)
+		const struct pbjson_field * const f = pbjson_plan_lookup(plan, json_object_iter_key(jiter));
+		if (!f)
 		{
 			++*errcount;
 			continue;
@@ -497,14 +643,25 @@ void *json_to_protobuf(const ProtobufCMessageDescriptor * const des, json_t * co
 		{
 			size_t sz = json_array_size(jval);
 			for (size_t i = 0; i < sz; ++i)
-				j2p_assign_field(pb, pbfield, json_array_get(jval, i), errcount);
+				j2p_assign_field(pb, f, json_array_get(jval, i), errcount);
 		}
 		else
-			j2p_assign_field(pb, pbfield, jval, errcount);
+			j2p_assign_field(pb, f, jval, errcount);
 	}
 	return pb;
 }
 
+void *json_to_protobuf(const ProtobufCMessageDescriptor * const des, json_t * const json, int * const errcount)
+{
+	const struct pbjson_plan * const plan = pbjson_plan_get(des);
+	if (!plan)
+	{
+		++*errcount;
+		return NULL;
+	}
+	return pbjson_plan_decode(plan, json, errcount);
+}
+
 static
 json_t *p2j_elem(void ** const addr_p, const ProtobufCFieldDescriptor * const pbfield, int * const errcount)
 {
@@ -543,7 +700,7 @@ json_t *p2j_elem(void ** const addr_p, const ProtobufCFieldDescriptor * const pb
 			break;
 		case PROTOBUF_C_TYPE_BOOL:
 		{
-			*addr_p += 1;
+			*addr_p += sizeof(protobuf_c_boolean);
 			protobuf_c_boolean *p = addr;
 			j = (*p) ? json_true() : json_false();
 			break;
@@ -658,3 +815,335 @@ json_t *protobuf_to_json(void * const _pb, int * const errcount)
 	
 	return j;
 }
+
+// Streaming writer: emits JSON text directly from messages, without building a jansson tree
+
+void fabd_json_writer_init(struct fabd_json_writer * const w, const bool pretty)
+{
+	*w = (struct fabd_json_writer){
+		.pretty = pretty,
+	};
+}
+
+void fabd_json_writer_free(struct fabd_json_writer * const w)
+{
+	free(w->buf);
+	w->buf = NULL;
+	w->len = w->sz = 0;
+}
+
+static
+bool jw_reserve(struct fabd_json_writer * const w, const size_t more)
+{
+	// Always leave room for a null terminator
+	if (w->len + more < w->sz)
+		return true;
+	size_t sz = w->sz ?: 0x100;
+	while (w->len + more >= sz)
+		sz *= 2;
+	char * const p = realloc(w->buf, sz);
+	if (!p)
+		return false;
+	w->buf = p;
+	w->sz = sz;
+	return true;
+}
+
+static
+bool jw_write(struct fabd_json_writer * const w, const char * const s, const size_t len)
+{
+	if (!jw_reserve(w, len))
+		return false;
+	memcpy(&w->buf[w->len], s, len);
+	w->len += len;
+	w->buf[w->len] = '\0';
+	return true;
+}
+
+__attribute__((format(printf, 2, 3)))
+static
+bool jw_printf(struct fabd_json_writer * const w, const char * const fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	const int rv = vsnprintf(&w->buf[w->len], (w->sz > w->len) ? (w->sz - w->len) : 0, fmt, ap);
+	va_end(ap);
+	if (rv < 0)
+		return false;
+	if (w->len + rv >= w->sz)
+	{
+		if (!jw_reserve(w, rv))
+			return false;
+		va_start(ap, fmt);
+		vsnprintf(&w->buf[w->len], w->sz - w->len, fmt, ap);
+		va_end(ap);
+	}
+	w->len += rv;
+	return true;
+}
+
+static
+bool jw_newline(struct fabd_json_writer * const w)
+{
+	if (!w->pretty)
+		return true;
+	if (!jw_reserve(w, 1 + w->depth))
+		return false;
+	w->buf[w->len++] = '\n';
+	for (unsigned i = 0; i < w->depth; ++i)
+		w->buf[w->len++] = '\t';
+	w->buf[w->len] = '\0';
+	return true;
+}
+
+// Length of the valid UTF-8 sequence starting with a non-ASCII byte, or 0 if there isn't one
+static
+size_t jw_utf8_seqlen(const uint8_t * const s, const size_t len)
+{
+	// Second bytes are narrowed to exclude overlong forms, surrogates and anything past U+10FFFF
+	uint8_t lo = 0x80, hi = 0xbf;
+	size_t n;
+	if (s[0] < 0xc2)
+		return 0;
+	else
+	if (s[0] < 0xe0)
+		n = 2;
+	else
+	if (s[0] < 0xf0)
+	{
+		n = 3;
+		if (s[0] == 0xe0)
+			lo = 0xa0;
+		else
+		if (s[0] == 0xed)
+			hi = 0x9f;
+	}
+	else
+	if (s[0] < 0xf5)
+	{
+		n = 4;
+		if (s[0] == 0xf0)
+			lo = 0x90;
+		else
+		if (s[0] == 0xf4)
+			hi = 0x8f;
+	}
+	else
+		return 0;
+	if (len < n || s[1] < lo || s[1] > hi)
+		return 0;
+	for (size_t i = 2; i < n; ++i)
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+	return n;
+}
+
+// Invalid UTF-8 is counted as an error, and each bad byte replaced with U+FFFD, so the output is still valid JSON
+static
+bool jw_string(struct fabd_json_writer * const w, const char * const s, const size_t len, int * const errcount)
+{
+	// Worst case, every byte becomes \u00XX
+	if (!jw_reserve(w, 2 + (len * 6)))
+		return false;
+	char *out = &w->buf[w->len];
+	*(out++) = '"';
+	for (size_t i = 0; i < len; ++i)
+	{
+		const uint8_t c = s[i];
+		switch (c)
+		{
+			case '"':  *(out++) = '\\'; *(out++) = '"'; break;
+			case '\\': *(out++) = '\\'; *(out++) = '\\'; break;
+			case '\n': *(out++) = '\\'; *(out++) = 'n'; break;
+			case '\r': *(out++) = '\\'; *(out++) = 'r'; break;
+			case '\t': *(out++) = '\\'; *(out++) = 't'; break;
+			default:
+				if (c < 0x20)
+				{
+					static const char hexdigits[] = "0123456789abcdef";
+					memcpy(out, "\\u00", 4);
+					out[4] = hexdigits[c >> 4];
+					out[5] = hexdigits[c & 0xf];
+					out += 6;
+				}
+				else
+				if (c < 0x80)
+					*(out++) = c;
+				else
+				{
+					const size_t n = jw_utf8_seqlen((const uint8_t *)&s[i], len - i);
+					if (n)
+					{
+						memcpy(out, &s[i], n);
+						out += n;
+						i += n - 1;
+					}
+					else
+					{
+						memcpy(out, "\xef\xbf\xbd", 3);
+						out += 3;
+						++*errcount;
+					}
+				}
+		}
+	}
+	*(out++) = '"';
+	*out = '\0';
+	w->len = out - w->buf;
+	return true;
+}
+
+static
+bool jw_real(struct fabd_json_writer * const w, const double d, const int digits)
+{
+	if (!isfinite(d))
+		// JSON has no representation for these
+		return jw_write(w, "null", 4);
+	return jw_printf(w, "%.*g", digits, d);
+}
+
+static bool jw_message(struct fabd_json_writer *, const struct pbjson_plan *, const void *pb, int *errcount);
+
+// Writes one element, and advances *addr_p past it
+static
+bool jw_elem(struct fabd_json_writer * const w, const struct pbjson_field * const f, const void ** const addr_p, int * const errcount)
+{
+	const void * const addr = *addr_p;
+	*addr_p += f->elem_sz;
+	switch (f->pbfield->type)
+	{
+		case PROTOBUF_C_TYPE_INT32:
+		case PROTOBUF_C_TYPE_SINT32:
+		case PROTOBUF_C_TYPE_SFIXED32:
+			return jw_printf(w, "%" PRId32, *(const int32_t *)addr);
+		case PROTOBUF_C_TYPE_INT64:
+		case PROTOBUF_C_TYPE_SINT64:
+		case PROTOBUF_C_TYPE_SFIXED64:
+			return jw_printf(w, "%" PRId64, *(const int64_t *)addr);
+		case PROTOBUF_C_TYPE_UINT32:
+		case PROTOBUF_C_TYPE_FIXED32:
+			return jw_printf(w, "%" PRIu32, *(const uint32_t *)addr);
+		case PROTOBUF_C_TYPE_UINT64:
+		case PROTOBUF_C_TYPE_FIXED64:
+			return jw_printf(w, "%" PRIu64, *(const uint64_t *)addr);
+		case PROTOBUF_C_TYPE_FLOAT:
+			return jw_real(w, *(const float *)addr, 9);
+		case PROTOBUF_C_TYPE_DOUBLE:
+			return jw_real(w, *(const double *)addr, 17);
+		case PROTOBUF_C_TYPE_BOOL:
+			return (*(const protobuf_c_boolean *)addr) ? jw_write(w, "true", 4) : jw_write(w, "false", 5);
+		case PROTOBUF_C_TYPE_ENUM:
+		{
+			const int n = *(const int *)addr;
+			const ProtobufCEnumValue * const enumv = protobuf_c_enum_descriptor_get_value(f->pbfield->descriptor, n);
+			if (enumv)
+				return jw_string(w, enumv->name, strlen(enumv->name), errcount);
+			return jw_printf(w, "%d", n);
+		}
+		case PROTOBUF_C_TYPE_STRING:
+		{
+			const char * const s = *(char * const *)addr;
+			if (!s)
+				return jw_write(w, "null", 4);
+			return jw_string(w, s, strlen(s), errcount);
+		}
+		case PROTOBUF_C_TYPE_BYTES:
+		{
+			const ProtobufCBinaryData * const p = addr;
+			if (!jw_reserve(w, (p->len * 2) + 2))
+				return false;
+			w->buf[w->len++] = '"';
+			bin2hex(&w->buf[w->len], p->data, p->len);
+			w->len += p->len * 2;
+			w->buf[w->len++] = '"';
+			w->buf[w->len] = '\0';
+			return true;
+		}
+		case PROTOBUF_C_TYPE_MESSAGE:
+		{
+			const void * const msg = *(void * const *)addr;
+			const struct pbjson_plan * const subplan = msg ? pbjson_field_subplan(f) : NULL;
+			if (!subplan)
+			{
+				if (msg)
+					++*errcount;
+				return jw_write(w, "null", 4);
+			}
+			return jw_message(w, subplan, msg, errcount);
+		}
+	}
+	++*errcount;
+	return jw_write(w, "null", 4);
+}
+
+static
+bool jw_message(struct fabd_json_writer * const w, const struct pbjson_plan * const plan, const void * const pb, int * const errcount)
+{
+	const ProtobufCMessageDescriptor * const des = plan->des;
+	bool first = true;
+	if (!jw_write(w, "{", 1))
+		return false;
+	++w->depth;
+	for (unsigned i = 0; i < des->n_fields; ++i)
+	{
+		const struct pbjson_field * const f = &plan->fields[i];
+		const ProtobufCFieldDescriptor * const pbfield = f->pbfield;
+		const void *addr = pb + pbfield->offset;
+		size_t n = 1;
+		if (pbfield->label == PROTOBUF_C_LABEL_REPEATED)
+		{
+			n = *(const size_t *)(pb + pbfield->quantifier_offset);
+			addr = *(void * const *)addr;
+			if (!n)
+				continue;
+		}
+		else
+		if (pb_is_optional_and_missing(pbfield, (void *)pb))
+			continue;
+		
+		if (!((first || jw_write(w, ",", 1)) && jw_newline(w) && jw_string(w, pbfield->name, f->namelen, errcount) && jw_write(w, w->pretty ? ": " : ":", w->pretty ? 2 : 1)))
+			return false;
+		first = false;
+		if (pbfield->label == PROTOBUF_C_LABEL_REPEATED)
+		{
+			if (!jw_write(w, "[", 1))
+				return false;
+			for (size_t j = 0; j < n; ++j)
+				if (!((j == 0 || jw_write(w, w->pretty ? ", " : ",", w->pretty ? 2 : 1)) && jw_elem(w, f, &addr, errcount)))
+					return false;
+			if (!jw_write(w, "]", 1))
+				return false;
+		}
+		else
+		if (!jw_elem(w, f, &addr, errcount))
+			return false;
+	}
+	--w->depth;
+	if (!(first || jw_newline(w)))
+		return false;
+	return jw_write(w, "}", 1);
+}
+
+bool protobuf_to_json_write(struct fabd_json_writer * const w, const void * const _pb, int * const errcount)
+{
+	const ProtobufCMessage * const pb = _pb;
+	const struct pbjson_plan * const plan = pbjson_plan_get(pb->descriptor);
+	const unsigned depth = w->depth;
+	if (plan && jw_message(w, plan, pb, errcount))
+		return true;
+	w->depth = depth;
+	++*errcount;
+	return false;
+}
+
+char *protobuf_to_json_str(const void * const pb, const bool pretty, int * const errcount)
+{
+	struct fabd_json_writer w;
+	fabd_json_writer_init(&w, pretty);
+	if (!protobuf_to_json_write(&w, pb, errcount))
+	{
+		fabd_json_writer_free(&w);
+		return NULL;
+	}
+	return w.buf;
+}
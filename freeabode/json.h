@@ -1,6 +1,9 @@
 #ifndef FABD_JSON_H
 #define FABD_JSON_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include <protobuf-c/protobuf-c.h>
 #include <jansson.h>
 
@@ -10,4 +13,18 @@ extern int fabd_json_as_int(const json_t *, int def);
 extern void *json_to_protobuf(const ProtobufCMessageDescriptor *, json_t *, int *errcount);
 extern json_t *protobuf_to_json(void *pb, int *errcount);
 
+struct fabd_json_writer {
+	char *buf;  // always null-terminated once anything is written
+	size_t len, sz;
+	bool pretty;
+	unsigned depth;
+};
+
+extern void fabd_json_writer_init(struct fabd_json_writer *, bool pretty);
+extern void fabd_json_writer_free(struct fabd_json_writer *);
+// Appends the message to the writer's buffer; set len to 0 to reuse it
+extern bool protobuf_to_json_write(struct fabd_json_writer *, const void *pb, int *errcount);
+// Returns a malloc'd string
+extern char *protobuf_to_json_str(const void *pb, bool pretty, int *errcount);
+
 #endif
@@ -1,35 +1,621 @@
 #include "config.h"
 
+#include <assert.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <strings.h>
+#include <sys/eventfd.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "logging.h"
+#include "util.h"
 
-void applog(const int loglevel, const char * const fmt, ...)
+// Callers only encode a binary record (format pointer plus raw arguments) into their own thread's ring.
+// A writer thread formats records from all rings in timestamp order, and writes them out in batches.
+
+#define APPLOG_RING_SIZE    0x4000
+#define APPLOG_MAX_RECORD   0x200
+#define APPLOG_MAX_SPEC     0x20
+#define APPLOG_LEVEL_PAD    0xff
+
+static const int applog_writer_interval_ms = 100;
+// Appended to messages that didn't fit
+static const char applog_truncated_mark[] = " [truncated]";
+
+int applog_level = LOG_DEBUG;
+
+struct applog_record {
+	uint16_t size;  // including this header, rounded up to 8 bytes
+	uint8_t level;
+	bool truncated;  // arguments didn't all fit
+	const char *fmt;
+	struct timespec ts;
+} __attribute__((aligned(8)));
+
+struct applog_ring {
+	uint8_t buf[APPLOG_RING_SIZE];
+	// Only the owning thread writes head, and only the writer thread writes tail
+	size_t head, tail;
+	unsigned long dropped;
+	bool dead;
+	struct applog_ring *next;
+};
+
+static pthread_once_t my_writer_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t my_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t my_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t my_ring_key;
+static __thread struct applog_ring *my_ring;
+static struct applog_ring *my_rings;
+static int my_wake_fd = -1;
+static const char *my_syslog_ident;
+
+enum applog_argkind {
+	AK_NONE,
+	AK_INT,
+	AK_LONG,
+	AK_LLONG,
+	AK_INTMAX,
+	AK_SIZE,
+	AK_PTRDIFF,
+	AK_DOUBLE,
+	AK_LDOUBLE,
+	AK_PTR,
+	AK_STR,
+};
+
+struct applog_spec {
+	const char *start, *end;
+	// '*' width and precision come first
+	enum applog_argkind args[3];
+	int n_args;
+};
+
+// Finds the next conversion; returns false at the end of the format
+static
+bool applog_next_spec(const char ** const pp, struct applog_spec * const spec)
+{
+	const char *p = *pp;
+	while (true)
+	{
+		p = strchr(p, '%');
+		if (!p)
+			return false;
+		if (p[1] != '%')
+			break;
+		p += 2;
+	}
+	spec->start = p++;
+	spec->n_args = 0;
+	while (strchr("-+ #0'", p[0]) && p[0])
+		++p;
+	for (int part = 0; part < 2; ++part)
+	{
+		if (part && p[0] != '.')
+			break;
+		if (part)
+			++p;
+		if (p[0] == '*')
+		{
+			spec->args[spec->n_args++] = AK_INT;
+			++p;
+		}
+		else
+			while (p[0] >= '0' && p[0] <= '9')
+				++p;
+	}
+	enum applog_argkind intkind = AK_INT;
+	bool ldouble = false;
+	switch (p[0])
+	{
+		case 'h':
+			p += (p[1] == 'h') ? 2 : 1;
+			break;
+		case 'l':
+			if (p[1] == 'l')
+			{
+				intkind = AK_LLONG;
+				p += 2;
+			}
+			else
+			{
+				intkind = AK_LONG;
+				++p;
+			}
+			break;
+		case 'j':
+			intkind = AK_INTMAX;
+			++p;
+			break;
+		case 'z':
+			intkind = AK_SIZE;
+			++p;
+			break;
+		case 't':
+			intkind = AK_PTRDIFF;
+			++p;
+			break;
+		case 'L':
+			ldouble = true;
+			++p;
+			break;
+	}
+	enum applog_argkind kind;
+	switch (p[0])
+	{
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+			kind = intkind;
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			kind = ldouble ? AK_LDOUBLE : AK_DOUBLE;
+			break;
+		case 's':
+			kind = AK_STR;
+			break;
+		case 'p':
+			kind = AK_PTR;
+			break;
+		default:
+			// Includes %n, which makes no sense for deferred formatting
+			kind = AK_NONE;
+	}
+	if (p[0])
+		++p;
+	spec->args[spec->n_args++] = kind;
+	spec->end = p;
+	*pp = p;
+	return true;
+}
+
+#define APPLOG_ENCODE(type, value)  do {  \
+	const type _v = (value);  \
+	if (len + sizeof(_v) > bufsz)  \
+	{  \
+		*truncated = true;  \
+		return len;  \
+	}  \
+	memcpy(&buf[len], &_v, sizeof(_v));  \
+	len += sizeof(_v);  \
+} while (0)
+
+static
+size_t applog_encode_args(uint8_t * const buf, const size_t bufsz, const char *fmt, va_list ap, bool * const truncated)
+{
+	size_t len = 0;
+	struct applog_spec spec;
+	while (applog_next_spec(&fmt, &spec))
+		for (int i = 0; i < spec.n_args; ++i)
+			switch (spec.args[i])
+			{
+				case AK_NONE:
+					break;
+				case AK_INT:     APPLOG_ENCODE(int, va_arg(ap, int)); break;
+				case AK_LONG:    APPLOG_ENCODE(long, va_arg(ap, long)); break;
+				case AK_LLONG:   APPLOG_ENCODE(long long, va_arg(ap, long long)); break;
+				case AK_INTMAX:  APPLOG_ENCODE(intmax_t, va_arg(ap, intmax_t)); break;
+				case AK_SIZE:    APPLOG_ENCODE(size_t, va_arg(ap, size_t)); break;
+				case AK_PTRDIFF: APPLOG_ENCODE(ptrdiff_t, va_arg(ap, ptrdiff_t)); break;
+				case AK_DOUBLE:  APPLOG_ENCODE(double, va_arg(ap, double)); break;
+				case AK_LDOUBLE: APPLOG_ENCODE(long double, va_arg(ap, long double)); break;
+				case AK_PTR:     APPLOG_ENCODE(void *, va_arg(ap, void *)); break;
+				case AK_STR:
+				{
+					// Copied, since the caller's string may not outlive the call
+					const char * const s = va_arg(ap, const char *) ?: "(null)";
+					const size_t slen = strlen(s);
+					if (len + sizeof(uint16_t) > bufsz)
+					{
+						*truncated = true;
+						return len;
+					}
+					const uint16_t cplen = fabd_min(slen, bufsz - len - sizeof(uint16_t));
+					if (cplen < slen)
+						*truncated = true;
+					memcpy(&buf[len], &cplen, sizeof(cplen));
+					len += sizeof(cplen);
+					memcpy(&buf[len], s, cplen);
+					len += cplen;
+					break;
+				}
+			}
+	return len;
+}
+
+#define APPLOG_DECODE(type)  ({  \
+	type _v = 0;  \
+	if (pos + sizeof(_v) <= datasz)  \
+		memcpy(&_v, &data[pos], sizeof(_v));  \
+	pos += sizeof(_v);  \
+	_v;  \
+})
+
+#define APPLOG_OUT(...)  do {  \
+	const int _rv = snprintf(&out[len], (len < outsz) ? (outsz - len) : 0, __VA_ARGS__);  \
+	if (_rv > 0)  \
+		len += _rv;  \
+} while (0)
+
+static
+size_t applog_format_record(char * const out, const size_t outsz, const char *fmt, const uint8_t * const data, const size_t datasz, bool * const truncated)
 {
-	struct timeval tv;
-	struct tm tm;
-	va_list ap, ap2;
-	
-	gettimeofday(&tv, NULL);
-	gmtime_r(&tv.tv_sec, &tm);
-	
+	size_t len = 0, pos = 0;
+	struct applog_spec spec;
+	const char *lit = fmt;
+	while (applog_next_spec(&fmt, &spec))
+	{
+		// Literal text, with %% unescaped
+		for (const char *p = lit; p < spec.start; ++p)
+		{
+			if (p[0] == '%')
+				++p;
+			if (len + 1 < outsz)
+				out[len] = p[0];
+			++len;
+		}
+		lit = spec.end;
+
+		char specstr[APPLOG_MAX_SPEC];
+		const size_t speclen = spec.end - spec.start;
+		if (speclen >= sizeof(specstr) || spec.args[spec.n_args - 1] == AK_NONE)
+			continue;
+		memcpy(specstr, spec.start, speclen);
+		specstr[speclen] = '\0';
+
+		int stars[2];
+		for (int i = 0; i < spec.n_args - 1; ++i)
+			stars[i] = APPLOG_DECODE(int);
+#define APPLOG_OUT_SPEC(value)  do {  \
+	switch (spec.n_args)  \
+	{  \
+		case 1: APPLOG_OUT(specstr, value); break;  \
+		case 2: APPLOG_OUT(specstr, stars[0], value); break;  \
+		case 3: APPLOG_OUT(specstr, stars[0], stars[1], value); break;  \
+	}  \
+} while (0)
+		switch (spec.args[spec.n_args - 1])
+		{
+			case AK_NONE:
+				break;
+			case AK_INT:     APPLOG_OUT_SPEC(APPLOG_DECODE(int)); break;
+			case AK_LONG:    APPLOG_OUT_SPEC(APPLOG_DECODE(long)); break;
+			case AK_LLONG:   APPLOG_OUT_SPEC(APPLOG_DECODE(long long)); break;
+			case AK_INTMAX:  APPLOG_OUT_SPEC(APPLOG_DECODE(intmax_t)); break;
+			case AK_SIZE:    APPLOG_OUT_SPEC(APPLOG_DECODE(size_t)); break;
+			case AK_PTRDIFF: APPLOG_OUT_SPEC(APPLOG_DECODE(ptrdiff_t)); break;
+			case AK_DOUBLE:  APPLOG_OUT_SPEC(APPLOG_DECODE(double)); break;
+			case AK_LDOUBLE: APPLOG_OUT_SPEC(APPLOG_DECODE(long double)); break;
+			case AK_PTR:     APPLOG_OUT_SPEC(APPLOG_DECODE(void *)); break;
+			case AK_STR:
+			{
+				uint16_t slen = APPLOG_DECODE(uint16_t);
+				if (pos > datasz)
+					slen = 0;
+				slen = fabd_min((size_t)slen, datasz - fabd_min(pos, datasz));
+				char s[slen + 1];
+				memcpy(s, &data[pos], slen);
+				s[slen] = '\0';
+				pos += slen;
+				APPLOG_OUT_SPEC(s);
+				break;
+			}
+		}
+#undef APPLOG_OUT_SPEC
+	}
+	for (const char *p = lit; p[0]; ++p)
+	{
+		if (p[0] == '%' && p[1] == '%')
+			++p;
+		if (len + 1 < outsz)
+			out[len] = p[0];
+		++len;
+	}
+	if (len >= outsz)
+	{
+		*truncated = true;
+		len = outsz - 1;
+	}
+	out[len] = '\0';
+	return len;
+}
+
+static
+size_t applog_mark_truncated(char * const msg, const size_t msgsz, size_t msglen)
+{
+	const size_t marklen = sizeof(applog_truncated_mark) - 1;
+	if (msglen + marklen >= msgsz)
+		msglen = msgsz - 1 - marklen;
+	memcpy(&msg[msglen], applog_truncated_mark, marklen + 1);
+	return msglen + marklen;
+}
+
+static
+void applog_emit(const int level, const struct timespec * const ts, const char * const msg, const size_t msglen, char * const batch, size_t * const batchlen, const size_t batchsz)
+{
+	if (my_syslog_ident)
+		syslog(level, "%s", msg);
+
+	// Only the writer formats timestamps, and the date part only changes once per second
+	static time_t prefix_sec = -1;
+	static char prefix[0x20];
+	static int prefix_datelen;
+	if (ts->tv_sec != prefix_sec)
+	{
+		struct tm tm;
+		gmtime_r(&ts->tv_sec, &tm);
+		prefix_datelen = snprintf(prefix, sizeof(prefix), "[%d-%02d-%02d %02d:%02d:%02d.", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+		prefix_sec = ts->tv_sec;
+	}
+	long usec = ts->tv_nsec / 1000;
+	for (int i = 5; i >= 0; --i, usec /= 10)
+		prefix[prefix_datelen + i] = '0' + (usec % 10);
+	prefix[prefix_datelen + 6] = ']';
+	prefix[prefix_datelen + 7] = ' ';
+	const int prefixlen = prefix_datelen + 8;
+	if (*batchlen + prefixlen + msglen + 1 > batchsz)
+	{
+		fwrite(batch, *batchlen, 1, stderr);
+		*batchlen = 0;
+	}
+	memcpy(&batch[*batchlen], prefix, prefixlen);
+	*batchlen += prefixlen;
+	memcpy(&batch[*batchlen], msg, msglen);
+	*batchlen += msglen;
+	batch[(*batchlen)++] = '\n';
+}
+
+static
+const struct applog_record *applog_ring_peek(struct applog_ring * const ring)
+{
+	while (true)
+	{
+		const size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (ring->tail == head)
+			return NULL;
+		const struct applog_record * const rec = (void*)&ring->buf[ring->tail % APPLOG_RING_SIZE];
+		if (rec->level != APPLOG_LEVEL_PAD)
+			return rec;
+		__atomic_store_n(&ring->tail, ring->tail + rec->size, __ATOMIC_RELEASE);
+	}
+}
+
+static
+bool applog_ts_before(const struct timespec * const a, const struct timespec * const b)
+{
+	return (a->tv_sec < b->tv_sec) || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Formats and writes everything queued so far, oldest first across all threads
+static
+void applog_drain(void)
+{
+	static char batch[0x4000], msg[APPLOG_MAX_RECORD * 2];
+	size_t batchlen = 0;
+
+	pthread_mutex_lock(&my_drain_mutex);
+	pthread_mutex_lock(&my_rings_mutex);
+	struct applog_ring *rings = my_rings;
+	pthread_mutex_unlock(&my_rings_mutex);
+
+	while (true)
+	{
+		struct applog_ring *best_ring = NULL;
+		const struct applog_record *best = NULL;
+		for (struct applog_ring *ring = rings; ring; ring = ring->next)
+		{
+			const struct applog_record * const rec = applog_ring_peek(ring);
+			if (rec && !(best && applog_ts_before(&best->ts, &rec->ts)))
+			{
+				best = rec;
+				best_ring = ring;
+			}
+		}
+		if (!best)
+			break;
+
+		bool truncated = best->truncated;
+		size_t msglen = applog_format_record(msg, sizeof(msg), best->fmt, (const uint8_t *)&best[1], best->size - sizeof(*best), &truncated);
+		if (truncated)
+			msglen = applog_mark_truncated(msg, sizeof(msg), msglen);
+		applog_emit(best->level, &best->ts, msg, msglen, batch, &batchlen, sizeof(batch));
+		__atomic_store_n(&best_ring->tail, best_ring->tail + best->size, __ATOMIC_RELEASE);
+	}
+
+	for (struct applog_ring *ring = rings; ring; ring = ring->next)
+	{
+		const unsigned long dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+		if (!dropped)
+			continue;
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		const int msglen = snprintf(msg, sizeof(msg), "(%lu log messages dropped)", dropped);
+		applog_emit(LOG_WARNING, &ts, msg, msglen, batch, &batchlen, sizeof(batch));
+	}
+
+	if (batchlen)
+	{
+		fwrite(batch, batchlen, 1, stderr);
+		fflush(stderr);
+	}
+	pthread_mutex_unlock(&my_drain_mutex);
+}
+
+// Rings of exited threads are only freed here, once empty, so draining never races with this
+static
+void applog_reap_rings(void)
+{
+	pthread_mutex_lock(&my_drain_mutex);
+	pthread_mutex_lock(&my_rings_mutex);
+	for (struct applog_ring **pp = &my_rings; *pp; )
+	{
+		struct applog_ring * const ring = *pp;
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) && !applog_ring_peek(ring) && !ring->dropped)
+		{
+			*pp = ring->next;
+			free(ring);
+		}
+		else
+			pp = &ring->next;
+	}
+	pthread_mutex_unlock(&my_rings_mutex);
+	pthread_mutex_unlock(&my_drain_mutex);
+}
+
+static
+void *applog_writer_thread(void * const userp)
+{
+	struct pollfd pfd = { .fd = my_wake_fd, .events = POLLIN, };
+	uint64_t n;
+	while (true)
+	{
+		if (poll(&pfd, 1, applog_writer_interval_ms) > 0 && read(my_wake_fd, &n, sizeof(n)) < 0)
+		{}
+		applog_drain();
+		applog_reap_rings();
+	}
+	return NULL;
+}
+
+static
+void applog_thread_exit(void * const p)
+{
+	struct applog_ring * const ring = p;
+	__atomic_store_n(&ring->dead, true, __ATOMIC_RELEASE);
+}
+
+static
+void applog_writer_start(void)
+{
+	my_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	assert(my_wake_fd >= 0);
+	const int rv = pthread_key_create(&my_ring_key, applog_thread_exit);
+	assert(!rv);
+	atexit(applog_flush);
+
+	// The writer shouldn't receive signals meant for the process
+	sigset_t sigs, oldsigs;
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_SETMASK, &sigs, &oldsigs);
+	pthread_t pth;
+	if (!pthread_create(&pth, NULL, applog_writer_thread, NULL))
+		pthread_detach(pth);
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+}
+
+static
+struct applog_ring *applog_my_ring(void)
+{
+	if (my_ring)
+		return my_ring;
+	pthread_once(&my_writer_once, applog_writer_start);
+	struct applog_ring * const ring = calloc(1, sizeof(*ring));
+	assert(ring);
+	pthread_setspecific(my_ring_key, ring);
+	pthread_mutex_lock(&my_rings_mutex);
+	ring->next = my_rings;
+	my_rings = ring;
+	pthread_mutex_unlock(&my_rings_mutex);
+	my_ring = ring;
+	return ring;
+}
+
+static
+void applog_wake_writer(void)
+{
+	const uint64_t one = 1;
+	if (write(my_wake_fd, &one, sizeof(one)) < 0)
+	{}
+}
+
+void applog_flush(void)
+{
+	if (my_wake_fd >= 0)
+		applog_drain();
+}
+
+void applog_(const int loglevel, const char * const fmt, ...)
+{
+	uint8_t recbuf[APPLOG_MAX_RECORD] __attribute__((aligned(8)));
+	struct applog_record * const rec = (void*)recbuf;
+	bool truncated = false;
+	va_list ap;
 	va_start(ap, fmt);
-	va_copy(ap2, ap);
-	int sz = vsnprintf(NULL, 0, fmt, ap2);
-	va_end(ap2);
-	
-	char buf[0x20 + sz + 1];
-	int len = snprintf(buf, sizeof(buf), "[%d-%02d-%02d %02d:%02d:%02d.%06ld] ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (long)tv.tv_usec);
-	len += vsnprintf(&buf[len], sizeof(buf)-len, fmt, ap);
+	const size_t datasz = applog_encode_args(&recbuf[sizeof(*rec)], sizeof(recbuf) - sizeof(*rec), fmt, ap, &truncated);
 	va_end(ap);
-	
-	strcpy(&buf[len], "\n");
-	++len;
-	
-	fwrite(buf, len, 1, stderr);
-	fflush(stderr);
+	rec->size = (sizeof(*rec) + datasz + 7) & ~(size_t)7;
+	rec->level = loglevel;
+	rec->truncated = truncated;
+	rec->fmt = fmt;
+	clock_gettime(CLOCK_REALTIME, &rec->ts);
+
+	struct applog_ring * const ring = applog_my_ring();
+	size_t head = ring->head;
+	const size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	// Records never wrap; pad out the end of the buffer instead
+	const size_t to_end = APPLOG_RING_SIZE - (head % APPLOG_RING_SIZE);
+	const size_t needed = rec->size + ((to_end < rec->size) ? to_end : 0);
+	if (head + needed - tail > APPLOG_RING_SIZE)
+	{
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (to_end < rec->size)
+	{
+		struct applog_record * const pad = (void*)&ring->buf[head % APPLOG_RING_SIZE];
+		pad->size = to_end;
+		pad->level = APPLOG_LEVEL_PAD;
+		head += to_end;
+	}
+	memcpy(&ring->buf[head % APPLOG_RING_SIZE], recbuf, rec->size);
+	__atomic_store_n(&ring->head, head + rec->size, __ATOMIC_RELEASE);
+
+	if (loglevel <= LOG_ERR)
+		// Errors are often followed by an assert or abort, which skips atexit, so don't leave it queued
+		applog_drain();
+	else
+	if (head + rec->size - tail > APPLOG_RING_SIZE / 2)
+		applog_wake_writer();
+}
+
+void applog_set_level(const int loglevel)
+{
+	// Changed by the config reload thread, while others are logging
+	__atomic_store_n(&applog_level, loglevel, __ATOMIC_RELAXED);
+}
+
+int applog_level_from_str(const char * const s)
+{
+	static const char * const names[] = {
+		[LOG_EMERG] = "emerg",
+		[LOG_ALERT] = "alert",
+		[LOG_CRIT] = "crit",
+		[LOG_ERR] = "err",
+		[LOG_WARNING] = "warning",
+		[LOG_NOTICE] = "notice",
+		[LOG_INFO] = "info",
+		[LOG_DEBUG] = "debug",
+	};
+	for (int i = 0; i < sizeof(names) / sizeof(*names); ++i)
+		if (!strcasecmp(s, names[i]))
+			return i;
+	if (!strcasecmp(s, "error"))
+		return LOG_ERR;
+	if (!strcasecmp(s, "warn"))
+		return LOG_WARNING;
+	return -1;
+}
+
+void applog_use_syslog(const char * const ident)
+{
+	openlog(ident, LOG_PID, LOG_DAEMON);
+	my_syslog_ident = ident;
 }
@@ -1,9 +1,41 @@
 #ifndef FABD_LOGGING_H
 #define FABD_LOGGING_H
 
+#include <stdbool.h>
 #include <syslog.h>
 
+// Messages are queued per thread, and formatted and written by a background thread.
+// Only format strings that outlive the process may be used (ie, string literals).
+
+// Messages less severe than this are compiled out entirely
+#ifndef APPLOG_MAX_LEVEL
+#define APPLOG_MAX_LEVEL  LOG_DEBUG
+#endif
+
+extern int applog_level;
+
+static inline
+bool applog_enabled(const int loglevel)
+{
+	return loglevel <= APPLOG_MAX_LEVEL && loglevel <= __atomic_load_n(&applog_level, __ATOMIC_RELAXED);
+}
+
 __attribute__((format(printf, 2, 3)))
-extern void applog(int loglevel, const char *fmt, ...);
+extern void applog_(int loglevel, const char *fmt, ...);
+
+// Arguments are only evaluated if the level is enabled
+#define applog(loglevel, ...)  do {  \
+	if (applog_enabled(loglevel))  \
+		applog_(loglevel, __VA_ARGS__);  \
+} while (0)
+
+// Messages less severe than this are discarded before any formatting
+extern void applog_set_level(int loglevel);
+// Accepts syslog priority names ("err", "warning", "info", "debug", etc); returns -1 if unknown
+extern int applog_level_from_str(const char *);
+// Also send messages to syslog (and thereby the journal)
+extern void applog_use_syslog(const char *ident);
+// Writes out everything queued so far
+extern void applog_flush(void);
 
 #endif
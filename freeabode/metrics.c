@@ -0,0 +1,487 @@
+#include "config.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zmq.h>
+#include <zmq_utils.h>
+
+#include <freeabode/fabdcfg.h>
+#include <freeabode/freeabode.pb-c.h>
+#include <freeabode/logging.h>
+#include <freeabode/security.h>
+#include <freeabode/util.h>
+
+#include "metrics.h"
+
+// Counters are split across cache lines, so threads rarely contend on one
+#define FABD_METRICS_SHARDS  8
+#define FABD_CACHELINE  0x40
+
+static const int int_zero = 0;
+
+struct fabd_metric_shard {
+	uint64_t value;
+} __attribute__((aligned(FABD_CACHELINE)));
+
+struct fabd_metric {
+	struct fabd_metric_shard shards[FABD_METRICS_SHARDS];
+	struct fabd_metric *next;
+	char *name;
+	char *labels;
+	char *help;
+	enum fabd_metric_type type;
+	bool external;
+	
+	int64_t gauge;
+	const uint64_t *ext_value;
+	
+	unsigned n_bounds;
+	uint32_t *bounds;
+	// Point at the fields below, unless external
+	uint64_t *buckets;
+	const uint64_t *sum_p;
+	const uint64_t *count_p;
+	uint64_t sum;
+	uint64_t count;
+};
+
+static pthread_mutex_t my_metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Metrics with the same name are kept together, so they share HELP and TYPE lines
+static struct fabd_metric *my_metrics;
+
+static unsigned my_next_shard;
+static __thread unsigned my_shard_plus1;
+
+static
+unsigned fabd_metrics_shard(void)
+{
+	if (!my_shard_plus1)
+		my_shard_plus1 = (__atomic_fetch_add(&my_next_shard, 1, __ATOMIC_RELAXED) % FABD_METRICS_SHARDS) + 1;
+	return my_shard_plus1 - 1;
+}
+
+static
+bool fabd_metric_matches(const struct fabd_metric * const m, const char * const name, const char * const labels)
+{
+	return !strcmp(m->name, name) && !strcmp(m->labels, labels ?: "");
+}
+
+static
+struct fabd_metric *fabd_metric_new(const char * const name, const char * const labels, const char * const help, const enum fabd_metric_type type)
+{
+	struct fabd_metric *m;
+	const int rv = posix_memalign((void**)&m, FABD_CACHELINE, sizeof(*m));
+	assert(!rv);
+	*m = (struct fabd_metric){
+		.name = strdup(name),
+		.labels = strdup(labels ?: ""),
+		.help = strdup(help ?: ""),
+		.type = type,
+	};
+	return m;
+}
+
+static
+void fabd_metric_free(struct fabd_metric * const m)
+{
+	free(m->name);
+	free(m->labels);
+	free(m->help);
+	free(m->bounds);
+	if (!m->external)
+		free(m->buckets);
+	free(m);
+}
+
+// Takes ownership of m; returns the metric actually registered
+static
+struct fabd_metric *fabd_metric_register(struct fabd_metric * const m)
+{
+	pthread_mutex_lock(&my_metrics_mutex);
+	struct fabd_metric **insert_at = &my_metrics;
+	bool seen_name = false;
+	for (struct fabd_metric **mp = &my_metrics; *mp; mp = &(*mp)->next)
+	{
+		struct fabd_metric * const other = *mp;
+		if (fabd_metric_matches(other, m->name, m->labels))
+		{
+			if (!(m->external || other->external))
+			{
+				pthread_mutex_unlock(&my_metrics_mutex);
+				if (other->type != m->type)
+					applog(LOG_WARNING, "Metric %s{%s} registered again with a different type", m->name, m->labels);
+				fabd_metric_free(m);
+				return other;
+			}
+			// Different storage can't be shared, and exporting both would duplicate the series
+			pthread_mutex_unlock(&my_metrics_mutex);
+			applog(LOG_WARNING, "Metric %s{%s} already registered elsewhere; not exporting it again", m->name, m->labels);
+			if (m->external)
+			{
+				fabd_metric_free(m);
+				return NULL;
+			}
+			// Still usable (and unregistrable), just never read
+			return m;
+		}
+		if (!strcmp(other->name, m->name))
+		{
+			seen_name = true;
+			insert_at = &other->next;
+		}
+		else
+		if (!seen_name)
+			insert_at = &other->next;
+	}
+	m->next = *insert_at;
+	*insert_at = m;
+	pthread_mutex_unlock(&my_metrics_mutex);
+	return m;
+}
+
+struct fabd_metric *fabd_metric_counter(const char * const name, const char * const labels, const char * const help)
+{
+	return fabd_metric_register(fabd_metric_new(name, labels, help, FMT_COUNTER));
+}
+
+struct fabd_metric *fabd_metric_gauge(const char * const name, const char * const labels, const char * const help)
+{
+	return fabd_metric_register(fabd_metric_new(name, labels, help, FMT_GAUGE));
+}
+
+static
+void fabd_metric_set_bounds(struct fabd_metric * const m, const uint32_t * const bounds, const unsigned n_bounds)
+{
+	m->n_bounds = n_bounds;
+	m->bounds = malloc(sizeof(*m->bounds) * (n_bounds ?: 1));
+	assert(m->bounds);
+	memcpy(m->bounds, bounds, sizeof(*m->bounds) * n_bounds);
+}
+
+struct fabd_metric *fabd_metric_histogram(const char * const name, const char * const labels, const char * const help, const uint32_t * const bounds, const unsigned n_bounds)
+{
+	struct fabd_metric * const m = fabd_metric_new(name, labels, help, FMT_HISTOGRAM);
+	fabd_metric_set_bounds(m, bounds, n_bounds);
+	m->buckets = calloc(n_bounds + 1, sizeof(*m->buckets));
+	assert(m->buckets);
+	m->sum_p = &m->sum;
+	m->count_p = &m->count;
+	return fabd_metric_register(m);
+}
+
+struct fabd_metric *fabd_metric_counter_external(const char * const name, const char * const labels, const char * const help, const uint64_t * const value)
+{
+	struct fabd_metric * const m = fabd_metric_new(name, labels, help, FMT_COUNTER);
+	m->external = true;
+	m->ext_value = value;
+	return fabd_metric_register(m);
+}
+
+struct fabd_metric *fabd_metric_histogram_external(const char * const name, const char * const labels, const char * const help, const uint32_t * const bounds, const unsigned n_bounds, const uint64_t * const buckets, const uint64_t * const sum, const uint64_t * const count)
+{
+	struct fabd_metric * const m = fabd_metric_new(name, labels, help, FMT_HISTOGRAM);
+	m->external = true;
+	fabd_metric_set_bounds(m, bounds, n_bounds);
+	// Never written through
+	m->buckets = (uint64_t *)buckets;
+	m->sum_p = sum;
+	m->count_p = count;
+	return fabd_metric_register(m);
+}
+
+void fabd_metric_unregister(struct fabd_metric * const m)
+{
+	if (!m)
+		return;
+	pthread_mutex_lock(&my_metrics_mutex);
+	for (struct fabd_metric **mp = &my_metrics; *mp; mp = &(*mp)->next)
+	{
+		if (*mp != m)
+			continue;
+		*mp = m->next;
+		break;
+	}
+	pthread_mutex_unlock(&my_metrics_mutex);
+	fabd_metric_free(m);
+}
+
+void fabd_metric_add(struct fabd_metric * const m, const uint64_t n)
+{
+	__atomic_add_fetch(&m->shards[fabd_metrics_shard()].value, n, __ATOMIC_RELAXED);
+}
+
+void fabd_metric_set(struct fabd_metric * const m, const int64_t value)
+{
+	__atomic_store_n(&m->gauge, value, __ATOMIC_RELAXED);
+}
+
+void fabd_metric_observe(struct fabd_metric * const m, const uint64_t value)
+{
+	// External histograms are only ever read; their owner updates them
+	assert(!m->external);
+	unsigned i;
+	for (i = 0; i < m->n_bounds; ++i)
+		if (value < m->bounds[i])
+			break;
+	__atomic_add_fetch(&m->buckets[i], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->sum, value, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->count, 1, __ATOMIC_RELAXED);
+}
+
+static
+int64_t fabd_metric_value(const struct fabd_metric * const m)
+{
+	if (m->type == FMT_GAUGE)
+		return __atomic_load_n(&m->gauge, __ATOMIC_RELAXED);
+	if (m->external)
+		return __atomic_load_n(m->ext_value, __ATOMIC_RELAXED);
+	uint64_t total = 0;
+	for (int i = 0; i < FABD_METRICS_SHARDS; ++i)
+		total += __atomic_load_n(&m->shards[i].value, __ATOMIC_RELAXED);
+	return total;
+}
+
+static
+uint64_t fabd_metric_count(const struct fabd_metric * const m)
+{
+	if (m->count_p)
+		return __atomic_load_n(m->count_p, __ATOMIC_RELAXED);
+	uint64_t total = 0;
+	for (unsigned i = 0; i <= m->n_bounds; ++i)
+		total += __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+	return total;
+}
+
+static const char * const fabd_metric_type_names[] = {
+	[FMT_COUNTER] = "counter",
+	[FMT_GAUGE] = "gauge",
+	[FMT_HISTOGRAM] = "histogram",
+};
+
+// Labels come preformatted, so values may hold anything; a quote only ends one if followed by the end, or the next name="
+static
+bool fabd_metric_label_value_ends(const char * const p)
+{
+	if (!p[1])
+		return true;
+	if (p[1] != ',')
+		return false;
+	const char *q = &p[2];
+	while (isalnum((unsigned char)q[0]) || q[0] == '_')
+		++q;
+	return q > &p[2] && q[0] == '=' && q[1] == '"';
+}
+
+static
+void fabd_metric_write_labels(FILE * const f, const char * const labels)
+{
+	bool in_value = false;
+	for (const char *p = labels; p[0]; ++p)
+	{
+		if (!in_value)
+		{
+			fputc(p[0], f);
+			if (p[0] == '"')
+				in_value = true;
+			continue;
+		}
+		switch (p[0])
+		{
+			case '"':
+				if (fabd_metric_label_value_ends(p))
+				{
+					fputc('"', f);
+					in_value = false;
+				}
+				else
+					fputs("\\\"", f);
+				break;
+			case '\\':
+				fputs("\\\\", f);
+				break;
+			case '\n':
+				fputs("\\n", f);
+				break;
+			default:
+				fputc(p[0], f);
+		}
+	}
+}
+
+static
+void fabd_metric_write_series(FILE * const f, const struct fabd_metric * const m, const char * const suffix)
+{
+	fprintf(f, "%s%s", m->name, suffix);
+	if (!m->labels[0])
+		return;
+	fputc('{', f);
+	fabd_metric_write_labels(f, m->labels);
+	fputc('}', f);
+}
+
+static
+void fabd_metric_write_bucket(FILE * const f, const struct fabd_metric * const m, const char * const le, const uint64_t cumulative)
+{
+	fprintf(f, "%s_bucket{", m->name);
+	if (m->labels[0])
+	{
+		fabd_metric_write_labels(f, m->labels);
+		fputc(',', f);
+	}
+	fprintf(f, "le=\"%s\"} %llu\n", le, (unsigned long long)cumulative);
+}
+
+char *fabd_metrics_prometheus(void)
+{
+	char *buf = NULL;
+	size_t bufsz = 0;
+	FILE * const f = open_memstream(&buf, &bufsz);
+	assert(f);
+	
+	pthread_mutex_lock(&my_metrics_mutex);
+	const char *last_name = NULL;
+	for (const struct fabd_metric *m = my_metrics; m; m = m->next)
+	{
+		if (!(last_name && !strcmp(last_name, m->name)))
+		{
+			if (m->help[0])
+				fprintf(f, "# HELP %s %s\n", m->name, m->help);
+			fprintf(f, "# TYPE %s %s\n", m->name, fabd_metric_type_names[m->type]);
+			last_name = m->name;
+		}
+		if (m->type != FMT_HISTOGRAM)
+		{
+			fabd_metric_write_series(f, m, "");
+			fprintf(f, " %lld\n", (long long)fabd_metric_value(m));
+			continue;
+		}
+		uint64_t cumulative = 0;
+		for (unsigned i = 0; i < m->n_bounds; ++i)
+		{
+			char le[0x10];
+			snprintf(le, sizeof(le), "%lu", (unsigned long)m->bounds[i]);
+			cumulative += __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+			fabd_metric_write_bucket(f, m, le, cumulative);
+		}
+		cumulative += __atomic_load_n(&m->buckets[m->n_bounds], __ATOMIC_RELAXED);
+		fabd_metric_write_bucket(f, m, "+Inf", cumulative);
+		if (m->sum_p)
+		{
+			fabd_metric_write_series(f, m, "_sum");
+			fprintf(f, " %llu\n", (unsigned long long)__atomic_load_n(m->sum_p, __ATOMIC_RELAXED));
+		}
+		// Counted separately from the buckets, so may be slightly off from the +Inf bucket while updates are in progress
+		fabd_metric_write_series(f, m, "_count");
+		fprintf(f, " %llu\n", (unsigned long long)fabd_metric_count(m));
+	}
+	pthread_mutex_unlock(&my_metrics_mutex);
+	
+	fclose(f);
+	return buf;
+}
+
+static
+void fabd_metrics_send_pb(void * const s)
+{
+	pthread_mutex_lock(&my_metrics_mutex);
+	size_t n = 0, n_buckets = 0;
+	for (const struct fabd_metric *m = my_metrics; m; m = m->next)
+	{
+		++n;
+		if (m->type == FMT_HISTOGRAM)
+			n_buckets += (m->n_bounds * 2) + 1;
+	}
+	PbMetric pbmetrics[n ?: 1], *pbmetric_ptrs[n ?: 1];
+	uint64_t * const bucket_data = malloc(sizeof(*bucket_data) * (n_buckets ?: 1));
+	assert(bucket_data);
+	uint64_t *next_bucket = bucket_data;
+	size_t i = 0;
+	for (const struct fabd_metric *m = my_metrics; m; m = m->next, ++i)
+	{
+		PbMetric * const pbm = &pbmetrics[i];
+		pbmetric_ptrs[i] = pbm;
+		pb_metric__init(pbm);
+		pbm->name = m->name;
+		pbm->labels = m->labels[0] ? m->labels : NULL;
+		pbm->type = (m->type == FMT_COUNTER) ? PB_METRIC_TYPE__Counter : ((m->type == FMT_GAUGE) ? PB_METRIC_TYPE__Gauge : PB_METRIC_TYPE__Histogram);
+		if (m->type != FMT_HISTOGRAM)
+		{
+			pbm->has_value = true;
+			pbm->value = fabd_metric_value(m);
+			continue;
+		}
+		pbm->n_bucket_bounds = m->n_bounds;
+		pbm->bucket_bounds = next_bucket;
+		for (unsigned j = 0; j < m->n_bounds; ++j)
+			*(next_bucket++) = m->bounds[j];
+		pbm->n_buckets = m->n_bounds + 1;
+		pbm->buckets = next_bucket;
+		for (unsigned j = 0; j <= m->n_bounds; ++j)
+			*(next_bucket++) = __atomic_load_n(&m->buckets[j], __ATOMIC_RELAXED);
+		if (m->sum_p)
+		{
+			pbm->has_sum = true;
+			pbm->sum = __atomic_load_n(m->sum_p, __ATOMIC_RELAXED);
+		}
+		pbm->has_count = true;
+		pbm->count = fabd_metric_count(m);
+	}
+	
+	PbMetrics reply = PB_METRICS__INIT;
+	reply.n_metric = n;
+	reply.metric = pbmetric_ptrs;
+	zmq_send_protobuf(s, pb_metrics, &reply, 0);
+	pthread_mutex_unlock(&my_metrics_mutex);
+	free(bucket_data);
+}
+
+static
+void fabd_metrics_thread(void * const s)
+{
+	static const char prometheus_req[] = "prometheus";
+	zmq_msg_t msg;
+	assert(!zmq_msg_init(&msg));
+	while (true)
+	{
+		if (zmq_msg_recv(&msg, s, 0) < 0)
+		{
+			if (errno == ETERM)
+				break;
+			continue;
+		}
+		if (zmq_msg_size(&msg) == sizeof(prometheus_req) - 1 && !memcmp(zmq_msg_data(&msg), prometheus_req, sizeof(prometheus_req) - 1))
+		{
+			char * const text = fabd_metrics_prometheus();
+			zmq_send(s, text, strlen(text), 0);
+			free(text);
+		}
+		else
+			fabd_metrics_send_pb(s);
+	}
+	zmq_msg_close(&msg);
+	zmq_close(s);
+}
+
+void fabd_metrics_serve(void * const ctx, const char * const devid)
+{
+	void * const s = zmq_socket(ctx, ZMQ_REP);
+	assert(s);
+	zmq_setsockopt(s, ZMQ_LINGER, &int_zero, sizeof(int_zero));
+	freeabode_zmq_security(s, true);
+	if (!fabdcfg_zmq_bind(devid, "metrics", s))
+	{
+		// Not configured, or failed to bind
+		zmq_close(s);
+		return;
+	}
+	void * const thread = zmq_threadstart(fabd_metrics_thread, s);
+	assert(thread);
+}
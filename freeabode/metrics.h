@@ -0,0 +1,47 @@
+#ifndef FABD_METRICS_H
+#define FABD_METRICS_H
+
+#include <stdint.h>
+
+// Process-wide registry of counters, gauges and histograms
+// Updates are lock-free; only registering, unregistering and reading take the registry lock.
+// Labels are Prometheus style (eg, devid="my_nbp",source="weather"), or NULL for none.
+
+enum fabd_metric_type {
+	FMT_COUNTER,
+	FMT_GAUGE,
+	FMT_HISTOGRAM,
+};
+
+struct fabd_metric;
+
+// Registering a name and labels already registered returns the existing metric (or, if that is external, one never exported)
+extern struct fabd_metric *fabd_metric_counter(const char *name, const char *labels, const char *help);
+extern struct fabd_metric *fabd_metric_gauge(const char *name, const char *labels, const char *help);
+// Samples below each bound go in that bucket; one more bucket has everything else
+extern struct fabd_metric *fabd_metric_histogram(const char *name, const char *labels, const char *help, const uint32_t *bounds, unsigned n_bounds);
+
+// Metrics kept elsewhere (read with relaxed atomic loads); these must be unregistered before the storage goes away
+// A name and labels already registered are rejected, returning NULL (which may still be unregistered)
+// sum may be NULL if not tracked, and count may be NULL to add up the buckets instead
+extern struct fabd_metric *fabd_metric_counter_external(const char *name, const char *labels, const char *help, const uint64_t *value);
+extern struct fabd_metric *fabd_metric_histogram_external(const char *name, const char *labels, const char *help, const uint32_t *bounds, unsigned n_bounds, const uint64_t *buckets, const uint64_t *sum, const uint64_t *count);
+extern void fabd_metric_unregister(struct fabd_metric *);
+
+extern void fabd_metric_add(struct fabd_metric *, uint64_t);
+static inline
+void fabd_metric_inc(struct fabd_metric * const m)
+{
+	fabd_metric_add(m, 1);
+}
+extern void fabd_metric_set(struct fabd_metric *, int64_t);
+// Not for external histograms, which only their owner updates
+extern void fabd_metric_observe(struct fabd_metric *, uint64_t);
+
+// Prometheus text exposition format; caller frees
+extern char *fabd_metrics_prometheus(void);
+
+// Answers requests on devid's "metrics" server, if it has one: "prometheus" gets the text format, anything else a PbMetrics
+extern void fabd_metrics_serve(void *ctx, const char *devid);
+
+#endif
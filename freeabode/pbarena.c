@@ -0,0 +1,102 @@
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <protobuf-c/protobuf-c.h>
+
+#include "pbarena.h"
+
+// Enough for any type protobuf-c will store
+#define FABD_PBARENA_ALIGN  0x10
+
+static
+void *fabd_pbarena_alloc(void * const userp, const size_t sz)
+{
+	struct fabd_pbarena * const arena = userp;
+	const size_t alignedsz = (sz + FABD_PBARENA_ALIGN - 1) & ~(FABD_PBARENA_ALIGN - 1);
+	
+	if (arena->bufsz - arena->used >= alignedsz)
+	{
+		void * const rv = &arena->buf[arena->used];
+		arena->used += alignedsz;
+		return rv;
+	}
+	
+	// Doesn't fit; keep track of it separately until the next reset, which will grow buf to accommodate
+	if (arena->n_overflow == arena->overflow_allocsz)
+	{
+		const size_t newsz = arena->overflow_allocsz ? (arena->overflow_allocsz * 2) : 4;
+		void ** const p = realloc(arena->overflow, sizeof(*arena->overflow) * newsz);
+		if (!p)
+			return NULL;
+		arena->overflow = p;
+		arena->overflow_allocsz = newsz;
+	}
+	void * const rv = malloc(alignedsz);
+	if (!rv)
+		return NULL;
+	arena->overflow[arena->n_overflow++] = rv;
+	arena->overflow_bytes += alignedsz;
+	return rv;
+}
+
+static
+void fabd_pbarena_free_noop(void * const userp, void * const p)
+{
+	// Released in bulk by fabd_pbarena_reset
+}
+
+void fabd_pbarena_init(struct fabd_pbarena * const arena, const size_t initsz)
+{
+	*arena = (struct fabd_pbarena){
+		.allocator = {
+			.alloc = fabd_pbarena_alloc,
+			.free = fabd_pbarena_free_noop,
+			.allocator_data = arena,
+		},
+	};
+	if (initsz)
+	{
+		arena->buf = malloc(initsz);
+		if (arena->buf)
+			arena->bufsz = initsz;
+	}
+}
+
+void fabd_pbarena_reset(struct fabd_pbarena * const arena)
+{
+	if (arena->n_overflow)
+	{
+		for (size_t i = 0; i < arena->n_overflow; ++i)
+			free(arena->overflow[i]);
+		
+		// Grow so the same workload fits without overflowing next time
+		size_t newsz = arena->bufsz ?: 0x100;
+		while (newsz < arena->used + arena->overflow_bytes)
+			newsz *= 2;
+		uint8_t * const newbuf = malloc(newsz);
+		if (newbuf)
+		{
+			free(arena->buf);
+			arena->buf = newbuf;
+			arena->bufsz = newsz;
+		}
+		
+		arena->n_overflow = 0;
+		arena->overflow_bytes = 0;
+	}
+	arena->used = 0;
+}
+
+void fabd_pbarena_free(struct fabd_pbarena * const arena)
+{
+	fabd_pbarena_reset(arena);
+	free(arena->buf);
+	free(arena->overflow);
+	arena->buf = NULL;
+	arena->bufsz = 0;
+	arena->overflow = NULL;
+	arena->overflow_allocsz = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef FABD_PBARENA_H
+#define FABD_PBARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <protobuf-c/protobuf-c.h>
+
+// Bump allocator for protobuf-c unpacking
+// Everything allocated from it is released at once by fabd_pbarena_reset; the allocator's free is a noop, so there is no need to call *__free_unpacked
+struct fabd_pbarena {
+	ProtobufCAllocator allocator;
+	
+	uint8_t *buf;
+	size_t bufsz;
+	size_t used;
+	
+	// Allocations that didn't fit in buf since the last reset
+	void **overflow;
+	size_t n_overflow;
+	size_t overflow_allocsz;
+	size_t overflow_bytes;
+};
+
+extern void fabd_pbarena_init(struct fabd_pbarena *, size_t initsz);
+extern void fabd_pbarena_reset(struct fabd_pbarena *);
+extern void fabd_pbarena_free(struct fabd_pbarena *);
+
+#endif
@@ -1,15 +1,28 @@
 #include "config.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/mman.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <sodium/crypto_scalarmult.h>
+#include <sodium/crypto_shorthash.h>
+#include <sodium/randombytes.h>
 #include <zmq.h>
 #include <zmq_utils.h>
 
+#include "authz.h"
 #include "bytes.h"
+#include "fabdcfg.h"
+#include "logging.h"
+#include "metrics.h"
 #include "security.h"
 #include "util.h"
 
@@ -82,6 +95,24 @@ void load_freeabode_key()
 	freeabode__pubkey = convert_private_key_to_public(freeabode__privkey);
 }
 
+bool freeabode_parse_pubkey(const char * const s, uint8_t * const out)
+{
+	const size_t len = strlen(s);
+	if (len == 40)
+		return zmq_z85_decode(out, s);
+	if (len == 0x40)
+		return hex2bin(out, s, 0x20);
+	return false;
+}
+
+void freeabode_zmq_security_serverkey(void * const socket, const uint8_t * const serverkey)
+{
+	if (serverkey)
+		zmq_setsockopt(socket, ZMQ_CURVE_SERVERKEY, serverkey, 0x20);
+	else
+		zmq_setsockopt(socket, ZMQ_CURVE_SERVERKEY, bytes_buf(freeabode_pubkey), bytes_len(freeabode_pubkey));
+}
+
 void freeabode_zmq_security(void * const socket, const bool server)
 {
 	if (server)
@@ -91,72 +122,370 @@ void freeabode_zmq_security(void * const socket, const bool server)
 	}
 	else
 	{
-		zmq_setsockopt(socket, ZMQ_CURVE_SERVERKEY, bytes_buf(freeabode_pubkey), bytes_len(freeabode_pubkey));
+		freeabode_zmq_security_serverkey(socket, NULL);
 		zmq_setsockopt(socket, ZMQ_CURVE_PUBLICKEY, bytes_buf(freeabode_pubkey), bytes_len(freeabode_pubkey));
 		zmq_setsockopt(socket, ZMQ_CURVE_SECRETKEY, bytes_buf(&freeabode__privkey), bytes_len(&freeabode__privkey));
 	}
 }
 
+static const int int_zero = 0;
+static const char fabd_zap_domain_peercred[] = "fabd-peercred";
+
+bool fabd_security_policy_from_str(const char * const s, enum fabd_security_policy * const out)
+{
+	if (!s)
+		return false;
+	if (!strcasecmp(s, "curve"))
+		*out = FSP_CURVE;
+	else
+	if (!strcasecmp(s, "peercred"))
+		*out = FSP_PEERCRED;
+	else
+	if (!strcasecmp(s, "null"))
+		*out = FSP_NULL;
+	else
+		return false;
+	return true;
+}
+
+// Only tcp (or anything else that might leave the host) needs encryption
+enum fabd_security_policy fabd_security_policy_default(const char * const uri)
+{
+	if (!strncmp(uri, "ipc:", 4))
+		return FSP_PEERCRED;
+	if (!strncmp(uri, "inproc:", 7))
+		return FSP_NULL;
+	return FSP_CURVE;
+}
+
+void freeabode_zmq_security_policy(void * const socket, const bool server, const enum fabd_security_policy policy)
+{
+	switch (policy)
+	{
+		case FSP_CURVE:
+			zmq_setsockopt(socket, ZMQ_ZAP_DOMAIN, "", 0);
+			freeabode_zmq_security(socket, server);
+			break;
+		case FSP_PEERCRED:
+			// Either CURVE_SERVER setting also resets the mechanism to NULL
+			zmq_setsockopt(socket, ZMQ_CURVE_SERVER, &int_zero, sizeof(int_zero));
+			// NULL mechanism only consults ZAP with a domain set
+			if (server)
+				zmq_setsockopt(socket, ZMQ_ZAP_DOMAIN, fabd_zap_domain_peercred, sizeof(fabd_zap_domain_peercred) - 1);
+			break;
+		case FSP_NULL:
+			zmq_setsockopt(socket, ZMQ_CURVE_SERVER, &int_zero, sizeof(int_zero));
+			zmq_setsockopt(socket, ZMQ_ZAP_DOMAIN, "", 0);
+			break;
+	}
+}
+
+// For ipc, libzmq appends ":uid:gid:pid" (from SO_PEERCRED) to the peer address
 static
-void zap_handler(void *handler)
+bool zap_peer_uid(const char * const address, uid_t * const out)
+{
+	const char *p = &address[strlen(address)];
+	for (int i = 0; i < 3; ++i)
+	{
+		while (p > address && p[-1] != ':')
+			--p;
+		if (p == address)
+			return false;
+		--p;
+	}
+	char *end;
+	const unsigned long uid = strtoul(&p[1], &end, 10);
+	if (end == &p[1] || end[0] != ':')
+		return false;
+	*out = uid;
+	return true;
+}
+
+static
+bool zap_peercred_allowed(const char * const address)
+{
+	uid_t uid;
+	if (!zap_peer_uid(address, &uid))
+		return false;
+	return uid == geteuid() || uid == 0;
+}
+
+// A ROUTER sees every handshake's request as one message, so none waits for another's frames; checks are all in memory
+#define ZAP_MAX_FRAMES  0x10
+#define ZAP_CACHE_SIZE  0x40
+
+enum zap_frame {
+	ZF_ROUTING_ID,
+	ZF_DELIMITER,
+	ZF_VERSION,
+	ZF_REQUEST_ID,
+	ZF_DOMAIN,
+	ZF_ADDRESS,
+	ZF_IDENTITY,
+	ZF_MECHANISM,
+	ZF_CREDENTIALS,
+};
+
+static const unsigned long zap_cache_ttl_ms = 60000;
+static const unsigned long zap_stats_log_interval_ms = 300000;
+static const uint32_t zap_latency_bounds_us[FABD_ZAP_LATENCY_BUCKETS - 1] = { 10, 100, 1000, 10000, };
+
+static struct fabd_zap_stats my_zap_stats;
+
+struct zap_cache_entry {
+	uint64_t hash;
+	unsigned generation;
+	struct timespec ts_expire;
+	bool allowed;
+};
+
+struct zap_state {
+	struct fabd_authz *authz;
+	const struct fabdcfg_snapshot *authz_snap;
+	// Bumped whenever authz is rebuilt, to invalidate cached decisions
+	unsigned generation;
+	uint8_t cache_hashkey[crypto_shorthash_KEYBYTES];
+	struct zap_cache_entry cache[ZAP_CACHE_SIZE];
+};
+
+void freeabode_zap_stats(struct fabd_zap_stats * const out)
+{
+	out->accepted = __atomic_load_n(&my_zap_stats.accepted, __ATOMIC_RELAXED);
+	out->denied = __atomic_load_n(&my_zap_stats.denied, __ATOMIC_RELAXED);
+	out->malformed = __atomic_load_n(&my_zap_stats.malformed, __ATOMIC_RELAXED);
+	out->cache_hits = __atomic_load_n(&my_zap_stats.cache_hits, __ATOMIC_RELAXED);
+	for (int i = 0; i < FABD_ZAP_LATENCY_BUCKETS; ++i)
+		out->latency_hist[i] = __atomic_load_n(&my_zap_stats.latency_hist[i], __ATOMIC_RELAXED);
+}
+
+static
+void zap_stats_add(uint64_t * const counter)
+{
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static
+void zap_record_latency(const struct timespec * const ts_start)
+{
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	const int64_t us = ((int64_t)(ts_now.tv_sec - ts_start->tv_sec) * 1000000) + ((ts_now.tv_nsec - ts_start->tv_nsec) / 1000);
+	int i;
+	for (i = 0; i < FABD_ZAP_LATENCY_BUCKETS - 1; ++i)
+		if (us < zap_latency_bounds_us[i])
+			break;
+	zap_stats_add(&my_zap_stats.latency_hist[i]);
+}
+
+static
+bool zap_frame_streq(zmq_msg_t * const msg, const char * const s)
+{
+	const size_t len = strlen(s);
+	return zmq_msg_size(msg) == len && !memcmp(zmq_msg_data(msg), s, len);
+}
+
+// Copies a frame as a C string, rejecting embedded nulls and anything too long
+static
+bool zap_frame_str(zmq_msg_t * const msg, char * const out, const size_t outsz)
+{
+	const size_t len = zmq_msg_size(msg);
+	if (len >= outsz || memchr(zmq_msg_data(msg), '\0', len))
+		return false;
+	memcpy(out, zmq_msg_data(msg), len);
+	out[len] = '\0';
+	return true;
+}
+
+static
+bool zap_check_curve(struct zap_state * const zs, const char * const domain, const uint8_t * const pubkey, const struct timespec * const ts_now)
+{
+	// Rebuilt only after config reloads; this thread never dispatches changes, so it moves on here
+	// (the new snapshot is taken before the old one is released, so they can't share an address)
+	fabdcfg_refresh();
+	const struct fabdcfg_snapshot * const snap = fabdcfg_current();
+	if (snap != zs->authz_snap || !zs->authz)
+	{
+		fabd_authz_free(zs->authz);
+		zs->authz = fabd_authz_build(snap);
+		zs->authz_snap = snap;
+		++zs->generation;
+	}
+	
+	const size_t domainlen = strlen(domain);
+	uint8_t keybuf[domainlen + 1 + 0x20], hashbuf[crypto_shorthash_BYTES];
+	memcpy(keybuf, domain, domainlen + 1);
+	memcpy(&keybuf[domainlen + 1], pubkey, 0x20);
+	crypto_shorthash(hashbuf, keybuf, sizeof(keybuf), zs->cache_hashkey);
+	const uint64_t hash = upk_u64le(hashbuf, 0);
+	// Keyed 64-bit hashes are trusted not to collide, so entries don't keep the key itself
+	struct zap_cache_entry * const ce = &zs->cache[hash % ZAP_CACHE_SIZE];
+	if (ce->hash == hash && ce->generation == zs->generation && !timespec_passed(&ce->ts_expire, ts_now, NULL))
+	{
+		zap_stats_add(&my_zap_stats.cache_hits);
+		return ce->allowed;
+	}
+	
+	const bool allowed = fabd_authz_check(zs->authz, domain, pubkey);
+	if (!allowed)
+	{
+		char z85[41];
+		zmq_z85_encode(z85, pubkey, 0x20);
+		applog(LOG_NOTICE, "Denied key %s access to %s", z85, domain[0] ? domain : "(unknown)");
+	}
+	*ce = (struct zap_cache_entry){
+		.hash = hash,
+		.generation = zs->generation,
+		.allowed = allowed,
+	};
+	timespec_add_ms(ts_now, zap_cache_ttl_ms, &ce->ts_expire);
+	return allowed;
+}
+
+// Returns the status code to reply with
+static
+const char *zap_decide(struct zap_state * const zs, zmq_msg_t * const frames, const int n_frames, const struct timespec * const ts_now)
+{
+	char domain[0x100], address[0x100];
+	if (!(zap_frame_streq(&frames[ZF_VERSION], "1.0") && zap_frame_str(&frames[ZF_DOMAIN], domain, sizeof(domain)) && zap_frame_str(&frames[ZF_ADDRESS], address, sizeof(address))))
+		goto malformed;
+	zmq_msg_t * const mechanism = &frames[ZF_MECHANISM];
+	const int n_credentials = n_frames - ZF_CREDENTIALS;
+	
+	if (zap_frame_streq(mechanism, "NULL"))
+	{
+		if (n_credentials != 0)
+			goto malformed;
+		if (!strcmp(domain, fabd_zap_domain_peercred) && zap_peercred_allowed(address))
+			return "200";
+		return "400";
+	}
+	if (zap_frame_streq(mechanism, "CURVE"))
+	{
+		if (!(n_credentials == 1 && zmq_msg_size(&frames[ZF_CREDENTIALS]) == 0x20))
+			goto malformed;
+		return zap_check_curve(zs, domain, zmq_msg_data(&frames[ZF_CREDENTIALS]), ts_now) ? "200" : "400";
+	}
+	// PLAIN, or anything else, is never used by FreeAbode
+	return "400";
+
+malformed:
+	zap_stats_add(&my_zap_stats.malformed);
+	return "400";
+}
+
+static
+void zap_reply(void * const handler, zmq_msg_t * const frames, const char * const status)
 {
 	static const char my_zap_ver[] = "1.0";
-	char buf[0x100], reqid[0x100];
-	int sz, reqidsz;
-	bool problem;
+	// Routing id and empty delimiter go back as-is
+	for (int i = ZF_ROUTING_ID; i <= ZF_DELIMITER; ++i)
+		zmq_msg_send(&frames[i], handler, ZMQ_SNDMORE);
+	zmq_send(handler, my_zap_ver, sizeof(my_zap_ver) - 1, ZMQ_SNDMORE);
+	zmq_msg_send(&frames[ZF_REQUEST_ID], handler, ZMQ_SNDMORE);
+	zmq_send(handler, status, 3, ZMQ_SNDMORE);
+	zmq_send(handler, NULL, 0, ZMQ_SNDMORE);
+	zmq_send(handler, NULL, 0, ZMQ_SNDMORE);
+	zmq_send(handler, NULL, 0, 0);
+}
+
+static
+void zap_log_stats(void)
+{
+	struct fabd_zap_stats st;
+	freeabode_zap_stats(&st);
+	applog(LOG_DEBUG, "ZAP: %llu accepted, %llu denied (%llu malformed), %llu cached; latency <10us:%llu <100us:%llu <1ms:%llu <10ms:%llu more:%llu",
+	       (unsigned long long)st.accepted, (unsigned long long)st.denied, (unsigned long long)st.malformed, (unsigned long long)st.cache_hits,
+	       (unsigned long long)st.latency_hist[0], (unsigned long long)st.latency_hist[1], (unsigned long long)st.latency_hist[2], (unsigned long long)st.latency_hist[3], (unsigned long long)st.latency_hist[4]);
+}
+
+static
+void zap_handler(void *handler)
+{
+	struct zap_state * const zs = calloc(1, sizeof(*zs));
+	assert(zs);
+	randombytes_buf(zs->cache_hashkey, sizeof(zs->cache_hashkey));
+	
+	zmq_msg_t frames[ZAP_MAX_FRAMES];
+	struct timespec ts_start, ts_next_log = TIMESPEC_INIT_CLEAR, ts_timeout;
+	uint64_t last_logged_total = 0;
+	zmq_pollitem_t pollitems[] = {
+		{ .socket = handler, .events = ZMQ_POLLIN },
+	};
 	while (true)
 	{
-		problem = false;
-		
-		// version
-		sz = zmq_recv(handler, buf, sizeof(buf) - 1, 0);
-		if (sz < 0)
-			break;
-		buf[sz] = '\0';
-		if (strcmp(buf, my_zap_ver))
-			// Version mismatch
-			problem = true;
+		clock_gettime(CLOCK_MONOTONIC, &ts_start);
+		timespec_clear(&ts_timeout);
+		if (timespec_passed(&ts_next_log, &ts_start, &ts_timeout) || !timespec_isset(&ts_next_log))
+		{
+			const uint64_t total = __atomic_load_n(&my_zap_stats.accepted, __ATOMIC_RELAXED) + __atomic_load_n(&my_zap_stats.denied, __ATOMIC_RELAXED);
+			if (total != last_logged_total)
+				zap_log_stats();
+			last_logged_total = total;
+			timespec_add_ms(&ts_start, zap_stats_log_interval_ms, &ts_next_log);
+			timespec_add_ms(&ts_start, zap_stats_log_interval_ms, &ts_timeout);
+		}
+		if (zmq_poll(pollitems, 1, timespec_to_timeout_ms(&ts_start, &ts_timeout)) < 0)
+		{
+			if (zmq_errno() == ETERM)
+				break;
+			continue;
+		}
+		if (!(pollitems[0].revents & ZMQ_POLLIN))
+			continue;
+		clock_gettime(CLOCK_MONOTONIC, &ts_start);
 		
-		// request id
-		reqidsz = zmq_recv(handler, reqid, sizeof(reqid) - 1, 0);
-		// domain
-		sz = zmq_recv(handler, buf, sizeof(buf) - 1, 0);
-		// address
-		sz = zmq_recv(handler, buf, sizeof(buf) - 1, 0);
-		// identity
-		sz = zmq_recv(handler, buf, sizeof(buf) - 1, 0);
-		// mechanism
-		sz = zmq_recv(handler, buf, sizeof(buf) - 1, 0);
-		buf[sz] = '\0';
-		if (strcmp("CURVE", buf))
-			// bad mechanism
-			problem = true;
-		// credentials
-		sz = zmq_recv(handler, buf, sizeof(buf) - 1, 0);
-		if (sz < 0x20)
-			// key too short
-			problem = true;
+		// Multipart messages arrive whole, so this never blocks past the first frame
+		int n_frames = 0;
+		bool more = true;
+		while (more)
+		{
+			zmq_msg_t * const msg = &frames[(n_frames < ZAP_MAX_FRAMES) ? n_frames : (ZAP_MAX_FRAMES - 1)];
+			if (n_frames >= ZAP_MAX_FRAMES)
+				zmq_msg_close(msg);
+			zmq_msg_init(msg);
+			++n_frames;
+			if (zmq_msg_recv(msg, handler, 0) < 0)
+				break;
+			more = zmq_msg_more(msg);
+		}
+		const bool overflow = (n_frames > ZAP_MAX_FRAMES);
+		n_frames = fabd_min(n_frames, ZAP_MAX_FRAMES);
+		if (more || n_frames < ZF_CREDENTIALS || zmq_msg_size(&frames[ZF_DELIMITER]))
+			// Truncated or not a request at all; nothing sensible to reply to
+			zap_stats_add(&my_zap_stats.malformed);
 		else
-		if (!problem)
+		if (overflow)
 		{
-			if (memcmp(bytes_buf(freeabode_pubkey), buf, 0x20))
-				problem = true;
+			// Too many frames, but the request id is still there to reply to
+			zap_stats_add(&my_zap_stats.malformed);
+			zap_stats_add(&my_zap_stats.denied);
+			zap_reply(handler, frames, "400");
 		}
-		
-		zmq_send(handler, my_zap_ver, sizeof(my_zap_ver)-1, ZMQ_SNDMORE);
-		zmq_send(handler, reqid, reqidsz, ZMQ_SNDMORE);
-		zmq_send(handler, problem ? "400" : "200", 3, ZMQ_SNDMORE);
-		zmq_send(handler, NULL, 0, ZMQ_SNDMORE);
-		zmq_send(handler, NULL, 0, ZMQ_SNDMORE);
-		zmq_send(handler, NULL, 0, 0);
+		else
+		{
+			const char * const status = zap_decide(zs, frames, n_frames, &ts_start);
+			zap_stats_add(status[0] == '2' ? &my_zap_stats.accepted : &my_zap_stats.denied);
+			zap_reply(handler, frames, status);
+			zap_record_latency(&ts_start);
+		}
+		for (int i = 0; i < n_frames; ++i)
+			zmq_msg_close(&frames[i]);
 	}
+	fabd_authz_free(zs->authz);
+	free(zs);
 	zmq_close (handler);
 }
 
 void start_zap_handler(void *ctx)
 {
-	void *handler = zmq_socket(ctx, ZMQ_REP);
+	void *handler = zmq_socket(ctx, ZMQ_ROUTER);
 	assert(handler);
 	assert(!zmq_bind(handler, "inproc://zeromq.zap.01"));
 	zmq_threadstart(&zap_handler, handler);
+	
+	fabd_metric_counter_external("fabd_zap_accepted_total", NULL, "ZAP requests accepted", &my_zap_stats.accepted);
+	fabd_metric_counter_external("fabd_zap_denied_total", NULL, "ZAP requests denied", &my_zap_stats.denied);
+	fabd_metric_counter_external("fabd_zap_malformed_total", NULL, "Malformed ZAP requests", &my_zap_stats.malformed);
+	fabd_metric_counter_external("fabd_zap_cache_hits_total", NULL, "ZAP decisions answered from cache", &my_zap_stats.cache_hits);
+	fabd_metric_histogram_external("fabd_zap_latency_us", NULL, "Time to decide each ZAP request", zap_latency_bounds_us, FABD_ZAP_LATENCY_BUCKETS - 1, my_zap_stats.latency_hist, NULL, NULL);
 }
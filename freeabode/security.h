@@ -1,6 +1,9 @@
 #ifndef FABD_SECURITY_H
 #define FABD_SECURITY_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "bytes.h"
 
 extern bytes_t freeabode__pubkey;
@@ -8,7 +11,35 @@ extern bytes_t freeabode__pubkey;
 extern void load_freeabode_key(void);
 
 extern void freeabode_zmq_security(void *socket, bool server);
+// Public keys may be Z85 (40 characters) or hex (64 characters)
+extern bool freeabode_parse_pubkey(const char *, uint8_t *out);
+// For clients: the CURVE public key of the server connected to next, or NULL if it shares ours
+extern void freeabode_zmq_security_serverkey(void *socket, const uint8_t *serverkey);
+
+// Per-endpoint mechanisms; options apply to each bind/connect made after setting them
+enum fabd_security_policy {
+	FSP_CURVE,
+	FSP_PEERCRED,  // NULL mechanism, with ZAP checking the peer's uid (ipc only)
+	FSP_NULL,
+};
+
+extern bool fabd_security_policy_from_str(const char *, enum fabd_security_policy *out);
+extern enum fabd_security_policy fabd_security_policy_default(const char *uri);
+extern void freeabode_zmq_security_policy(void *socket, bool server, enum fabd_security_policy);
 
 extern void start_zap_handler(void *ctx);
 
+#define FABD_ZAP_LATENCY_BUCKETS  5
+
+struct fabd_zap_stats {
+	uint64_t accepted;
+	uint64_t denied;
+	uint64_t malformed;  // also counted as denied, if they could be replied to
+	uint64_t cache_hits;
+	// Time to decide each request: <10us, <100us, <1ms, <10ms, longer
+	uint64_t latency_hist[FABD_ZAP_LATENCY_BUCKETS];
+};
+
+extern void freeabode_zap_stats(struct fabd_zap_stats *);
+
 #endif
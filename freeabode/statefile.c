@@ -0,0 +1,74 @@
+#include "config.h"
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "statefile.h"
+
+bool fabd_statefile_begin(struct fabd_statefile_txn * const txn, const char * const path)
+{
+	const size_t tmppathsz = strlen(path) + 5;
+	*txn = (struct fabd_statefile_txn){
+		.path = path,
+		.tmppath = malloc(tmppathsz),
+	};
+	if (!txn->tmppath)
+		return false;
+	snprintf(txn->tmppath, tmppathsz, "%s.tmp", path);
+	txn->F = fopen(txn->tmppath, "w");
+	if (!txn->F)
+	{
+		applog(LOG_WARNING, "Failed to create %s", txn->tmppath);
+		free(txn->tmppath);
+		return false;
+	}
+	return true;
+}
+
+static
+void fabd_statefile_sync_dir(const char * const path)
+{
+	// Make the rename itself durable
+	char * const pathcopy = strdup(path);
+	if (!pathcopy)
+		return;
+	const int fd = open(dirname(pathcopy), O_RDONLY | O_DIRECTORY);
+	if (fd >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+	free(pathcopy);
+}
+
+bool fabd_statefile_commit(struct fabd_statefile_txn * const txn)
+{
+	FILE * const F = txn->F;
+	bool success = !(ferror(F) || fflush(F) || fsync(fileno(F)));
+	if (fclose(F))
+		success = false;
+	if (success && rename(txn->tmppath, txn->path))
+		success = false;
+	if (success)
+		fabd_statefile_sync_dir(txn->path);
+	else
+	{
+		applog(LOG_WARNING, "Failed to save %s", txn->path);
+		unlink(txn->tmppath);
+	}
+	free(txn->tmppath);
+	return success;
+}
+
+void fabd_statefile_abort(struct fabd_statefile_txn * const txn)
+{
+	fclose(txn->F);
+	unlink(txn->tmppath);
+	free(txn->tmppath);
+}
@@ -0,0 +1,20 @@
+#ifndef FABD_STATEFILE_H
+#define FABD_STATEFILE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Crash-safe replacement of small state files: write a temporary file, sync it, then rename it over the original.
+// Readers only ever see the old or new contents in full.
+
+struct fabd_statefile_txn {
+	FILE *F;
+	const char *path;
+	char *tmppath;
+};
+
+extern bool fabd_statefile_begin(struct fabd_statefile_txn *, const char *path);
+extern bool fabd_statefile_commit(struct fabd_statefile_txn *);
+extern void fabd_statefile_abort(struct fabd_statefile_txn *);
+
+#endif
@@ -0,0 +1,199 @@
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <freeabode/freeabode.pb-c.h>
+#include <freeabode/logging.h>
+#include <freeabode/statefile.h>
+#include <freeabode/util.h>
+
+#include "wirestats.h"
+
+static const char * const wirestats_magic = "freeabode-wirestats 1";
+
+const uint32_t fabd_wirestats_bounds_ms[FABD_WIRESTATS_BUCKETS - 1] = {
+	60000,
+	180000,
+	300000,
+	600000,
+	900000,
+	1800000,
+	3600000,
+	7200000,
+};
+
+static
+int wirestats_bucket(const uint64_t duration_ms)
+{
+	int i;
+	for (i = 0; i < FABD_WIRESTATS_BUCKETS - 1; ++i)
+		if (duration_ms < fabd_wirestats_bounds_ms[i])
+			break;
+	return i;
+}
+
+static
+uint64_t wirestats_elapsed_ms(const struct timespec * const since, const struct timespec * const now)
+{
+	struct timespec elapsed;
+	if (timespec_cmp(now, since) <= 0)
+		return 0;
+	timespec_sub(now, since, &elapsed);
+	return ((uint64_t)elapsed.tv_sec * 1000) + (elapsed.tv_nsec / 1000000);
+}
+
+static
+void wirestats_load(struct fabd_wirestats * const ws)
+{
+	FILE * const F = fopen(ws->path, "r");
+	if (!F)
+		return;
+	
+	char line[0x400];
+	if (!(fgets(line, sizeof(line), F) && !strncmp(line, wirestats_magic, strlen(wirestats_magic))))
+	{
+		applog(LOG_WARNING, "%s: Not a wire statistics file, ignoring", ws->path);
+		goto out;
+	}
+	while (fgets(line, sizeof(line), F))
+	{
+		unsigned wire;
+		struct fabd_wirestats_wire w = { .state = FTS_UNKNOWN, };
+		char *p = line;
+		int n;
+		if (sscanf(p, "%u %" SCNu64 " %" SCNu64 " %" SCNu32 "%n", &wire, &w.runtime_ms, &w.offtime_ms, &w.cycles, &n) < 4 || wire >= PB_HVACWIRES___COUNT)
+			continue;
+		p += n;
+		for (int i = 0; i < FABD_WIRESTATS_BUCKETS * 2; ++i)
+		{
+			uint32_t * const v = (i < FABD_WIRESTATS_BUCKETS) ? &w.on_hist[i] : &w.off_hist[i - FABD_WIRESTATS_BUCKETS];
+			if (sscanf(p, " %" SCNu32 "%n", v, &n) < 1)
+				break;
+			p += n;
+		}
+		ws->wire[wire] = w;
+	}
+	
+out:
+	fclose(F);
+}
+
+void fabd_wirestats_init(struct fabd_wirestats * const ws, const char * const path)
+{
+	*ws = (struct fabd_wirestats){
+		.path = path ? strdup(path) : NULL,
+	};
+	for (int i = 0; i < PB_HVACWIRES___COUNT; ++i)
+		ws->wire[i].state = FTS_UNKNOWN;
+	if (ws->path)
+		wirestats_load(ws);
+}
+
+void fabd_wirestats_free(struct fabd_wirestats * const ws)
+{
+	free(ws->path);
+}
+
+bool fabd_wirestats_save(struct fabd_wirestats * const ws)
+{
+	if (!ws->path)
+		return true;
+	
+	struct fabd_statefile_txn txn;
+	if (!fabd_statefile_begin(&txn, ws->path))
+		return false;
+	FILE * const F = txn.F;
+	fprintf(F, "%s\n", wirestats_magic);
+	for (int i = 0; i < PB_HVACWIRES___COUNT; ++i)
+	{
+		const struct fabd_wirestats_wire * const w = &ws->wire[i];
+		if (!(w->runtime_ms || w->offtime_ms || w->cycles))
+			continue;
+		fprintf(F, "%d %" PRIu64 " %" PRIu64 " %" PRIu32, i, w->runtime_ms, w->offtime_ms, w->cycles);
+		for (int j = 0; j < FABD_WIRESTATS_BUCKETS; ++j)
+			fprintf(F, " %" PRIu32, w->on_hist[j]);
+		for (int j = 0; j < FABD_WIRESTATS_BUCKETS; ++j)
+			fprintf(F, " %" PRIu32, w->off_hist[j]);
+		fputc('\n', F);
+	}
+	return fabd_statefile_commit(&txn);
+}
+
+// Returns true if the state actually changed
+bool fabd_wirestats_change(struct fabd_wirestats * const ws, const PbHVACWires wire, const bool on, const struct timespec * const now)
+{
+	if (wire >= PB_HVACWIRES___COUNT)
+		return false;
+	struct fabd_wirestats_wire * const w = &ws->wire[wire];
+	if (w->state == (enum fabd_tristate)on)
+		return false;
+	
+	if (w->span_known)
+	{
+		const uint64_t duration_ms = wirestats_elapsed_ms(&w->ts_changed, now);
+		const int bucket = wirestats_bucket(duration_ms);
+		if (w->state == FTS_TRUE)
+		{
+			w->runtime_ms += duration_ms;
+			++w->on_hist[bucket];
+		}
+		else
+		{
+			w->offtime_ms += duration_ms;
+			++w->off_hist[bucket];
+		}
+	}
+	// Only a change from known off starts a cycle; the first change at startup may just be asserting what was already on
+	if (on && w->state == FTS_FALSE)
+		++w->cycles;
+	
+	// The first span after startup (from unknown) has no known beginning
+	w->span_known = (w->state != FTS_UNKNOWN);
+	w->state = on;
+	w->ts_changed = *now;
+	return true;
+}
+
+// Release with fabd_wirestats_pb_free
+void fabd_wirestats_to_pb(const struct fabd_wirestats * const ws, const PbHVACWires wire, const struct timespec * const now, PbWireStats * const pb)
+{
+	const struct fabd_wirestats_wire * const w = &ws->wire[wire];
+	pb_wire_stats__init(pb);
+	pb->wire = wire;
+	
+	// Include the current span, so duty cycle is up to date
+	uint64_t runtime_ms = w->runtime_ms, offtime_ms = w->offtime_ms;
+	if (w->span_known)
+	{
+		if (w->state == FTS_TRUE)
+			runtime_ms += wirestats_elapsed_ms(&w->ts_changed, now);
+		else
+			offtime_ms += wirestats_elapsed_ms(&w->ts_changed, now);
+	}
+	pb->has_runtime_ms = true;
+	pb->runtime_ms = runtime_ms;
+	pb->has_offtime_ms = true;
+	pb->offtime_ms = offtime_ms;
+	pb->has_cycles = true;
+	pb->cycles = w->cycles;
+	
+	pb->n_on_histogram = pb->n_off_histogram = FABD_WIRESTATS_BUCKETS;
+	pb->on_histogram = malloc(sizeof(*pb->on_histogram) * FABD_WIRESTATS_BUCKETS);
+	pb->off_histogram = malloc(sizeof(*pb->off_histogram) * FABD_WIRESTATS_BUCKETS);
+	memcpy(pb->on_histogram, w->on_hist, sizeof(w->on_hist));
+	memcpy(pb->off_histogram, w->off_hist, sizeof(w->off_hist));
+	pb->n_histogram_bounds_ms = FABD_WIRESTATS_BUCKETS - 1;
+	pb->histogram_bounds_ms = (uint32_t *)fabd_wirestats_bounds_ms;
+}
+
+void fabd_wirestats_pb_free(PbWireStats * const pb)
+{
+	free(pb->on_histogram);
+	free(pb->off_histogram);
+}
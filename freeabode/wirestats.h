@@ -0,0 +1,41 @@
+#ifndef FABD_WIRESTATS_H
+#define FABD_WIRESTATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <freeabode/freeabode.pb-c.h>
+#include <freeabode/util.h>
+
+// Durations below each bound go in that bucket; the last bucket has everything else
+#define FABD_WIRESTATS_BUCKETS  9
+extern const uint32_t fabd_wirestats_bounds_ms[FABD_WIRESTATS_BUCKETS - 1];
+
+struct fabd_wirestats_wire {
+	enum fabd_tristate state;
+	// Only meaningful when state is known; CLOCK_MONOTONIC
+	struct timespec ts_changed;
+	bool span_known;  // false until we've seen the start of the current span
+	
+	// Completed spans only
+	uint64_t runtime_ms;
+	uint64_t offtime_ms;
+	uint32_t cycles;
+	uint32_t on_hist[FABD_WIRESTATS_BUCKETS];
+	uint32_t off_hist[FABD_WIRESTATS_BUCKETS];
+};
+
+struct fabd_wirestats {
+	char *path;
+	struct fabd_wirestats_wire wire[PB_HVACWIRES___COUNT];
+};
+
+extern void fabd_wirestats_init(struct fabd_wirestats *, const char *path);
+extern void fabd_wirestats_free(struct fabd_wirestats *);
+extern bool fabd_wirestats_change(struct fabd_wirestats *, PbHVACWires, bool on, const struct timespec *now);
+extern bool fabd_wirestats_save(struct fabd_wirestats *);
+extern void fabd_wirestats_to_pb(const struct fabd_wirestats *, PbHVACWires, const struct timespec *now, PbWireStats *);
+extern void fabd_wirestats_pb_free(PbWireStats *);
+
+#endif
@@ -0,0 +1,812 @@
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jansson.h>
+#include <zmq.h>
+
+#include <freeabode/authz.h>
+#include <freeabode/fabdcfg.h>
+#include <freeabode/freeabode.pb-c.h>
+#include <freeabode/json.h>
+#include <freeabode/logging.h>
+#include <freeabode/pbarena.h>
+#include <freeabode/security.h>
+#include <freeabode/util.h>
+
+// HTTP front end for FreeAbode services:
+//   POST /request/<client>  body is a PbRequest as JSON; the reply is a PbRequestReply as JSON
+//   GET /events[/<client>]  streams PbEvents as newline-delimited JSON, or Server-Sent Events if asked for
+// Each service has a single persistent connection, with requests pipelined over it.
+// Services are reached with this node's key, so callers are held to roles (see authz.h) here instead:
+// requests need control, and events read. Roles come from a bearer token, or for unix sockets the peer's uid.
+
+#define GW_MAX_CONNS  0x40
+#define GW_MAX_REQUEST  0x10000
+#define GW_MAX_LISTENERS  4
+// Streaming clients that fall this far behind are dropped
+#define GW_MAX_BACKLOG  0x100000
+
+static const char *my_devid;
+static void *my_zmq_context;
+static unsigned long request_timeout_ms;
+
+struct gw_pending {
+	uint64_t conn_id;
+	struct timespec ts_deadline;
+	struct gw_pending *next;
+};
+
+struct gw_service {
+	char *name;
+	bool events;
+	void *socket;
+	// Events: the name as a JSON string, for NDJSON framing
+	char *jname;
+	// Requests: connections awaiting replies, in the order sent
+	struct gw_pending *pending;
+	struct gw_pending **pending_tail;
+};
+
+enum gw_conn_state {
+	GCS_READING,
+	GCS_WAITING,
+	GCS_STREAMING,
+};
+
+struct gw_conn {
+	int fd;
+	uint64_t id;
+	enum gw_conn_state state;
+	bool keepalive;
+	
+	char in[GW_MAX_REQUEST];
+	size_t inlen;
+	// Bytes of in belonging to the request currently being handled
+	size_t reqlen;
+	
+	char *out;
+	size_t outpos, outlen, outsz;
+	
+	// Streaming only; NULL for all sources
+	const struct gw_service *stream_service;
+	bool sse;
+	
+	// From the peer's credentials, before any token
+	unsigned peer_roles;
+};
+
+struct gw_token {
+	char *token;
+	size_t len;
+	unsigned roles;
+};
+
+struct gw_uid {
+	uid_t uid;
+	unsigned roles;
+};
+
+static struct gw_service *services;
+static size_t n_services;
+static struct gw_token *tokens;
+static size_t n_tokens;
+static struct gw_uid *uids;
+static size_t n_uids;
+static struct gw_conn *conns[GW_MAX_CONNS];
+static uint64_t next_conn_id = 1;
+
+static
+bool gw_out(struct gw_conn * const c, const void * const data, const size_t len)
+{
+	if (c->outlen + len > c->outsz)
+	{
+		size_t sz = c->outsz ?: 0x1000;
+		while (c->outlen + len > sz)
+			sz *= 2;
+		char * const p = realloc(c->out, sz);
+		if (!p)
+			return false;
+		c->out = p;
+		c->outsz = sz;
+	}
+	memcpy(&c->out[c->outlen], data, len);
+	c->outlen += len;
+	return true;
+}
+
+static
+void gw_respond(struct gw_conn * const c, const char * const status, const char * const ctype, const char * const body, const size_t bodylen)
+{
+	char hdr[0x100];
+	const int hdrlen = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: %s\r\n\r\n", status, ctype, (unsigned long)bodylen, c->keepalive ? "keep-alive" : "close");
+	if (!(gw_out(c, hdr, hdrlen) && gw_out(c, body, bodylen)))
+		c->keepalive = false;
+	
+	// Done with this request; anything after it is pipelined
+	memmove(c->in, &c->in[c->reqlen], c->inlen - c->reqlen);
+	c->inlen -= c->reqlen;
+	c->reqlen = 0;
+	c->state = GCS_READING;
+}
+
+static
+void gw_respond_error(struct gw_conn * const c, const char * const status)
+{
+	gw_respond(c, status, "text/plain", status, strlen(status));
+}
+
+static
+struct gw_service *gw_find_service(const char * const name, const size_t namelen, const bool events)
+{
+	for (size_t i = 0; i < n_services; ++i)
+		if (services[i].events == events && strlen(services[i].name) == namelen && !memcmp(services[i].name, name, namelen))
+			return &services[i];
+	return NULL;
+}
+
+static
+struct gw_conn *gw_find_conn(const uint64_t id)
+{
+	for (int i = 0; i < GW_MAX_CONNS; ++i)
+		if (conns[i] && conns[i]->id == id)
+			return conns[i];
+	return NULL;
+}
+
+static
+void gw_service_connect(struct gw_service * const svc)
+{
+	svc->socket = zmq_socket(my_zmq_context, svc->events ? ZMQ_SUB : ZMQ_DEALER);
+	freeabode_zmq_security(svc->socket, false);
+	assert(fabdcfg_zmq_connect(my_devid, svc->name, svc->socket));
+	if (svc->events)
+		assert(!zmq_setsockopt(svc->socket, ZMQ_SUBSCRIBE, NULL, 0));
+}
+
+// Fails everything in flight, and starts over with a fresh connection
+static
+void gw_service_reset(struct gw_service * const svc)
+{
+	applog(LOG_WARNING, "No reply from %s; reconnecting", svc->name);
+	while (svc->pending)
+	{
+		struct gw_pending * const pending = svc->pending;
+		svc->pending = pending->next;
+		struct gw_conn * const c = gw_find_conn(pending->conn_id);
+		if (c)
+			gw_respond_error(c, "504 Gateway Timeout");
+		free(pending);
+	}
+	svc->pending_tail = &svc->pending;
+	static const int zero = 0;
+	zmq_setsockopt(svc->socket, ZMQ_LINGER, &zero, sizeof(zero));
+	zmq_close(svc->socket);
+	gw_service_connect(svc);
+}
+
+static
+void gw_handle_request(struct gw_conn * const c, struct gw_service * const svc, const char * const body, const size_t bodylen)
+{
+	json_error_t jserr;
+	json_t * const json_req = json_loadb(body, bodylen, 0, &jserr);
+	if (!json_req)
+	{
+		gw_respond_error(c, "400 Bad Request");
+		return;
+	}
+	int errcount = 0;
+	PbRequest * const pb_req = json_to_protobuf(&pb_request__descriptor, json_req, &errcount);
+	json_decref(json_req);
+	if (errcount)
+	{
+		if (pb_req)
+			pb_request__free_unpacked(pb_req, NULL);
+		gw_respond_error(c, "400 Bad Request");
+		return;
+	}
+	
+	struct gw_pending * const pending = malloc(sizeof(*pending));
+	if (!pending)
+	{
+		pb_request__free_unpacked(pb_req, NULL);
+		gw_respond_error(c, "503 Service Unavailable");
+		return;
+	}
+	
+	// DEALER talking to REP: an empty delimiter frame, then the request
+	zmq_send(svc->socket, NULL, 0, ZMQ_SNDMORE);
+	zmq_send_protobuf(svc->socket, pb_request, pb_req, 0);
+	pb_request__free_unpacked(pb_req, NULL);
+	
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	*pending = (struct gw_pending){
+		.conn_id = c->id,
+	};
+	timespec_add_ms(&ts_now, request_timeout_ms, &pending->ts_deadline);
+	*svc->pending_tail = pending;
+	svc->pending_tail = &pending->next;
+	c->state = GCS_WAITING;
+}
+
+static
+void gw_handle_events(struct gw_conn * const c, const struct gw_service * const svc, const bool sse)
+{
+	static const char hdr_sse[] = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+	static const char hdr_ndjson[] = "HTTP/1.1 200 OK\r\nContent-Type: application/x-ndjson\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+	c->stream_service = svc;
+	c->sse = sse;
+	c->keepalive = false;
+	c->state = GCS_STREAMING;
+	if (sse)
+		gw_out(c, hdr_sse, sizeof(hdr_sse) - 1);
+	else
+		gw_out(c, hdr_ndjson, sizeof(hdr_ndjson) - 1);
+}
+
+static
+const char *gw_header(const char * const headers, const char * const end, const char * const name)
+{
+	const size_t namelen = strlen(name);
+	for (const char *p = headers; p < end; ++p)
+	{
+		if (!strncasecmp(p, name, namelen) && p[namelen] == ':')
+		{
+			p += namelen + 1;
+			while (*p == ' ' || *p == '\t')
+				++p;
+			return p;
+		}
+		p = memchr(p, '\n', end - p);
+		if (!p)
+			break;
+	}
+	return NULL;
+}
+
+// Takes as long for any guess of the same length, so tokens can't be found a byte at a time
+static
+bool gw_token_equal(const struct gw_token * const t, const char * const s, const size_t len)
+{
+	uint8_t diff = (len != t->len);
+	for (size_t i = 0; i < t->len; ++i)
+		diff |= t->token[i] ^ ((i < len) ? s[i] : 0);
+	return !diff;
+}
+
+static
+unsigned gw_request_roles(const struct gw_conn * const c, const char * const headers, const char * const hdrend)
+{
+	unsigned roles = c->peer_roles;
+	const char *auth = gw_header(headers, hdrend, "Authorization");
+	if (!(auth && !strncasecmp(auth, "Bearer ", 7)))
+		return roles;
+	auth += 7;
+	const char *authend = memchr(auth, '\r', hdrend + 1 - auth) ?: hdrend;
+	while (authend > auth && (authend[-1] == ' ' || authend[-1] == '\t'))
+		--authend;
+	for (size_t i = 0; i < n_tokens; ++i)
+		if (gw_token_equal(&tokens[i], auth, authend - auth))
+			roles |= tokens[i].roles;
+	return roles;
+}
+
+// Returns false if the request is incomplete
+static
+bool gw_parse_request(struct gw_conn * const c)
+{
+	const char * const in = c->in;
+	const char * const hdrend = memmem(in, c->inlen, "\r\n\r\n", 4);
+	if (!hdrend)
+	{
+		if (c->inlen >= sizeof(c->in))
+		{
+			c->reqlen = c->inlen;
+			c->keepalive = false;
+			gw_respond_error(c, "431 Request Header Fields Too Large");
+		}
+		return false;
+	}
+	const size_t hdrlen = hdrend + 4 - in;
+	
+	const char * const method = in;
+	const char * const path = memchr(in, ' ', hdrend - in);
+	const char * const pathend = path ? memchr(path + 1, ' ', hdrend - path - 1) : NULL;
+	if (!pathend)
+	{
+		c->reqlen = c->inlen;
+		c->keepalive = false;
+		gw_respond_error(c, "400 Bad Request");
+		return true;
+	}
+	const char * const lineend = memchr(pathend, '\r', hdrend + 2 - pathend);
+	const char * const headers = lineend + 2;
+	
+	const char * const connhdr = gw_header(headers, hdrend, "Connection");
+	if (!strncmp(pathend + 1, "HTTP/1.0", 8))
+		c->keepalive = (connhdr && !strncasecmp(connhdr, "keep-alive", 10));
+	else
+		c->keepalive = !(connhdr && !strncasecmp(connhdr, "close", 5));
+	
+	// Only Content-Length framing is supported; otherwise the body would be taken for the next request
+	if (gw_header(headers, hdrend, "Transfer-Encoding"))
+	{
+		c->reqlen = c->inlen;
+		c->keepalive = false;
+		gw_respond_error(c, "411 Length Required");
+		return true;
+	}
+	const char * const clhdr = gw_header(headers, hdrend, "Content-Length");
+	const unsigned long bodylen = clhdr ? strtoul(clhdr, NULL, 10) : 0;
+	if (bodylen > sizeof(c->in) - hdrlen)
+	{
+		c->reqlen = c->inlen;
+		c->keepalive = false;
+		gw_respond_error(c, "413 Payload Too Large");
+		return true;
+	}
+	if (c->inlen < hdrlen + bodylen)
+		return false;
+	c->reqlen = hdrlen + bodylen;
+	
+	const char *query = memchr(path + 1, '?', pathend - path - 1);
+	const char * const pathe = query ?: pathend;
+	const size_t methodlen = path - method;
+	const unsigned roles = gw_request_roles(c, headers, hdrend);
+	static const char req_prefix[] = "/request/", events_path[] = "/events";
+	if (methodlen == 4 && !memcmp(method, "POST", 4) && pathe - path - 1 > sizeof(req_prefix) - 1 && !memcmp(path + 1, req_prefix, sizeof(req_prefix) - 1))
+	{
+		const char * const name = path + sizeof(req_prefix);
+		struct gw_service * const svc = gw_find_service(name, pathe - name, false);
+		if (!(roles & FABD_ROLE_CONTROL))
+		{
+			applog(LOG_NOTICE, "Denied request to %.*s without the control role", (int)(pathe - name), name);
+			gw_respond_error(c, "403 Forbidden");
+		}
+		else
+		if (!svc)
+			gw_respond_error(c, "404 Not Found");
+		else
+			gw_handle_request(c, svc, &in[hdrlen], bodylen);
+	}
+	else
+	if (methodlen == 3 && !memcmp(method, "GET", 3) && pathe - path - 1 >= sizeof(events_path) - 1 && !memcmp(path + 1, events_path, sizeof(events_path) - 1))
+	{
+		if (!(roles & FABD_ROLE_READ))
+		{
+			applog(LOG_NOTICE, "Denied events without the read role");
+			gw_respond_error(c, "403 Forbidden");
+			return true;
+		}
+		const char * const name = path + sizeof(events_path);
+		const struct gw_service *svc = NULL;
+		if (name < pathe)
+		{
+			if (name[0] != '/' || !(svc = gw_find_service(name + 1, pathe - name - 1, true)))
+			{
+				gw_respond_error(c, "404 Not Found");
+				return true;
+			}
+		}
+		const char * const accept = gw_header(headers, hdrend, "Accept");
+		const bool sse = (accept && !strncmp(accept, "text/event-stream", 17)) || (query && memmem(query, pathend - query, "format=sse", 10));
+		gw_handle_events(c, svc, sse);
+	}
+	else
+		gw_respond_error(c, "404 Not Found");
+	return true;
+}
+
+static
+void gw_close(const int i)
+{
+	struct gw_conn * const c = conns[i];
+	close(c->fd);
+	free(c->out);
+	free(c);
+	conns[i] = NULL;
+}
+
+static
+unsigned gw_peer_roles(const int fd)
+{
+	struct ucred cred;
+	socklen_t credsz = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credsz))
+		return 0;
+	// The same users peer credentials allow over ipc
+	if (cred.uid == geteuid() || cred.uid == 0)
+		return FABD_ROLE_ALL;
+	for (size_t i = 0; i < n_uids; ++i)
+		if (uids[i].uid == cred.uid)
+			return uids[i].roles;
+	return 0;
+}
+
+static
+void gw_accept(const int listenfd, const bool is_unix)
+{
+	const int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	for (int i = 0; i < GW_MAX_CONNS; ++i)
+	{
+		if (conns[i])
+			continue;
+		struct gw_conn * const c = malloc(sizeof(*c));
+		if (!c)
+			break;
+		c->fd = fd;
+		c->id = next_conn_id++;
+		c->state = GCS_READING;
+		c->keepalive = true;
+		c->inlen = c->reqlen = 0;
+		c->out = NULL;
+		c->outpos = c->outlen = c->outsz = 0;
+		c->peer_roles = is_unix ? gw_peer_roles(fd) : 0;
+		conns[i] = c;
+		return;
+	}
+	applog(LOG_WARNING, "Too many connections");
+	close(fd);
+}
+
+// Returns false if the connection should be closed
+static
+bool gw_conn_read(struct gw_conn * const c)
+{
+	if (c->state == GCS_STREAMING)
+		// Nothing more to say; we only watch for it to go away
+		c->inlen = 0;
+	const ssize_t rv = recv(c->fd, &c->in[c->inlen], sizeof(c->in) - c->inlen, 0);
+	if (rv == 0 || (rv < 0 && errno != EAGAIN && errno != EINTR))
+		return false;
+	if (rv > 0)
+		c->inlen += rv;
+	if (c->state != GCS_READING)
+		// Pipelined requests wait their turn
+		return true;
+	while (c->state == GCS_READING && c->inlen && gw_parse_request(c))
+		if (!c->keepalive)
+			break;
+	return true;
+}
+
+static
+bool gw_conn_write(struct gw_conn * const c)
+{
+	while (c->outpos < c->outlen)
+	{
+		const ssize_t rv = send(c->fd, &c->out[c->outpos], c->outlen - c->outpos, MSG_NOSIGNAL);
+		if (rv < 0)
+			return (errno == EAGAIN || errno == EINTR);
+		c->outpos += rv;
+	}
+	c->outpos = c->outlen = 0;
+	if (c->state == GCS_READING && !c->keepalive)
+		return false;
+	// Any pipelined requests can proceed now
+	while (c->state == GCS_READING && c->inlen && gw_parse_request(c))
+		if (!c->keepalive)
+			break;
+	return true;
+}
+
+static
+void gw_recv_reply(struct gw_service * const svc, struct fabd_pbarena * const arena)
+{
+	zmq_msg_t msg;
+	zmq_msg_init(&msg);
+	while (zmq_msg_recv(&msg, svc->socket, ZMQ_DONTWAIT) >= 0)
+	{
+		if (zmq_msg_more(&msg))
+			// Delimiter
+			continue;
+		struct gw_pending * const pending = svc->pending;
+		if (!pending)
+			continue;
+		svc->pending = pending->next;
+		if (!svc->pending)
+			svc->pending_tail = &svc->pending;
+		struct gw_conn * const c = gw_find_conn(pending->conn_id);
+		free(pending);
+		if (!c)
+			// Client went away
+			continue;
+		
+		PbRequestReply * const reply = pb_request_reply__unpack(&arena->allocator, zmq_msg_size(&msg), zmq_msg_data(&msg));
+		int errcount = 0;
+		struct fabd_json_writer w;
+		fabd_json_writer_init(&w, false);
+		if (reply && protobuf_to_json_write(&w, reply, &errcount))
+			gw_respond(c, "200 OK", "application/json", w.buf, w.len);
+		else
+			gw_respond_error(c, "502 Bad Gateway");
+		fabd_json_writer_free(&w);
+		fabd_pbarena_reset(arena);
+	}
+	zmq_msg_close(&msg);
+}
+
+static
+void gw_recv_event(const struct gw_service * const svc, struct fabd_pbarena * const arena, struct fabd_json_writer * const w)
+{
+	PbEvent *pbevent;
+	zmq_recv_protobuf(svc->socket, pb_event, pbevent, &arena->allocator);
+	if (!pbevent)
+		return;
+	int errcount = 0;
+	w->len = 0;
+	bool ok = protobuf_to_json_write(w, pbevent, &errcount);
+	fabd_pbarena_reset(arena);
+	if (!ok)
+		return;
+	
+	// Encoded once, and framed per client
+	for (int i = 0; i < GW_MAX_CONNS; ++i)
+	{
+		struct gw_conn * const c = conns[i];
+		if (!(c && c->state == GCS_STREAMING))
+			continue;
+		if (c->stream_service && c->stream_service != svc)
+			continue;
+		if (c->outlen - c->outpos > GW_MAX_BACKLOG)
+		{
+			applog(LOG_WARNING, "Dropping slow event stream client");
+			gw_close(i);
+			continue;
+		}
+		if (c->sse)
+			ok = gw_out(c, "event: ", 7) && gw_out(c, svc->name, strlen(svc->name)) && gw_out(c, "\ndata: ", 7) && gw_out(c, w->buf, w->len) && gw_out(c, "\n\n", 2);
+		else
+		if (c->stream_service)
+			ok = gw_out(c, w->buf, w->len) && gw_out(c, "\n", 1);
+		else
+			ok = gw_out(c, "{\"source\":", 10) && gw_out(c, svc->jname, strlen(svc->jname)) && gw_out(c, ",\"event\":", 9) && gw_out(c, w->buf, w->len) && gw_out(c, "}\n", 2);
+		if (!ok)
+			gw_close(i);
+	}
+}
+
+static
+int gw_listen(const char * const spec, bool * const is_unix)
+{
+	int fd;
+	*is_unix = !strncmp(spec, "unix:", 5);
+	if (*is_unix)
+	{
+		struct sockaddr_un sa = { .sun_family = AF_UNIX, };
+		const char * const path = &spec[5];
+		if (strlen(path) >= sizeof(sa.sun_path))
+			return -1;
+		strcpy(sa.sun_path, path);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		unlink(path);
+		// Only the owner and group may connect, from the start; peer credentials then decide what they can do
+		const mode_t oldmask = umask(0117);
+		const int rv = bind(fd, (void*)&sa, sizeof(sa));
+		umask(oldmask);
+		if (rv)
+			goto err;
+	}
+	else
+	{
+		const char * const colon = strrchr(spec, ':');
+		if (!colon)
+			return -1;
+		char host[colon - spec + 1];
+		memcpy(host, spec, colon - spec);
+		host[colon - spec] = '\0';
+		const struct addrinfo hints = {
+			.ai_family = AF_UNSPEC,
+			.ai_socktype = SOCK_STREAM,
+			.ai_flags = AI_PASSIVE,
+		};
+		struct addrinfo *ai;
+		if (getaddrinfo(host[0] ? host : NULL, &colon[1], &hints, &ai))
+			return -1;
+		fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+		{
+			freeaddrinfo(ai);
+			return -1;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &int_one, sizeof(int_one));
+		const int rv = bind(fd, ai->ai_addr, ai->ai_addrlen);
+		freeaddrinfo(ai);
+		if (rv)
+			goto err;
+	}
+	if (listen(fd, 0x10))
+		goto err;
+	return fd;
+	
+err:
+	close(fd);
+	return -1;
+}
+
+static
+void gw_add_services(json_t * const jnames, const bool events)
+{
+	const size_t n = json_array_size(jnames);
+	services = realloc(services, sizeof(*services) * (n_services + n));
+	assert(services);
+	for (size_t i = 0; i < n; ++i)
+	{
+		const char * const name = json_string_value(json_array_get(jnames, i));
+		assert(name);
+		struct gw_service * const svc = &services[n_services++];
+		*svc = (struct gw_service){
+			.name = strdup(name),
+			.events = events,
+		};
+		svc->pending_tail = &svc->pending;
+		json_t * const jname = json_string(name);
+		svc->jname = json_dumps(jname, JSON_ENCODE_ANY);
+		json_decref(jname);
+		gw_service_connect(svc);
+		applog(LOG_INFO, "Serving %s %s", events ? "events from" : "requests to", name);
+	}
+}
+
+// "http_tokens": { "<bearer token>": <role or Array of roles>, ... }
+// "http_uids": { "<uid>": <role or Array of roles>, ... } for unix socket peers, besides this user and root (which get all)
+static
+void gw_load_access()
+{
+	const char *key;
+	json_t *j;
+	json_t * const jtokens = fabdcfg_device_get(my_devid, "http_tokens");
+	tokens = malloc(sizeof(*tokens) * (json_object_size(jtokens) ?: 1));
+	assert(tokens);
+	json_object_foreach(jtokens, key, j)
+		tokens[n_tokens++] = (struct gw_token){
+			.token = strdup(key),
+			.len = strlen(key),
+			.roles = fabd_authz_parse_roles(j),
+		};
+	
+	json_t * const juids = fabdcfg_device_get(my_devid, "http_uids");
+	uids = malloc(sizeof(*uids) * (json_object_size(juids) ?: 1));
+	assert(uids);
+	json_object_foreach(juids, key, j)
+	{
+		char *end;
+		const unsigned long uid = strtoul(key, &end, 10);
+		if (end == key || end[0])
+		{
+			applog(LOG_WARNING, "Invalid uid '%s' in http_uids", key);
+			continue;
+		}
+		uids[n_uids++] = (struct gw_uid){
+			.uid = uid,
+			.roles = fabd_authz_parse_roles(j),
+		};
+	}
+}
+
+int main(int argc, char **argv)
+{
+	my_devid = fabd_common_argv(argc, argv, "gateway");
+	load_freeabode_key();
+	signal(SIGPIPE, SIG_IGN);
+	
+	request_timeout_ms = fabdcfg_device_getint(my_devid, "request_timeout_ms", 5000);
+	gw_load_access();
+	
+	my_zmq_context = zmq_ctx_new();
+	
+	json_t *j = fabd_json_array(fabdcfg_device_get(my_devid, "request_clients"));
+	gw_add_services(j, false);
+	json_decref(j);
+	j = fabd_json_array(fabdcfg_device_get(my_devid, "event_clients"));
+	gw_add_services(j, true);
+	json_decref(j);
+	
+	int listenfds[GW_MAX_LISTENERS];
+	bool listen_unix[GW_MAX_LISTENERS];
+	size_t n_listeners = 0;
+	json_t * const jlisten_default = json_string("127.0.0.1:2980");
+	j = fabd_json_array(fabdcfg_device_get(my_devid, "listen") ?: jlisten_default);
+	json_decref(jlisten_default);
+	for (size_t i = 0; i < json_array_size(j) && n_listeners < GW_MAX_LISTENERS; ++i)
+	{
+		const char * const spec = json_string_value(json_array_get(j, i));
+		const int fd = spec ? gw_listen(spec, &listen_unix[n_listeners]) : -1;
+		if (fd < 0)
+		{
+			applog(LOG_ERR, "Failed to listen on %s", spec ?: "(invalid)");
+			exit(1);
+		}
+		if (!(listen_unix[n_listeners] || n_tokens))
+			applog(LOG_WARNING, "No http_tokens configured, so nothing is allowed on %s", spec);
+		listenfds[n_listeners++] = fd;
+		applog(LOG_INFO, "Listening on %s", spec);
+	}
+	json_decref(j);
+	
+	struct fabd_pbarena arena;
+	fabd_pbarena_init(&arena, 0x400);
+	struct fabd_json_writer w;
+	fabd_json_writer_init(&w, false);
+	
+	zmq_pollitem_t pollitems[GW_MAX_LISTENERS + n_services + GW_MAX_CONNS];
+	int pollconn[GW_MAX_CONNS];
+	struct timespec ts_now, ts_timeout;
+	while (true)
+	{
+		size_t n_pollitems = 0;
+		for (size_t i = 0; i < n_listeners; ++i)
+			pollitems[n_pollitems++] = (zmq_pollitem_t){ .fd = listenfds[i], .events = ZMQ_POLLIN };
+		for (size_t i = 0; i < n_services; ++i)
+			pollitems[n_pollitems++] = (zmq_pollitem_t){ .socket = services[i].socket, .events = ZMQ_POLLIN };
+		const size_t first_conn_pollitem = n_pollitems;
+		for (int i = 0; i < GW_MAX_CONNS; ++i)
+		{
+			struct gw_conn * const c = conns[i];
+			if (!c)
+				continue;
+			pollconn[n_pollitems - first_conn_pollitem] = i;
+			pollitems[n_pollitems++] = (zmq_pollitem_t){
+				.fd = c->fd,
+				.events = ((c->inlen < sizeof(c->in)) ? ZMQ_POLLIN : 0) | ((c->outlen > c->outpos) ? ZMQ_POLLOUT : 0),
+			};
+		}
+		
+		timespec_clear(&ts_timeout);
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+		for (size_t i = 0; i < n_services; ++i)
+			if (services[i].pending && timespec_passed(&services[i].pending->ts_deadline, &ts_now, &ts_timeout))
+				gw_service_reset(&services[i]);
+		
+		if (zmq_poll(pollitems, n_pollitems, timespec_to_timeout_ms(&ts_now, &ts_timeout)) <= 0)
+			continue;
+		
+		for (size_t i = 0; i < n_listeners; ++i)
+			if (pollitems[i].revents & ZMQ_POLLIN)
+				gw_accept(listenfds[i], listen_unix[i]);
+		for (size_t i = 0; i < n_services; ++i)
+		{
+			if (!(pollitems[n_listeners + i].revents & ZMQ_POLLIN))
+				continue;
+			if (services[i].events)
+				gw_recv_event(&services[i], &arena, &w);
+			else
+				gw_recv_reply(&services[i], &arena);
+		}
+		for (size_t i = first_conn_pollitem; i < n_pollitems; ++i)
+		{
+			const int ci = pollconn[i - first_conn_pollitem];
+			struct gw_conn * const c = conns[ci];
+			if (!c)
+				// Dropped while handling events
+				continue;
+			bool ok = true;
+			if (pollitems[i].revents & (ZMQ_POLLIN | ZMQ_POLLERR))
+				ok = gw_conn_read(c);
+			if (ok && c->outlen > c->outpos)
+				ok = gw_conn_write(c);
+			if (!ok)
+				gw_close(ci);
+		}
+	}
+}
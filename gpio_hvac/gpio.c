@@ -0,0 +1,27 @@
+#include "config.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "gpio.h"
+
+static const struct gpio_backend * const gpio_backends[] = {
+#ifdef HAVE_LIBGPIOD
+	&gpio_backend_gpiod,
+#endif
+	&gpio_backend_sim,
+};
+
+const struct gpio_backend *gpio_backend_find(const char * const name)
+{
+	for (size_t i = 0; i < sizeof(gpio_backends) / sizeof(*gpio_backends); ++i)
+		if (!strcmp(gpio_backends[i]->name, name))
+			return gpio_backends[i];
+	return NULL;
+}
+
+const char *gpio_backend_default_name(void)
+{
+	// Real hardware if it can be had
+	return gpio_backends[0]->name;
+}
@@ -0,0 +1,69 @@
+#ifndef FABD_GPIO_HVAC_GPIO_H
+#define FABD_GPIO_HVAC_GPIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+// Output lines requested together from one chip; every backend's handle starts with this
+struct gpio_lines {
+	const struct gpio_backend *backend;
+	unsigned n_lines;
+};
+
+struct gpio_backend {
+	const char *name;
+	// Offsets are line numbers on the chip; every line starts off low
+	struct gpio_lines *(*request)(const char *chip_path, const unsigned *offsets, unsigned n_lines, const char *consumer);
+	// Lines are identified by their index in the offsets given to request
+	bool (*set)(struct gpio_lines *, unsigned line, bool value);
+	// Sets every line at once
+	bool (*set_all)(struct gpio_lines *, const bool *values);
+	void (*release)(struct gpio_lines *);
+};
+
+#ifdef HAVE_LIBGPIOD
+extern const struct gpio_backend gpio_backend_gpiod;
+#endif
+extern const struct gpio_backend gpio_backend_sim;
+
+// NULL if unknown, or not built
+extern const struct gpio_backend *gpio_backend_find(const char *name);
+extern const char *gpio_backend_default_name(void);
+
+static inline
+bool gpio_lines_set(struct gpio_lines * const lines, const unsigned line, const bool value)
+{
+	return lines->backend->set(lines, line, value);
+}
+
+static inline
+bool gpio_lines_set_all(struct gpio_lines * const lines, const bool * const values)
+{
+	return lines->backend->set_all(lines, values);
+}
+
+static inline
+void gpio_lines_release(struct gpio_lines * const lines)
+{
+	lines->backend->release(lines);
+}
+
+// Simulated chip: nothing but a record of every change made
+// Only the most recent GPIO_SIM_TIMELINE_SIZE changes are kept in memory
+#define GPIO_SIM_TIMELINE_SIZE  0x1000
+
+struct gpio_sim_change {
+	struct timespec ts;  // CLOCK_MONOTONIC
+	unsigned line;
+	bool value;
+};
+
+// Returns the number of changes recorded in total; *out (oldest first) has up to GPIO_SIM_TIMELINE_SIZE of the latest, *n_out of them
+extern unsigned long gpio_sim_timeline(const struct gpio_lines *, struct gpio_sim_change *out, size_t *n_out);
+extern bool gpio_sim_get(const struct gpio_lines *, unsigned line);
+// Also appends each change to f, as "<seconds>.<nanoseconds> <offset> <0|1>" lines (flushed once per call)
+extern void gpio_sim_set_log(struct gpio_lines *, FILE *f);
+
+#endif
@@ -0,0 +1,104 @@
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <gpiod.h>
+
+#include <freeabode/logging.h>
+
+#include "gpio.h"
+
+// libgpiod 1.x
+
+struct gpio_gpiod_lines {
+	struct gpio_lines base;
+	struct gpiod_chip *chip;
+	struct gpiod_line_bulk bulk;
+};
+
+static
+struct gpio_lines *gpio_gpiod_request(const char * const chip_path, const unsigned * const offsets, const unsigned n_lines, const char * const consumer)
+{
+	if (n_lines > GPIOD_LINE_BULK_MAX_LINES)
+		return NULL;
+	struct gpiod_chip * const chip = gpiod_chip_open(chip_path);
+	if (!chip)
+	{
+		applog(LOG_ERR, "Failed to open GPIO chip %s", chip_path);
+		return NULL;
+	}
+	struct gpio_gpiod_lines * const gl = malloc(sizeof(*gl));
+	assert(gl);
+	*gl = (struct gpio_gpiod_lines){
+		.base = {
+			.backend = &gpio_backend_gpiod,
+			.n_lines = n_lines,
+		},
+		.chip = chip,
+	};
+	gpiod_line_bulk_init(&gl->bulk);
+	int default_vals[n_lines ?: 1];
+	for (unsigned i = 0; i < n_lines; ++i)
+	{
+		struct gpiod_line * const line = gpiod_chip_get_line(chip, offsets[i]);
+		if (!line)
+		{
+			applog(LOG_ERR, "GPIO chip %s has no line %u", chip_path, offsets[i]);
+			goto err;
+		}
+		gpiod_line_bulk_add(&gl->bulk, line);
+		default_vals[i] = 0;
+	}
+	if (n_lines && gpiod_line_request_bulk_output(&gl->bulk, consumer, default_vals))
+	{
+		applog(LOG_ERR, "Failed to request GPIO lines from %s", chip_path);
+		goto err;
+	}
+	return &gl->base;
+	
+err:
+	gpiod_chip_close(chip);
+	free(gl);
+	return NULL;
+}
+
+static
+bool gpio_gpiod_set(struct gpio_lines * const lines, const unsigned line, const bool value)
+{
+	struct gpio_gpiod_lines * const gl = (void*)lines;
+	if (line >= lines->n_lines)
+		return false;
+	return !gpiod_line_set_value(gl->bulk.lines[line], value ? 1 : 0);
+}
+
+static
+bool gpio_gpiod_set_all(struct gpio_lines * const lines, const bool * const values)
+{
+	struct gpio_gpiod_lines * const gl = (void*)lines;
+	if (!lines->n_lines)
+		return true;
+	int vals[lines->n_lines];
+	for (unsigned i = 0; i < lines->n_lines; ++i)
+		vals[i] = values[i] ? 1 : 0;
+	return !gpiod_line_set_value_bulk(&gl->bulk, vals);
+}
+
+static
+void gpio_gpiod_release(struct gpio_lines * const lines)
+{
+	struct gpio_gpiod_lines * const gl = (void*)lines;
+	if (lines->n_lines)
+		gpiod_line_release_bulk(&gl->bulk);
+	gpiod_chip_close(gl->chip);
+	free(gl);
+}
+
+const struct gpio_backend gpio_backend_gpiod = {
+	.name = "gpiod",
+	.request = gpio_gpiod_request,
+	.set = gpio_gpiod_set,
+	.set_all = gpio_gpiod_set_all,
+	.release = gpio_gpiod_release,
+};
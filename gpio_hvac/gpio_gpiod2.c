@@ -0,0 +1,121 @@
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gpiod.h>
+
+#include <freeabode/logging.h>
+
+#include "gpio.h"
+
+// libgpiod 2.x: all lines belong to one line request, which can set any subset of them in one ioctl
+
+struct gpio_gpiod_lines {
+	struct gpio_lines base;
+	struct gpiod_chip *chip;
+	struct gpiod_line_request *req;
+	unsigned *offsets;
+};
+
+static
+struct gpiod_line_request *gpio_gpiod_request_lines(struct gpiod_chip * const chip, const unsigned * const offsets, const unsigned n_lines, const char * const consumer)
+{
+	struct gpiod_line_request *req = NULL;
+	struct gpiod_line_settings * const settings = gpiod_line_settings_new();
+	struct gpiod_line_config * const lcfg = gpiod_line_config_new();
+	struct gpiod_request_config * const rcfg = gpiod_request_config_new();
+	if (!(settings && lcfg && rcfg))
+		goto out;
+	gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_OUTPUT);
+	gpiod_line_settings_set_output_value(settings, GPIOD_LINE_VALUE_INACTIVE);
+	if (gpiod_line_config_add_line_settings(lcfg, offsets, n_lines, settings))
+		goto out;
+	gpiod_request_config_set_consumer(rcfg, consumer);
+	req = gpiod_chip_request_lines(chip, rcfg, lcfg);
+	
+out:
+	gpiod_request_config_free(rcfg);
+	gpiod_line_config_free(lcfg);
+	gpiod_line_settings_free(settings);
+	return req;
+}
+
+static
+struct gpio_lines *gpio_gpiod_request(const char * const chip_path, const unsigned * const offsets, const unsigned n_lines, const char * const consumer)
+{
+	struct gpiod_chip * const chip = gpiod_chip_open(chip_path);
+	if (!chip)
+	{
+		applog(LOG_ERR, "Failed to open GPIO chip %s", chip_path);
+		return NULL;
+	}
+	struct gpio_gpiod_lines * const gl = malloc(sizeof(*gl));
+	assert(gl);
+	*gl = (struct gpio_gpiod_lines){
+		.base = {
+			.backend = &gpio_backend_gpiod,
+			.n_lines = n_lines,
+		},
+		.chip = chip,
+		.offsets = malloc(sizeof(*gl->offsets) * (n_lines ?: 1)),
+	};
+	assert(gl->offsets);
+	memcpy(gl->offsets, offsets, sizeof(*offsets) * n_lines);
+	if (n_lines)
+	{
+		gl->req = gpio_gpiod_request_lines(chip, offsets, n_lines, consumer);
+		if (!gl->req)
+		{
+			applog(LOG_ERR, "Failed to request GPIO lines from %s", chip_path);
+			gpiod_chip_close(chip);
+			free(gl->offsets);
+			free(gl);
+			return NULL;
+		}
+	}
+	return &gl->base;
+}
+
+static
+bool gpio_gpiod_set(struct gpio_lines * const lines, const unsigned line, const bool value)
+{
+	struct gpio_gpiod_lines * const gl = (void*)lines;
+	if (line >= lines->n_lines)
+		return false;
+	return !gpiod_line_request_set_value(gl->req, gl->offsets[line], value ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE);
+}
+
+static
+bool gpio_gpiod_set_all(struct gpio_lines * const lines, const bool * const values)
+{
+	struct gpio_gpiod_lines * const gl = (void*)lines;
+	if (!lines->n_lines)
+		return true;
+	enum gpiod_line_value vals[lines->n_lines];
+	for (unsigned i = 0; i < lines->n_lines; ++i)
+		vals[i] = values[i] ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE;
+	// Offsets given explicitly, so the order of values can't depend on how the request was laid out
+	return !gpiod_line_request_set_values_subset(gl->req, lines->n_lines, gl->offsets, vals);
+}
+
+static
+void gpio_gpiod_release(struct gpio_lines * const lines)
+{
+	struct gpio_gpiod_lines * const gl = (void*)lines;
+	if (gl->req)
+		gpiod_line_request_release(gl->req);
+	gpiod_chip_close(gl->chip);
+	free(gl->offsets);
+	free(gl);
+}
+
+const struct gpio_backend gpio_backend_gpiod = {
+	.name = "gpiod",
+	.request = gpio_gpiod_request,
+	.set = gpio_gpiod_set,
+	.set_all = gpio_gpiod_set_all,
+	.release = gpio_gpiod_release,
+};
@@ -2,169 +2,187 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-#include <gpiod.h>
 #include <zmq.h>
 
+#include <freeabode/eventtime.h>
 #include <freeabode/fabdcfg.h>
+#include <freeabode/interlock.h>
 #include <freeabode/freeabode.pb-c.h>
 #include <freeabode/json.h>
 #include <freeabode/logging.h>
+#include <freeabode/metrics.h>
 #include <freeabode/security.h>
 #include <freeabode/util.h>
 #include <freeabode/util_hvac.h>
+#include <freeabode/wirestats.h>
 
-static const struct timespec ts_shutoff_delay = { .tv_sec = 337, .tv_nsec = 500000000, };
-static const struct timespec ts_reversing_delay_tolerance = { .tv_sec = 1, };
+#include "gpio.h"
+
+// Each wire at most twice over; anything more is refused outright
+#define GPIO_HVAC_MAX_WIRES_PER_REQUEST  (PB_HVACWIRES___COUNT * 2)
+
+static const struct fabd_interlock_rule gpio_hvac_interlocks[] = {
+	// after turning off, lock off for a few minutes
+	{ .type = FIT_MIN_OFF, .wires = FABD_WIRE(PB_HVACWIRES__Y1) | FABD_WIRE(PB_HVACWIRES__W2), .delay = { .tv_sec = 337, .tv_nsec = 500000000, }, },
+	// don't allow reversing changes while compressor is running
+	{ .type = FIT_HOLD_WHILE, .wires = FABD_WIRE(PB_HVACWIRES__OB), .others = FABD_WIRE(PB_HVACWIRES__Y1), .delay = { .tv_sec = 1, }, },
+	// fan must run with the compressor or heat
+	{ .type = FIT_REQUIRES, .wires = FABD_WIRE(PB_HVACWIRES__Y1) | FABD_WIRE(PB_HVACWIRES__W2), .others = FABD_WIRE(PB_HVACWIRES__G), .force = true, },
+};
+static const uint32_t request_latency_bounds_us[] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 10000, 100000, };
 
 static const char *my_devid;
 static void *my_zmq_context, *my_zmq_publisher;
 
 struct my_gpioinfo {
-	struct gpiod_line *gpioline;
+	int line;  // index into gpio_hvac_obj.lines, or -1 if not connected
 	enum fabd_tristate value;
-	struct timespec last_changed;
 };
 
 struct gpio_hvac_obj {
 	struct my_gpioinfo gpio[PB_HVACWIRES___COUNT];
+	struct gpio_lines *lines;
+	struct fabd_interlocks interlocks;
+	struct fabd_wirestats wirestats;
+	struct fabd_metric *request_latency;
 };
 
 static
 void gpio_hvac_obj_init(struct gpio_hvac_obj * const gho)
 {
-	struct timespec ts_now;
-	clock_gettime(CLOCK_MONOTONIC, &ts_now);
 	for (int i = 0; i < PB_HVACWIRES___COUNT; ++i)
 	{
-		gho->gpio[i].gpioline = NULL;
+		gho->gpio[i].line = -1;
 		gho->gpio[i].value = FTS_UNKNOWN;
-		
-		// Initialise last_changed to now, since it's used for safety lockouts only
-		gho->gpio[i].last_changed = ts_now;
 	}
 }
 
+// Puts every wire in the target state with one update of all the GPIOs, so no intermediate state is ever visible
+// Wires without a GPIO line are left alone
 static
-struct my_gpioinfo *gpioinfo_from_wire(struct gpio_hvac_obj * const gho, const PbHVACWires wire) {
-	if (wire >= PB_HVACWIRES___COUNT) return NULL;
-	return &gho->gpio[wire];
-}
-
-static
-bool control_wire_unsafe(struct gpio_hvac_obj * const gho, const PbHVACWires wire, const bool connect)
+bool gpio_hvac_apply(struct gpio_hvac_obj * const gho, const uint32_t target)
 {
-	struct my_gpioinfo * const gpioinfo = gpioinfo_from_wire(gho, wire);
-	if (!gpioinfo->gpioline) return false;
-	const bool success = (0 == gpiod_line_set_value(gpioinfo->gpioline, connect ? 1 : 0));
-	if (!success) {
-		applog(LOG_WARNING, "Failed to set GPIO for turning %s %s", connect ? "on" : "off", hvacwire_name(wire));
+	bool values[PB_HVACWIRES___COUNT];
+	PbHVACWires changed[PB_HVACWIRES___COUNT];
+	size_t n_changed = 0;
+	for (int i = 0; i < PB_HVACWIRES___COUNT; ++i)
+	{
+		const struct my_gpioinfo * const gpioinfo = &gho->gpio[i];
+		if (gpioinfo->line < 0)
+			continue;
+		const bool connect = target & FABD_WIRE(i);
+		values[gpioinfo->line] = connect;
+		if (gpioinfo->value != (enum fabd_tristate)connect)
+			changed[n_changed++] = i;
+	}
+	if (!n_changed)
+		return true;
+	if (!gpio_lines_set_all(gho->lines, values)) {
+		applog(LOG_WARNING, "Failed to set GPIOs for %u wire changes", (unsigned)n_changed);
 		return false;
 	}
 	
-	if (gpioinfo->value != connect) {
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	fabd_interlocks_commit(&gho->interlocks, target & gho->interlocks.available, &ts_now);
+	PbEvent pbevent = PB_EVENT__INIT;
+	PbSetHVACWireRequest pbwire[n_changed], *pbwirep[n_changed];
+	PbWireStats pbstats[n_changed], *pbstatsp[n_changed];
+	bool save_wirestats = false;
+	for (size_t i = 0; i < n_changed; ++i)
+	{
+		const PbHVACWires wire = changed[i];
+		const bool connect = target & FABD_WIRE(wire);
 		applog(LOG_INFO, "Turned %s %s", hvacwire_name(wire), connect ? "on" : "off");
-		clock_gettime(CLOCK_MONOTONIC, &gpioinfo->last_changed);
+		gho->gpio[wire].value = connect;
+		if (fabd_wirestats_change(&gho->wirestats, wire, connect, &ts_now))
+			save_wirestats = true;
+		
+		pb_set_hvacwire_request__init(&pbwire[i]);
+		pbwire[i].wire = wire;
+		pbwire[i].connect = connect;
+		pbwirep[i] = &pbwire[i];
+		fabd_wirestats_to_pb(&gho->wirestats, wire, &ts_now, &pbstats[i]);
+		pbstatsp[i] = &pbstats[i];
 	}
-	gpioinfo->value = connect;
+	if (save_wirestats)
+		fabd_wirestats_save(&gho->wirestats);
 	
-	PbEvent pbevent = PB_EVENT__INIT;
-	PbSetHVACWireRequest pbwire = PB_SET_HVACWIRE_REQUEST__INIT;
-	pbwire.wire = wire;
-	pbwire.connect = connect;
-	pbevent.wire_change = malloc(sizeof(*pbevent.wire_change));
-	pbevent.n_wire_change = 1;
-	*pbevent.wire_change = &pbwire;
-	zmq_send_protobuf(my_zmq_publisher, pb_event, &pbevent, 0);
-	free(pbevent.wire_change);
+	pbevent.wire_change = pbwirep;
+	pbevent.n_wire_change = n_changed;
+	pbevent.wire_stats = pbstatsp;
+	pbevent.n_wire_stats = n_changed;
+	fabd_pbevent_send(my_zmq_publisher, &pbevent, &ts_now);
+	for (size_t i = 0; i < n_changed; ++i)
+		fabd_wirestats_pb_free(&pbstats[i]);
 	
 	return true;
 }
 
 static
-bool control_wire_safe(struct gpio_hvac_obj * const gho, const PbHVACWires wire, const bool connect)
+bool gpio_hvac_wire_controllable(const struct gpio_hvac_obj * const gho, const PbHVACWires wire, const bool connect)
 {
-	struct my_gpioinfo * const gpioinfo = gpioinfo_from_wire(gho, wire);
-	switch (wire) {
-		case PB_HVACWIRES__Y1:  // compressor
-		case PB_HVACWIRES__W2:  // heat 2
-		{
-			if (connect && gpioinfo->value != true) {
-				// after turning off, lock off for a few minutes
-				struct timespec ts_soonest_cycle, ts_now;
-				timespec_add(&gpioinfo->last_changed, &ts_shutoff_delay, &ts_soonest_cycle);
-				clock_gettime(CLOCK_MONOTONIC, &ts_now);
-				if (timespec_cmp(&ts_now, &ts_soonest_cycle) < 0) {
-					applog(LOG_WARNING, "Prevented attempt to turn on %s during safety lockout", hvacwire_name(wire));
-					return false;
-				}
-				
-				struct my_gpioinfo * const gpioinfo_fan = gpioinfo_from_wire(gho, PB_HVACWIRES__G);
-				if (gpioinfo_fan->gpioline && gpioinfo_fan->value != true) {
-					// force fan on
-					if (!control_wire_safe(gho, PB_HVACWIRES__G, true)) {
-						applog(LOG_WARNING, "Failed to force fan on during request to turn on %s", hvacwire_name(wire));
-						return false;
-					}
-				}
-			}
-			break;
-		}
-		case PB_HVACWIRES__OB:  // reversing
-		{
-			// don't allow changes while compressor is running
-			// but if attempted, try to shut off the compressor since it's working against what is presumably desired
-			struct my_gpioinfo * const gpioinfo_compressor = gpioinfo_from_wire(gho, PB_HVACWIRES__Y1);
-			if (gpioinfo_compressor->value != false && connect != gpioinfo->value) {
-				struct timespec ts_tolerance, ts_now;
-				timespec_add(&gpioinfo_compressor->last_changed, &ts_reversing_delay_tolerance, &ts_tolerance);
-				clock_gettime(CLOCK_MONOTONIC, &ts_now);
-				if (timespec_cmp(&ts_now, &ts_tolerance) > 0) {
-					applog(LOG_WARNING, "Prevented attempt to turn %s reversing while compressor running", connect ? "on" : "off");
-					control_wire_safe(gho, PB_HVACWIRES__Y1, false);
-					return false;
-				}
-			}
-			break;
-		}
-		case PB_HVACWIRES__G:   // fan
-		{
-			// don't allow turning off while compressor or heat running
-			if (!connect) {
-				struct my_gpioinfo * const gpioinfo_compressor = gpioinfo_from_wire(gho, PB_HVACWIRES__Y1);
-				if (gpioinfo_compressor->value != false) {
-					applog(LOG_WARNING, "Prevented attempt to turn off fan while compressor running");
-					return false;
-				}
-				
-				struct my_gpioinfo * const gpioinfo_heat2 = gpioinfo_from_wire(gho, PB_HVACWIRES__W2);
-				if (gpioinfo_heat2->gpioline && gpioinfo_heat2->value != false) {
-					applog(LOG_WARNING, "Prevented attempt to turn off fan while heat 2 running");
-					return false;
-				}
-			}
-			break;
-		}
-		default:
-			// Assume unknown relays are always unsafe, since we have no safety controls
-			applog(LOG_WARNING, "Prevented attempt to turn %s unknown wire #%d", connect ? "on" : "off", (int)wire);
-			return false;
+	if (wire >= PB_HVACWIRES___COUNT) {
+		// Assume unknown relays are always unsafe, since we have no safety controls
+		applog(LOG_WARNING, "Prevented attempt to turn %s unknown wire #%d", connect ? "on" : "off", (int)wire);
+		return false;
 	}
-	return control_wire_unsafe(gho, wire, connect);
+	return gho->interlocks.available & FABD_WIRE(wire);
 }
 
 void handle_req(void * const s, struct gpio_hvac_obj * const gho)
 {
 	PbRequest *req;
 	zmq_recv_protobuf(s, pb_request, req, NULL);
+	struct timespec ts_start, ts_end;
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
 	PbRequestReply reply = PB_REQUEST_REPLY__INIT;
+	if (!req)
+	{
+		// Still needs a reply; with no successes, nothing was done
+		applog(LOG_WARNING, "Ignoring malformed request");
+		zmq_send_protobuf(s, pb_request_reply, &reply, 0);
+		return;
+	}
 	reply.n_sethvacwiresuccess = req->n_sethvacwire;
-	reply.sethvacwiresuccess = malloc(sizeof(*reply.sethvacwiresuccess) * reply.n_sethvacwiresuccess);
+	reply.sethvacwiresuccess = calloc(reply.n_sethvacwiresuccess ?: 1, sizeof(*reply.sethvacwiresuccess));
+	assert(reply.sethvacwiresuccess);
+	if (req->n_sethvacwire > GPIO_HVAC_MAX_WIRES_PER_REQUEST)
+	{
+		applog(LOG_WARNING, "Refused request to change %zu wires at once", req->n_sethvacwire);
+		goto out;
+	}
+	
+	// Gather the whole request into one proposed state, and apply what the interlocks allow of it at once
+	uint32_t proposed = gho->interlocks.on;
+	bool controllable[GPIO_HVAC_MAX_WIRES_PER_REQUEST];
+	for (size_t i = 0; i < req->n_sethvacwire; ++i)
+	{
+		const PbSetHVACWireRequest * const wirereq = req->sethvacwire[i];
+		controllable[i] = gpio_hvac_wire_controllable(gho, wirereq->wire, wirereq->connect);
+		if (!controllable[i])
+			continue;
+		if (wirereq->connect)
+			proposed |= FABD_WIRE(wirereq->wire);
+		else
+			proposed &= ~FABD_WIRE(wirereq->wire);
+	}
+	proposed = fabd_interlocks_check(&gho->interlocks, proposed, &ts_start);
+	const bool applied = gpio_hvac_apply(gho, proposed);
+	
 	for (size_t i = 0; i < req->n_sethvacwire; ++i)
-		reply.sethvacwiresuccess[i] = control_wire_safe(gho, req->sethvacwire[i]->wire, req->sethvacwire[i]->connect);
+		reply.sethvacwiresuccess[i] = applied && controllable[i] && !!(proposed & FABD_WIRE(req->sethvacwire[i]->wire)) == req->sethvacwire[i]->connect;
+	
+out:
 	pb_request__free_unpacked(req, NULL);
 	zmq_send_protobuf(s, pb_request_reply, &reply, 0);
 	free(reply.sethvacwiresuccess);
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	fabd_metric_observe(gho->request_latency, ((int64_t)(ts_end.tv_sec - ts_start.tv_sec) * 1000000) + ((ts_end.tv_nsec - ts_start.tv_nsec) / 1000));
 }
 
 void got_new_subscriber(void * const s, struct gpio_hvac_obj * const gho)
@@ -185,6 +203,11 @@ void got_new_subscriber(void * const s, struct gpio_hvac_obj * const gho)
 	PbSetHVACWireRequest *pbwire_top = pbwire;
 	pbevent.wire_change = malloc(sizeof(*pbevent.wire_change) * PB_HVACWIRES___COUNT);
 	pbevent.n_wire_change = 0;
+	PbWireStats pbstats[PB_HVACWIRES___COUNT];
+	pbevent.wire_stats = malloc(sizeof(*pbevent.wire_stats) * PB_HVACWIRES___COUNT);
+	pbevent.n_wire_stats = 0;
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
 	for (int i = 0; i < PB_HVACWIRES___COUNT; ++i)
 	{
 		const enum fabd_tristate asserted = gho->gpio[i].value;
@@ -197,10 +220,17 @@ void got_new_subscriber(void * const s, struct gpio_hvac_obj * const gho)
 		
 		pbevent.wire_change[pbevent.n_wire_change++] = pbwire;
 		++pbwire;
+		
+		fabd_wirestats_to_pb(&gho->wirestats, i, &ts_now, &pbstats[pbevent.n_wire_stats]);
+		pbevent.wire_stats[pbevent.n_wire_stats] = &pbstats[pbevent.n_wire_stats];
+		++pbevent.n_wire_stats;
 	}
 	
-	zmq_send_protobuf(my_zmq_publisher, pb_event, &pbevent, 0);
+	fabd_pbevent_send(my_zmq_publisher, &pbevent, NULL);
 	
+	for (size_t i = 0; i < pbevent.n_wire_stats; ++i)
+		fabd_wirestats_pb_free(&pbstats[i]);
+	free(pbevent.wire_stats);
 	free(pbevent.wire_change);
 	free(pbwire_top);
 	
@@ -209,14 +239,12 @@ out:
 }
 
 static
-struct gpiod_line *fabd_get_gpiod_line(struct gpiod_chip * const gpiochip, const json_t * const json_gpios, const char * const key)
+void fabd_add_gpio_line(struct gpio_hvac_obj * const gho, const PbHVACWires wire, const json_t * const json_gpios, const char * const key, unsigned * const offsets, unsigned * const n_lines)
 {
 	const int gpio_num = fabd_json_as_int(json_object_get(json_gpios, key), -1);
-	if (gpio_num < 0) return NULL;
-	struct gpiod_line * const gpioline = gpiod_chip_get_line(gpiochip, gpio_num);
-	assert(gpioline);
-	assert(0 == gpiod_line_request_output(gpioline, "freeabode gpio_hvac", 0));
-	return gpioline;
+	if (gpio_num < 0) return;
+	gho->gpio[wire].line = *n_lines;
+	offsets[(*n_lines)++] = gpio_num;
 }
 
 int main(int argc, char **argv)
@@ -224,27 +252,62 @@ int main(int argc, char **argv)
 	my_devid = fabd_common_argv(argc, argv, "gpio_hvac");
 	load_freeabode_key();
 	
+	const char * const gpio_backend_name = fabdcfg_device_getstr(my_devid, "gpio_backend") ?: gpio_backend_default_name();
+	const struct gpio_backend * const gpio_backend = gpio_backend_find(gpio_backend_name);
+	if (!gpio_backend)
+	{
+		applog(LOG_ERR, "Unknown GPIO backend '%s'", gpio_backend_name);
+		exit(1);
+	}
 	const char * const gpiochip_path = fabdcfg_device_getstr(my_devid, "gpiochip_device") ?: "/dev/gpiochip0";
-	struct gpiod_chip * const gpiochip = gpiod_chip_open(gpiochip_path);
-	assert(gpiochip);
 	
 	json_t * const json_gpios = fabdcfg_device_get(my_devid, "gpios");
 	struct gpio_hvac_obj _gho, *gho = &_gho;
 	gpio_hvac_obj_init(gho);
-	gho->gpio[PB_HVACWIRES__Y1].gpioline = fabd_get_gpiod_line(gpiochip, json_gpios, "compressor");
-	gho->gpio[PB_HVACWIRES__OB].gpioline = fabd_get_gpiod_line(gpiochip, json_gpios, "reversing");
-	gho->gpio[PB_HVACWIRES__G ].gpioline = fabd_get_gpiod_line(gpiochip, json_gpios, "fan");
-	gho->gpio[PB_HVACWIRES__W2].gpioline = fabd_get_gpiod_line(gpiochip, json_gpios, "heat 2");
+	{
+		char wirestats_path[0x100];
+		snprintf(wirestats_path, sizeof(wirestats_path), "%s.wirestats", my_devid);
+		fabd_wirestats_init(&gho->wirestats, fabdcfg_device_getstr(my_devid, "wirestats_file") ?: wirestats_path);
+	}
+	unsigned gpio_offsets[PB_HVACWIRES___COUNT], n_gpio_lines = 0;
+	fabd_add_gpio_line(gho, PB_HVACWIRES__Y1, json_gpios, "compressor", gpio_offsets, &n_gpio_lines);
+	fabd_add_gpio_line(gho, PB_HVACWIRES__OB, json_gpios, "reversing", gpio_offsets, &n_gpio_lines);
+	fabd_add_gpio_line(gho, PB_HVACWIRES__G , json_gpios, "fan", gpio_offsets, &n_gpio_lines);
+	fabd_add_gpio_line(gho, PB_HVACWIRES__W2, json_gpios, "heat 2", gpio_offsets, &n_gpio_lines);
 	// TODO: Support other wires
+	gho->lines = gpio_backend->request(gpiochip_path, gpio_offsets, n_gpio_lines, "freeabode gpio_hvac");
+	assert(gho->lines);
+	{
+		uint32_t available = 0;
+		for (int i = 0; i < PB_HVACWIRES___COUNT; ++i)
+			if (gho->gpio[i].line >= 0)
+				available |= FABD_WIRE(i);
+		struct timespec ts_now;
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+		fabd_interlocks_init(&gho->interlocks, gpio_hvac_interlocks, sizeof(gpio_hvac_interlocks) / sizeof(*gpio_hvac_interlocks), available, &ts_now);
+	}
+	if (gpio_backend == &gpio_backend_sim)
+	{
+		const char * const timeline_path = fabdcfg_device_getstr(my_devid, "gpio_sim_timeline");
+		FILE * const timeline = timeline_path ? fopen(timeline_path, "a") : NULL;
+		if (timeline)
+			gpio_sim_set_log(gho->lines, timeline);
+		else
+		if (timeline_path)
+			applog(LOG_ERR, "Failed to open %s", timeline_path);
+	}
+	{
+		char metric_labels[strlen(my_devid) + 0x10];
+		snprintf(metric_labels, sizeof(metric_labels), "devid=\"%s\"", my_devid);
+		gho->request_latency = fabd_metric_histogram("fabd_gpio_hvac_request_latency_us", metric_labels, "Time to carry out each request", request_latency_bounds_us, sizeof(request_latency_bounds_us) / sizeof(*request_latency_bounds_us));
+	}
 	
 	// Set them all to known and sane states (noop since Linux GPIO resets everything nowadays)
-	control_wire_safe(gho, PB_HVACWIRES__W2, false);
-	control_wire_safe(gho, PB_HVACWIRES__Y1, false);
-	control_wire_safe(gho, PB_HVACWIRES__OB, false);
-	control_wire_safe(gho, PB_HVACWIRES__G , false);
+	gpio_hvac_apply(gho, 0);
 	
 	my_zmq_context = zmq_ctx_new();
 	start_zap_handler(my_zmq_context);
+	fabd_metrics_serve(my_zmq_context, my_devid);
 	
 	void *my_zmq_ctl = zmq_socket(my_zmq_context, ZMQ_REP);
 	freeabode_zmq_security(my_zmq_ctl, true);
@@ -0,0 +1,129 @@
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <freeabode/logging.h>
+
+#include "gpio.h"
+
+struct gpio_sim_lines {
+	struct gpio_lines base;
+	unsigned *offsets;
+	bool *values;
+	FILE *log;
+	
+	// Ring of the most recent changes
+	struct gpio_sim_change timeline[GPIO_SIM_TIMELINE_SIZE];
+	unsigned long n_changes;
+};
+
+static
+struct gpio_lines *gpio_sim_request(const char * const chip_path, const unsigned * const offsets, const unsigned n_lines, const char * const consumer)
+{
+	struct gpio_sim_lines * const sim = malloc(sizeof(*sim));
+	assert(sim);
+	*sim = (struct gpio_sim_lines){
+		.base = {
+			.backend = &gpio_backend_sim,
+			.n_lines = n_lines,
+		},
+		.offsets = malloc(sizeof(*sim->offsets) * (n_lines ?: 1)),
+		.values = calloc(n_lines ?: 1, sizeof(*sim->values)),
+	};
+	assert(sim->offsets && sim->values);
+	memcpy(sim->offsets, offsets, sizeof(*offsets) * n_lines);
+	applog(LOG_NOTICE, "Using simulated GPIO chip (%u lines); no hardware will be controlled", n_lines);
+	return &sim->base;
+}
+
+static
+void gpio_sim_record(struct gpio_sim_lines * const sim, const unsigned line, const bool value, const struct timespec * const ts_now)
+{
+	if (sim->values[line] == value)
+		return;
+	sim->values[line] = value;
+	sim->timeline[sim->n_changes++ % GPIO_SIM_TIMELINE_SIZE] = (struct gpio_sim_change){
+		.ts = *ts_now,
+		.line = line,
+		.value = value,
+	};
+	if (sim->log)
+		fprintf(sim->log, "%lld.%09ld %u %d\n", (long long)ts_now->tv_sec, ts_now->tv_nsec, sim->offsets[line], (int)value);
+}
+
+static
+bool gpio_sim_set(struct gpio_lines * const lines, const unsigned line, const bool value)
+{
+	struct gpio_sim_lines * const sim = (void*)lines;
+	if (line >= lines->n_lines)
+		return false;
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	gpio_sim_record(sim, line, value, &ts_now);
+	if (sim->log)
+		fflush(sim->log);
+	return true;
+}
+
+static
+bool gpio_sim_set_all(struct gpio_lines * const lines, const bool * const values)
+{
+	struct gpio_sim_lines * const sim = (void*)lines;
+	// One timestamp for all, as the change is meant to be simultaneous
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	for (unsigned i = 0; i < lines->n_lines; ++i)
+		gpio_sim_record(sim, i, values[i], &ts_now);
+	if (sim->log)
+		fflush(sim->log);
+	return true;
+}
+
+static
+void gpio_sim_release(struct gpio_lines * const lines)
+{
+	struct gpio_sim_lines * const sim = (void*)lines;
+	if (sim->log)
+		fclose(sim->log);
+	free(sim->offsets);
+	free(sim->values);
+	free(sim);
+}
+
+unsigned long gpio_sim_timeline(const struct gpio_lines * const lines, struct gpio_sim_change * const out, size_t * const n_out)
+{
+	const struct gpio_sim_lines * const sim = (const void*)lines;
+	const unsigned long first = (sim->n_changes > GPIO_SIM_TIMELINE_SIZE) ? (sim->n_changes - GPIO_SIM_TIMELINE_SIZE) : 0;
+	*n_out = 0;
+	for (unsigned long i = first; i < sim->n_changes; ++i)
+		out[(*n_out)++] = sim->timeline[i % GPIO_SIM_TIMELINE_SIZE];
+	return sim->n_changes;
+}
+
+bool gpio_sim_get(const struct gpio_lines * const lines, const unsigned line)
+{
+	const struct gpio_sim_lines * const sim = (const void*)lines;
+	return (line < lines->n_lines) && sim->values[line];
+}
+
+void gpio_sim_set_log(struct gpio_lines * const lines, FILE * const f)
+{
+	struct gpio_sim_lines * const sim = (void*)lines;
+	assert(lines->backend == &gpio_backend_sim);
+	if (sim->log)
+		fclose(sim->log);
+	sim->log = f;
+}
+
+const struct gpio_backend gpio_backend_sim = {
+	.name = "sim",
+	.request = gpio_sim_request,
+	.set = gpio_sim_set,
+	.set_all = gpio_sim_set_all,
+	.release = gpio_sim_release,
+};
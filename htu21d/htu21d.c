@@ -2,6 +2,8 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,15 +13,19 @@
 
 #include <zmq.h>
 
+#include <freeabode/eventtime.h>
 #include <freeabode/fabdcfg.h>
 #include <freeabode/freeabode.pb-c.h>
 #include <freeabode/logging.h>
+#include <freeabode/metrics.h>
 #include <freeabode/security.h>
 #include <freeabode/util.h>
 
-static unsigned poll_interval_ms = 21094;
+static const unsigned default_poll_interval_ms = 21094;
+static unsigned poll_interval_ms;
 
 static void *zmq_pub;
+static struct fabd_metric *read_errors;
 static PbEvent current_pbe = PB_EVENT__INIT;
 static PbWeather current_pbw = PB_WEATHER__INIT;
 
@@ -80,7 +86,7 @@ bool htu21d_rcv_temp(const int fd, const struct timespec *now)
 	current_pbw.has_temperature = pbw.has_temperature = true;
 	current_pbw.temperature = pbw.temperature = temperature;
 	pbe.weather = &pbw;
-	zmq_send_protobuf(zmq_pub, pb_event, &pbe, 0);
+	fabd_pbevent_send(zmq_pub, &pbe, now);
 	
 	htu21d_req_humid(fd, now);
 	return true;
@@ -116,11 +122,17 @@ bool htu21d_rcv_humid(const int fd, const struct timespec *now)
 	current_pbw.has_humidity = pbw.has_humidity = true;
 	current_pbw.humidity = pbw.humidity = humidity;
 	pbe.weather = &pbw;
-	zmq_send_protobuf(zmq_pub, pb_event, &pbe, 0);
+	fabd_pbevent_send(zmq_pub, &pbe, now);
 	
 	return poll_complete(now);
 }
 
+static
+void poll_interval_changed(const char * const devid, const char * const key, const struct fabdcfg_value * const newvalue, void * const userp)
+{
+	poll_interval_ms = (newvalue && newvalue->has_int && newvalue->intval > 0) ? newvalue->intval : default_poll_interval_ms;
+}
+
 void got_new_subscriber(void * const s)
 {
 	zmq_msg_t msg;
@@ -133,7 +145,7 @@ void got_new_subscriber(void * const s)
 	if (!data[0])
 		goto out;
 	
-	zmq_send_protobuf(zmq_pub, pb_event, &current_pbe, 0);
+	fabd_pbevent_send(zmq_pub, &current_pbe, NULL);
 	
 out:
 	zmq_msg_close(&msg);
@@ -153,23 +165,33 @@ int main(int argc, char **argv)
 		addr = addrstr ? strtol(addrstr, NULL, 0) : 0x40;
 	}
 	assert(!ioctl(fd, I2C_SLAVE, addr));
+	poll_interval_changed(devid, "poll_interval_ms", fabdcfg_lookup(fabdcfg_current(), devid, "poll_interval_ms"), NULL);
+	fabdcfg_on_change(devid, "poll_interval_ms", poll_interval_changed, NULL);
 	
 	current_pbe.weather = &current_pbw;
 	
 	void * const zmq_ctx = zmq_ctx_new();
 	start_zap_handler(zmq_ctx);
+	fabd_metrics_serve(zmq_ctx, devid);
 	
 	zmq_pub = zmq_socket(zmq_ctx, ZMQ_XPUB);
 	zmq_setsockopt(zmq_pub, ZMQ_XPUB_VERBOSE, &int_one, sizeof(int_one));
 	freeabode_zmq_security(zmq_pub, true);
 	assert(fabdcfg_zmq_bind(devid, "events", zmq_pub));
 	
+	{
+		char labels[strlen(devid) + 0x10];
+		snprintf(labels, sizeof(labels), "devid=\"%s\"", devid);
+		read_errors = fabd_metric_counter("fabd_sensor_read_errors_total", labels, "Sensor requests or readings that failed");
+	}
+	
 	req_func = htu21d_req_temp;
 	clock_gettime(CLOCK_MONOTONIC, &ts_next_req);
 	
 	struct timespec ts_now, ts_timeout;
 	zmq_pollitem_t pollitems[] = {
 		{ .socket = zmq_pub, .events = ZMQ_POLLIN },
+		{ .fd = fabdcfg_watch_start(), .events = ZMQ_POLLIN },
 	};
 	while (true)
 	{
@@ -179,7 +201,10 @@ next_req:
 		if (timespec_passed(&ts_next_req, &ts_now, &ts_timeout))
 		{
 			if (!req_func(fd, &ts_now))
+			{
+				fabd_metric_inc(read_errors);
 				htu21d_reset(fd, &ts_now);
+			}
 			// Need to get new time in ts_timeout
 			goto next_req;
 		}
@@ -187,5 +212,7 @@ next_req:
 			continue;
 		if (pollitems[0].revents & ZMQ_POLLIN)
 			got_new_subscriber(zmq_pub);
+		if (pollitems[1].revents & ZMQ_POLLIN)
+			fabdcfg_dispatch_changes();
 	}
 }
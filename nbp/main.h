@@ -1,4 +0,0 @@
-#ifndef FABD_MAIN_H
-#define FABD_MAIN_H
-
-#endif
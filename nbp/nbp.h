@@ -0,0 +1,8 @@
+#ifndef FABD_NBP_H
+#define FABD_NBP_H
+
+#include <freeabode/component.h>
+
+extern const struct fabd_component_type nbp_component;
+
+#endif
@@ -14,7 +14,9 @@
 #include "crc.h"
 #include "nest.h"
 
-#define NBP_DEFAULT_SHUTOFF_DELAY  { .tv_sec = 337, .tv_nsec = 500000000, }
+static const struct fabd_interlock_rule nbp_default_interlocks[] = {
+	{ .type = FIT_MIN_OFF, .wires = FABD_WIRE(NBPF__COUNT) - 1, .delay = { .tv_sec = 337, .tv_nsec = 500000000, }, },
+};
 
 #define NBP_READ_BUFFER_SIZE  0x10
 
@@ -55,11 +57,10 @@ struct nbp_device *nbp_open(const char * const path)
 	};
 	for (int i = 0; i < NBPF__COUNT; ++i)
 		nbp->_fet[i] = (struct nbp_fet_data){
-			.ts_shutoff_delay = NBP_DEFAULT_SHUTOFF_DELAY,
 			._present = FTS_UNKNOWN,
 			._asserted = FTS_UNKNOWN,
-			._ts_last_shutoff = ts_now,
 		};
+	fabd_interlocks_init(&nbp->interlocks, nbp_default_interlocks, sizeof(nbp_default_interlocks) / sizeof(*nbp_default_interlocks), FABD_WIRE(NBPF__COUNT) - 1, &ts_now);
 	return nbp;
 }
 
@@ -238,7 +239,10 @@ invalid: ;
 		uint16_t good_crc = crc16ccitt(&buf[3], 2 + 2 + datasz);
 		uint16_t actual_crc = buf[7 + datasz] | (((uint16_t)buf[8 + datasz]) << 8);
 		if (good_crc != actual_crc)
+		{
+			__atomic_add_fetch(&nbp->crc_errors, 1, __ATOMIC_RELAXED);
 			goto invalid;
+		}
 		
 		// Entire valid packet found
 		nbp_got_message(nbp, &buf[7], datasz, &now);
@@ -260,8 +264,10 @@ bool nbp_control_fet_unsafe(struct nbp_device * const nbp, const enum nbp_fet fe
 		return false;
 	if (fet < NBPF__COUNT)
 	{
-		if (nbp->_fet[fet]._asserted != FTS_FALSE && !connect)
-			clock_gettime(CLOCK_MONOTONIC, &nbp->_fet[fet]._ts_last_shutoff);
+		struct timespec ts_now;
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+		const uint32_t state = connect ? (nbp->interlocks.on | FABD_WIRE(fet)) : (nbp->interlocks.on & ~FABD_WIRE(fet));
+		fabd_interlocks_commit(&nbp->interlocks, state, &ts_now);
 		nbp->_fet[fet]._asserted = connect;
 	}
 	nbp->cb_asserting_fet_control(nbp, fet, connect);
@@ -273,14 +279,11 @@ bool nbp_control_fet(struct nbp_device * const nbp, const enum nbp_fet fet, cons
 	if (fet >= NBPF__COUNT)
 		// Assume unknown FETs are always unsafe, since we have no safety controls
 		return false;
-	const struct timespec *ts_shutoff_delay = &nbp->_fet[fet].ts_shutoff_delay;
-	if (connect && (ts_shutoff_delay->tv_sec || ts_shutoff_delay->tv_nsec))
-	{
-		struct timespec ts_soonest_cycle, ts_now;
-		timespec_add(&nbp->_fet[fet]._ts_last_shutoff, ts_shutoff_delay, &ts_soonest_cycle);
-		clock_gettime(CLOCK_MONOTONIC, &ts_now);
-		if (timespec_cmp(&ts_now, &ts_soonest_cycle) < 0)
-			return false;
-	}
+	// Only the one FET can be changed here, so refuse anything the interlocks would do otherwise
+	const uint32_t proposed = connect ? (nbp->interlocks.on | FABD_WIRE(fet)) : (nbp->interlocks.on & ~FABD_WIRE(fet));
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	if (fabd_interlocks_check(&nbp->interlocks, proposed, &ts_now) != proposed)
+		return false;
 	return nbp_control_fet_unsafe(nbp, fet, connect);
 }
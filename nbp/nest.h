@@ -4,6 +4,7 @@
 #include <time.h>
 
 #include <freeabode/bytes.h>
+#include <freeabode/interlock.h>
 #include <freeabode/util.h>
 
 enum nbp_fet {
@@ -39,11 +40,8 @@ enum nbp_power_flags {
 };
 
 struct nbp_fet_data {
-	struct timespec ts_shutoff_delay;
-	
 	enum fabd_tristate _present;
 	enum fabd_tristate _asserted;
-	struct timespec _ts_last_shutoff;
 };
 
 struct nbp_device {
@@ -66,6 +64,12 @@ struct nbp_device {
 	uint16_t vb_mV;
 	uint8_t power_flags;
 	
+	// Packets discarded for a bad checksum (atomic, so other threads may read it)
+	uint64_t crc_errors;
+	
+	// Checked by nbp_control_fet; by default, only a lockout after shutting off any FET
+	struct fabd_interlocks interlocks;
+	
 	int _fd;
 	bytes_t _rdbuf;
 	struct nbp_fet_data *_fet;
@@ -0,0 +1,359 @@
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <jansson.h>
+#include <zmq.h>
+
+#include <freeabode/eventtime.h>
+#include <freeabode/fabdcfg.h>
+#include <freeabode/freeabode.pb-c.h>
+#include <freeabode/json.h>
+#include <freeabode/logging.h>
+#include <freeabode/metrics.h>
+#include <freeabode/pbarena.h>
+#include <freeabode/security.h>
+#include <freeabode/util.h>
+
+#include "rollup.h"
+#include "tsdb.h"
+
+static const unsigned long sync_interval_ms = 10547;
+static const uint32_t default_max_points = 0x100000;
+
+static const char *my_devid;
+static const char *history_dir;
+
+struct recorder_source {
+	char *name;
+	void *socket;
+	struct fabd_event_latency latency;
+};
+
+struct recorder_series {
+	struct tsdb_series *raw;
+	struct rollup_tier tiers[ROLLUP_TIERS];
+};
+
+static struct recorder_series **all_series;
+static size_t n_series, all_series_allocsz;
+
+static
+int64_t recorder_now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static
+struct recorder_series *recorder_get_series(const char * const name, const bool create)
+{
+	for (size_t i = 0; i < n_series; ++i)
+		if (!strcmp(all_series[i]->raw->name, name))
+			return all_series[i];
+	
+	if (!tsdb_valid_name(name))
+		return NULL;
+	struct tsdb_series * const raw = tsdb_open(history_dir, name, 1, create);
+	if (!raw)
+	{
+		if (create)
+			applog(LOG_ERR, "Failed to open history for %s", name);
+		return NULL;
+	}
+	struct recorder_series * const series = malloc(sizeof(*series));
+	assert(series);
+	series->raw = raw;
+	for (int i = 0; i < ROLLUP_TIERS; ++i)
+		if (!rollup_open(&series->tiers[i], &rollup_tier_defs[i], history_dir, raw))
+		{
+			while (i--)
+				rollup_close(&series->tiers[i]);
+			tsdb_close(raw);
+			free(series);
+			return NULL;
+		}
+	if (n_series == all_series_allocsz)
+	{
+		all_series_allocsz = all_series_allocsz ? (all_series_allocsz * 2) : 0x10;
+		all_series = realloc(all_series, sizeof(*all_series) * all_series_allocsz);
+		assert(all_series);
+	}
+	all_series[n_series++] = series;
+	return series;
+}
+
+static
+void record(const struct recorder_source * const source, const char * const column, const int64_t ts, const int64_t value)
+{
+	char name[0x100];
+	snprintf(name, sizeof(name), "%s.%s", source->name, column);
+	struct recorder_series * const series = recorder_get_series(name, true);
+	if (!series)
+		return;
+	if (!tsdb_append(series->raw, ts, &value))
+		return;
+	for (int i = 0; i < ROLLUP_TIERS; ++i)
+		rollup_add(&series->tiers[i], ts, value);
+}
+
+static
+void record_event(const struct recorder_source * const source, const PbEvent * const pbevent)
+{
+	const int64_t ts = recorder_now_ms();
+	
+	if (pbevent->weather)
+	{
+		if (pbevent->weather->has_temperature)
+			record(source, "temperature", ts, pbevent->weather->temperature);
+		if (pbevent->weather->has_humidity)
+			record(source, "humidity", ts, pbevent->weather->humidity);
+	}
+	for (size_t i = 0; i < pbevent->n_wire_change; ++i)
+	{
+		const PbSetHVACWireRequest * const wc = pbevent->wire_change[i];
+		const ProtobufCEnumValue * const enumv = protobuf_c_enum_descriptor_get_value(&pb_hvacwires__descriptor, wc->wire);
+		char column[0x20];
+		if (enumv)
+			snprintf(column, sizeof(column), "wire.%s", enumv->name);
+		else
+			snprintf(column, sizeof(column), "wire.%d", (int)wc->wire);
+		record(source, column, ts, wc->connect);
+	}
+	if (pbevent->hvacgoals)
+	{
+		const PbHVACGoals * const goals = pbevent->hvacgoals;
+		if (goals->has_temp_low)
+			record(source, "temp_low", ts, goals->temp_low);
+		if (goals->has_temp_high)
+			record(source, "temp_high", ts, goals->temp_high);
+		if (goals->has_temp_hysteresis)
+			record(source, "temp_hysteresis", ts, goals->temp_hysteresis);
+		if (goals->has_fan_mode)
+			record(source, "fan_mode", ts, goals->fan_mode);
+	}
+	if (pbevent->battery)
+	{
+		if (pbevent->battery->has_charging)
+			record(source, "battery_charging", ts, pbevent->battery->charging);
+		if (pbevent->battery->has_voltage)
+			record(source, "battery_voltage", ts, pbevent->battery->voltage);
+	}
+	if (pbevent->tstat_status && pbevent->tstat_status->has_compressor_cycles_24h)
+		record(source, "compressor_cycles_24h", ts, pbevent->tstat_status->compressor_cycles_24h);
+}
+
+static
+void recv_event(struct recorder_source * const source, struct fabd_pbarena * const arena)
+{
+	PbEvent *pbevent;
+	zmq_recv_protobuf(source->socket, pb_event, pbevent, &arena->allocator);
+	if (pbevent)
+	{
+		fabd_event_latency_record(&source->latency, pbevent);
+		record_event(source, pbevent);
+	}
+	fabd_pbarena_reset(arena);
+}
+
+struct query_state {
+	PbHistoryResult *result;
+	size_t allocsz;
+	uint32_t max_points;
+	bool rollup;
+};
+
+static
+bool query_sample_cb(void * const userp, const int64_t ts, const int64_t * const values)
+{
+	struct query_state * const qs = userp;
+	PbHistoryResult * const result = qs->result;
+	if (result->n_ts >= qs->max_points)
+	{
+		result->has_truncated = true;
+		result->truncated = true;
+		return false;
+	}
+	if (result->n_ts == qs->allocsz)
+	{
+		qs->allocsz = qs->allocsz ? (qs->allocsz * 2) : 0x100;
+		result->ts = realloc(result->ts, sizeof(*result->ts) * qs->allocsz);
+		result->value = realloc(result->value, sizeof(*result->value) * qs->allocsz);
+		assert(result->ts && result->value);
+		if (qs->rollup)
+		{
+			result->min = realloc(result->min, sizeof(*result->min) * qs->allocsz);
+			result->max = realloc(result->max, sizeof(*result->max) * qs->allocsz);
+			result->count = realloc(result->count, sizeof(*result->count) * qs->allocsz);
+			assert(result->min && result->max && result->count);
+		}
+	}
+	result->ts[result->n_ts++] = ts;
+	if (qs->rollup)
+	{
+		result->value[result->n_value++] = values[RV_MEAN];
+		result->min[result->n_min++] = values[RV_MIN];
+		result->max[result->n_max++] = values[RV_MAX];
+		result->count[result->n_count++] = values[RV_COUNT];
+	}
+	else
+		result->value[result->n_value++] = values[0];
+	return true;
+}
+
+static
+void do_history_query(const PbHistoryQuery * const query, PbHistoryResult * const result)
+{
+	result->series = query->series;
+	struct recorder_series * const series = recorder_get_series(query->series, false);
+	if (!series)
+		return;
+	
+	// Use the coarsest tier no coarser than requested
+	struct rollup_tier *tier = NULL;
+	if (query->has_resolution_ms)
+		for (int i = 0; i < ROLLUP_TIERS; ++i)
+			if (series->tiers[i].def->period_ms <= query->resolution_ms)
+				tier = &series->tiers[i];
+	
+	struct query_state qs = {
+		.result = result,
+		.max_points = (query->has_max_points && query->max_points) ? query->max_points : default_max_points,
+		.rollup = tier,
+	};
+	const int64_t start = query->has_start ? query->start : INT64_MIN;
+	const int64_t end = query->has_end ? query->end : INT64_MAX;
+	if (tier)
+	{
+		result->has_resolution_ms = true;
+		result->resolution_ms = tier->def->period_ms;
+		rollup_query(tier, start, end, query_sample_cb, &qs);
+	}
+	else
+		tsdb_query(series->raw, start, end, query_sample_cb, &qs);
+}
+
+static
+void handle_req(void * const s)
+{
+	PbRequest *req;
+	zmq_recv_protobuf(s, pb_request, req, NULL);
+	PbRequestReply reply = PB_REQUEST_REPLY__INIT;
+	PbHistoryResult *results = NULL;
+	
+	if (req && req->n_historyquery)
+	{
+		reply.n_historyresult = req->n_historyquery;
+		reply.historyresult = malloc(sizeof(*reply.historyresult) * reply.n_historyresult);
+		results = malloc(sizeof(*results) * reply.n_historyresult);
+		assert(reply.historyresult && results);
+		for (size_t i = 0; i < req->n_historyquery; ++i)
+		{
+			pb_history_result__init(&results[i]);
+			do_history_query(req->historyquery[i], &results[i]);
+			reply.historyresult[i] = &results[i];
+		}
+	}
+	
+	// Replies can be large, so pack directly into the message rather than onto the stack
+	zmq_msg_t msg;
+	const size_t sz = pb_request_reply__get_packed_size(&reply);
+	assert(!zmq_msg_init_size(&msg, sz));
+	pb_request_reply__pack(&reply, zmq_msg_data(&msg));
+	if (zmq_msg_send(&msg, s, 0) < 0)
+		zmq_msg_close(&msg);
+	
+	for (size_t i = 0; i < reply.n_historyresult; ++i)
+	{
+		free(results[i].ts);
+		free(results[i].value);
+		free(results[i].min);
+		free(results[i].max);
+		free(results[i].count);
+	}
+	free(results);
+	free(reply.historyresult);
+	if (req)
+		pb_request__free_unpacked(req, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	my_devid = fabd_common_argv(argc, argv, "recorder");
+	load_freeabode_key();
+	
+	history_dir = fabdcfg_device_getstr(my_devid, "history_dir") ?: "history";
+	if (mkdir(history_dir, 0755) && errno != EEXIST)
+	{
+		applog(LOG_ERR, "Failed to create %s", history_dir);
+		exit(1);
+	}
+	
+	void * const my_zmq_context = zmq_ctx_new();
+	start_zap_handler(my_zmq_context);
+	fabd_metrics_serve(my_zmq_context, my_devid);
+	
+	void * const my_zmq_ctl = zmq_socket(my_zmq_context, ZMQ_REP);
+	freeabode_zmq_security(my_zmq_ctl, true);
+	assert(fabdcfg_zmq_bind(my_devid, "control", my_zmq_ctl));
+	
+	json_t * const jsources = fabd_json_array(fabdcfg_device_get(my_devid, "sources"));
+	const size_t n_sources = json_array_size(jsources);
+	struct recorder_source sources[n_sources];
+	zmq_pollitem_t pollitems[1 + n_sources];
+	pollitems[0] = (zmq_pollitem_t){ .socket = my_zmq_ctl, .events = ZMQ_POLLIN };
+	for (size_t i = 0; i < n_sources; ++i)
+	{
+		const char * const name = json_string_value(json_array_get(jsources, i));
+		assert(name);
+		sources[i].name = strdup(name);
+		sources[i].socket = zmq_socket(my_zmq_context, ZMQ_SUB);
+		freeabode_zmq_security(sources[i].socket, false);
+		assert(fabdcfg_zmq_connect(my_devid, name, sources[i].socket));
+		assert(!zmq_setsockopt(sources[i].socket, ZMQ_SUBSCRIBE, NULL, 0));
+		fabd_event_latency_init(&sources[i].latency, my_devid, sources[i].name);
+		pollitems[1 + i] = (zmq_pollitem_t){ .socket = sources[i].socket, .events = ZMQ_POLLIN };
+		applog(LOG_INFO, "Recording %s", name);
+	}
+	json_decref(jsources);
+	
+	struct fabd_pbarena arena;
+	fabd_pbarena_init(&arena, 0x400);
+	
+	struct timespec ts_now, ts_timeout, ts_next_sync;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	timespec_add_ms(&ts_now, sync_interval_ms, &ts_next_sync);
+	while (true)
+	{
+		timespec_clear(&ts_timeout);
+		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+		if (timespec_passed(&ts_next_sync, &ts_now, &ts_timeout))
+		{
+			for (size_t i = 0; i < n_series; ++i)
+			{
+				tsdb_sync(all_series[i]->raw);
+				for (int j = 0; j < ROLLUP_TIERS; ++j)
+					tsdb_sync(all_series[i]->tiers[j].series);
+			}
+			timespec_add_ms(&ts_now, sync_interval_ms, &ts_next_sync);
+			timespec_min(&ts_timeout, &ts_next_sync, &ts_timeout);
+		}
+		if (zmq_poll(pollitems, 1 + n_sources, timespec_to_timeout_ms(&ts_now, &ts_timeout)) <= 0)
+			continue;
+		if (pollitems[0].revents & ZMQ_POLLIN)
+			handle_req(my_zmq_ctl);
+		for (size_t i = 0; i < n_sources; ++i)
+			if (pollitems[1 + i].revents & ZMQ_POLLIN)
+				recv_event(&sources[i], &arena);
+	}
+}
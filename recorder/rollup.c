@@ -0,0 +1,112 @@
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <freeabode/logging.h>
+
+#include "rollup.h"
+#include "tsdb.h"
+
+const struct rollup_tier_def rollup_tier_defs[ROLLUP_TIERS] = {
+	{ "1m",    60000 },
+	{ "1h",  3600000 },
+	{ "1d", 86400000 },
+};
+
+static inline
+int64_t rollup_period_start(const struct rollup_tier * const tier, const int64_t ts)
+{
+	const int64_t period_ms = tier->def->period_ms;
+	int64_t q = ts / period_ms;
+	if (ts % period_ms < 0)
+		--q;
+	return q * period_ms;
+}
+
+static
+void rollup_current(const struct rollup_tier * const tier, int64_t * const values)
+{
+	values[RV_MIN] = tier->cur_min;
+	values[RV_MAX] = tier->cur_max;
+	values[RV_MEAN] = tier->cur_sum / (int64_t)tier->cur_count;
+	values[RV_COUNT] = tier->cur_count;
+}
+
+void rollup_add(struct rollup_tier * const tier, const int64_t ts, const int64_t value)
+{
+	const int64_t start = rollup_period_start(tier, ts);
+	if (tier->cur_count && start > tier->cur_start)
+	{
+		int64_t values[RV__COUNT];
+		rollup_current(tier, values);
+		tsdb_append(tier->series, tier->cur_start, values);
+		tier->cur_count = 0;
+	}
+	if (!tier->cur_count)
+	{
+		tier->cur_start = start;
+		tier->cur_min = tier->cur_max = tier->cur_sum = value;
+		tier->cur_count = 1;
+		return;
+	}
+	// Late samples (start < cur_start) are folded into the current period, as raw appends clamp them forward too
+	if (value < tier->cur_min)
+		tier->cur_min = value;
+	if (value > tier->cur_max)
+		tier->cur_max = value;
+	tier->cur_sum += value;
+	++tier->cur_count;
+}
+
+static
+bool rollup_catchup_cb(void * const userp, const int64_t ts, const int64_t * const values)
+{
+	rollup_add(userp, ts, values[0]);
+	return true;
+}
+
+bool rollup_open(struct rollup_tier * const tier, const struct rollup_tier_def * const def, const char * const dir, struct tsdb_series * const raw)
+{
+	char name[0x100];
+	snprintf(name, sizeof(name), "%s@%s", raw->name, def->suffix);
+	*tier = (struct rollup_tier){
+		.def = def,
+		.series = tsdb_open(dir, name, RV__COUNT, true),
+	};
+	if (!tier->series)
+	{
+		applog(LOG_ERR, "Failed to open rollup %s", name);
+		return false;
+	}
+	
+	// Rebuild the open period (and any closed since the last run) from raw samples
+	int64_t last_start, values[RV__COUNT];
+	const int64_t from = tsdb_last(tier->series, &last_start, values) ? (last_start + def->period_ms) : INT64_MIN;
+	tsdb_query(raw, from, INT64_MAX, rollup_catchup_cb, tier);
+	return true;
+}
+
+void rollup_close(struct rollup_tier * const tier)
+{
+	// The open period is not written; it gets rebuilt from raw samples next time
+	tsdb_close(tier->series);
+}
+
+bool rollup_query(struct rollup_tier * const tier, int64_t start, const int64_t end, const tsdb_sample_cb cb, void * const userp)
+{
+	// Include the whole period containing start
+	if (start != INT64_MIN)
+		start = rollup_period_start(tier, start);
+	if (!tsdb_query(tier->series, start, end, cb, userp))
+		return false;
+	if (tier->cur_count && tier->cur_start >= start && tier->cur_start <= end)
+	{
+		int64_t values[RV__COUNT];
+		rollup_current(tier, values);
+		return cb(userp, tier->cur_start, values);
+	}
+	return true;
+}
@@ -0,0 +1,44 @@
+#ifndef FABD_RECORDER_ROLLUP_H
+#define FABD_RECORDER_ROLLUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tsdb.h"
+
+// Rollups summarise a raw series over fixed periods, aligned to the epoch.
+// Each period is stored as one multi-value sample at the period's start, once a later sample closes it.
+
+enum rollup_value {
+	RV_MIN,
+	RV_MAX,
+	RV_MEAN,
+	RV_COUNT,
+	
+	RV__COUNT,
+};
+
+struct rollup_tier_def {
+	const char *suffix;
+	int64_t period_ms;
+};
+
+#define ROLLUP_TIERS  3
+extern const struct rollup_tier_def rollup_tier_defs[ROLLUP_TIERS];
+
+struct rollup_tier {
+	const struct rollup_tier_def *def;
+	struct tsdb_series *series;
+	
+	// The period still accumulating
+	int64_t cur_start;
+	int64_t cur_min, cur_max, cur_sum;
+	uint32_t cur_count;
+};
+
+extern bool rollup_open(struct rollup_tier *, const struct rollup_tier_def *, const char *dir, struct tsdb_series *raw);
+extern void rollup_close(struct rollup_tier *);
+extern void rollup_add(struct rollup_tier *, int64_t ts, int64_t value);
+extern bool rollup_query(struct rollup_tier *, int64_t start, int64_t end, tsdb_sample_cb, void *userp);
+
+#endif
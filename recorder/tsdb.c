@@ -0,0 +1,355 @@
+#include "config.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <freeabode/logging.h>
+#include <freeabode/util.h>
+
+#include "tsdb.h"
+
+static const char tsdb_magic[8] = "FABDTS1\n";
+static const char * const tsdb_suffix = ".fts";
+
+// Header page layout
+#define TSDB_HDR_MAGIC       0x00
+#define TSDB_HDR_BLOCK_SIZE  0x08
+#define TSDB_HDR_N_BLOCKS    0x0c
+#define TSDB_HDR_N_VALUES    0x10
+
+// Block layout; first and last values are arrays of n_values
+#define TSDB_BLK_FIRST_TS     0x00
+#define TSDB_BLK_LAST_TS      0x08
+#define TSDB_BLK_LAST_DELTA   0x10
+#define TSDB_BLK_COUNT        0x18
+#define TSDB_BLK_USED         0x1c
+#define TSDB_BLK_FIRST_VALUE  0x20
+#define TSDB_BLK_LAST_VALUE(n_values)  (TSDB_BLK_FIRST_VALUE + (8 * (n_values)))
+#define TSDB_BLK_DATA(n_values)        (TSDB_BLK_FIRST_VALUE + (16 * (n_values)))
+
+// One 64-bit varint for the timestamp, and one per value
+#define TSDB_MAX_SAMPLE_SIZE(n_values)  (10 * (1 + (n_values)))
+// Grow files this many blocks at a time
+#define TSDB_GROW_BLOCKS  0x40
+
+static inline
+uint64_t zigzag_encode(const int64_t n)
+{
+	return ((uint64_t)n << 1) ^ (uint64_t)(n >> 63);
+}
+
+static inline
+int64_t zigzag_decode(const uint64_t n)
+{
+	return (int64_t)(n >> 1) ^ -(int64_t)(n & 1);
+}
+
+static
+size_t varint_put(uint8_t * const buf, uint64_t n)
+{
+	size_t i = 0;
+	while (n >= 0x80)
+	{
+		buf[i++] = (n & 0x7f) | 0x80;
+		n >>= 7;
+	}
+	buf[i++] = n;
+	return i;
+}
+
+static
+size_t varint_get(const uint8_t * const buf, const size_t bufsz, uint64_t * const out)
+{
+	uint64_t n = 0;
+	for (size_t i = 0; i < bufsz && i < 10; ++i)
+	{
+		n |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+		if (!(buf[i] & 0x80))
+		{
+			*out = n;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+// '@' is allowed in file names, but reserved for derived series (such as rollups)
+static
+bool tsdb_valid_filename(const char * const name)
+{
+	if (!(name[0] && name[0] != '.' && name[0] != '@'))
+		return false;
+	for (const char *p = name; p[0]; ++p)
+		if (!(isalnum((unsigned char)p[0]) || p[0] == '.' || p[0] == '_' || p[0] == '-' || p[0] == '@'))
+			return false;
+	return true;
+}
+
+bool tsdb_valid_name(const char * const name)
+{
+	return tsdb_valid_filename(name) && !strchr(name, '@');
+}
+
+static inline
+uint8_t *tsdb_block(const struct tsdb_series * const series, const uint32_t blockno)
+{
+	return &series->map[TSDB_BLOCK_SIZE * (1 + (size_t)blockno)];
+}
+
+static
+bool tsdb_map(struct tsdb_series * const series, const size_t sz)
+{
+	if (series->map)
+		munmap(series->map, series->mapsz);
+	series->map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, series->fd, 0);
+	if (series->map == MAP_FAILED)
+	{
+		series->map = NULL;
+		series->mapsz = 0;
+		return false;
+	}
+	series->mapsz = sz;
+	return true;
+}
+
+static
+bool tsdb_reserve_blocks(struct tsdb_series * const series, const uint32_t n_blocks)
+{
+	const size_t needsz = TSDB_BLOCK_SIZE * (1 + (size_t)n_blocks);
+	if (needsz <= series->mapsz)
+		return true;
+	const size_t newsz = needsz + (TSDB_BLOCK_SIZE * TSDB_GROW_BLOCKS);
+	if (ftruncate(series->fd, newsz))
+		return false;
+	return tsdb_map(series, newsz);
+}
+
+struct tsdb_series *tsdb_open(const char * const dir, const char * const name, const unsigned n_values, const bool create)
+{
+	if (!(tsdb_valid_filename(name) && n_values >= 1 && n_values <= TSDB_MAX_VALUES))
+		return NULL;
+	const size_t pathsz = strlen(dir) + 1 + strlen(name) + strlen(tsdb_suffix) + 1;
+	char path[pathsz];
+	snprintf(path, pathsz, "%s/%s%s", dir, name, tsdb_suffix);
+	
+	const int fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st))
+		goto err;
+	
+	struct tsdb_series * const series = malloc(sizeof(*series));
+	*series = (struct tsdb_series){
+		.name = strdup(name),
+		.fd = fd,
+		.n_values = n_values,
+	};
+	if (st.st_size < TSDB_BLOCK_SIZE)
+	{
+		// New file
+		if (!tsdb_reserve_blocks(series, 0))
+			goto err_series;
+		memcpy(&series->map[TSDB_HDR_MAGIC], tsdb_magic, sizeof(tsdb_magic));
+		pk_u32le(series->map, TSDB_HDR_BLOCK_SIZE, TSDB_BLOCK_SIZE);
+		pk_u32le(series->map, TSDB_HDR_N_BLOCKS, 0);
+		pk_u32le(series->map, TSDB_HDR_N_VALUES, n_values);
+	}
+	else
+	{
+		if (!tsdb_map(series, st.st_size))
+			goto err_series;
+		if (memcmp(&series->map[TSDB_HDR_MAGIC], tsdb_magic, sizeof(tsdb_magic)) || upk_u32le(series->map, TSDB_HDR_BLOCK_SIZE) != TSDB_BLOCK_SIZE)
+		{
+			applog(LOG_ERR, "%s: Not a history file", path);
+			goto err_series;
+		}
+		if (upk_u32le(series->map, TSDB_HDR_N_VALUES) != n_values)
+		{
+			applog(LOG_ERR, "%s: Wrong number of values per sample", path);
+			goto err_series;
+		}
+		series->n_blocks = upk_u32le(series->map, TSDB_HDR_N_BLOCKS);
+		if (TSDB_BLOCK_SIZE * (1 + (size_t)series->n_blocks) > series->mapsz)
+		{
+			applog(LOG_ERR, "%s: Truncated history file", path);
+			goto err_series;
+		}
+	}
+	return series;
+	
+err_series:
+	if (series->map)
+		munmap(series->map, series->mapsz);
+	free(series->name);
+	free(series);
+err:
+	close(fd);
+	return NULL;
+}
+
+void tsdb_sync(struct tsdb_series * const series)
+{
+	if (!series->dirty)
+		return;
+	msync(series->map, series->mapsz, MS_ASYNC);
+	series->dirty = false;
+}
+
+void tsdb_close(struct tsdb_series * const series)
+{
+	tsdb_sync(series);
+	munmap(series->map, series->mapsz);
+	close(series->fd);
+	free(series->name);
+	free(series);
+}
+
+bool tsdb_last(struct tsdb_series * const series, int64_t * const ts, int64_t * const values)
+{
+	if (!series->n_blocks)
+		return false;
+	const uint8_t * const blk = tsdb_block(series, series->n_blocks - 1);
+	*ts = upk_u64le(blk, TSDB_BLK_LAST_TS);
+	for (unsigned i = 0; i < series->n_values; ++i)
+		values[i] = upk_u64le(blk, TSDB_BLK_LAST_VALUE(series->n_values) + (8 * i));
+	return true;
+}
+
+bool tsdb_append(struct tsdb_series * const series, int64_t ts, const int64_t * const values)
+{
+	const unsigned n_values = series->n_values;
+	uint8_t *blk = series->n_blocks ? tsdb_block(series, series->n_blocks - 1) : NULL;
+	
+	if (blk)
+	{
+		const int64_t last_ts = upk_u64le(blk, TSDB_BLK_LAST_TS);
+		// Keep timestamps monotonic, so queries can binary search
+		if (ts < last_ts)
+			ts = last_ts;
+		
+		const uint32_t used = upk_u32le(blk, TSDB_BLK_USED);
+		if (used + TSDB_MAX_SAMPLE_SIZE(n_values) <= TSDB_BLOCK_SIZE)
+		{
+			const int64_t delta = ts - last_ts;
+			const int64_t last_delta = upk_u64le(blk, TSDB_BLK_LAST_DELTA);
+			size_t sz = varint_put(&blk[used], zigzag_encode(delta - last_delta));
+			for (unsigned i = 0; i < n_values; ++i)
+			{
+				const int64_t last_value = upk_u64le(blk, TSDB_BLK_LAST_VALUE(n_values) + (8 * i));
+				sz += varint_put(&blk[used + sz], zigzag_encode(values[i] - last_value));
+			}
+			
+			// Data first, then the state describing it
+			pk_u64le(blk, TSDB_BLK_LAST_TS, ts);
+			pk_u64le(blk, TSDB_BLK_LAST_DELTA, delta);
+			for (unsigned i = 0; i < n_values; ++i)
+				pk_u64le(blk, TSDB_BLK_LAST_VALUE(n_values) + (8 * i), values[i]);
+			pk_u32le(blk, TSDB_BLK_COUNT, upk_u32le(blk, TSDB_BLK_COUNT) + 1);
+			pk_u32le(blk, TSDB_BLK_USED, used + sz);
+			series->dirty = true;
+			return true;
+		}
+	}
+	
+	// Start a new block
+	if (!tsdb_reserve_blocks(series, series->n_blocks + 1))
+	{
+		applog(LOG_ERR, "%s: Failed to grow history file", series->name);
+		return false;
+	}
+	blk = tsdb_block(series, series->n_blocks);
+	pk_u64le(blk, TSDB_BLK_FIRST_TS, ts);
+	pk_u64le(blk, TSDB_BLK_LAST_TS, ts);
+	pk_u64le(blk, TSDB_BLK_LAST_DELTA, 0);
+	for (unsigned i = 0; i < n_values; ++i)
+	{
+		pk_u64le(blk, TSDB_BLK_FIRST_VALUE + (8 * i), values[i]);
+		pk_u64le(blk, TSDB_BLK_LAST_VALUE(n_values) + (8 * i), values[i]);
+	}
+	pk_u32le(blk, TSDB_BLK_COUNT, 1);
+	pk_u32le(blk, TSDB_BLK_USED, TSDB_BLK_DATA(n_values));
+	++series->n_blocks;
+	pk_u32le(series->map, TSDB_HDR_N_BLOCKS, series->n_blocks);
+	series->dirty = true;
+	return true;
+}
+
+// Returns false if the callback asked to stop, or end was reached
+static
+bool tsdb_decode_block(const uint8_t * const blk, const unsigned n_values, const int64_t start, const int64_t end, const tsdb_sample_cb cb, void * const userp, bool * const stopped)
+{
+	const uint32_t count = upk_u32le(blk, TSDB_BLK_COUNT);
+	const uint32_t used = fabd_min(upk_u32le(blk, TSDB_BLK_USED), (uint32_t)TSDB_BLOCK_SIZE);
+	int64_t ts = upk_u64le(blk, TSDB_BLK_FIRST_TS);
+	int64_t values[TSDB_MAX_VALUES];
+	for (unsigned i = 0; i < n_values; ++i)
+		values[i] = upk_u64le(blk, TSDB_BLK_FIRST_VALUE + (8 * i));
+	int64_t delta = 0;
+	size_t pos = TSDB_BLK_DATA(n_values);
+	for (uint32_t n = 0; ; )
+	{
+		if (ts > end)
+			return false;
+		if (ts >= start && !cb(userp, ts, values))
+		{
+			*stopped = true;
+			return false;
+		}
+		if (++n >= count)
+			break;
+		
+		uint64_t v;
+		// A corrupt count or used could otherwise run past the end
+		if (pos >= used)
+			break;
+		size_t sz = varint_get(&blk[pos], used - pos, &v);
+		if (!sz)
+			break;
+		pos += sz;
+		delta += zigzag_decode(v);
+		ts += delta;
+		for (unsigned i = 0; i < n_values; ++i)
+		{
+			if (pos >= used)
+				return true;
+			sz = varint_get(&blk[pos], used - pos, &v);
+			if (!sz)
+				return true;
+			pos += sz;
+			values[i] += zigzag_decode(v);
+		}
+	}
+	return true;
+}
+
+// Returns false if the callback asked to stop
+bool tsdb_query(struct tsdb_series * const series, const int64_t start, const int64_t end, const tsdb_sample_cb cb, void * const userp)
+{
+	// Find the first block which might have samples at or after start
+	uint32_t lo = 0, hi = series->n_blocks;
+	while (lo < hi)
+	{
+		const uint32_t mid = lo + (hi - lo) / 2;
+		if ((int64_t)upk_u64le(tsdb_block(series, mid), TSDB_BLK_LAST_TS) < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	
+	bool stopped = false;
+	for (uint32_t blockno = lo; blockno < series->n_blocks; ++blockno)
+		if (!tsdb_decode_block(tsdb_block(series, blockno), series->n_values, start, end, cb, userp, &stopped))
+			break;
+	return !stopped;
+}
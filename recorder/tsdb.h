@@ -0,0 +1,36 @@
+#ifndef FABD_RECORDER_TSDB_H
+#define FABD_RECORDER_TSDB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Each series is a single memory-mapped file: a header page, followed by fixed-size blocks.
+// Every block starts with the absolute first sample and the state needed to append, so it can be decoded on its own.
+// The rest of the block is a stream of zigzag varints: delta-of-delta for the timestamp, then delta for each value.
+
+#define TSDB_BLOCK_SIZE  0x1000
+#define TSDB_MAX_VALUES  4
+
+struct tsdb_series {
+	char *name;
+	int fd;
+	uint8_t *map;
+	size_t mapsz;
+	uint32_t n_blocks;
+	unsigned n_values;
+	bool dirty;
+};
+
+typedef bool (*tsdb_sample_cb)(void *userp, int64_t ts, const int64_t *values);
+
+extern struct tsdb_series *tsdb_open(const char *dir, const char *name, unsigned n_values, bool create);
+extern void tsdb_close(struct tsdb_series *);
+extern bool tsdb_append(struct tsdb_series *, int64_t ts, const int64_t *values);
+extern bool tsdb_query(struct tsdb_series *, int64_t start, int64_t end, tsdb_sample_cb, void *userp);
+extern bool tsdb_last(struct tsdb_series *, int64_t *ts, int64_t *values);
+extern void tsdb_sync(struct tsdb_series *);
+
+extern bool tsdb_valid_name(const char *);
+
+#endif
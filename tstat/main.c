@@ -0,0 +1,10 @@
+#include "config.h"
+
+#include <freeabode/component.h>
+
+#include "tstat.h"
+
+int main(int argc, char **argv)
+{
+	return fabd_component_main(argc, argv, &tstat_component);
+}
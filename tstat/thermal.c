@@ -0,0 +1,125 @@
+#include "config.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <freeabode/util.h>
+
+#include "thermal.h"
+
+// Readings closer together than this give too noisy a slope, so they get combined
+static const long thermal_min_interval_ms = 90000;
+// Readings further apart than this don't describe a single trend
+static const long thermal_max_interval_ms = 900000;
+// Forget old behaviour slowly, so the model tracks changing weather
+static const double thermal_forgetting = 0.995;
+static const unsigned thermal_min_samples = 8;
+
+static inline
+double thermal_x(const int32_t temperature)
+{
+	return (temperature / 100.) - 20.;
+}
+
+static
+void thermal_regressors(double * const phi, const int32_t temperature, const enum tstat_equipment equipment)
+{
+	phi[0] = 1.;
+	phi[1] = thermal_x(temperature);
+	phi[2] = (equipment == TTE_COOLING) ? 1. : 0.;
+	phi[3] = (equipment == TTE_HEATING) ? 1. : 0.;
+}
+
+void tstat_thermal_init(struct tstat_thermal_model * const model)
+{
+	*model = (struct tstat_thermal_model){
+		.have_last = false,
+	};
+	for (int i = 0; i < TSTAT_THERMAL_PARAMS; ++i)
+		model->P[i][i] = 1000.;
+}
+
+static
+void thermal_rls(struct tstat_thermal_model * const model, const double * const phi, const double y)
+{
+	const int n = TSTAT_THERMAL_PARAMS;
+	double Pphi[TSTAT_THERMAL_PARAMS], k[TSTAT_THERMAL_PARAMS];
+	double denom = thermal_forgetting, predicted = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		Pphi[i] = 0;
+		for (int j = 0; j < n; ++j)
+			Pphi[i] += model->P[i][j] * phi[j];
+		denom += phi[i] * Pphi[i];
+		predicted += phi[i] * model->theta[i];
+	}
+	for (int i = 0; i < n; ++i)
+		k[i] = Pphi[i] / denom;
+	const double error = y - predicted;
+	for (int i = 0; i < n; ++i)
+		model->theta[i] += k[i] * error;
+	// P is symmetric, so phi' * P == (P * phi)'
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < n; ++j)
+			model->P[i][j] = (model->P[i][j] - k[i] * Pphi[j]) / thermal_forgetting;
+}
+
+void tstat_thermal_update(struct tstat_thermal_model * const model, const struct timespec * const now, const int32_t temperature, const enum tstat_equipment equipment)
+{
+	if (model->have_last && equipment == model->equipment_last)
+	{
+		const long elapsed_ms = -timespec_to_timeout_ms(now, &model->ts_last);
+		if (elapsed_ms < thermal_min_interval_ms)
+			return;
+		if (elapsed_ms <= thermal_max_interval_ms)
+		{
+			// Fit the slope against the midpoint of the interval
+			const double hours = elapsed_ms / 3600000.;
+			const double y = (thermal_x(temperature) - thermal_x(model->temperature_last)) / hours;
+			double phi[TSTAT_THERMAL_PARAMS];
+			thermal_regressors(phi, (temperature + model->temperature_last) / 2, equipment);
+			thermal_rls(model, phi, y);
+			++model->samples[equipment];
+		}
+	}
+	// Equipment changes leave a transient we don't model, so just start over from here
+	model->have_last = true;
+	model->ts_last = *now;
+	model->temperature_last = temperature;
+	model->equipment_last = equipment;
+}
+
+bool tstat_thermal_predict(const struct tstat_thermal_model * const model, const int32_t temperature, const enum tstat_equipment equipment, const int32_t threshold, double * const out_secs)
+{
+	if (model->samples[TTE_IDLE] + model->samples[equipment] < thermal_min_samples || model->samples[equipment] < thermal_min_samples / 2)
+		return false;
+	
+	const double x0 = thermal_x(temperature), xth = thermal_x(threshold);
+	double phi[TSTAT_THERMAL_PARAMS];
+	thermal_regressors(phi, temperature, equipment);
+	const double b = model->theta[1];
+	const double drive = model->theta[0] + model->theta[2] * phi[2] + model->theta[3] * phi[3];
+	double hours;
+	if (b < -1e-3)
+	{
+		// Exponential approach to an equilibrium temperature
+		const double x_inf = -drive / b;
+		const double ratio = (xth - x_inf) / (x0 - x_inf);
+		if (!(ratio > 0 && ratio <= 1))
+			// Never gets there
+			return false;
+		hours = log(ratio) / b;
+	}
+	else
+	{
+		// Effectively unbounded; treat it as linear
+		const double rate = drive + b * x0;
+		if (rate == 0 || (xth - x0) / rate < 0)
+			return false;
+		hours = (xth - x0) / rate;
+	}
+	*out_secs = hours * 3600.;
+	return true;
+}
@@ -0,0 +1,35 @@
+#ifndef FABD_TSTAT_THERMAL_H
+#define FABD_TSTAT_THERMAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+enum tstat_equipment {
+	TTE_IDLE,
+	TTE_COOLING,
+	TTE_HEATING,
+	
+	TTE__COUNT,
+};
+
+#define TSTAT_THERMAL_PARAMS  4
+
+// First-order model of the space: dT/dt = a + b*T + c*cooling + d*heating
+// Fit online by recursive least squares; T is in degrees C offset by 20, and time in hours, to keep things well-conditioned
+struct tstat_thermal_model {
+	double theta[TSTAT_THERMAL_PARAMS];
+	double P[TSTAT_THERMAL_PARAMS][TSTAT_THERMAL_PARAMS];
+	unsigned samples[TTE__COUNT];
+	
+	bool have_last;
+	struct timespec ts_last;
+	int32_t temperature_last;
+	enum tstat_equipment equipment_last;
+};
+
+extern void tstat_thermal_init(struct tstat_thermal_model *);
+extern void tstat_thermal_update(struct tstat_thermal_model *, const struct timespec *now, int32_t temperature, enum tstat_equipment);
+extern bool tstat_thermal_predict(const struct tstat_thermal_model *, int32_t temperature, enum tstat_equipment, int32_t threshold, double *out_secs);
+
+#endif
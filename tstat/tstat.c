@@ -3,17 +3,27 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <time.h>
 
 #include <zmq.h>
 
+#include <freeabode/component.h>
+#include <freeabode/eventtime.h>
 #include <freeabode/fabdcfg.h>
 #include <freeabode/freeabode.pb-c.h>
 #include <freeabode/logging.h>
+#include <freeabode/metrics.h>
 #include <freeabode/security.h>
+#include <freeabode/statefile.h>
 #include <freeabode/util.h>
 
+#include "thermal.h"
+#include "tstat.h"
+
 static const int default_temp_goal_low  = 2400;
 static const int default_temp_goal_high = 3020;
 static const int default_temp_hysteresis = 50;
@@ -21,6 +31,17 @@ static const unsigned long fan_before_cool_ms =  10547;
 static const unsigned long  fan_after_cool_ms =  42188;
 static const unsigned long   shutoff_delay_ms = 337500;
 static const unsigned long           retry_ms =   1319;
+static const unsigned long predict_start_lead_ms = 168750;
+static const time_t cycles_window_secs = 86400;
+// Goal changes tend to come in bursts (eg, turning a knob), so only sync them this often
+static const unsigned long state_flush_ms = 5273;
+static const char * const tstat_state_magic = "freeabode-tstat-state 1";
+static const uint32_t hwctl_latency_bounds_us[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 1000000, };
+
+// Round trip of each request to hwctl
+static struct fabd_metric *hwctl_latency_metric;
+
+#define TSTAT_MAX_CYCLES_TRACKED  0x100
 
 enum tstat_mode {
 	TSM_OFF,
@@ -28,11 +49,17 @@ enum tstat_mode {
 	TSM_HEAT,
 };
 
+enum tstat_control {
+	TSC_HYSTERESIS,
+	TSC_PREDICTIVE,
+};
+
 struct tstat_data {
 	// ZMQ sockets
 	void *client_hwctl;
 	void *client_weather;
 	void *server_events;
+	struct fabd_event_latency weather_latency;
 	void *server_ctl;
 	
 	// Configuration
@@ -40,15 +67,26 @@ struct tstat_data {
 	int t_goal_high;
 	int t_hysteresis;
 	bool fan_always_on;
+	enum tstat_control control;
+	unsigned long predict_start_lead_ms;
+	unsigned long predict_stop_lead_ms;
 	
 	// State
 	enum tstat_mode mode;
+	bool compressor_on;
 	struct timespec ts_earliest_compressor;
+	struct tstat_thermal_model model;
+	struct timespec compressor_starts[TSTAT_MAX_CYCLES_TRACKED];
+	unsigned compressor_starts_next;
 	
 	// Timers
 	struct timespec ts_turn_fan_on;
 	struct timespec ts_turn_compressor_on;
 	struct timespec ts_turn_fan_off;
+	
+	// Persistence
+	const char *state_path;
+	struct timespec ts_state_flush;
 };
 
 static
@@ -66,6 +104,156 @@ const char *tstat_mode_str(const enum tstat_mode mode)
 	}
 }
 
+static
+enum tstat_control tstat_control_from_str(const char * const s)
+{
+	if (s && !strcasecmp(s, "predictive"))
+		return TSC_PREDICTIVE;
+	return TSC_HYSTERESIS;
+}
+
+static
+enum tstat_equipment tstat_equipment_running(const struct tstat_data * const tstat)
+{
+	if (!tstat->compressor_on)
+		return TTE_IDLE;
+	return (tstat->mode == TSM_HEAT) ? TTE_HEATING : TTE_COOLING;
+}
+
+static
+unsigned tstat_compressor_cycles(const struct tstat_data * const tstat, const struct timespec * const ts_now)
+{
+	unsigned count = 0;
+	for (int i = 0; i < TSTAT_MAX_CYCLES_TRACKED; ++i)
+	{
+		const struct timespec * const ts_start = &tstat->compressor_starts[i];
+		if (timespec_isset(ts_start) && ts_now->tv_sec - ts_start->tv_sec < cycles_window_secs)
+			++count;
+	}
+	return count;
+}
+
+static
+void populate_tstat_status(PbTstatStatus * const status, const struct tstat_data * const tstat, const struct timespec * const ts_now)
+{
+	status->has_compressor_cycles_24h = true;
+	status->compressor_cycles_24h = tstat_compressor_cycles(tstat, ts_now);
+}
+
+static
+void tstat_record_compressor_start(struct tstat_data * const tstat, const struct timespec * const ts_now)
+{
+	tstat->compressor_starts[tstat->compressor_starts_next] = *ts_now;
+	tstat->compressor_starts_next = (tstat->compressor_starts_next + 1) % TSTAT_MAX_CYCLES_TRACKED;
+	
+	PbEvent pbevent = PB_EVENT__INIT;
+	PbTstatStatus status = PB_TSTAT_STATUS__INIT;
+	populate_tstat_status(&status, tstat, ts_now);
+	pbevent.tstat_status = &status;
+	applog(LOG_INFO, "Compressor cycles in the last day: %u", (unsigned)status.compressor_cycles_24h);
+	fabd_pbevent_send(tstat->server_events, &pbevent, NULL);
+}
+
+static
+int64_t realtime_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static
+void tstat_state_save(struct tstat_data * const tstat)
+{
+	timespec_clear(&tstat->ts_state_flush);
+	
+	// The lockout timer is monotonic, which doesn't survive reboots, so store it as wall time
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	const int64_t earliest_compressor_ms = realtime_ms() + timespec_to_timeout_ms(&ts_now, &tstat->ts_earliest_compressor);
+	
+	struct fabd_statefile_txn txn;
+	if (!fabd_statefile_begin(&txn, tstat->state_path))
+		return;
+	fprintf(txn.F, "%s\n", tstat_state_magic);
+	fprintf(txn.F, "temp_low %d\n", tstat->t_goal_low);
+	fprintf(txn.F, "temp_high %d\n", tstat->t_goal_high);
+	fprintf(txn.F, "temp_hysteresis %d\n", tstat->t_hysteresis);
+	fprintf(txn.F, "fan_always_on %d\n", (int)tstat->fan_always_on);
+	fprintf(txn.F, "compressor_on %d\n", (int)tstat->compressor_on);
+	fprintf(txn.F, "earliest_compressor_ms %lld\n", (long long)earliest_compressor_ms);
+	fabd_statefile_commit(&txn);
+}
+
+// Safety-relevant changes are written immediately; others are batched
+static
+void tstat_state_changed(struct tstat_data * const tstat, const bool urgent)
+{
+	if (urgent)
+	{
+		tstat_state_save(tstat);
+		return;
+	}
+	if (timespec_isset(&tstat->ts_state_flush))
+		return;
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	timespec_add_ms(&ts_now, state_flush_ms, &tstat->ts_state_flush);
+}
+
+static
+void tstat_state_load(struct tstat_data * const tstat, const struct timespec * const ts_now)
+{
+	FILE * const F = fopen(tstat->state_path, "r");
+	if (!F)
+		return;
+	
+	char line[0x100], key[0x40];
+	long long value;
+	bool compressor_on = true;
+	int64_t earliest_compressor_ms = INT64_MAX;
+	if (!(fgets(line, sizeof(line), F) && !strncmp(line, tstat_state_magic, strlen(tstat_state_magic))))
+	{
+		applog(LOG_WARNING, "%s: Not a tstat state file, ignoring", tstat->state_path);
+		goto out;
+	}
+	while (fgets(line, sizeof(line), F))
+	{
+		if (sscanf(line, "%63s %lld", key, &value) != 2)
+			continue;
+		if (!strcmp(key, "temp_low"))
+			tstat->t_goal_low = value;
+		else
+		if (!strcmp(key, "temp_high"))
+			tstat->t_goal_high = value;
+		else
+		if (!strcmp(key, "temp_hysteresis"))
+			tstat->t_hysteresis = value;
+		else
+		if (!strcmp(key, "fan_always_on"))
+			tstat->fan_always_on = value;
+		else
+		if (!strcmp(key, "compressor_on"))
+			compressor_on = value;
+		else
+		if (!strcmp(key, "earliest_compressor_ms"))
+			earliest_compressor_ms = value;
+	}
+	
+	// If the compressor might have been running when we stopped, keep the full lockout
+	if (!compressor_on)
+	{
+		const int64_t remaining_ms = earliest_compressor_ms - realtime_ms();
+		// Clamp, in case the clock has jumped
+		const unsigned long lockout_ms = (remaining_ms < 0) ? 0 : fabd_min((unsigned long)remaining_ms, shutoff_delay_ms);
+		timespec_add_ms(ts_now, lockout_ms, &tstat->ts_earliest_compressor);
+		applog(LOG_INFO, "Restored state; compressor lockout %lums", lockout_ms);
+	}
+	
+out:
+	fclose(F);
+}
+
 static
 bool hvac_control_wire(void *ctl, PbHVACWires wire, bool connect)
 {
@@ -77,11 +265,18 @@ bool hvac_control_wire(void *ctl, PbHVACWires wire, bool connect)
 	pb_set_hvacwire_request__init(req.sethvacwire[0]);
 	req.sethvacwire[0]->wire = wire;
 	req.sethvacwire[0]->connect = connect;
+	struct timespec ts_start, ts_end;
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
 	zmq_send_protobuf(ctl, pb_request, &req, 0);
 	free(mem);
 	
 	PbRequestReply *reply;
 	zmq_recv_protobuf(ctl, pb_request_reply, reply, NULL);
+	if (hwctl_latency_metric)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		fabd_metric_observe(hwctl_latency_metric, ((int64_t)(ts_end.tv_sec - ts_start.tv_sec) * 1000000) + ((ts_end.tv_nsec - ts_start.tv_nsec) / 1000));
+	}
 	assert(reply->n_sethvacwiresuccess >= 1);
 	bool rv = reply->sethvacwiresuccess[0];
 	pb_request_reply__free_unpacked(reply, NULL);
@@ -139,12 +334,14 @@ void do_compressor_off(struct tstat_data * const tstat, struct timespec * const
 			applog(LOG_ERR, "WARNING: Failed to turn off compressor");
 		else
 		{
+			tstat->compressor_on = false;
 			tstat->mode = TSM_OFF;
 			struct timespec ts_now;
 			clock_gettime(CLOCK_MONOTONIC, &ts_now);
 			timespec_add_ms(&ts_now, fan_after_cool_ms, &tstat->ts_turn_fan_off);
 		}
 		timespec_add_ms(ts_now, shutoff_delay_ms, &tstat->ts_earliest_compressor);
+		tstat_state_changed(tstat, true);
 	}
 }
 
@@ -163,24 +360,58 @@ void do_compressor_on(struct tstat_data * const tstat, const enum tstat_mode mod
 		tstat->ts_turn_fan_on = tstat->ts_earliest_compressor;
 }
 
+// Returns true if the model expects the temperature to reach threshold within lead_ms
+static
+bool tstat_predict_crossing(const struct tstat_data * const tstat, const int32_t temperature, const enum tstat_equipment equipment, const int32_t threshold, const unsigned long lead_ms)
+{
+	if (tstat->control != TSC_PREDICTIVE)
+		return false;
+	double secs;
+	if (!tstat_thermal_predict(&tstat->model, temperature, equipment, threshold, &secs))
+		return false;
+	if (secs * 1000 > lead_ms)
+		return false;
+	applog(LOG_INFO, "Predicted to reach %d.%02d C in %ds", (int)(threshold / 100), (int)(threshold % 100), (int)secs);
+	return true;
+}
+
 static
 void do_tstat_logic(struct tstat_data * const tstat, struct timespec * const ts_now, PbWeather * const weather)
 {
+	const int32_t temperature = weather->temperature;
+	const int32_t t_cool_on  = tstat->t_goal_high + tstat->t_hysteresis;
+	const int32_t t_cool_off = tstat->t_goal_high - tstat->t_hysteresis;
+	const int32_t t_heat_on  = tstat->t_goal_low  - tstat->t_hysteresis;
+	const int32_t t_heat_off = tstat->t_goal_low  + tstat->t_hysteresis;
+	
+	// Predictions only ever move a transition within the hysteresis band, past the goal itself
 	switch (tstat->mode)
 	{
 		case TSM_COOL:
-			if (weather->temperature < tstat->t_goal_high - tstat->t_hysteresis)
+			if (temperature < t_cool_off)
+				do_compressor_off(tstat, ts_now);
+			else
+			if (tstat->compressor_on && temperature < tstat->t_goal_high && tstat_predict_crossing(tstat, temperature, TTE_COOLING, t_cool_off, tstat->predict_stop_lead_ms))
 				do_compressor_off(tstat, ts_now);
 			break;
 		case TSM_HEAT:
-			if (weather->temperature > tstat->t_goal_low + tstat->t_hysteresis)
+			if (temperature > t_heat_off)
+				do_compressor_off(tstat, ts_now);
+			else
+			if (tstat->compressor_on && temperature > tstat->t_goal_low && tstat_predict_crossing(tstat, temperature, TTE_HEATING, t_heat_off, tstat->predict_stop_lead_ms))
 				do_compressor_off(tstat, ts_now);
 			break;
 		case TSM_OFF:
-			if (weather->temperature > tstat->t_goal_high + tstat->t_hysteresis)
+			if (temperature > t_cool_on)
 				do_compressor_on(tstat, TSM_COOL);
 			else
-			if (weather->temperature < tstat->t_goal_low - tstat->t_hysteresis)
+			if (temperature < t_heat_on)
+				do_compressor_on(tstat, TSM_HEAT);
+			else
+			if (temperature > tstat->t_goal_high && tstat_predict_crossing(tstat, temperature, TTE_IDLE, t_cool_on, tstat->predict_start_lead_ms))
+				do_compressor_on(tstat, TSM_COOL);
+			else
+			if (temperature < tstat->t_goal_low && tstat_predict_crossing(tstat, temperature, TTE_IDLE, t_heat_on, tstat->predict_start_lead_ms))
 				do_compressor_on(tstat, TSM_HEAT);
 			break;
 	}
@@ -191,11 +422,13 @@ void read_weather(struct tstat_data *tstat, struct timespec *ts_now)
 {
 	PbEvent *pbevent;
 	zmq_recv_protobuf(tstat->client_weather, pb_event, pbevent, NULL);
+	fabd_event_latency_record(&tstat->weather_latency, pbevent);
 	PbWeather *weather = pbevent->weather;
 	
 	if (weather && weather->has_temperature)
 	{
 		applog(LOG_INFO, "Temperature %2u.%02u C", (unsigned)(weather->temperature / 100), (unsigned)(weather->temperature % 100));
+		tstat_thermal_update(&tstat->model, ts_now, weather->temperature, tstat_equipment_running(tstat));
 		do_tstat_logic(tstat, ts_now, weather);
 	}
 	
@@ -218,6 +451,7 @@ void populate_hvacgoals(PbHVACGoals * const goals, const struct tstat_data * con
 	goals->fan_mode = (tstat->fan_always_on ? PB_FAN_MODE__AlwaysOn : PB_FAN_MODE__Auto);
 }
 
+static
 void handle_req(struct tstat_data *tstat)
 {
 	PbRequest *req;
@@ -243,13 +477,41 @@ void handle_req(struct tstat_data *tstat)
 		populate_hvacgoals(&goalreply, tstat);
 		reply.hvacgoals = &goalreply;
 		pbevent.hvacgoals = &goalreply;
+		tstat_state_changed(tstat, false);
 	}
 	
 	pb_request__free_unpacked(req, NULL);
 	zmq_send_protobuf(tstat->server_ctl, pb_request_reply, &reply, 0);
-	zmq_send_protobuf(tstat->server_events, pb_event, &pbevent, 0);
+	fabd_pbevent_send(tstat->server_events, &pbevent, NULL);
 }
 
+static
+void tstat_config_changed(const char * const devid, const char * const key, const struct fabdcfg_value * const newvalue, void * const userp)
+{
+	struct tstat_data * const tstat = userp;
+	const bool has_int = newvalue && newvalue->has_int;
+	
+	if (!strcmp(key, "temp_low"))
+		tstat->t_goal_low = has_int ? newvalue->intval : default_temp_goal_low;
+	else
+	if (!strcmp(key, "temp_high"))
+		tstat->t_goal_high = has_int ? newvalue->intval : default_temp_goal_high;
+	else
+	if (!strcmp(key, "temp_hysteresis"))
+		tstat->t_hysteresis = has_int ? newvalue->intval : default_temp_hysteresis;
+	else
+	if (!strcmp(key, "fan"))
+		tstat_set_fan_always_on(tstat, newvalue && newvalue->truth == FTS_TRUE);
+	
+	PbEvent pbevent = PB_EVENT__INIT;
+	PbHVACGoals goals = PB_HVACGOALS__INIT;
+	populate_hvacgoals(&goals, tstat);
+	pbevent.hvacgoals = &goals;
+	fabd_pbevent_send(tstat->server_events, &pbevent, NULL);
+	tstat_state_changed(tstat, false);
+}
+
+static
 void got_new_subscriber(void * const s, const struct tstat_data * const tstat)
 {
 	zmq_msg_t msg;
@@ -267,31 +529,51 @@ void got_new_subscriber(void * const s, const struct tstat_data * const tstat)
 	populate_hvacgoals(&goalreply, tstat);
 	pbevent.hvacgoals = &goalreply;
 	
-	zmq_send_protobuf(s, pb_event, &pbevent, 0);
+	struct timespec ts_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
+	PbTstatStatus status = PB_TSTAT_STATUS__INIT;
+	populate_tstat_status(&status, tstat, &ts_now);
+	pbevent.tstat_status = &status;
+	
+	fabd_pbevent_send(s, &pbevent, NULL);
 	
 out:
 	zmq_msg_close(&msg);
 }
 
-int main(int argc, char **argv)
+static const char * const reloadable_keys[] = { "temp_low", "temp_high", "temp_hysteresis", "fan", };
+
+static
+void tstat_run(struct fabd_component * const comp)
 {
-	const char * const my_devid = fabd_common_argv(argc, argv, "tstat");
-	load_freeabode_key();
-	
-	void *my_zmq_context;
+	const char * const my_devid = comp->devid;
+	void * const my_zmq_context = comp->zmq_context;
 	struct timespec ts_now, ts_timeout;
 	struct tstat_data _tstat = {
 		.t_goal_low = fabdcfg_device_getint(my_devid, "temp_low", default_temp_goal_low),
 		.t_goal_high = fabdcfg_device_getint(my_devid, "temp_high", default_temp_goal_high),
 		.t_hysteresis = fabdcfg_device_getint(my_devid, "temp_hysteresis", default_temp_hysteresis),
+		.control = tstat_control_from_str(fabdcfg_device_getstr(my_devid, "control")),
+		.predict_start_lead_ms = fabdcfg_device_getint(my_devid, "predict_start_lead_ms", predict_start_lead_ms),
+		.predict_stop_lead_ms = fabdcfg_device_getint(my_devid, "predict_stop_lead_ms", fan_after_cool_ms),
 		.ts_turn_fan_on = TIMESPEC_INIT_CLEAR,
 		.ts_turn_compressor_on = TIMESPEC_INIT_CLEAR,
 		.ts_turn_fan_off = TIMESPEC_INIT_CLEAR,
+		.ts_state_flush = TIMESPEC_INIT_CLEAR,
 	}, *tstat = &_tstat;
 	clock_gettime(CLOCK_MONOTONIC, &ts_now);
 	timespec_add_ms(&ts_now, shutoff_delay_ms, &tstat->ts_earliest_compressor);
-	
-	my_zmq_context = zmq_ctx_new();
+	{
+		char state_path[0x100];
+		snprintf(state_path, sizeof(state_path), "%s.state", my_devid);
+		tstat->state_path = strdup(fabdcfg_device_getstr(my_devid, "state_file") ?: state_path);
+	}
+	tstat->fan_always_on = fabdcfg_device_getbool(my_devid, "fan", false);
+	tstat_state_load(tstat, &ts_now);
+	tstat_thermal_init(&tstat->model);
+	for (int i = 0; i < TSTAT_MAX_CYCLES_TRACKED; ++i)
+		timespec_clear(&tstat->compressor_starts[i]);
+	applog(LOG_INFO, "Using %s control", (tstat->control == TSC_PREDICTIVE) ? "predictive" : "hysteresis");
 	
 	tstat->client_hwctl = zmq_socket(my_zmq_context, ZMQ_REQ);
 	freeabode_zmq_security(tstat->client_hwctl, false);
@@ -301,6 +583,12 @@ int main(int argc, char **argv)
 	freeabode_zmq_security(tstat->client_weather, false);
 	assert(fabdcfg_zmq_connect(my_devid, "weather", tstat->client_weather));
 	assert(!zmq_setsockopt(tstat->client_weather, ZMQ_SUBSCRIBE, NULL, 0));
+	fabd_event_latency_init(&tstat->weather_latency, my_devid, "weather");
+	
+	char metric_labels[strlen(my_devid) + 0x10];
+	snprintf(metric_labels, sizeof(metric_labels), "devid=\"%s\"", my_devid);
+	hwctl_latency_metric = fabd_metric_histogram("fabd_tstat_hwctl_latency_us", metric_labels, "Round trip of requests to hwctl", hwctl_latency_bounds_us, sizeof(hwctl_latency_bounds_us) / sizeof(*hwctl_latency_bounds_us));
+	struct fabd_metric * const wakeups_metric = fabd_metric_counter("fabd_poll_wakeups_total", metric_labels, "Times the main loop woke up");
 	
 	tstat->server_events = zmq_socket(my_zmq_context, ZMQ_XPUB);
 	freeabode_zmq_security(tstat->server_events, true);
@@ -311,17 +599,29 @@ int main(int argc, char **argv)
 	freeabode_zmq_security(tstat->server_ctl, true);
 	assert(fabdcfg_zmq_bind(my_devid, "control", tstat->server_ctl));
 	
-	tstat_set_fan_always_on(tstat, fabdcfg_device_getbool(my_devid, "fan", false));
+	if (tstat->fan_always_on)
+	{
+		// Apply the restored (or configured) fan mode to the hardware
+		tstat->fan_always_on = false;
+		tstat_set_fan_always_on(tstat, true);
+	}
+	
+	for (size_t i = 0; i < sizeof(reloadable_keys) / sizeof(*reloadable_keys); ++i)
+		fabdcfg_on_change(my_devid, reloadable_keys[i], tstat_config_changed, tstat);
 	
 	zmq_pollitem_t pollitems[] = {
 		{ .socket = tstat->client_weather, .events = ZMQ_POLLIN },
 		{ .socket = tstat->server_ctl, .events = ZMQ_POLLIN },
 		{ .socket = tstat->server_events, .events = ZMQ_POLLIN },
+		{ .fd = fabdcfg_watch_start(), .events = ZMQ_POLLIN },
+		{ .fd = comp->stop_fd, .events = ZMQ_POLLIN },
 	};
-	while (true)
+	while (!fabd_component_stopping(comp))
 	{
 		timespec_clear(&ts_timeout);
 		clock_gettime(CLOCK_MONOTONIC, &ts_now);
+		if (timespec_passed(&tstat->ts_state_flush, &ts_now, &ts_timeout))
+			tstat_state_save(tstat);
 		if (timespec_passed(&tstat->ts_turn_fan_on, &ts_now, &ts_timeout))
 		{
 			applog(LOG_INFO, "Turning on  fan");
@@ -344,7 +644,12 @@ int main(int argc, char **argv)
 			success &= hvac_control_wire(tstat->client_hwctl, PB_HVACWIRES__OB, ctl_ob);
 			success &= hvac_control_wire(tstat->client_hwctl, PB_HVACWIRES__Y1, true);
 			if (success)
+			{
 				timespec_clear(&tstat->ts_turn_compressor_on);
+				tstat->compressor_on = true;
+				tstat_state_changed(tstat, true);
+				tstat_record_compressor_start(tstat, &ts_now);
+			}
 			else
 			{
 				applog(LOG_ERR, "FAILED to turn on compressor");
@@ -362,6 +667,7 @@ int main(int argc, char **argv)
 			
 			applog(LOG_INFO, "Turning off fan");
 			timespec_add_ms(&ts_now, shutoff_delay_ms, &tstat->ts_earliest_compressor);
+			tstat_state_changed(tstat, false);
 			if (hvac_control_wire(tstat->client_hwctl, PB_HVACWIRES__G , false))
 				timespec_clear(&tstat->ts_turn_fan_off);
 			else
@@ -370,6 +676,7 @@ int main(int argc, char **argv)
 				timespec_add_ms(&ts_now, retry_ms, &ts_timeout);
 			}
 		}
+		if (applog_enabled(LOG_DEBUG))
 		{
 			char buf[4][0x100];
 			timespec_to_str(buf[0], sizeof(buf[0]), &tstat->ts_earliest_compressor);
@@ -378,7 +685,9 @@ int main(int argc, char **argv)
 			timespec_to_str(buf[3], sizeof(buf[3]), &tstat->ts_turn_fan_off);
 			applog(LOG_DEBUG, "Delay=%s FanOn=%s CompOn=%s FanOff=%s", buf[0], buf[1], buf[2], buf[3]);
 		}
-		if (zmq_poll(pollitems, sizeof(pollitems) / sizeof(*pollitems), timespec_to_timeout_ms(&ts_now, &ts_timeout)) <= 0)
+		const int rv = zmq_poll(pollitems, sizeof(pollitems) / sizeof(*pollitems), timespec_to_timeout_ms(&ts_now, &ts_timeout));
+		fabd_metric_inc(wakeups_metric);
+		if (rv <= 0)
 			continue;
 		clock_gettime(CLOCK_MONOTONIC, &ts_now);
 		if (pollitems[0].revents & ZMQ_POLLIN)
@@ -387,5 +696,23 @@ int main(int argc, char **argv)
 			handle_req(tstat);
 		if (pollitems[2].revents & ZMQ_POLLIN)
 			got_new_subscriber(tstat->server_events, tstat);
+		if (pollitems[3].revents & ZMQ_POLLIN)
+			fabdcfg_dispatch_changes();
 	}
+	
+	// Equipment is left as-is; the saved state covers whatever is running
+	tstat_state_save(tstat);
+	for (size_t i = 0; i < sizeof(reloadable_keys) / sizeof(*reloadable_keys); ++i)
+		fabdcfg_off_change(my_devid, reloadable_keys[i], tstat_config_changed, tstat);
+	zmq_close(tstat->server_ctl);
+	zmq_close(tstat->server_events);
+	zmq_close(tstat->client_weather);
+	fabd_event_latency_free(&tstat->weather_latency);
+	zmq_close(tstat->client_hwctl);
+	free((void*)tstat->state_path);
 }
+
+const struct fabd_component_type tstat_component = {
+	.type = "tstat",
+	.run = tstat_run,
+};
@@ -0,0 +1,8 @@
+#ifndef FABD_TSTAT_H
+#define FABD_TSTAT_H
+
+#include <freeabode/component.h>
+
+extern const struct fabd_component_type tstat_component;
+
+#endif
@@ -0,0 +1,11 @@
+#include "config.h"
+
+#include <freeabode/component.h>
+
+#include "wallknob.h"
+
+int main(int argc, char **argv)
+{
+	fabdwk_directfb_init(&argc, &argv);
+	return fabd_component_main(argc, argv, &wallknob_component);
+}
@@ -76,7 +76,11 @@ redraw: ;
 	fabdwk_textmenu_draw(wi, font, prompt, opts, optcount, scroll, &sel);
 	while (true)
 	{
-		fabdwk_wait_for_event(&ev);
+		if (!fabdwk_wait_for_event(&ev))
+		{
+			sel = defopt;
+			goto done;
+		}
 		
 		if (ev.clazz != DFEC_INPUT)
 			continue;
@@ -4,6 +4,7 @@
 #include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -12,9 +13,12 @@
 #include <zmq.h>
 #include <zmq_utils.h>
 
+#include <freeabode/component.h>
+#include <freeabode/eventtime.h>
 #include <freeabode/fabdcfg.h>
 #include <freeabode/freeabode.pb-c.h>
 #include <freeabode/logging.h>
+#include <freeabode/pbarena.h>
 #include <freeabode/security.h>
 #include <freeabode/util.h>
 
@@ -44,6 +48,7 @@ void dfbassert_(DFBResult err, const char *file, int line, const char *expr)
 	DirectFBErrorFatal(expr, err);
 }
 
+static struct fabd_component *my_component;
 static const char *my_devid;
 static void *my_zmq_context;
 
@@ -201,6 +206,10 @@ struct weather_windows {
 	struct my_window_info i_charging;
 	struct my_window_info circle;
 	struct my_window_info temperature_bar;
+	
+	struct fabd_event_latency latency_tstat;
+	struct fabd_event_latency latency_weather;
+	struct fabd_event_latency latency_wires;
 };
 
 struct button_windows {
@@ -607,10 +616,13 @@ void update_win_temperature_bar(struct my_window_info * const wi, const int32_t
 }
 
 static
-void weather_recv(struct weather_windows * const ww, void * const client_weather, int32_t * const current_temp_p, unsigned *current_humidity)
+void weather_recv(struct weather_windows * const ww, struct fabd_pbarena * const arena, void * const client_weather, int32_t * const current_temp_p, unsigned *current_humidity)
 {
 	PbEvent *pbevent;
-	zmq_recv_protobuf(client_weather, pb_event, pbevent, NULL);
+	zmq_recv_protobuf(client_weather, pb_event, pbevent, &arena->allocator);
+	if (!pbevent)
+		goto out;
+	fabd_event_latency_record(&ww->latency_weather, pbevent);
 	
 	PbWeather *weather = pbevent->weather;
 	if (weather)
@@ -626,15 +638,21 @@ void weather_recv(struct weather_windows * const ww, void * const client_weather
 			update_win_humid(&ww->humid, weather->humidity);
 		}
 	}
+	
+out:
+	fabd_pbarena_reset(arena);
 }
 
 static
-void wires_recv(struct weather_windows * const ww, void * const client_weather)
+void wires_recv(struct weather_windows * const ww, struct fabd_pbarena * const arena, void * const client_weather)
 {
 	static bool fetstatus[PB_HVACWIRES___COUNT] = {true,true,true,true,true,true,true,true,true,true,true,true};
 	
 	PbEvent *pbevent;
-	zmq_recv_protobuf(client_weather, pb_event, pbevent, NULL);
+	zmq_recv_protobuf(client_weather, pb_event, pbevent, &arena->allocator);
+	if (!pbevent)
+		goto out;
+	fabd_event_latency_record(&ww->latency_wires, pbevent);
 	
 	if (pbevent->n_wire_change)
 	{
@@ -645,6 +663,9 @@ void wires_recv(struct weather_windows * const ww, void * const client_weather)
 	}
 	if (pbevent->battery && pbevent->battery->has_charging)
 		update_win_i_charging(&ww->i_charging, pbevent->battery->charging);
+	
+out:
+	fabd_pbarena_reset(arena);
 }
 
 static int adjusting_pipe[2];
@@ -659,10 +680,13 @@ void init_client_tstat_ctl()
 }
 
 static
-void tstat_recv(struct weather_windows * const ww, void * const client_tstat)
+void tstat_recv(struct weather_windows * const ww, struct fabd_pbarena * const arena, void * const client_tstat)
 {
 	PbEvent *pbevent;
-	zmq_recv_protobuf(client_tstat, pb_event, pbevent, NULL);
+	zmq_recv_protobuf(client_tstat, pb_event, pbevent, &arena->allocator);
+	if (!pbevent)
+		goto out;
+	fabd_event_latency_record(&ww->latency_tstat, pbevent);
 	
 	PbHVACGoals *goals = pbevent->hvacgoals;
 	if (goals)
@@ -690,6 +714,124 @@ void tstat_recv(struct weather_windows * const ww, void * const client_tstat)
 		if (goals->has_temp_hysteresis)
 			temp_hysteresis = goals->temp_hysteresis;
 	}
+	
+out:
+	fabd_pbarena_reset(arena);
+}
+
+// Soak test: "soak_events" replays that many synthetic events through the usual handlers, instead of subscribing to the configured sources
+// RSS is sampled as they are handled, and wallknob exits with failure if it grows by more than SOAK_RSS_TOLERANCE_KB after warm-up
+#define SOAK_WARMUP_EVENTS  0x40000
+#define SOAK_RSS_INTERVAL  0x10000
+#define SOAK_RSS_TOLERANCE_KB  0x400
+
+static const char * const soak_sources[] = { "tstat", "weather", "wires", };
+
+static
+void *soak_socket(const char * const name, const bool bind)
+{
+	char endpoint[0x40];
+	snprintf(endpoint, sizeof(endpoint), "inproc://wallknob-soak-%s", name);
+	void * const s = zmq_socket(my_zmq_context, ZMQ_PAIR);
+	assert(s);
+	if (bind)
+		assert(!zmq_bind(s, endpoint));
+	else
+		assert(!zmq_connect(s, endpoint));
+	return s;
+}
+
+static
+void soak_feed_thread(void * const userp)
+{
+	const unsigned long * const n_events = userp;
+	void *s[3];
+	// Don't get stuck sending if wallknob is stopped early
+	const int timeout_ms = 100;
+	for (int i = 0; i < 3; ++i)
+	{
+		s[i] = soak_socket(soak_sources[i], false);
+		zmq_setsockopt(s[i], ZMQ_SNDTIMEO, &timeout_ms, sizeof(timeout_ms));
+		zmq_setsockopt(s[i], ZMQ_LINGER, &timeout_ms, sizeof(timeout_ms));
+	}
+	for (unsigned long i = 0; i < *n_events && !fabd_component_stopping(my_component); ++i)
+	{
+		PbEvent pbevent = PB_EVENT__INIT;
+		PbHVACGoals goals = PB_HVACGOALS__INIT;
+		PbWeather weather = PB_WEATHER__INIT;
+		PbBattery battery = PB_BATTERY__INIT;
+		PbSetHVACWireRequest wire = PB_SET_HVACWIRE_REQUEST__INIT, *wirep = &wire;
+		switch (i % 3)
+		{
+			case 0:
+				// Without temp_high/temp_low, which would connect to a tstat to control
+				goals.has_temp_hysteresis = true;
+				goals.temp_hysteresis = 50 + (i % 10);
+				pbevent.hvacgoals = &goals;
+				break;
+			case 1:
+				weather.has_temperature = weather.has_humidity = true;
+				weather.temperature = 2150 + (i % 50);
+				weather.humidity = 450 + (i % 20);
+				pbevent.weather = &weather;
+				break;
+			case 2:
+				wire.wire = PB_HVACWIRES__G;
+				wire.connect = (i / 3) & 1;
+				pbevent.n_wire_change = 1;
+				pbevent.wire_change = &wirep;
+				battery.has_charging = true;
+				battery.charging = (i / 6) & 1;
+				pbevent.battery = &battery;
+				break;
+		}
+		pbevent.has_published_us = true;
+		pbevent.published_us = fabd_realtime_us();
+		const size_t pbsz = pb_event__get_packed_size(&pbevent);
+		uint8_t pbbuf[pbsz];
+		pb_event__pack(&pbevent, pbbuf);
+		// Only times out if nothing is reading, ie wallknob is stopping
+		while (zmq_send(s[i % 3], pbbuf, pbsz, 0) < 0 && !fabd_component_stopping(my_component))
+		{}
+	}
+	for (int i = 0; i < 3; ++i)
+		zmq_close(s[i]);
+}
+
+static
+long soak_rss_kb(void)
+{
+	FILE * const f = fopen("/proc/self/statm", "r");
+	long pages_total, pages_resident;
+	if (!f)
+		return -1;
+	const bool ok = (fscanf(f, "%ld %ld", &pages_total, &pages_resident) == 2);
+	fclose(f);
+	return ok ? (pages_resident * (sysconf(_SC_PAGESIZE) / 1024)) : -1;
+}
+
+// Returns true once the soak is over
+static
+bool soak_check(const unsigned long handled, const unsigned long n_events, long * const rss_baseline_kb, long * const rss_max_kb)
+{
+	if (handled != n_events && (handled % SOAK_RSS_INTERVAL))
+		return false;
+	const long rss_kb = soak_rss_kb();
+	if (handled == SOAK_WARMUP_EVENTS || (handled == n_events && *rss_baseline_kb < 0))
+		*rss_baseline_kb = rss_kb;
+	if (rss_kb > *rss_max_kb)
+		*rss_max_kb = rss_kb;
+	if (handled != n_events)
+		return false;
+	
+	const long growth_kb = *rss_max_kb - *rss_baseline_kb;
+	if (rss_kb < 0 || growth_kb > SOAK_RSS_TOLERANCE_KB)
+	{
+		applog(LOG_CRIT, "Soak test failed: RSS grew from %ld to %ld kB over %lu events", *rss_baseline_kb, *rss_max_kb, n_events);
+		exit(1);
+	}
+	applog(LOG_NOTICE, "Soak test passed: RSS stayed within %ld kB of %ld kB over %lu events", growth_kb, *rss_baseline_kb, n_events);
+	return true;
 }
 
 static
@@ -697,9 +839,33 @@ void weather_thread(void * const userp)
 {
 	struct weather_windows * const ww = userp;
 	
-	void *client_tstat = my_zmqsub("tstat");
-	void *client_weather = my_zmqsub("weather");
-	void *client_wires = my_zmqsub("wires");
+	const unsigned long soak_events = fabdcfg_device_getint(my_devid, "soak_events", 0);
+	void *soak_thread = NULL;
+	unsigned long soak_handled = 0;
+	long soak_rss_baseline_kb = -1, soak_rss_max_kb = -1;
+	void *client_tstat, *client_weather, *client_wires;
+	if (soak_events)
+	{
+		applog(LOG_NOTICE, "Soak test: replaying %lu events", soak_events);
+		client_tstat = soak_socket("tstat", true);
+		client_weather = soak_socket("weather", true);
+		client_wires = soak_socket("wires", true);
+		soak_thread = zmq_threadstart(soak_feed_thread, (void*)&soak_events);
+		assert(soak_thread);
+	}
+	else
+	{
+		client_tstat = my_zmqsub("tstat");
+		client_weather = my_zmqsub("weather");
+		client_wires = my_zmqsub("wires");
+	}
+	fabd_event_latency_init(&ww->latency_tstat, my_devid, "tstat");
+	fabd_event_latency_init(&ww->latency_weather, my_devid, "weather");
+	fabd_event_latency_init(&ww->latency_wires, my_devid, "wires");
+	
+	// All events are decoded into this, and released after each is handled
+	struct fabd_pbarena arena;
+	fabd_pbarena_init(&arena, 0x400);
 	
 	my_win_init(&ww->clock);
 	my_win_init(&ww->temp);
@@ -716,13 +882,14 @@ void weather_thread(void * const userp)
 		{ .socket = client_weather, .events = ZMQ_POLLIN },
 		{ .fd = redraw_pipe[0], .events = ZMQ_POLLIN },
 		{ .socket = client_wires, .events = ZMQ_POLLIN },
+		{ .fd = my_component->stop_fd, .events = ZMQ_POLLIN },
 	};
 	
 	char buf[0x10];
 	int32_t current_temp = 0;
 	unsigned current_humidity = 0;
 	struct timespec ts_timeout = {0, 0}, ts_now = {0, 0};
-	while (true)
+	while (!fabd_component_stopping(my_component))
 	{
 		{
 			long msecs_to_change = timespec_to_timeout_ms(&ts_now, &ts_timeout);
@@ -742,8 +909,12 @@ void weather_thread(void * const userp)
 			update_win_humid(&ww->humid, current_humidity);
 		}
 		
+		const unsigned long handled_before = soak_handled;
 		if (pollitems[0].revents & ZMQ_POLLIN)
-			tstat_recv(ww, client_tstat);
+		{
+			tstat_recv(ww, &arena, client_tstat);
+			++soak_handled;
+		}
 		if (pollitems[1].revents & ZMQ_POLLIN)
 		{
 			if (read(adjusting_pipe[0], buf, sizeof(buf)) <= 0)
@@ -751,13 +922,32 @@ void weather_thread(void * const userp)
 			update_win_tempgoal(&ww->tempgoal, goal_high, goal_low);
 		}
 		if (pollitems[2].revents & ZMQ_POLLIN)
-			weather_recv(ww, client_weather, &current_temp, &current_humidity);
+		{
+			weather_recv(ww, &arena, client_weather, &current_temp, &current_humidity);
+			++soak_handled;
+		}
 		if (pollitems[4].revents & ZMQ_POLLIN)
-			wires_recv(ww, client_wires);
+		{
+			wires_recv(ww, &arena, client_wires);
+			++soak_handled;
+		}
+		for (unsigned long n = handled_before + 1; soak_events && n <= soak_handled; ++n)
+			if (soak_check(n, soak_events, &soak_rss_baseline_kb, &soak_rss_max_kb))
+				fabd_component_request_stop(my_component);
 		
 		if (ww->circle.win) update_win_circle(&ww->circle, current_temp, goal_high, goal_low);
 		if (ww->temperature_bar.win) update_win_temperature_bar(&ww->temperature_bar, current_temp, goal_high, goal_low);
 	}
+	
+	fabd_pbarena_free(&arena);
+	fabd_event_latency_free(&ww->latency_wires);
+	fabd_event_latency_free(&ww->latency_weather);
+	fabd_event_latency_free(&ww->latency_tstat);
+	if (soak_thread)
+		zmq_threadclose(soak_thread);
+	zmq_close(client_wires);
+	zmq_close(client_weather);
+	zmq_close(client_tstat);
 }
 
 // right is negative, left is positive
@@ -915,13 +1105,23 @@ static void main_event_handler(DFBEvent *);
 static IDirectFBEventBuffer *evbuf;
 static IDirectFBDisplayLayer *layer;
 static int width, height;
+static bool my_directfb_initialised;
+
+void fabdwk_directfb_init(int * const argc, char *** const argv)
+{
+	if (my_directfb_initialised)
+		return;
+	dfbassert(DirectFBInit(argc, argv));
+	my_directfb_initialised = true;
+}
 
-int main(int argc, char **argv)
+static
+void wallknob_run(struct fabd_component * const comp)
 {
-	dfbassert(DirectFBInit(&argc, &argv));
-	my_devid = fabd_common_argv(argc, argv, "wallknob");
-	load_freeabode_key();
-	my_zmq_context = zmq_ctx_new();
+	fabdwk_directfb_init(NULL, NULL);
+	my_component = comp;
+	my_devid = comp->devid;
+	my_zmq_context = comp->zmq_context;
 	assert(!pipe(adjusting_pipe));
 	assert(!pipe(redraw_pipe));
 	
@@ -929,6 +1129,7 @@ int main(int argc, char **argv)
 	
 	struct weather_windows weather_windows;
 	struct button_windows button_windows;
+	void *weather_thread_handle;
 	
 	dfbassert(DirectFBCreate(&dfb));
 	dfbassert(dfb->GetDisplayLayer(dfb, DLID_PRIMARY, &layer));
@@ -1040,7 +1241,7 @@ int main(int argc, char **argv)
 		dfbassert(layer->CreateWindow(layer, &windesc, &window));
 		weather_windows.i_charging.win = window;
 		
-		zmq_threadstart(weather_thread, &weather_windows);
+		weather_thread_handle = zmq_threadstart(weather_thread, &weather_windows);
 		
 		windesc.width = width_full - button_width;
 		windesc.height = height;
@@ -1080,16 +1281,39 @@ int main(int argc, char **argv)
 	// Main thread now handles input
 	DFBEvent ev;
 	dfbassert(dfb->CreateInputEventBuffer(dfb, DICAPS_ALL, DFB_TRUE, &evbuf));
-	while (true)
-	{
-		fabdwk_wait_for_event(&ev);
+	while (fabdwk_wait_for_event(&ev))
 		current_event_handler(&ev);
-	}
+	
+	zmq_threadclose(weather_thread_handle);
+	if (client_tstat_ctl)
+		zmq_close(client_tstat_ctl);
+	evbuf->Release(evbuf);
+	dfb->Release(dfb);
+	close(adjusting_pipe[0]);
+	close(adjusting_pipe[1]);
+	close(redraw_pipe[0]);
+	close(redraw_pipe[1]);
+}
+
+static
+void wallknob_stop(struct fabd_component * const comp)
+{
+	// Input waits are only interrupted by this
+	if (evbuf)
+		evbuf->WakeUp(evbuf);
 }
 
-void fabdwk_wait_for_event(DFBEvent * const ev)
+const struct fabd_component_type wallknob_component = {
+	.type = "wallknob",
+	.run = wallknob_run,
+	.stop = wallknob_stop,
+};
+
+bool fabdwk_wait_for_event(DFBEvent * const ev)
 {
 retry: ;
+	if (fabd_component_stopping(my_component))
+		return false;
 	{
 		DFBResult res;
 		if (adjusting)
@@ -1112,7 +1336,7 @@ retry: ;
 	dfbassert(evbuf->GetEvent(evbuf, ev));
 	
 	if (ev->clazz != DFEC_INPUT)
-		return;
+		return true;
 	
 	if (ev->input.type == DIET_KEYPRESS && (ev->input.flags & DIEF_KEYID))
 	{
@@ -1167,6 +1391,7 @@ retry: ;
 			}
 		}
 	}
+	return true;
 }
 
 static
@@ -1,8 +1,12 @@
 #ifndef FABD_WALLKNOB_H
 #define FABD_WALLKNOB_H
 
+#include <stdbool.h>
+
 #include <directfb.h>
 
+#include <freeabode/component.h>
+
 extern void dfbassert_(DFBResult, const char *, int line, const char *);
 #define dfbassert(expr)  dfbassert_(expr, __FILE__, __LINE__, #expr)
 
@@ -34,8 +38,12 @@ struct my_font {
 };
 extern struct my_font font_h2, font_h4;
 
-extern void fabdwk_wait_for_event(DFBEvent *);
+// Returns false once the component is stopping
+extern bool fabdwk_wait_for_event(DFBEvent *);
 
 extern int fabdwk_textmenu(struct my_window_info *, const char *prompt, const char * const *opts, int optcount, int defopt);
 
+extern void fabdwk_directfb_init(int *argc, char ***argv);
+extern const struct fabd_component_type wallknob_component;
+
 #endif